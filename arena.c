@@ -0,0 +1,114 @@
+#include <pthread.h>
+#include "arena.h"
+
+static struct Arena_Block *arena_block_create(size_t size) {
+    struct Arena_Block *block = malloc(sizeof(struct Arena_Block) + size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+void *arena_alloc(struct Arena *arena, size_t size) {
+    size_t aligned_size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    if (aligned_size == 0) {
+        aligned_size = ARENA_ALIGNMENT;
+    }
+
+    struct Arena_Block *block = arena->current;
+    if (block == NULL || block->size - block->used < aligned_size) {
+        size_t block_size = aligned_size > ARENA_BLOCK_SIZE ? aligned_size : ARENA_BLOCK_SIZE;
+        struct Arena_Block *new_block = arena_block_create(block_size);
+        if (new_block == NULL) {
+            return NULL;
+        }
+        if (block == NULL) {
+            arena->first = new_block;
+        } else {
+            block->next = new_block;
+        }
+        arena->current = new_block;
+        block = new_block;
+    }
+
+    void *pointer = block->data + block->used;
+    block->used += aligned_size;
+    arena->allocations++;
+    return pointer;
+}
+
+char *arena_strndup(struct Arena *arena, const char *string, size_t length) {
+    size_t actual_length = strnlen(string, length);
+    char *copy = arena_alloc(arena, actual_length + 1);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, string, actual_length);
+    copy[actual_length] = '\0';
+    return copy;
+}
+
+char *arena_strdup(struct Arena *arena, const char *string) {
+    return arena_strndup(arena, string, strlen(string));
+}
+
+void *arena_memdup(struct Arena *arena, const void *data, size_t length) {
+    void *copy = arena_alloc(arena, length);
+    if (copy != NULL) {
+        memcpy(copy, data, length);
+    }
+    return copy;
+}
+
+// Releases every allocation at once, keeping the first block for the next request
+void arena_reset(struct Arena *arena) {
+    if (arena->first == NULL) {
+        return;
+    }
+    struct Arena_Block *block = arena->first->next;
+    while (block != NULL) {
+        struct Arena_Block *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first->next = NULL;
+    arena->first->used = 0;
+    arena->current = arena->first;
+    arena->allocations = 0;
+}
+
+void arena_destroy(struct Arena *arena) {
+    arena_reset(arena);
+    free(arena->first);
+    arena->first = NULL;
+    arena->current = NULL;
+}
+
+static __thread struct Arena thread_arena;
+static __thread bool thread_arena_registered;
+static pthread_key_t thread_arena_key;
+static pthread_once_t thread_arena_key_once = PTHREAD_ONCE_INIT;
+
+static void thread_arena_destroy(void *arg) {
+    arena_destroy(arg);
+}
+
+static void create_thread_arena_key(void) {
+    pthread_key_create(&thread_arena_key, thread_arena_destroy);
+}
+
+/*
+    Arena for the request being handled on the calling thread. Parsing and response
+    building allocate from it, and it is reset once the response has been sent.
+*/
+struct Arena *request_arena(void) {
+    if (!thread_arena_registered) {
+        pthread_once(&thread_arena_key_once, create_thread_arena_key);
+        pthread_setspecific(thread_arena_key, &thread_arena);
+        thread_arena_registered = true;
+    }
+    return &thread_arena;
+}
@@ -0,0 +1,38 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "includes.h"
+
+// Size of the block every arena keeps between resets
+#define ARENA_BLOCK_SIZE (16 * 1024)
+// Alignment of every allocation
+#define ARENA_ALIGNMENT 16
+
+struct Arena_Block {
+    struct Arena_Block *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+/*
+    Bump-pointer allocator. Allocations are never freed individually: everything is
+    released at once by arena_reset. Blocks are chained when the current one is full,
+    allocations bigger than ARENA_BLOCK_SIZE get a block of their own.
+*/
+struct Arena {
+    struct Arena_Block *current;
+    struct Arena_Block *first;
+    size_t allocations; // Since the last reset
+};
+
+void *arena_alloc(struct Arena *arena, size_t size);
+char *arena_strdup(struct Arena *arena, const char *string);
+char *arena_strndup(struct Arena *arena, const char *string, size_t length);
+void *arena_memdup(struct Arena *arena, const void *data, size_t length);
+void arena_reset(struct Arena *arena);
+void arena_destroy(struct Arena *arena);
+
+struct Arena *request_arena(void);
+
+#endif
@@ -0,0 +1,676 @@
+/*
+    HTTP/1.1 load generator used by make bench.
+    Every thread runs its own epoll loop over its share of the connections, and every
+    connection has one request in flight at a time. Without --rate the connections send
+    back to back. With --rate each connection sends on a fixed schedule and latency is
+    measured from the time a request was due, so a stalled server shows up in the tail
+    instead of just slowing the generator down.
+
+    Prints one JSON object: throughput, status counts and latency percentiles.
+
+        ./bench/load_gen 8080 --path /health --connections 64 --duration 10
+
+    Build with: make bench/load_gen
+*/
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include "includes.h"
+
+#define RESPONSE_BUFFER_SIZE 65536
+#define MAX_EXTRA_HEADERS 8
+#define RETRY_DELAY_NS 1000000ull       // Before reconnecting after an error
+
+struct Load_Config {
+    const char *name;
+    const char *host;
+    int port;
+    const char *method;
+    const char *path;
+    const char *headers[MAX_EXTRA_HEADERS];
+    int header_count;
+    const char *body_file;
+    int connections;
+    int threads;
+    double duration_s;
+    double rate;              // Requests per second over all connections, 0 for no limit
+    bool keep_alive;
+};
+
+enum Connection_Phase { CONN_IDLE, CONN_CONNECTING, CONN_SENDING, CONN_RECEIVING };
+
+struct Connection {
+    int fd;                   // -1 while not connected
+    enum Connection_Phase phase;
+    uint64_t due_ns;          // When its next request is due, for CONN_IDLE
+    uint64_t started_ns;      // When the request in flight was due
+    size_t sent;
+    size_t received;          // Bytes in buffer, only until the headers are complete
+    size_t header_length;     // 0 until the headers are complete
+    long long body_left;      // -1 if the body ends when the server closes
+    int status;
+    bool server_closes;       // The response carried Connection: close
+    char buffer[RESPONSE_BUFFER_SIZE];
+};
+
+struct Worker {
+    pthread_t thread;
+    struct Connection *connections;
+    int connection_count;
+    uint64_t interval_ns;     // Between two requests of a connection with --rate, else 0
+    uint64_t end_ns;
+    int epoll_fd;
+    // Results
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes_received;
+    uint64_t status_counts[600];
+    uint64_t *latencies_ns;
+    size_t latency_count;
+    size_t latency_capacity;
+};
+
+static struct Load_Config config = {
+    .name = "load",
+    .host = "127.0.0.1",
+    .method = "GET",
+    .path = "/",
+    .connections = 16,
+    .threads = 0,
+    .duration_s = 10,
+    .rate = 0,
+    .keep_alive = true,
+};
+static struct sockaddr_storage server_address;
+static socklen_t server_address_length;
+static char *request;
+static size_t request_length;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+static void print_usage(const char *program_name) {
+    printf("Usage: %s {port number} [options]\n", program_name);
+    printf("  --host HOST               server address (default: 127.0.0.1)\n");
+    printf("  --path PATH               request target (default: /)\n");
+    printf("  --method METHOD           request method (default: GET)\n");
+    printf("  --header 'NAME: VALUE'    extra request header, may be repeated\n");
+    printf("  --body-file FILE          request body, sent with its Content-Length\n");
+    printf("  --connections N           concurrent connections (default: 16)\n");
+    printf("  --threads N               epoll threads sharing the connections (default: half the online CPUs)\n");
+    printf("  --duration S              seconds to run (default: 10)\n");
+    printf("  --rate N                  requests per second over all connections, 0 sends back to back (default: 0)\n");
+    printf("  --no-keep-alive           open a new connection for every request\n");
+    printf("  --name NAME               scenario name in the output (default: load)\n");
+}
+
+static bool parse_number(const char *value, const char *option_name, double min, double *result) {
+    char *end = NULL;
+    double parsed = strtod(value, &end);
+    if (end == value || *end != '\0' || parsed < min) {
+        printf("Invalid value for %s: %s\n", option_name, value);
+        return false;
+    }
+    *result = parsed;
+    return true;
+}
+
+static int parse_options(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"host", required_argument, NULL, 'H'},
+        {"path", required_argument, NULL, 'p'},
+        {"method", required_argument, NULL, 'm'},
+        {"header", required_argument, NULL, 'h'},
+        {"body-file", required_argument, NULL, 'b'},
+        {"connections", required_argument, NULL, 'c'},
+        {"threads", required_argument, NULL, 't'},
+        {"duration", required_argument, NULL, 'd'},
+        {"rate", required_argument, NULL, 'r'},
+        {"no-keep-alive", no_argument, NULL, 'k'},
+        {"name", required_argument, NULL, 'n'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    double number;
+    while ((option = getopt_long(argc, argv, "H:p:m:h:b:c:t:d:r:kn:", long_options, NULL)) != -1) {
+        switch (option) {
+            case 'H':
+                config.host = optarg;
+                break;
+            case 'p':
+                config.path = optarg;
+                break;
+            case 'm':
+                config.method = optarg;
+                break;
+            case 'h':
+                if (config.header_count == MAX_EXTRA_HEADERS) {
+                    printf("At most %d --header options\n", MAX_EXTRA_HEADERS);
+                    return -1;
+                }
+                config.headers[config.header_count++] = optarg;
+                break;
+            case 'b':
+                config.body_file = optarg;
+                break;
+            case 'c':
+                if (!parse_number(optarg, "--connections", 1, &number)) {
+                    return -1;
+                }
+                config.connections = (int)number;
+                break;
+            case 't':
+                if (!parse_number(optarg, "--threads", 1, &number)) {
+                    return -1;
+                }
+                config.threads = (int)number;
+                break;
+            case 'd':
+                if (!parse_number(optarg, "--duration", 0.1, &config.duration_s)) {
+                    return -1;
+                }
+                break;
+            case 'r':
+                if (!parse_number(optarg, "--rate", 0, &config.rate)) {
+                    return -1;
+                }
+                break;
+            case 'k':
+                config.keep_alive = false;
+                break;
+            case 'n':
+                config.name = optarg;
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    if (optind >= argc) {
+        printf("Missing argument, please provide the port number\n");
+        return -1;
+    }
+    config.port = atoi(argv[optind]);
+    if (config.port <= 0 || config.port > 65535) {
+        printf("Invalid port number: %s\n", argv[optind]);
+        return -1;
+    }
+    if (config.threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        config.threads = cpus > 1 ? (int)(cpus / 2) : 1;
+    }
+    if (config.threads > config.connections) {
+        config.threads = config.connections;
+    }
+    return 0;
+}
+
+static bool resolve_server(void) {
+    char port[16];
+    snprintf(port, sizeof(port), "%d", config.port);
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *result;
+    int error = getaddrinfo(config.host, port, &hints, &result);
+    if (error != 0) {
+        printf("Could not resolve %s: %s\n", config.host, gai_strerror(error));
+        return false;
+    }
+    memcpy(&server_address, result->ai_addr, result->ai_addrlen);
+    server_address_length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+// Builds the one request every connection sends, with the body of --body-file if any
+static bool build_request(void) {
+    char *body = NULL;
+    long body_length = 0;
+    if (config.body_file != NULL) {
+        FILE *file = fopen(config.body_file, "rb");
+        if (file == NULL || fseek(file, 0, SEEK_END) != 0 || (body_length = ftell(file)) < 0) {
+            printf("Could not read %s: %s\n", config.body_file, strerror(errno));
+            if (file != NULL) {
+                fclose(file);
+            }
+            return false;
+        }
+        rewind(file);
+        body = malloc(body_length + 1);
+        if (body == NULL || fread(body, 1, body_length, file) != (size_t)body_length) {
+            printf("Could not read %s\n", config.body_file);
+            free(body);
+            fclose(file);
+            return false;
+        }
+        fclose(file);
+    }
+
+    char *headers = NULL;
+    size_t headers_length = 0;
+    FILE *out = open_memstream(&headers, &headers_length);
+    if (out == NULL) {
+        free(body);
+        return false;
+    }
+    fprintf(out, "%s %s HTTP/1.1\r\nHost: %s:%d\r\n", config.method, config.path, config.host, config.port);
+    if (!config.keep_alive) {
+        fprintf(out, "Connection: close\r\n");
+    }
+    for (int i = 0; i < config.header_count; i++) {
+        fprintf(out, "%s\r\n", config.headers[i]);
+    }
+    if (body != NULL) {
+        fprintf(out, "Content-Length: %ld\r\n", body_length);
+    }
+    fprintf(out, "\r\n");
+    fclose(out);
+
+    request_length = headers_length + body_length;
+    request = malloc(request_length);
+    if (request == NULL) {
+        free(headers);
+        free(body);
+        return false;
+    }
+    memcpy(request, headers, headers_length);
+    if (body != NULL) {
+        memcpy(request + headers_length, body, body_length);
+    }
+    free(headers);
+    free(body);
+    return true;
+}
+
+static void record_latency(struct Worker *worker, uint64_t latency_ns) {
+    if (worker->latency_count == worker->latency_capacity) {
+        size_t capacity = worker->latency_capacity == 0 ? 65536 : worker->latency_capacity * 2;
+        uint64_t *latencies = realloc(worker->latencies_ns, capacity * sizeof(uint64_t));
+        if (latencies == NULL) {
+            return; // Counted in the throughput, left out of the percentiles
+        }
+        worker->latencies_ns = latencies;
+        worker->latency_capacity = capacity;
+    }
+    worker->latencies_ns[worker->latency_count++] = latency_ns;
+}
+
+static void connection_close(struct Connection *conn) {
+    if (conn->fd != -1) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+static void connection_idle(struct Connection *conn, uint64_t due_ns) {
+    conn->phase = CONN_IDLE;
+    conn->due_ns = due_ns;
+}
+
+static void connection_failed(struct Worker *worker, struct Connection *conn) {
+    worker->errors++;
+    connection_close(conn);
+    connection_idle(conn, now_ns() + RETRY_DELAY_NS);
+}
+
+// Writes what is left of the request, false on error
+static bool connection_send(struct Connection *conn) {
+    while (conn->sent < request_length) {
+        ssize_t written = send(conn->fd, request + conn->sent, request_length - conn->sent, MSG_NOSIGNAL);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn->sent += written;
+    }
+    conn->phase = CONN_RECEIVING;
+    return true;
+}
+
+// Starts the request due at due_ns, connecting first if needed
+static void connection_start(struct Worker *worker, struct Connection *conn, uint64_t due_ns) {
+    conn->started_ns = due_ns;
+    conn->sent = 0;
+    conn->received = 0;
+    conn->header_length = 0;
+    conn->body_left = -1;
+    conn->status = 0;
+    conn->server_closes = false;
+
+    if (conn->fd == -1) {
+        conn->fd = socket(server_address.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (conn->fd == -1) {
+            connection_failed(worker, conn);
+            return;
+        }
+        int on = 1;
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        // Edge-triggered: every phase reads or writes until EAGAIN
+        struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = conn };
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+            connection_failed(worker, conn);
+            return;
+        }
+        if (connect(conn->fd, (struct sockaddr *)&server_address, server_address_length) == -1 && errno != EINPROGRESS) {
+            connection_failed(worker, conn);
+            return;
+        }
+        conn->phase = CONN_CONNECTING;
+        return; // Sent once writable
+    }
+
+    conn->phase = CONN_SENDING;
+    if (!connection_send(conn)) {
+        connection_failed(worker, conn);
+    }
+}
+
+// Takes the status, Content-Length and Connection header of a complete response head
+static void parse_response_head(struct Connection *conn) {
+    const char *head = conn->buffer;
+    const char *end = head + conn->header_length;
+    if (conn->header_length > 12 && strncmp(head, "HTTP/1.", 7) == 0) {
+        conn->status = atoi(head + 9);
+    }
+    const char *line = memchr(head, '\n', conn->header_length);
+    while (line != NULL && line + 1 < end) {
+        line++;
+        size_t remaining = end - line;
+        if (remaining > 15 && strncasecmp(line, "Content-Length:", 15) == 0) {
+            conn->body_left = strtoll(line + 15, NULL, 10);
+        } else if (remaining > 11 && strncasecmp(line, "Connection:", 11) == 0) {
+            const char *value = line + 11;
+            while (*value == ' ') {
+                value++;
+            }
+            conn->server_closes = strncasecmp(value, "close", 5) == 0;
+        }
+        line = memchr(line, '\n', remaining);
+    }
+}
+
+static void response_done(struct Worker *worker, struct Connection *conn) {
+    uint64_t now = now_ns();
+    worker->requests++;
+    if (conn->status > 0 && conn->status < 600) {
+        worker->status_counts[conn->status]++;
+    }
+    record_latency(worker, now - conn->started_ns);
+
+    if (!config.keep_alive || conn->server_closes || conn->body_left == -1) {
+        connection_close(conn);
+    }
+    if (worker->interval_ns == 0) {
+        connection_start(worker, conn, now);
+        return;
+    }
+    // Requests stay on schedule, a late one is sent at once and measured from when it was due
+    connection_idle(conn, conn->started_ns + worker->interval_ns);
+}
+
+// Reads until EAGAIN, finishing the response once its body is complete
+static void connection_receive(struct Worker *worker, struct Connection *conn) {
+    while (conn->phase == CONN_RECEIVING) {
+        char *destination = conn->buffer;
+        size_t room = sizeof(conn->buffer);
+        if (conn->header_length == 0) {
+            destination += conn->received;
+            room -= conn->received;
+            if (room == 0) {
+                connection_failed(worker, conn); // Response head too large
+                return;
+            }
+        }
+        ssize_t bytes = recv(conn->fd, destination, room, 0);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                connection_failed(worker, conn);
+            }
+            return;
+        }
+        if (bytes == 0) {
+            if (conn->header_length != 0 && conn->body_left == -1) {
+                response_done(worker, conn); // The body ended with the connection
+            } else {
+                connection_failed(worker, conn);
+            }
+            return;
+        }
+        worker->bytes_received += bytes;
+
+        if (conn->header_length == 0) {
+            conn->received += bytes;
+            char *head_end = memmem(conn->buffer, conn->received, "\r\n\r\n", 4);
+            if (head_end == NULL) {
+                continue;
+            }
+            conn->header_length = head_end + 4 - conn->buffer;
+            parse_response_head(conn);
+            bytes = conn->received - conn->header_length;
+        }
+        if (conn->body_left != -1) {
+            conn->body_left -= bytes;
+            if (conn->body_left <= 0) {
+                conn->body_left = 0;
+                response_done(worker, conn);
+            }
+        }
+    }
+}
+
+static void connection_on_event(struct Worker *worker, struct Connection *conn, uint32_t events) {
+    if (conn->phase == CONN_IDLE) {
+        if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+            connection_close(conn); // The server closed it between requests, reconnect when due
+        }
+        return;
+    }
+    if (conn->phase == CONN_CONNECTING) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            return;
+        }
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0) {
+            connection_failed(worker, conn);
+            return;
+        }
+        conn->phase = CONN_SENDING;
+    }
+    if (conn->phase == CONN_SENDING && !connection_send(conn)) {
+        connection_failed(worker, conn);
+        return;
+    }
+    if (conn->phase == CONN_RECEIVING) {
+        connection_receive(worker, conn);
+    }
+}
+
+static void *worker_run(void *arg) {
+    struct Worker *worker = arg;
+    struct epoll_event events[256];
+    uint64_t start = now_ns();
+    for (int i = 0; i < worker->connection_count; i++) {
+        struct Connection *conn = &worker->connections[i];
+        conn->fd = -1;
+        // Scheduled connections are spread over one interval so they do not send in bursts
+        uint64_t offset = worker->interval_ns * i / worker->connection_count;
+        connection_idle(conn, start + offset);
+    }
+
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= worker->end_ns) {
+            break;
+        }
+        uint64_t next_due = worker->end_ns;
+        for (int i = 0; i < worker->connection_count; i++) {
+            struct Connection *conn = &worker->connections[i];
+            if (conn->phase != CONN_IDLE) {
+                continue;
+            }
+            if (conn->due_ns <= now) {
+                connection_start(worker, conn, conn->due_ns);
+            }
+            if (conn->phase == CONN_IDLE && conn->due_ns < next_due) {
+                next_due = conn->due_ns;
+            }
+        }
+
+        int timeout_ms = next_due > now ? (int)((next_due - now + 999999) / 1000000) : 0;
+        int count = epoll_wait(worker->epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout_ms);
+        if (count == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            connection_on_event(worker, events[i].data.ptr, events[i].events);
+        }
+    }
+
+    for (int i = 0; i < worker->connection_count; i++) {
+        connection_close(&worker->connections[i]);
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile of sorted latencies, in microseconds
+static double percentile_us(const uint64_t *sorted, size_t count, double quantile) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t rank = (size_t)(quantile * count + 0.999999);
+    if (rank == 0) {
+        rank = 1;
+    }
+    return sorted[(rank > count ? count : rank) - 1] / 1e3;
+}
+
+static void print_json_string(const char *text) {
+    putchar('"');
+    for (; *text != '\0'; text++) {
+        if (*text == '"' || *text == '\\') {
+            putchar('\\');
+        }
+        putchar(*text);
+    }
+    putchar('"');
+}
+
+static void print_results(struct Worker *workers, double elapsed_s) {
+    uint64_t requests = 0, errors = 0, bytes = 0;
+    uint64_t status_counts[600] = {0};
+    size_t latency_count = 0;
+    for (int i = 0; i < config.threads; i++) {
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes_received;
+        latency_count += workers[i].latency_count;
+        for (int status = 0; status < 600; status++) {
+            status_counts[status] += workers[i].status_counts[status];
+        }
+    }
+    uint64_t *latencies = malloc((latency_count + 1) * sizeof(uint64_t));
+    size_t merged = 0;
+    double sum_ns = 0;
+    for (int i = 0; i < config.threads && latencies != NULL; i++) {
+        memcpy(latencies + merged, workers[i].latencies_ns, workers[i].latency_count * sizeof(uint64_t));
+        merged += workers[i].latency_count;
+    }
+    if (latencies != NULL) {
+        qsort(latencies, merged, sizeof(uint64_t), compare_u64);
+        for (size_t i = 0; i < merged; i++) {
+            sum_ns += latencies[i];
+        }
+    }
+
+    printf("{\"scenario\":");
+    print_json_string(config.name);
+    printf(",\"method\":");
+    print_json_string(config.method);
+    printf(",\"path\":");
+    print_json_string(config.path);
+    printf(",\"connections\":%d,\"threads\":%d,\"keep_alive\":%s,\"rate\":%.0f,\"duration_s\":%.3f",
+        config.connections, config.threads, config.keep_alive ? "true" : "false", config.rate, elapsed_s);
+    printf(",\"requests\":%lu,\"errors\":%lu,\"requests_per_s\":%.1f,\"bytes_per_s\":%.0f,\"status\":{",
+        (unsigned long)requests, (unsigned long)errors, requests / elapsed_s, bytes / elapsed_s);
+    bool first = true;
+    for (int status = 0; status < 600; status++) {
+        if (status_counts[status] != 0) {
+            printf("%s\"%d\":%lu", first ? "" : ",", status, (unsigned long)status_counts[status]);
+            first = false;
+        }
+    }
+    printf("},\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+        merged == 0 ? 0 : sum_ns / merged / 1e3, percentile_us(latencies, merged, 0.5), percentile_us(latencies, merged, 0.99),
+        percentile_us(latencies, merged, 0.999), merged == 0 ? 0 : latencies[merged - 1] / 1e3);
+    free(latencies);
+}
+
+int main(int argc, char **argv) {
+    if (parse_options(argc, argv) != 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (!resolve_server() || !build_request()) {
+        return EXIT_FAILURE;
+    }
+
+    struct Worker *workers = calloc(config.threads, sizeof(struct Worker));
+    if (workers == NULL) {
+        return EXIT_FAILURE;
+    }
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)(config.duration_s * 1e9);
+    for (int i = 0; i < config.threads; i++) {
+        struct Worker *worker = &workers[i];
+        worker->connection_count = config.connections / config.threads + (i < config.connections % config.threads);
+        worker->connections = calloc(worker->connection_count, sizeof(struct Connection));
+        worker->epoll_fd = epoll_create1(0);
+        if (worker->connections == NULL || worker->epoll_fd == -1) {
+            perror("Could not set up the load threads");
+            return EXIT_FAILURE;
+        }
+        // Every connection gets an equal share of the rate
+        worker->interval_ns = config.rate > 0 ? (uint64_t)(1e9 * config.connections / config.rate) : 0;
+        worker->end_ns = end;
+    }
+    for (int i = 0; i < config.threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+            perror("Could not start the load threads");
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < config.threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double elapsed_s = (now_ns() - start) / 1e9;
+
+    print_results(workers, elapsed_s);
+    for (int i = 0; i < config.threads; i++) {
+        close(workers[i].epoll_fd);
+        free(workers[i].connections);
+        free(workers[i].latencies_ns);
+    }
+    free(workers);
+    free(request);
+    return EXIT_SUCCESS;
+}
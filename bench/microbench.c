@@ -0,0 +1,820 @@
+/*
+    Microbenchmarks of the parsing, routing and response-building code the server runs for
+    every request, without any networking: sendmsg is replaced by a stub that only counts
+    the bytes, so the response senders are timed up to the system call.
+    Every benchmark runs one function on one request of the corpus below and reports:
+
+        ns/op      best of MICROBENCH_RUNS timed runs, the request arena reset included
+        allocs/op  heap allocations (malloc, calloc, realloc) per call
+        arena/op   request arena allocations per call
+
+    Shared and frequency-scaled CPUs easily change speed by a third between two runs, so
+    every benchmark is also timed relative to a fixed calibration loop run alongside it,
+    and that ratio is what gets compared. Interference only ever makes a run slower, so
+    the ratio is taken between the fastest run of each. The benchmarks are measured in child
+    processes of this program: the memory layout of a process alone moves some of them by a
+    third, and only fresh processes show that.
+
+    Results are compared against a baseline file, one
+    "<benchmark> <ns/op> <allocs/op> <ratio> <noise>" line per benchmark. --update writes it
+    from the fastest of MICROBENCH_BASELINE_PROCESSES processes, noise being the percent
+    between the slowest and the fastest of them. A benchmark regresses when its ratio is more
+    than --threshold plus its noise percent (at most MICROBENCH_MAX_NOISE) above the baseline,
+    or when it allocates more often. One that looks slower is measured again in up to
+    MICROBENCH_RETRIES more processes and only counts as a regression if it is slower in
+    every one; the exit status is then 1.
+
+    Build and run with: make microbench (make microbench_baseline to update the baseline)
+*/
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include "http_helpers.h"
+#include "file_helpers.h"
+#include "body_reader.h"
+#include "multipart.h"
+#include "route_table.h"
+#include "response_handlers.h"
+#include "request_handlers.h"
+#include "trace.h"
+
+#define MICROBENCH_RUNS 15
+#define MICROBENCH_RUN_NS 10000000.0       // Each timed run lasts about 10ms
+#define MICROBENCH_BASELINE_PROCESSES 5
+#define MICROBENCH_RETRIES (MICROBENCH_BASELINE_PROCESSES - 1) // Extra processes measuring a benchmark that looks slower
+#define MICROBENCH_MAX_NOISE 10.0          // Most of the baseline noise percent added to the threshold
+#define MICROBENCH_MAX_BENCHMARKS 32
+#define STUB_SOCKET_FD 1000                // Never opened, sendmsg is replaced below
+#define MULTIPART_FILE_SIZE (256 * 1024)
+#define MULTIPART_FEED_SIZE (16 * 1024)    // Bodies arrive from recv in pieces, the parsers are fed like that
+#define CHUNKED_CHUNK_COUNT 16
+#define CHUNKED_CHUNK_SIZE 4096
+#define CACHED_FILE_SIZE 4096
+
+/* ---- Heap allocation counting: these replace the glibc allocator entry points ---- */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void __libc_free(void *pointer);
+
+static uint64_t heap_allocations;
+
+void *malloc(size_t size) {
+    heap_allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    heap_allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+    heap_allocations++;
+    return __libc_realloc(pointer, size);
+}
+
+void free(void *pointer) {
+    __libc_free(pointer);
+}
+
+/* ---- Socket stub: replaces sendmsg, so the response senders are timed without the kernel ---- */
+
+static uint64_t bytes_sent;
+
+ssize_t sendmsg(int fd, const struct msghdr *message, int flags) {
+    (void)fd;
+    (void)flags;
+    size_t length = 0;
+    for (size_t i = 0; i < message->msg_iovlen; i++) {
+        length += message->msg_iov[i].iov_len;
+    }
+    bytes_sent += length;
+    return length;
+}
+
+/* ---- Corpus ---- */
+
+struct Sample {
+    const char *name;
+    char *request;              // Null-terminated
+    size_t length;
+    const char *content_type;   // Of the body, for the body parsers
+    size_t body_offset;
+    struct Str_View method;     // Of the request line, for the router
+    struct Str_View uri;
+};
+
+static struct Sample get_small = {
+    .name = "get_small",
+    .request =
+        "GET /health HTTP/1.1\r\n"
+        "Host: localhost:8080\r\n"
+        "User-Agent: curl/8.0.1\r\n"
+        "Accept: */*\r\n"
+        "\r\n",
+};
+
+static struct Sample get_browser = {
+    .name = "get_browser",
+    .request =
+        "GET /assets/styles.css HTTP/1.1\r\n"
+        "Host: localhost:8080\r\n"
+        "Connection: keep-alive\r\n"
+        "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+        "sec-ch-ua-mobile: ?0\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+        "sec-ch-ua-platform: \"Linux\"\r\n"
+        "Accept: text/css,*/*;q=0.1\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "Sec-Fetch-Mode: no-cors\r\n"
+        "Sec-Fetch-Dest: style\r\n"
+        "Referer: http://localhost:8080/\r\n"
+        "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+        "Accept-Language: en-US,en;q=0.9\r\n"
+        "Cookie: session=9f86d081884c7d659a2feaa0c55ad015; theme=dark; consent=1\r\n"
+        "If-None-Match: \"1a2b3c-70-65f0a1b2\"\r\n"
+        "If-Modified-Since: Tue, 12 Mar 2024 10:00:00 GMT\r\n"
+        "\r\n",
+};
+
+static struct Sample post_text = {
+    .name = "post_text",
+    .request =
+        "POST /post HTTP/1.1\r\n"
+        "Host: localhost:8080\r\n"
+        "User-Agent: curl/8.0.1\r\n"
+        "Accept: */*\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: 45\r\n"
+        "\r\n"
+        "Example text data sent via curl POST request.",
+    .content_type = MIME_TEXT_PLAIN,
+};
+
+static struct Sample get_record = {
+    .name = "get_record",
+    .request =
+        "GET /post/00000000002a HTTP/1.1\r\n"
+        "Host: localhost:8080\r\n"
+        "User-Agent: curl/8.0.1\r\n"
+        "Accept: */*\r\n"
+        "\r\n",
+};
+
+static struct Sample post_chunked = {
+    .name = "post_chunked",
+};
+
+#define MULTIPART_BOUNDARY "----WebKitFormBoundary7MA4YWxkTrZu0gW"
+
+static struct Sample post_form = {
+    .name = "post_form",
+    .request =
+        "POST /post HTTP/1.1\r\n"
+        "Host: localhost:8080\r\n"
+        "Content-Type: multipart/form-data; boundary=" MULTIPART_BOUNDARY "\r\n"
+        "Content-Length: 250\r\n"
+        "\r\n"
+        "--" MULTIPART_BOUNDARY "\r\nContent-Disposition: form-data; name=\"title\"\r\n\r\nQuarterly report\r\n"
+        "--" MULTIPART_BOUNDARY "\r\nContent-Disposition: form-data; name=\"author\"\r\n\r\nJane Doe\r\n"
+        "--" MULTIPART_BOUNDARY "--\r\n",
+    .content_type = "multipart/form-data; boundary=" MULTIPART_BOUNDARY,
+};
+
+static struct Sample post_multipart = {
+    .name = "post_multipart",
+    .content_type = "multipart/form-data; boundary=" MULTIPART_BOUNDARY,
+};
+
+// A browser form upload: a few text fields and one binary file of MULTIPART_FILE_SIZE bytes
+static bool build_multipart_request(struct Sample *sample) {
+    size_t capacity = MULTIPART_FILE_SIZE + 4096;
+    char *request = malloc(capacity);
+    if (request == NULL) {
+        return false;
+    }
+    char *body = request + 1024;
+    size_t used = 0;
+    const char *fields[][2] = { {"title", "Quarterly report"}, {"author", "Jane Doe"}, {"tags", "finance,q3,draft"} };
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        used += sprintf(body + used, "--" MULTIPART_BOUNDARY "\r\nContent-Disposition: form-data; name=\"%s\"\r\n\r\n%s\r\n",
+            fields[i][0], fields[i][1]);
+    }
+    used += sprintf(body + used, "--" MULTIPART_BOUNDARY "\r\nContent-Disposition: form-data; name=\"file\"; filename=\"report.bin\"\r\n"
+        "Content-Type: application/octet-stream\r\n\r\n");
+    uint32_t state = 2463534242u;
+    for (size_t i = 0; i < MULTIPART_FILE_SIZE; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        body[used + i] = (char)(state & 0xff);
+    }
+    used += MULTIPART_FILE_SIZE;
+    used += sprintf(body + used, "\r\n--" MULTIPART_BOUNDARY "--\r\n");
+
+    char headers[1024];
+    int headers_length = snprintf(headers, sizeof(headers),
+        "POST /post HTTP/1.1\r\n"
+        "Host: localhost:8080\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+        "Origin: http://localhost:8080\r\n"
+        "Referer: http://localhost:8080/pages/page.html\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "\r\n", sample->content_type, used);
+    // The headers go right before the body, so the request is one contiguous buffer
+    sample->body_offset = headers_length;
+    sample->request = body - headers_length;
+    memcpy(sample->request, headers, headers_length);
+    sample->length = headers_length + used;
+    sample->request[sample->length] = '\0';
+    return true;
+}
+
+// A text upload of CHUNKED_CHUNK_COUNT chunks sent with Transfer-Encoding: chunked
+static bool build_chunked_request(struct Sample *sample) {
+    size_t capacity = 256 + CHUNKED_CHUNK_COUNT * (CHUNKED_CHUNK_SIZE + 16);
+    char *request = malloc(capacity);
+    if (request == NULL) {
+        return false;
+    }
+    size_t used = sprintf(request,
+        "POST /post HTTP/1.1\r\n"
+        "Host: localhost:8080\r\n"
+        "Content-Type: text/plain\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "\r\n");
+    sample->body_offset = used;
+    for (int i = 0; i < CHUNKED_CHUNK_COUNT; i++) {
+        used += sprintf(request + used, "%x\r\n", CHUNKED_CHUNK_SIZE);
+        memset(request + used, 'a' + i, CHUNKED_CHUNK_SIZE);
+        used += CHUNKED_CHUNK_SIZE;
+        used += sprintf(request + used, "\r\n");
+    }
+    used += sprintf(request + used, "0\r\n\r\n");
+    sample->request = request;
+    sample->length = used;
+    sample->content_type = MIME_TEXT_PLAIN;
+    return true;
+}
+
+/* ---- Benchmarks: each returns something derived from the result, so it is not optimized away ---- */
+
+/*
+    Fixed work unrelated to the server code that stresses the CPU like the parsers do: a
+    tokenizer with data-dependent branches and table lookups over a constant text. A neighbor
+    on the same core or a lower clock slows it down about as much as the benchmarks.
+*/
+static size_t run_calibration(const struct Sample *sample) {
+    (void)sample;
+    static const char text[] =
+        "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+        "text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+        "session=9f86d081884c7d659a2feaa0c55ad015; theme=dark; consent=1; region=eu-west\r\n";
+    // Read through a volatile pointer so that the compiler cannot work the result out ahead of time
+    const char *volatile text_pointer = text;
+    const char *data = text_pointer;
+    static unsigned char is_delimiter[256] = { [' '] = 1, [','] = 1, [';'] = 1, ['/'] = 1, ['='] = 1, ['\r'] = 1, ['\n'] = 1 };
+    uint32_t counts[64] = {0};
+    uint32_t hash = 0;
+    size_t tokens = 0;
+    for (size_t i = 0; i < sizeof(text) - 1; i++) {
+        unsigned char c = data[i];
+        if (is_delimiter[c]) {
+            if (hash != 0) {
+                counts[hash & 63]++;
+                tokens++;
+            }
+            hash = 0;
+        } else if (c >= 'A' && c <= 'Z') {
+            hash = hash * 31 + (c | 0x20);
+        } else {
+            hash = hash * 31 + c;
+        }
+    }
+    return tokens + counts[hash & 63];
+}
+
+static size_t run_parse_request_headers(const struct Sample *sample) {
+    struct Req_Headers headers;
+    parse_request_headers(sample->request, sample->length, &headers);
+    return headers.headers_length + headers.field_count;
+}
+
+static int count_body_data(void *context, const char *data, size_t length) {
+    (void)data;
+    *(size_t *)context += length;
+    return 0;
+}
+
+// The whole body is in the buffer already, as when it arrives with the headers
+static size_t run_body_reader_feed(const struct Sample *sample) {
+    const char *body = sample->request + sample->body_offset;
+    size_t length = sample->length - sample->body_offset;
+    struct Body_Reader reader;
+    body_reader_init(&reader, sample == &post_chunked ? BODY_CHUNKED : BODY_CONTENT_LENGTH, length, SIZE_MAX);
+    size_t received = 0, consumed = 0;
+    body_reader_feed(&reader, body, length, &consumed, count_body_data, &received);
+    return received;
+}
+
+static int count_part(void *context, struct Part *part) {
+    *(size_t *)context += part->fdn_length;
+    return 0;
+}
+
+static int count_part_data(void *context, const char *data, size_t length) {
+    (void)data;
+    *(size_t *)context += length;
+    return 0;
+}
+
+static int part_end(void *context) {
+    (void)context;
+    return 0;
+}
+
+static const struct Multipart_Callbacks counting_callbacks = {
+    .on_part_begin = count_part,
+    .on_part_data = count_part_data,
+    .on_part_end = part_end,
+};
+
+static size_t run_multipart_parser_feed(const struct Sample *sample) {
+    static struct Multipart_Parser parser;
+    size_t total = 0;
+    if (multipart_parser_init(&parser, sample->content_type, &counting_callbacks, &total) == -1) {
+        return 0;
+    }
+    const char *body = sample->request + sample->body_offset;
+    size_t length = sample->length - sample->body_offset;
+    for (size_t offset = 0; offset < length; offset += MULTIPART_FEED_SIZE) {
+        size_t piece = length - offset < MULTIPART_FEED_SIZE ? length - offset : MULTIPART_FEED_SIZE;
+        if (multipart_parser_feed(&parser, body + offset, piece) == -1) {
+            return 0;
+        }
+    }
+    return multipart_parser_done(&parser) ? total : 0;
+}
+
+static size_t run_route_table_match(const struct Sample *sample) {
+    Route_Handler handler;
+    struct Route_Params params;
+    enum Route_Match match = route_table_match(sample->method, sample->uri, &handler, &params);
+    return match == ROUTE_FOUND ? (size_t)params.route + params.count + 1 : 0;
+}
+
+static size_t run_get_file_mime_type(const struct Sample *sample) {
+    (void)sample;
+    static char *file_names[] = { "index.html", "assets/styles.css", "assets/photo.jpeg", "archive.unknown" };
+    size_t total = 0;
+    for (size_t i = 0; i < sizeof(file_names) / sizeof(file_names[0]); i++) {
+        total += strlen(get_file_mime_type(file_names[i]));
+    }
+    return total;
+}
+
+static size_t run_format_response_headers_validators(const struct Sample *sample) {
+    (void)sample;
+    char headers[512];
+    return format_response_headers(headers, sizeof(headers), STATUS_OK, MIME_TEXT_HTML, 16384, true,
+        "ETag: \"1a2b3c-4000-65f0a1b2\"\r\nLast-Modified: Tue, 12 Mar 2024 10:00:00 GMT\r\nCache-Control: max-age=3600\r\n");
+}
+
+// The answer to an upload, as post_upload_respond sends it
+static size_t run_send_response_parts(const struct Sample *sample) {
+    (void)sample;
+    static const char body[] = "File uploaded successfully: " UPLOAD_RECORD_PREFIX "42";
+    uint64_t before = bytes_sent;
+    send_response_parts(STUB_SOCKET_FD, STATUS_LINE(STATUS_CREATED), MIME_TEXT_PLAIN, body, sizeof(body) - 1);
+    return bytes_sent - before;
+}
+
+// A file of the static cache: headers formatted when it was loaded, body in memory
+static char cached_file_headers[512];
+static size_t cached_file_headers_length;
+static char cached_file_data[CACHED_FILE_SIZE];
+
+static size_t run_send_prebuilt_response(const struct Sample *sample) {
+    (void)sample;
+    uint64_t before = bytes_sent;
+    send_prebuilt_response(STUB_SOCKET_FD, cached_file_headers, cached_file_headers_length, cached_file_data, sizeof(cached_file_data));
+    return bytes_sent - before;
+}
+
+struct Benchmark {
+    const char *function;
+    const char *variant;
+    size_t (*run)(const struct Sample *sample);
+    const struct Sample *sample;
+};
+
+static const struct Benchmark benchmarks[] = {
+    { "parse_request_headers", "get_small", run_parse_request_headers, &get_small },
+    { "parse_request_headers", "get_browser", run_parse_request_headers, &get_browser },
+    { "parse_request_headers", "post_text", run_parse_request_headers, &post_text },
+    { "parse_request_headers", "post_multipart", run_parse_request_headers, &post_multipart },
+    { "body_reader_feed", "post_text", run_body_reader_feed, &post_text },
+    { "body_reader_feed", "post_chunked", run_body_reader_feed, &post_chunked },
+    { "multipart_parser_feed", "post_form", run_multipart_parser_feed, &post_form },
+    { "multipart_parser_feed", "post_multipart", run_multipart_parser_feed, &post_multipart },
+    { "route_table_match", "get_small", run_route_table_match, &get_small },
+    { "route_table_match", "get_browser", run_route_table_match, &get_browser },
+    { "route_table_match", "get_record", run_route_table_match, &get_record },
+    { "route_table_match", "post_multipart", run_route_table_match, &post_multipart },
+    { "get_file_mime_type", "four_names", run_get_file_mime_type, NULL },
+    { "format_response_headers", "validators", run_format_response_headers_validators, NULL },
+    { "send_response_parts", "created", run_send_response_parts, NULL },
+    { "send_prebuilt_response", "cached_file", run_send_prebuilt_response, NULL },
+};
+
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static const struct Benchmark calibration = { "calibration", "tokenizer", run_calibration, NULL };
+
+/* ---- Harness ---- */
+
+struct Result {
+    char name[96];
+    double ns_per_op;
+    double allocs_per_op;
+    double arena_per_op;
+    double ratio;             // Best ns/op over the best calibration time
+    double noise;             // Percent between the slowest and fastest baseline process
+};
+
+struct Baseline_Entry {
+    char name[96];
+    double ns_per_op;
+    double allocs_per_op;
+    double ratio;
+    double noise;
+};
+
+static volatile size_t sink;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double time_iterations(const struct Benchmark *benchmark, long iterations) {
+    struct Arena *arena = request_arena();
+    double start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        sink += benchmark->run(benchmark->sample);
+        arena_reset(arena);
+    }
+    return now_ns() - start;
+}
+
+// Iterations that make one run of the benchmark last about MICROBENCH_RUN_NS
+static long calibrate_iterations(const struct Benchmark *benchmark) {
+    long iterations = 1;
+    double elapsed = time_iterations(benchmark, iterations);
+    while (elapsed < MICROBENCH_RUN_NS / 10) {
+        iterations *= 10;
+        elapsed = time_iterations(benchmark, iterations);
+    }
+    return (long)(iterations * MICROBENCH_RUN_NS / elapsed) + 1;
+}
+
+/*
+    Every timed run of the benchmark follows a run of the calibration loop, and the ratio is
+    taken between the fastest run of each, so a change of machine speed while the harness
+    runs cancels out and a run slowed down by other processes is ignored.
+*/
+static void measure(const struct Benchmark *benchmark, struct Result *result) {
+    struct Arena *arena = request_arena();
+    snprintf(result->name, sizeof(result->name), "%s/%s", benchmark->function, benchmark->variant);
+
+    // One call to warm up and count arena allocations, the arena keeps its first block from here on
+    sink += benchmark->run(benchmark->sample);
+    result->arena_per_op = arena->allocations;
+    arena_reset(arena);
+
+    static long calibration_iterations;
+    if (calibration_iterations == 0) {
+        calibration_iterations = calibrate_iterations(&calibration);
+    }
+    long iterations = calibrate_iterations(benchmark);
+
+    double best = 0, best_calibration = 0;
+    uint64_t allocations = 0;
+    for (int run = 0; run < MICROBENCH_RUNS; run++) {
+        double calibration_ns = time_iterations(&calibration, calibration_iterations) / calibration_iterations;
+        uint64_t allocations_before = heap_allocations;
+        double ns_per_op = time_iterations(benchmark, iterations) / iterations;
+        allocations += heap_allocations - allocations_before;
+        if (run == 0 || ns_per_op < best) {
+            best = ns_per_op;
+        }
+        if (run == 0 || calibration_ns < best_calibration) {
+            best_calibration = calibration_ns;
+        }
+    }
+    result->ns_per_op = best;
+    result->ratio = best / best_calibration;
+    result->allocs_per_op = (double)allocations / ((double)iterations * MICROBENCH_RUNS);
+}
+
+static int compare_ratios(const void *a, const void *b) {
+    double x = ((const struct Result *)a)->ratio, y = ((const struct Result *)b)->ratio;
+    return x < y ? -1 : x > y;
+}
+
+// Child side of measure_in_child: measures the benchmarks marked '1' in selected
+static int run_child(const char *selected) {
+    for (size_t i = 0; i < BENCHMARK_COUNT && selected[i] != '\0'; i++) {
+        if (selected[i] == '1') {
+            struct Result result;
+            measure(&benchmarks[i], &result);
+            printf("%zu %.1f %.4f %.0f %.6f\n", i, result.ns_per_op, result.allocs_per_op, result.arena_per_op, result.ratio);
+            fflush(stdout);
+        }
+    }
+    return sink == 0;
+}
+
+/*
+    Measures the benchmarks for which selected is true in a new process of this program and
+    fills in their results. Every process gets its own memory layout and physical pages,
+    which alone change the speed of some benchmarks by a third, so repeated attempts are
+    made in new processes rather than in this one.
+*/
+static bool measure_in_child(const bool *selected, struct Result *results) {
+    char program[PATH_MAX];
+    ssize_t length = readlink("/proc/self/exe", program, sizeof(program) - 1);
+    if (length == -1) {
+        printf("Could not find the microbench program: %s\n", strerror(errno));
+        return false;
+    }
+    program[length] = '\0';
+
+    char command[PATH_MAX + 32 + BENCHMARK_COUNT];
+    int used = snprintf(command, sizeof(command), "'%s' --child ", program);
+    for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+        command[used++] = selected[i] ? '1' : '0';
+    }
+    command[used] = '\0';
+
+    FILE *child = popen(command, "r");
+    if (child == NULL) {
+        printf("Could not start %s: %s\n", program, strerror(errno));
+        return false;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), child) != NULL) {
+        size_t i;
+        struct Result result = {0};
+        if (sscanf(line, "%zu %lf %lf %lf %lf", &i, &result.ns_per_op, &result.allocs_per_op, &result.arena_per_op, &result.ratio) == 5 &&
+            i < BENCHMARK_COUNT) {
+            snprintf(result.name, sizeof(result.name), "%s/%s", benchmarks[i].function, benchmarks[i].variant);
+            results[i] = result;
+        }
+    }
+    if (pclose(child) != 0) {
+        printf("The microbench child process failed\n");
+        return false;
+    }
+    return true;
+}
+
+/*
+    The baseline of every benchmark is the fastest process out of MICROBENCH_BASELINE_PROCESSES,
+    the same way the check keeps the fastest of its retries, so that both sides compare the best
+    memory layout they found. The spread between the processes is kept as the noise of the
+    benchmark.
+*/
+static bool measure_baseline(struct Result *results) {
+    static struct Result attempts[BENCHMARK_COUNT][MICROBENCH_BASELINE_PROCESSES];
+    bool all[BENCHMARK_COUNT];
+    memset(all, true, sizeof(all));
+    for (int process = 0; process < MICROBENCH_BASELINE_PROCESSES; process++) {
+        struct Result process_results[BENCHMARK_COUNT];
+        if (!measure_in_child(all, process_results)) {
+            return false;
+        }
+        for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+            attempts[i][process] = process_results[i];
+        }
+    }
+    for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+        qsort(attempts[i], MICROBENCH_BASELINE_PROCESSES, sizeof(struct Result), compare_ratios);
+        results[i] = attempts[i][0];
+        results[i].noise = (attempts[i][MICROBENCH_BASELINE_PROCESSES - 1].ratio / attempts[i][0].ratio - 1) * 100;
+    }
+    return true;
+}
+
+// Whether result is more than allowed percent slower than the baseline entry, if there is one
+static bool is_slower(const struct Result *result, const struct Baseline_Entry *entry, double allowed) {
+    return entry != NULL && result->ratio > entry->ratio * (1 + allowed / 100);
+}
+
+// Returns the number of entries read, -1 if the file could not be opened
+static int read_baseline(const char *path, struct Baseline_Entry *entries, int capacity) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    int count = 0;
+    char line[256];
+    while (count < capacity && fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        struct Baseline_Entry *entry = &entries[count];
+        if (sscanf(line, "%95s %lf %lf %lf %lf", entry->name, &entry->ns_per_op, &entry->allocs_per_op, &entry->ratio, &entry->noise) == 5) {
+            count++;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+static bool write_baseline(const char *path, const struct Result *results, int count) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        printf("Could not write %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    fprintf(file, "# make microbench baseline, regenerate with make microbench_baseline\n");
+    fprintf(file, "# benchmark ns/op allocs/op ratio-to-calibration noise-percent\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(file, "%s %.1f %.2f %.4f %.1f\n", results[i].name, results[i].ns_per_op, results[i].allocs_per_op, results[i].ratio, results[i].noise);
+    }
+    fclose(file);
+    printf("Baseline written to %s\n", path);
+    return true;
+}
+
+static void print_usage(const char *program_name) {
+    printf("Usage: %s [options]\n", program_name);
+    printf("  --baseline FILE           results to compare against (default: none)\n");
+    printf("  --threshold PERCENT       slowdown over the baseline reported as a regression, on top of\n");
+    printf("                            the noise recorded in the baseline (default: 25)\n");
+    printf("  --update                  write the results to the baseline file instead of comparing\n");
+}
+
+int main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"baseline", required_argument, NULL, 'b'},
+        {"threshold", required_argument, NULL, 't'},
+        {"update", no_argument, NULL, 'u'},
+        {"child", required_argument, NULL, 'c'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    const char *baseline_path = NULL;
+    double threshold = 25;
+    bool update = false;
+    const char *child_selection = NULL;
+    int option;
+    while ((option = getopt_long(argc, argv, "b:t:uc:h", long_options, NULL)) != -1) {
+        switch (option) {
+            case 'b':
+                baseline_path = optarg;
+                break;
+            case 't':
+                threshold = atof(optarg);
+                break;
+            case 'u':
+                update = true;
+                break;
+            case 'c':
+                child_selection = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 2;
+        }
+    }
+    if (update && baseline_path == NULL) {
+        printf("--update needs --baseline\n");
+        return 2;
+    }
+
+    struct Sample *static_samples[] = { &get_small, &get_browser, &get_record, &post_text, &post_form };
+    for (size_t i = 0; i < sizeof(static_samples) / sizeof(static_samples[0]); i++) {
+        struct Sample *sample = static_samples[i];
+        sample->length = strlen(sample->request);
+        const char *body = strstr(sample->request, "\r\n\r\n");
+        sample->body_offset = body + 4 - sample->request;
+    }
+    if (!build_multipart_request(&post_multipart) || !build_chunked_request(&post_chunked)) {
+        printf("Could not allocate the corpus\n");
+        return 2;
+    }
+    struct Sample *all_samples[] = { &get_small, &get_browser, &get_record, &post_text, &post_form, &post_multipart, &post_chunked };
+    for (size_t i = 0; i < sizeof(all_samples) / sizeof(all_samples[0]); i++) {
+        struct Req_Headers headers;
+        if (parse_request_headers(all_samples[i]->request, all_samples[i]->length, &headers) == -1) {
+            printf("Could not parse the %s sample\n", all_samples[i]->name);
+            return 2;
+        }
+        all_samples[i]->method = headers.method;
+        all_samples[i]->uri = headers.uri;
+    }
+    cached_file_headers_length = format_response_headers(cached_file_headers, sizeof(cached_file_headers), STATUS_OK, MIME_TEXT_HTML,
+        sizeof(cached_file_data), true, "ETag: \"1a2b3c-1000-65f0a1b2\"\r\nLast-Modified: Tue, 12 Mar 2024 10:00:00 GMT\r\n");
+    memset(cached_file_data, 'x', sizeof(cached_file_data));
+    request_context.keep_alive = true;
+    // The server's own routes, with tracing on so that /debug/trace is among them
+    trace_init(INT_MAX);
+    if (!register_routes()) {
+        printf("Could not build the route table\n");
+        return 2;
+    }
+    if (child_selection != NULL) {
+        return run_child(child_selection);
+    }
+
+    struct Baseline_Entry baseline[MICROBENCH_MAX_BENCHMARKS];
+    int baseline_count = 0;
+    if (baseline_path != NULL && !update) {
+        baseline_count = read_baseline(baseline_path, baseline, MICROBENCH_MAX_BENCHMARKS);
+        if (baseline_count == -1) {
+            printf("No baseline at %s, create it with --update\n", baseline_path);
+            baseline_count = 0;
+        }
+    }
+
+    struct Result results[BENCHMARK_COUNT];
+    if (update) {
+        return measure_baseline(results) && write_baseline(baseline_path, results, BENCHMARK_COUNT) ? 0 : 2;
+    }
+    bool selected[BENCHMARK_COUNT];
+    memset(selected, true, sizeof(selected));
+    if (!measure_in_child(selected, results)) {
+        return 2;
+    }
+
+    /*
+        A benchmark is allowed the threshold plus the noise seen while recording its baseline, up
+        to MICROBENCH_MAX_NOISE: a noisy baseline must not hide a real slowdown, retrying in new
+        processes is what filters out the noise.
+    */
+    const struct Baseline_Entry *entries[BENCHMARK_COUNT];
+    double allowed[BENCHMARK_COUNT];
+    for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+        entries[i] = NULL;
+        for (int j = 0; j < baseline_count; j++) {
+            if (strcmp(baseline[j].name, results[i].name) == 0) {
+                entries[i] = &baseline[j];
+            }
+        }
+        double noise = entries[i] != NULL ? entries[i]->noise : 0;
+        allowed[i] = threshold + (noise < MICROBENCH_MAX_NOISE ? noise : MICROBENCH_MAX_NOISE);
+    }
+
+    // Noise rarely slows down the same benchmark in every process, a real regression does
+    for (int retry = 0; retry < MICROBENCH_RETRIES; retry++) {
+        bool any = false;
+        for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+            selected[i] = is_slower(&results[i], entries[i], allowed[i]);
+            any = any || selected[i];
+        }
+        if (!any) {
+            break;
+        }
+        struct Result again[BENCHMARK_COUNT];
+        if (!measure_in_child(selected, again)) {
+            return 2;
+        }
+        for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+            if (selected[i] && again[i].ratio < results[i].ratio) {
+                results[i] = again[i];
+            }
+        }
+    }
+
+    int regressions = 0;
+    printf("%-46s %10s %10s %9s %12s %8s\n", "benchmark", "ns/op", "allocs/op", "arena/op", "baseline ns", "change");
+    for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+        const struct Result *result = &results[i];
+        const struct Baseline_Entry *entry = entries[i];
+        printf("%-46s %10.1f %10.2f %9.0f", result->name, result->ns_per_op, result->allocs_per_op, result->arena_per_op);
+        if (entry == NULL) {
+            printf("%s\n", baseline_count > 0 ? " (not in baseline)" : "");
+            continue;
+        }
+        // The baseline time scaled to the current speed of the machine
+        double change = (result->ratio / entry->ratio - 1) * 100;
+        bool slower = is_slower(result, entry, allowed[i]);
+        bool allocates_more = result->allocs_per_op > entry->allocs_per_op + 0.005;
+        printf(" %12.1f %+7.1f%%%s%s\n", result->ns_per_op * entry->ratio / result->ratio, change, slower ? "  SLOWER" : "",
+            allocates_more ? "  MORE ALLOCATIONS" : "");
+        regressions += slower || allocates_more;
+    }
+
+    if (regressions > 0) {
+        printf("%d of %zu benchmarks regressed beyond the %.0f%% threshold\n", regressions, BENCHMARK_COUNT, threshold);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,177 @@
+/*
+    Microbenchmark for the request header parser.
+    Compares the single-pass, allocation-free parse_request_headers against the previous
+    implementation (kept below as legacy_*), which copied the request once per header and
+    re-tokenized it with strtok.
+
+    Build and run with: make parse_bench
+*/
+#include "http_helpers.h"
+
+#define ITERATIONS 200000
+
+static const char *sample_requests[] = {
+    "GET /health HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/8.0.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+
+    "GET /assets/styles.css HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: style\r\n"
+    "Referer: http://localhost:8080/\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "If-None-Match: \"1a2b3c-70-65f0a1b2\"\r\n"
+    "If-Modified-Since: Tue, 12 Mar 2024 10:00:00 GMT\r\n"
+    "\r\n",
+
+    "POST /post HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/8.0.1\r\n"
+    "Accept: */*\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 45\r\n"
+    "\r\n"
+    "Example text data sent via curl POST request.",
+};
+
+/* ---- Previous implementation, copied verbatim apart from the names ---- */
+
+struct Legacy_Req_Headers {
+    char *method;
+    char *uri;
+    char *protocol;
+    char *host;
+    char *user_agent;
+    char *accept;
+    char *content_type;
+    char *connection;
+    int content_length;
+};
+
+static char *legacy_get_header(const char *headers, const char *key) {
+    char *headers_copy = strdup(headers);
+    if (headers_copy == NULL) {
+        return NULL;
+    }
+    char *line = strtok(headers_copy, "\r\n");
+    size_t key_len = strlen(key);
+
+    if (strcmp(key, "Method") == 0) {
+        char *extracted = strtok(headers_copy, " ");
+        char *value = strdup(extracted);
+        free(headers_copy);
+        return value;
+    }
+
+    if (strcmp(key, "Path") == 0) {
+        strtok(headers_copy, " ");
+        char *extracted = strtok(NULL, " ");
+        char *value = strdup(extracted);
+        free(headers_copy);
+        return value;
+    }
+
+    if (strcmp(key, "Protocol") == 0) {
+        strtok(headers_copy, " ");
+        strtok(NULL, " ");
+        char *extracted = strtok(NULL, "\r\n");
+        char *value = strdup(extracted);
+        free(headers_copy);
+        return value;
+    }
+
+    while (line != NULL) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ':') {
+            char *value_start = line + key_len + 1;
+            while (*value_start == ' ') value_start++;
+            char *value = strdup(value_start);
+            free(headers_copy);
+            return value;
+        }
+        line = strtok(NULL, "\r\n");
+    }
+
+    free(headers_copy);
+    return NULL;
+}
+
+static struct Legacy_Req_Headers legacy_parse_request_headers(const char *request) {
+    struct Legacy_Req_Headers headers = {0};
+    char *request_copy = strdup(request);
+
+    headers.method = legacy_get_header(request_copy, "Method");
+    headers.uri = legacy_get_header(request_copy, "Path");
+    headers.protocol = legacy_get_header(request_copy, "Protocol");
+    headers.host = legacy_get_header(request_copy, "Host");
+    headers.user_agent = legacy_get_header(request_copy, "User-Agent");
+    headers.accept = legacy_get_header(request_copy, "Accept");
+    headers.content_type = legacy_get_header(request_copy, "Content-Type");
+    headers.connection = legacy_get_header(request_copy, "Connection");
+    char *content_length_str = legacy_get_header(request_copy, "Content-Length");
+    headers.content_length = content_length_str ? atoi(content_length_str) : 0;
+
+    free(content_length_str);
+    free(request_copy);
+    return headers;
+}
+
+static void legacy_free_req_headers(struct Legacy_Req_Headers *headers) {
+    free(headers->method);
+    free(headers->uri);
+    free(headers->protocol);
+    free(headers->host);
+    free(headers->user_agent);
+    free(headers->accept);
+    free(headers->content_type);
+    free(headers->connection);
+}
+
+/* ---- Benchmark ---- */
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(void) {
+    size_t sample_count = sizeof(sample_requests) / sizeof(sample_requests[0]);
+    volatile size_t sink = 0;
+
+    printf("%-10s %10s %12s %12s %8s\n", "request", "bytes", "legacy ns", "single ns", "speedup");
+    for (size_t i = 0; i < sample_count; i++) {
+        const char *request = sample_requests[i];
+        size_t length = strlen(request);
+
+        double start = now_ns();
+        for (int n = 0; n < ITERATIONS; n++) {
+            struct Legacy_Req_Headers headers = legacy_parse_request_headers(request);
+            sink += headers.content_length + (headers.uri != NULL);
+            legacy_free_req_headers(&headers);
+        }
+        double legacy_ns = (now_ns() - start) / ITERATIONS;
+
+        struct Req_Headers headers;
+        start = now_ns();
+        for (int n = 0; n < ITERATIONS; n++) {
+            parse_request_headers(request, length, &headers);
+            sink += headers.content_length + headers.uri.length;
+        }
+        double single_pass_ns = (now_ns() - start) / ITERATIONS;
+
+        printf("%-10zu %10zu %12.1f %12.1f %7.1fx\n", i, length, legacy_ns, single_pass_ns, legacy_ns / single_pass_ns);
+    }
+
+    return sink == 0;
+}
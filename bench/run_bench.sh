@@ -0,0 +1,83 @@
+#!/bin/bash
+#
+# Runs the load scenarios of make bench against ./server and prints the results as one
+# JSON document, also written to the file given as first argument (default: bench/results.json).
+# The server runs in a scratch copy of www/ with a bounded upload store, so uploads and
+# POSTed files do not touch the tree.
+#
+# BENCH_MODE         server --mode (default: epoll)
+# BENCH_PORT         port the server listens on (default: 18080)
+# BENCH_DURATION     seconds per scenario (default: 5)
+# BENCH_CONNECTIONS  concurrent connections per scenario (default: 64)
+# BENCH_RATE         requests per second of the fixed-rate scenario (default: 10000)
+
+set -e
+
+repo=$(cd "$(dirname "$0")/.." && pwd)
+output=${1:-$repo/bench/results.json}
+mode=${BENCH_MODE:-epoll}
+port=${BENCH_PORT:-18080}
+duration=${BENCH_DURATION:-5}
+connections=${BENCH_CONNECTIONS:-64}
+rate=${BENCH_RATE:-10000}
+
+workdir=$(mktemp -d)
+server_pid=
+cleanup() {
+    if [ -n "$server_pid" ]; then
+        kill "$server_pid" 2>/dev/null || true
+        wait "$server_pid" 2>/dev/null || true
+    fi
+    rm -rf "$workdir"
+}
+trap cleanup EXIT
+
+cp -r "$repo/www" "$workdir/"
+head -c 1048576 /dev/urandom > "$workdir/www/bench_large.bin"
+printf 'Benchmark text body posted to the server.' > "$workdir/text_body"
+boundary=BenchBoundary7MA4YWxkTrZu0gW
+{
+    printf -- '--%s\r\nContent-Disposition: form-data; name="field"\r\n\r\nvalue\r\n' "$boundary"
+    printf -- '--%s\r\nContent-Disposition: form-data; name="file"; filename="bench_upload.bin"\r\n' "$boundary"
+    printf 'Content-Type: application/octet-stream\r\n\r\n'
+    head -c 4096 /dev/urandom
+    printf -- '\r\n--%s--\r\n' "$boundary"
+} > "$workdir/multipart_body"
+
+(cd "$workdir" && exec "$repo/server" "$port" --mode "$mode" --log-level warn --retention 64 > "$workdir/server.log" 2>&1) &
+server_pid=$!
+for _ in $(seq 50); do
+    if (exec 3<>"/dev/tcp/127.0.0.1/$port") 2>/dev/null; then
+        break
+    fi
+    sleep 0.1
+done
+
+load() {
+    "$repo/bench/load_gen" "$port" --duration "$duration" "$@"
+}
+
+scenarios=(
+    "$(load --name health --path /health --connections "$connections")"
+    "$(load --name health_no_keepalive --path /health --connections "$connections" --no-keep-alive)"
+    "$(load --name health_fixed_rate --path /health --connections "$connections" --rate "$rate")"
+    "$(load --name static_small --path /index.html --connections "$connections")"
+    "$(load --name static_large --path /bench_large.bin --connections "$connections")"
+    "$(load --name post_text --method POST --path /post --connections "$connections" \
+        --header 'Content-Type: text/plain' --body-file "$workdir/text_body")"
+    "$(load --name post_multipart --method POST --path /post --connections "$connections" \
+        --header "Content-Type: multipart/form-data; boundary=$boundary" --body-file "$workdir/multipart_body")"
+    "$(load --name not_found --path /missing.html --connections "$connections")"
+)
+
+commit=$(git -C "$repo" rev-parse --short HEAD 2>/dev/null || echo unknown)
+{
+    printf '{"commit":"%s","date":"%s","mode":"%s","duration_s":%s,"connections":%s,"scenarios":[\n' \
+        "$commit" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$mode" "$duration" "$connections"
+    last=$((${#scenarios[@]} - 1))
+    for i in "${!scenarios[@]}"; do
+        printf '%s%s\n' "${scenarios[$i]}" "$([ "$i" -lt "$last" ] && echo ,)"
+    done
+    printf ']}\n'
+} > "$output"
+cat "$output"
@@ -0,0 +1,111 @@
+/*
+    Benchmark for the delimiter scanning kernels in simd_scan.c.
+    Runs the header parser on a request with large headers and a boundary search over a
+    large form body once per available implementation (scalar, SSE2, AVX2).
+
+    Build and run with: make scan_bench
+*/
+#include "http_helpers.h"
+
+#define HEADER_COUNT 60
+#define HEADER_VALUE_SIZE 120
+#define HEADER_ITERATIONS 50000
+#define MULTIPART_PARTS 8
+#define MULTIPART_PART_SIZE (256 * 1024)
+#define MULTIPART_ITERATIONS 40
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static char *build_large_headers(size_t *length) {
+    size_t capacity = 64 + HEADER_COUNT * (HEADER_VALUE_SIZE + 32);
+    char *request = malloc(capacity);
+    size_t used = sprintf(request, "GET /assets/styles.css HTTP/1.1\r\n");
+    for (int i = 0; i < HEADER_COUNT; i++) {
+        used += sprintf(request + used, "X-Custom-Header-%02d: ", i);
+        memset(request + used, 'v', HEADER_VALUE_SIZE);
+        used += HEADER_VALUE_SIZE;
+        used += sprintf(request + used, "\r\n");
+    }
+    used += sprintf(request + used, "Host: localhost\r\n\r\n");
+    *length = used;
+    return request;
+}
+
+static char *build_multipart_body(const char *boundary, size_t *length) {
+    size_t capacity = MULTIPART_PARTS * (MULTIPART_PART_SIZE + 256) + 64;
+    char *body = malloc(capacity + 1);
+    size_t used = 0;
+    for (int i = 0; i < MULTIPART_PARTS; i++) {
+        used += sprintf(body + used, "--%s\r\nContent-Disposition: form-data; name=\"field%d\"\r\n\r\n", boundary, i);
+        // Text with plenty of dashes and CRLFs, so candidate positions show up all the time
+        for (size_t j = 0; j < MULTIPART_PART_SIZE; j++) {
+            body[used + j] = (j % 64 == 62) ? '\r' : (j % 64 == 63) ? '\n' : (j % 16 == 0) ? '-' : 'a' + (j % 26);
+        }
+        used += MULTIPART_PART_SIZE;
+        used += sprintf(body + used, "\r\n");
+    }
+    used += sprintf(body + used, "--%s--\r\n", boundary);
+    *length = used;
+    return body;
+}
+
+int main(void) {
+    size_t headers_length = 0;
+    char *headers_request = build_large_headers(&headers_length);
+
+    const char *boundary = "----WebKitFormBoundary7MA4YWxkTrZu0gW";
+    char delimiter[128];
+    size_t delimiter_length = snprintf(delimiter, sizeof(delimiter), "--%s", boundary);
+    size_t multipart_length = 0;
+    char *multipart_body = build_multipart_body(boundary, &multipart_length);
+
+    enum Scan_Implementation implementations[] = { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+    double baseline_headers = 0, baseline_multipart = 0;
+    volatile size_t sink = 0;
+
+    printf("large headers: %zu bytes, multipart body: %zu bytes\n", headers_length, multipart_length);
+    printf("%-8s %16s %8s %18s %8s\n", "kernel", "headers ns/req", "speedup", "multipart MB/s", "speedup");
+
+    for (size_t i = 0; i < sizeof(implementations) / sizeof(implementations[0]); i++) {
+        if (!scan_set_implementation(implementations[i])) {
+            printf("%-8s not supported on this CPU\n", scan_implementation_name(implementations[i]));
+            continue;
+        }
+
+        struct Req_Headers headers;
+        double start = now_ns();
+        for (int n = 0; n < HEADER_ITERATIONS; n++) {
+            parse_request_headers(headers_request, headers_length, &headers);
+            sink += headers.field_count;
+        }
+        double headers_ns = (now_ns() - start) / HEADER_ITERATIONS;
+
+        // Every boundary of the body, each search starting where the previous one matched
+        const char *multipart_end = multipart_body + multipart_length;
+        start = now_ns();
+        for (int n = 0; n < MULTIPART_ITERATIONS; n++) {
+            const char *cursor = multipart_body;
+            while ((cursor = scan_find(cursor, multipart_end, delimiter, delimiter_length)) != NULL) {
+                cursor += delimiter_length;
+                sink++;
+            }
+        }
+        double multipart_ns = (now_ns() - start) / MULTIPART_ITERATIONS;
+        double multipart_mb_s = (multipart_length / 1e6) / (multipart_ns / 1e9);
+
+        if (implementations[i] == SCAN_SCALAR) {
+            baseline_headers = headers_ns;
+            baseline_multipart = multipart_mb_s;
+        }
+        printf("%-8s %16.1f %7.2fx %18.1f %7.2fx\n", scan_implementation_name(implementations[i]),
+            headers_ns, baseline_headers / headers_ns, multipart_mb_s, multipart_mb_s / baseline_multipart);
+    }
+
+    free(headers_request);
+    free(multipart_body);
+    return sink == 0;
+}
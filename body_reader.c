@@ -0,0 +1,164 @@
+#include "body_reader.h"
+
+void body_reader_init(struct Body_Reader *reader, enum Body_Encoding encoding, size_t content_length, size_t max_body_size) {
+    memset(reader, 0, sizeof(struct Body_Reader));
+    reader->encoding = encoding;
+    reader->remaining = encoding == BODY_CONTENT_LENGTH ? content_length : 0;
+    reader->max_body_size = max_body_size;
+    reader->chunk_state = CHUNK_SIZE;
+}
+
+static int hex_digit_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Passes up to reader->remaining bytes of data on, returns how many were taken or -1 if the callback failed
+static ssize_t emit_data(struct Body_Reader *reader, const char *data, size_t length, Body_Data_Callback on_data, void *context) {
+    size_t take = length < reader->remaining ? length : reader->remaining;
+    if (take > 0 && on_data != NULL && on_data(context, data, take) == -1) {
+        return -1;
+    }
+    reader->remaining -= take;
+    reader->received += take;
+    return take;
+}
+
+/*
+    Chunked framing, one byte of state at a time except for chunk data which is passed on in bulk:
+        chunk-size [; extensions] CRLF
+        chunk-data CRLF
+        ...
+        0 CRLF
+        [trailer fields CRLF]
+        CRLF
+*/
+static enum Body_Status feed_chunked(struct Body_Reader *reader, const char *data, size_t length, size_t *consumed, Body_Data_Callback on_data, void *context) {
+    size_t i = 0;
+    while (i < length) {
+        char c = data[i];
+        switch (reader->chunk_state) {
+            case CHUNK_SIZE: {
+                int digit = hex_digit_value(c);
+                if (digit != -1) {
+                    if (reader->remaining > (reader->max_body_size - reader->received) / 16) {
+                        *consumed = i;
+                        return BODY_TOO_LARGE;
+                    }
+                    reader->remaining = reader->remaining * 16 + digit;
+                    reader->chunk_size_digits = true;
+                } else if (!reader->chunk_size_digits) {
+                    *consumed = i;
+                    return BODY_MALFORMED;
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    reader->chunk_state = CHUNK_EXTENSION;
+                } else if (c == '\r') {
+                    reader->chunk_state = CHUNK_SIZE_LF;
+                } else {
+                    *consumed = i;
+                    return BODY_MALFORMED;
+                }
+                i++;
+                break;
+            }
+            case CHUNK_EXTENSION:
+                if (c == '\r') {
+                    reader->chunk_state = CHUNK_SIZE_LF;
+                }
+                i++;
+                break;
+            case CHUNK_SIZE_LF:
+                if (c != '\n') {
+                    *consumed = i;
+                    return BODY_MALFORMED;
+                }
+                if (reader->remaining > reader->max_body_size - reader->received) {
+                    *consumed = i;
+                    return BODY_TOO_LARGE;
+                }
+                reader->chunk_state = reader->remaining == 0 ? CHUNK_TRAILER_START : CHUNK_DATA;
+                i++;
+                break;
+            case CHUNK_DATA: {
+                ssize_t taken = emit_data(reader, data + i, length - i, on_data, context);
+                if (taken == -1) {
+                    *consumed = i;
+                    return BODY_SINK_FAILED;
+                }
+                i += taken;
+                if (reader->remaining == 0) {
+                    reader->chunk_state = CHUNK_DATA_CR;
+                }
+                break;
+            }
+            case CHUNK_DATA_CR:
+            case CHUNK_DATA_LF:
+                if (c != (reader->chunk_state == CHUNK_DATA_CR ? '\r' : '\n')) {
+                    *consumed = i;
+                    return BODY_MALFORMED;
+                }
+                if (reader->chunk_state == CHUNK_DATA_CR) {
+                    reader->chunk_state = CHUNK_DATA_LF;
+                } else {
+                    reader->chunk_state = CHUNK_SIZE;
+                    reader->chunk_size_digits = false;
+                }
+                i++;
+                break;
+            case CHUNK_TRAILER_START:
+                reader->chunk_state = c == '\r' ? CHUNK_TRAILER_END_LF : CHUNK_TRAILER_LINE;
+                i++;
+                break;
+            case CHUNK_TRAILER_LINE:
+                // Trailer fields are ignored
+                if (c == '\n') {
+                    reader->chunk_state = CHUNK_TRAILER_START;
+                }
+                i++;
+                break;
+            case CHUNK_TRAILER_END_LF:
+                if (c != '\n') {
+                    *consumed = i;
+                    return BODY_MALFORMED;
+                }
+                *consumed = i + 1;
+                reader->encoding = BODY_NONE;
+                return BODY_DONE;
+        }
+    }
+    *consumed = i;
+    return BODY_NEED_MORE;
+}
+
+/*
+    Consumes as much of data as belongs to the body and passes the decoded bytes to on_data
+    (which may be NULL to discard the body). *consumed is set to the number of bytes of data
+    that were used; after BODY_DONE the rest belongs to the next request.
+*/
+enum Body_Status body_reader_feed(struct Body_Reader *reader, const char *data, size_t length, size_t *consumed, Body_Data_Callback on_data, void *context) {
+    *consumed = 0;
+    switch (reader->encoding) {
+        case BODY_NONE:
+            return BODY_DONE;
+        case BODY_CONTENT_LENGTH: {
+            if (reader->remaining > reader->max_body_size - reader->received) {
+                return BODY_TOO_LARGE;
+            }
+            ssize_t taken = emit_data(reader, data, length, on_data, context);
+            if (taken == -1) {
+                return BODY_SINK_FAILED;
+            }
+            *consumed = taken;
+            if (reader->remaining == 0) {
+                reader->encoding = BODY_NONE;
+                return BODY_DONE;
+            }
+            return BODY_NEED_MORE;
+        }
+        case BODY_CHUNKED:
+            return feed_chunked(reader, data, length, consumed, on_data, context);
+    }
+    return BODY_MALFORMED;
+}
@@ -0,0 +1,54 @@
+#ifndef BODY_READER_H
+#define BODY_READER_H
+
+#include "includes.h"
+
+/*
+    Incremental decoder for request bodies. Raw bytes are fed in as they arrive from the
+    socket, in pieces of any size, and the decoded body is handed to a callback in pieces no
+    bigger than what was fed in. Nothing is buffered, so memory use does not depend on the
+    size of the body.
+*/
+
+enum Body_Encoding {
+    BODY_NONE,           // No body
+    BODY_CONTENT_LENGTH, // Exactly content_length bytes
+    BODY_CHUNKED         // Transfer-Encoding: chunked
+};
+
+enum Body_Status {
+    BODY_NEED_MORE,  // Everything fed was consumed, the body is not complete yet
+    BODY_DONE,       // The body is complete, bytes after it were not consumed
+    BODY_MALFORMED,  // Invalid chunked framing
+    BODY_TOO_LARGE,  // The body is bigger than max_body_size
+    BODY_SINK_FAILED // The callback returned -1
+};
+
+enum Chunk_State {
+    CHUNK_SIZE,
+    CHUNK_EXTENSION,
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER_START,
+    CHUNK_TRAILER_LINE,
+    CHUNK_TRAILER_END_LF
+};
+
+struct Body_Reader {
+    enum Body_Encoding encoding;
+    size_t remaining;     // Bytes left in the body (Content-Length) or in the current chunk
+    size_t received;      // Decoded body bytes so far
+    size_t max_body_size;
+    enum Chunk_State chunk_state;
+    bool chunk_size_digits;
+};
+
+// Receives decoded body bytes, returns -1 to abort the request
+typedef int (*Body_Data_Callback)(void *context, const char *data, size_t length);
+
+void body_reader_init(struct Body_Reader *reader, enum Body_Encoding encoding, size_t content_length, size_t max_body_size);
+enum Body_Status body_reader_feed(struct Body_Reader *reader, const char *data, size_t length, size_t *consumed, Body_Data_Callback on_data, void *context);
+
+#endif
@@ -0,0 +1,250 @@
+#include <pthread.h>
+#include "buffer_pool.h"
+#include "logger.h"
+
+static const size_t buffer_class_sizes[BUFFER_CLASS_COUNT] = {
+    4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024, BUFFER_MAX_POOLED_SIZE,
+};
+// How many free buffers of each class a thread keeps, and how many the depot keeps
+static const int thread_cache_limits[BUFFER_CLASS_COUNT] = { 64, 32, 8, 2, 1 };
+static const int depot_limits[BUFFER_CLASS_COUNT] = { 1024, 256, 32, 8, 2 };
+
+// Free buffers are linked through their first bytes
+struct Free_Buffer {
+    struct Free_Buffer *next;
+};
+
+struct Free_List {
+    struct Free_Buffer *head;
+    int count;
+};
+
+/*
+    Counters are only written by the owning thread (relaxed stores, no locked instructions)
+    and summed up by buffer_pool_get_stats through the list of live caches.
+*/
+struct Thread_Cache {
+    struct Free_List lists[BUFFER_CLASS_COUNT];
+    unsigned long acquires;
+    unsigned long hits;
+    struct Thread_Cache *prev;
+    struct Thread_Cache *next;
+};
+
+static struct Free_List depot[BUFFER_CLASS_COUNT];
+static pthread_mutex_t depot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Live thread caches, and the counters of threads that already exited
+static struct Thread_Cache *live_caches;
+static pthread_mutex_t live_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long exited_acquires;
+static unsigned long exited_hits;
+static size_t bytes_allocated;
+static size_t peak_bytes_allocated;
+
+static pthread_key_t thread_cache_key;
+static pthread_once_t thread_cache_key_once = PTHREAD_ONCE_INIT;
+static __thread struct Thread_Cache *thread_cache;
+
+static int size_class_for(size_t size) {
+    for (int i = 0; i < BUFFER_CLASS_COUNT; i++) {
+        if (size <= buffer_class_sizes[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void free_list_push(struct Free_List *list, char *buffer) {
+    struct Free_Buffer *node = (struct Free_Buffer *)buffer;
+    node->next = list->head;
+    list->head = node;
+    list->count++;
+}
+
+static char *free_list_pop(struct Free_List *list) {
+    struct Free_Buffer *node = list->head;
+    if (node == NULL) {
+        return NULL;
+    }
+    list->head = node->next;
+    list->count--;
+    return (char *)node;
+}
+
+static void account_allocated(ssize_t delta) {
+    size_t now = __atomic_add_fetch(&bytes_allocated, delta, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peak_bytes_allocated, __ATOMIC_RELAXED);
+    while (now > peak && !__atomic_compare_exchange_n(&peak_bytes_allocated, &peak, now, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void counter_increment(unsigned long *counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+// Thread exit: hand cached buffers to the depot so short-lived threads still get recycling
+static void thread_cache_destroy(void *arg) {
+    struct Thread_Cache *cache = arg;
+
+    pthread_mutex_lock(&live_caches_lock);
+    exited_acquires += cache->acquires;
+    exited_hits += cache->hits;
+    if (cache->prev) {
+        cache->prev->next = cache->next;
+    } else {
+        live_caches = cache->next;
+    }
+    if (cache->next) {
+        cache->next->prev = cache->prev;
+    }
+    pthread_mutex_unlock(&live_caches_lock);
+
+    pthread_mutex_lock(&depot_lock);
+    for (int i = 0; i < BUFFER_CLASS_COUNT; i++) {
+        char *buffer;
+        while ((buffer = free_list_pop(&cache->lists[i])) != NULL) {
+            if (depot[i].count < depot_limits[i]) {
+                free_list_push(&depot[i], buffer);
+            } else {
+                free(buffer);
+                account_allocated(-(ssize_t)buffer_class_sizes[i]);
+            }
+        }
+    }
+    pthread_mutex_unlock(&depot_lock);
+    free(cache);
+}
+
+static void create_thread_cache_key(void) {
+    pthread_key_create(&thread_cache_key, thread_cache_destroy);
+}
+
+static struct Thread_Cache *get_thread_cache(void) {
+    if (thread_cache == NULL) {
+        pthread_once(&thread_cache_key_once, create_thread_cache_key);
+        thread_cache = calloc(1, sizeof(struct Thread_Cache));
+        if (thread_cache != NULL) {
+            pthread_setspecific(thread_cache_key, thread_cache);
+            pthread_mutex_lock(&live_caches_lock);
+            thread_cache->next = live_caches;
+            if (live_caches) {
+                live_caches->prev = thread_cache;
+            }
+            live_caches = thread_cache;
+            pthread_mutex_unlock(&live_caches_lock);
+        }
+    }
+    return thread_cache;
+}
+
+/*
+    Returns a buffer of at least min_size bytes and stores its real size in *size.
+    The contents are not cleared. Returns NULL if memory runs out.
+*/
+char *buffer_pool_acquire(size_t min_size, size_t *size) {
+    int size_class = size_class_for(min_size);
+    if (size_class == -1) {
+        char *buffer = malloc(min_size);
+        if (buffer != NULL) {
+            *size = min_size;
+            account_allocated(min_size);
+        }
+        return buffer;
+    }
+
+    struct Thread_Cache *cache = get_thread_cache();
+    char *buffer = NULL;
+    if (cache != NULL) {
+        counter_increment(&cache->acquires);
+        buffer = free_list_pop(&cache->lists[size_class]);
+
+        if (buffer == NULL) {
+            pthread_mutex_lock(&depot_lock);
+            buffer = free_list_pop(&depot[size_class]);
+            pthread_mutex_unlock(&depot_lock);
+        }
+        if (buffer != NULL) {
+            counter_increment(&cache->hits);
+        }
+    }
+
+    if (buffer == NULL) {
+        buffer = malloc(buffer_class_sizes[size_class]);
+        if (buffer == NULL) {
+            return NULL;
+        }
+        account_allocated(buffer_class_sizes[size_class]);
+    }
+
+    *size = buffer_class_sizes[size_class];
+    return buffer;
+}
+
+void buffer_pool_release(char *buffer, size_t size) {
+    if (buffer == NULL) {
+        return;
+    }
+
+    int size_class = size_class_for(size);
+    if (size_class == -1 || buffer_class_sizes[size_class] != size) {
+        free(buffer);
+        account_allocated(-(ssize_t)size);
+        return;
+    }
+
+    struct Thread_Cache *cache = get_thread_cache();
+    if (cache != NULL && cache->lists[size_class].count < thread_cache_limits[size_class]) {
+        free_list_push(&cache->lists[size_class], buffer);
+        return;
+    }
+
+    pthread_mutex_lock(&depot_lock);
+    if (depot[size_class].count < depot_limits[size_class]) {
+        free_list_push(&depot[size_class], buffer);
+        buffer = NULL;
+    }
+    pthread_mutex_unlock(&depot_lock);
+
+    if (buffer != NULL) {
+        free(buffer);
+        account_allocated(-(ssize_t)size);
+    }
+}
+
+/*
+    Moves the first used bytes of buffer into a buffer of at least min_size bytes (the next
+    size class up) and releases the old one. Returns NULL, leaving buffer untouched, on failure.
+*/
+char *buffer_pool_grow(char *buffer, size_t used, size_t *size, size_t min_size) {
+    size_t new_size = 0;
+    char *new_buffer = buffer_pool_acquire(min_size, &new_size);
+    if (new_buffer == NULL) {
+        return NULL;
+    }
+    memcpy(new_buffer, buffer, used);
+    buffer_pool_release(buffer, *size);
+    *size = new_size;
+    return new_buffer;
+}
+
+void buffer_pool_get_stats(struct Buffer_Pool_Stats *stats) {
+    pthread_mutex_lock(&live_caches_lock);
+    stats->acquires = exited_acquires;
+    stats->hits = exited_hits;
+    for (struct Thread_Cache *cache = live_caches; cache != NULL; cache = cache->next) {
+        stats->acquires += __atomic_load_n(&cache->acquires, __ATOMIC_RELAXED);
+        stats->hits += __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&live_caches_lock);
+    stats->bytes_allocated = __atomic_load_n(&bytes_allocated, __ATOMIC_RELAXED);
+    stats->peak_bytes_allocated = __atomic_load_n(&peak_bytes_allocated, __ATOMIC_RELAXED);
+}
+
+void buffer_pool_report(void) {
+    struct Buffer_Pool_Stats stats;
+    buffer_pool_get_stats(&stats);
+    double hit_rate = stats.acquires ? 100.0 * stats.hits / stats.acquires : 0.0;
+    log_info("Buffer pool: %lu acquires, %.1f%% hit rate, %zu KB allocated, %zu KB peak",
+        stats.acquires, hit_rate, stats.bytes_allocated / 1024, stats.peak_bytes_allocated / 1024);
+}
@@ -0,0 +1,30 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include "includes.h"
+
+/*
+    Recycles connection buffers instead of going through malloc for every connection.
+    Buffers come in a few size classes; each thread keeps a small free list per class and
+    overflows into a shared depot that is only locked on a thread cache miss or thread exit.
+    Requests above the largest class are allocated directly and never cached.
+*/
+
+#define BUFFER_CLASS_COUNT 5
+// Largest size class, anything bigger bypasses the pool
+#define BUFFER_MAX_POOLED_SIZE (1024 * 1024)
+
+struct Buffer_Pool_Stats {
+    unsigned long acquires;
+    unsigned long hits;          // Served from a thread cache or the depot
+    size_t bytes_allocated;      // Currently held by the pool: in use plus cached
+    size_t peak_bytes_allocated;
+};
+
+char *buffer_pool_acquire(size_t min_size, size_t *size);
+char *buffer_pool_grow(char *buffer, size_t used, size_t *size, size_t min_size);
+void buffer_pool_release(char *buffer, size_t size);
+void buffer_pool_get_stats(struct Buffer_Pool_Stats *stats);
+void buffer_pool_report(void);
+
+#endif
@@ -0,0 +1,323 @@
+#include <pthread.h>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#include "compress_cache.h"
+#include "file_helpers.h"
+#include "logger.h"
+#include "trace.h"
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Compressed_Entry *buckets[COMPRESS_CACHE_BUCKETS];
+static struct Compressed_Entry *lru_head; // Most recently used
+static struct Compressed_Entry *lru_tail;
+static size_t cache_budget;
+static size_t cache_bytes;
+static size_t cache_entries;
+static size_t original_bytes;
+static size_t max_file_size;
+static unsigned long hits;
+static unsigned long misses;
+static unsigned long evictions;
+static unsigned long incompressible;
+static bool cache_enabled = false;
+
+static int64_t mtime_ns_of(const struct stat *file_stat) {
+    return (int64_t)file_stat->st_mtim.tv_sec * 1000000000 + file_stat->st_mtim.tv_nsec;
+}
+
+// FNV-1a over the key fields
+static uint32_t hash_key(const struct stat *file_stat, enum Content_Encoding encoding) {
+    uint64_t fields[5] = { (uint64_t)file_stat->st_dev, (uint64_t)file_stat->st_ino, (uint64_t)file_stat->st_size,
+        (uint64_t)mtime_ns_of(file_stat), (uint64_t)encoding };
+    uint32_t hash = 2166136261u;
+    const unsigned char *bytes = (const unsigned char *)fields;
+    for (size_t i = 0; i < sizeof(fields); i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool entry_matches(const struct Compressed_Entry *entry, const struct stat *file_stat, enum Content_Encoding encoding, uint32_t hash) {
+    return entry->hash == hash && entry->encoding == encoding && entry->inode == file_stat->st_ino && entry->device == file_stat->st_dev
+        && entry->size == file_stat->st_size && entry->mtime_ns == mtime_ns_of(file_stat);
+}
+
+static void entry_unref(struct Compressed_Entry *entry) {
+    if (--entry->refcount == 0) {
+        free(entry->data);
+        free(entry);
+    }
+}
+
+static void lru_remove(struct Compressed_Entry *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(struct Compressed_Entry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = entry;
+    } else {
+        lru_tail = entry;
+    }
+    lru_head = entry;
+}
+
+static void entry_unlink(struct Compressed_Entry *entry) {
+    struct Compressed_Entry **link = &buckets[entry->hash % COMPRESS_CACHE_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+    entry->bucket_next = NULL;
+    lru_remove(entry);
+    cache_bytes -= entry->cost;
+    original_bytes -= entry->size;
+    cache_entries--;
+    entry->linked = false;
+    entry_unref(entry);
+}
+
+/*
+    Enables the cache with a memory budget. Without it files are only sent compressed when
+    they have a precompressed sibling.
+*/
+bool compress_cache_init(size_t budget) {
+    if (budget == 0) {
+        return false;
+    }
+    cache_budget = budget;
+    max_file_size = COMPRESS_MAX_FILE_SIZE < budget / 4 ? COMPRESS_MAX_FILE_SIZE : budget / 4;
+    cache_enabled = true;
+    return true;
+}
+
+// Text files are worth compressing, images such as JPEG and PNG already are compressed
+bool compression_applies(const char *file_name) {
+    return is_text_based_mime_type(get_file_mime_type((char *)file_name));
+}
+
+// Whether this build can compress with encoding on the fly
+bool compression_supported(enum Content_Encoding encoding) {
+#ifdef HAVE_BROTLI
+    return encoding == ENCODING_GZIP || encoding == ENCODING_BROTLI;
+#else
+    return encoding == ENCODING_GZIP;
+#endif
+}
+
+// Suffix of the precompressed sibling of a file in encoding, NULL for identity
+const char *precompressed_extension(enum Content_Encoding encoding) {
+    static const char *extensions[CONTENT_ENCODING_COUNT] = {
+        [ENCODING_GZIP] = ".gz",
+        [ENCODING_BROTLI] = ".br",
+    };
+    return extensions[encoding];
+}
+
+// gzip with zlib. Returns NULL on failure or if the output is not smaller than the input.
+static char *compress_gzip(const char *data, size_t size, size_t *length) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // 15 window bits + 16 selects the gzip wrapper instead of zlib's
+    if (deflateInit2(&stream, COMPRESS_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    size_t capacity = size; // Anything bigger is not worth sending
+    char *output = malloc(capacity);
+    if (output == NULL) {
+        deflateEnd(&stream);
+        return NULL;
+    }
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = size;
+    stream.next_out = (Bytef *)output;
+    stream.avail_out = capacity;
+    int result = deflate(&stream, Z_FINISH);
+    *length = stream.total_out;
+    deflateEnd(&stream);
+    if (result != Z_STREAM_END) {
+        free(output);
+        return NULL;
+    }
+    return output;
+}
+
+#ifdef HAVE_BROTLI
+static char *compress_brotli(const char *data, size_t size, size_t *length) {
+    char *output = malloc(size);
+    if (output == NULL) {
+        return NULL;
+    }
+    *length = size;
+    if (!BrotliEncoderCompress(COMPRESS_BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, size, (const uint8_t *)data,
+            length, (uint8_t *)output) || *length >= size) {
+        free(output);
+        return NULL;
+    }
+    return output;
+}
+#endif
+
+// Reads and compresses the file into entry. Runs without the lock held.
+static void compress_entry(struct Compressed_Entry *entry, const char *path) {
+    struct Trace_Span span = trace_begin("compress");
+    struct file_data *filedata = load_file((char *)path);
+    if (filedata == NULL || filedata->size != (size_t)entry->size) {
+        // Changed since it was stat()ed, keep it out of the cache
+        if (filedata != NULL) {
+            file_free(filedata);
+        }
+        entry->length = SIZE_MAX;
+        trace_end(&span);
+        return;
+    }
+    if (entry->encoding == ENCODING_GZIP) {
+        entry->data = compress_gzip(filedata->data, filedata->size, &entry->length);
+    }
+#ifdef HAVE_BROTLI
+    if (entry->encoding == ENCODING_BROTLI) {
+        entry->data = compress_brotli(filedata->data, filedata->size, &entry->length);
+    }
+#endif
+    if (entry->data == NULL) {
+        entry->length = 0;
+    }
+    file_free(filedata);
+    trace_end(&span);
+}
+
+/*
+    Returns the variant of the file at path in encoding, compressing it on a miss. file_stat
+    is the file's current metadata, it is the key. Returns NULL if the cache is disabled, the
+    encoding is not supported, the file is too small or too big, or compressing it does not
+    save anything; the caller then sends it uncompressed.
+    Every entry returned must be given back with compress_cache_release once it has been sent.
+*/
+struct Compressed_Entry *compress_cache_acquire(const char *path, const struct stat *file_stat, enum Content_Encoding encoding, const char *cache_control) {
+    if (!cache_enabled || !compression_supported(encoding) || file_stat->st_size < COMPRESS_MIN_FILE_SIZE
+        || (size_t)file_stat->st_size > max_file_size) {
+        return NULL;
+    }
+
+    uint32_t hash = hash_key(file_stat, encoding);
+    pthread_mutex_lock(&cache_lock);
+    for (struct Compressed_Entry *entry = buckets[hash % COMPRESS_CACHE_BUCKETS]; entry != NULL; entry = entry->bucket_next) {
+        if (entry_matches(entry, file_stat, encoding, hash)) {
+            hits++;
+            lru_remove(entry);
+            lru_push_front(entry);
+            if (entry->data == NULL) {
+                pthread_mutex_unlock(&cache_lock);
+                return NULL;
+            }
+            entry->refcount++;
+            pthread_mutex_unlock(&cache_lock);
+            return entry;
+        }
+    }
+    misses++;
+    pthread_mutex_unlock(&cache_lock);
+
+    // Concurrent misses for the same variant each compress it, the first one to finish is kept
+    struct Compressed_Entry *entry = calloc(1, sizeof(struct Compressed_Entry));
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->device = file_stat->st_dev;
+    entry->inode = file_stat->st_ino;
+    entry->size = file_stat->st_size;
+    entry->mtime_ns = mtime_ns_of(file_stat);
+    entry->encoding = encoding;
+    entry->hash = hash;
+    compress_entry(entry, path);
+    if (entry->length == SIZE_MAX) {
+        free(entry);
+        return NULL;
+    }
+    file_validators_init(&entry->validators, file_stat, cache_control);
+    file_validators_set_encoding(&entry->validators, encoding);
+    entry->cost = sizeof(struct Compressed_Entry) + entry->length;
+    entry->refcount = 2; // The table and this thread
+
+    pthread_mutex_lock(&cache_lock);
+    for (struct Compressed_Entry *existing = buckets[hash % COMPRESS_CACHE_BUCKETS]; existing != NULL; existing = existing->bucket_next) {
+        if (entry_matches(existing, file_stat, encoding, hash)) {
+            pthread_mutex_unlock(&cache_lock);
+            if (entry->data == NULL) {
+                free(entry);
+                return NULL;
+            }
+            entry->refcount = 1;
+            return entry; // Sent once, then freed on release
+        }
+    }
+    if (entry->data == NULL) {
+        incompressible++;
+    }
+    entry->linked = true;
+    entry->bucket_next = buckets[hash % COMPRESS_CACHE_BUCKETS];
+    buckets[hash % COMPRESS_CACHE_BUCKETS] = entry;
+    lru_push_front(entry);
+    cache_bytes += entry->cost;
+    original_bytes += entry->size;
+    cache_entries++;
+    while (cache_bytes > cache_budget && lru_tail != NULL && lru_tail != entry) {
+        entry_unlink(lru_tail);
+        evictions++;
+    }
+    if (entry->data == NULL) {
+        entry_unref(entry); // Only remembered so the file is not compressed again
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return entry;
+}
+
+void compress_cache_release(struct Compressed_Entry *entry) {
+    pthread_mutex_lock(&cache_lock);
+    entry_unref(entry);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void compress_cache_get_stats(struct Compress_Cache_Stats *stats) {
+    pthread_mutex_lock(&cache_lock);
+    stats->hits = hits;
+    stats->misses = misses;
+    stats->evictions = evictions;
+    stats->incompressible = incompressible;
+    stats->entries = cache_entries;
+    stats->bytes = cache_bytes;
+    stats->budget = cache_budget;
+    stats->original_bytes = original_bytes;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void compress_cache_report(void) {
+    if (!cache_enabled) {
+        log_info("Compression cache: disabled");
+        return;
+    }
+    struct Compress_Cache_Stats stats;
+    compress_cache_get_stats(&stats);
+    unsigned long lookups = stats.hits + stats.misses;
+    double hit_rate = lookups ? 100.0 * stats.hits / lookups : 0.0;
+    log_info("Compression cache: %zu entries, %zu KB of %zu KB (from %zu KB of files), %lu hits, %lu misses (%.1f%% hit rate), %lu evictions, %lu incompressible",
+        stats.entries, stats.bytes / 1024, stats.budget / 1024, stats.original_bytes / 1024, stats.hits, stats.misses, hit_rate,
+        stats.evictions, stats.incompressible);
+}
@@ -0,0 +1,64 @@
+#ifndef COMPRESS_CACHE_H
+#define COMPRESS_CACHE_H
+
+#include <stdint.h>
+#include "includes.h"
+#include "http_helpers.h"
+
+/*
+    Compressed variants of text files, made on the first request that accepts them and kept
+    in memory under a budget, least recently used first out. Entries are keyed by file
+    identity (device, inode, size, modification time) and encoding, so a file that changes
+    gets new entries and the stale ones simply age out.
+    Precompressed .gz/.br siblings of a file are preferred over this cache, see
+    request_handlers.c; files are compressed here only when there is none.
+*/
+
+#define COMPRESS_CACHE_BUCKETS 256
+// Bigger files are sent uncompressed rather than compressed on the fly
+#define COMPRESS_MAX_FILE_SIZE (8 * 1024 * 1024)
+// Smaller files are not worth compressing, the headers outweigh the savings
+#define COMPRESS_MIN_FILE_SIZE 256
+// Each variant is compressed once and sent many times, so favor ratio over speed
+#define COMPRESS_GZIP_LEVEL 9
+#define COMPRESS_BROTLI_QUALITY 9
+
+struct Compressed_Entry {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    int64_t mtime_ns;
+    enum Content_Encoding encoding;
+    uint32_t hash;
+    char *data;                // NULL if compression did not make the file smaller
+    size_t length;
+    struct File_Validators validators;
+    size_t cost;
+    int refcount;              // Held by the table while linked, and by every reader
+    bool linked;
+    struct Compressed_Entry *bucket_next;
+    struct Compressed_Entry *lru_prev;
+    struct Compressed_Entry *lru_next;
+};
+
+struct Compress_Cache_Stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long incompressible;
+    size_t entries;
+    size_t bytes;
+    size_t budget;
+    size_t original_bytes;     // Size of the files the cached variants were made from
+};
+
+bool compress_cache_init(size_t budget);
+bool compression_applies(const char *file_name);
+bool compression_supported(enum Content_Encoding encoding);
+const char *precompressed_extension(enum Content_Encoding encoding);
+struct Compressed_Entry *compress_cache_acquire(const char *path, const struct stat *file_stat, enum Content_Encoding encoding, const char *cache_control);
+void compress_cache_release(struct Compressed_Entry *entry);
+void compress_cache_get_stats(struct Compress_Cache_Stats *stats);
+void compress_cache_report(void);
+
+#endif
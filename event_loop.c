@@ -0,0 +1,450 @@
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "event_loop.h"
+#include "server_handlers.h"
+#include "net_helpers.h"
+#include "server_config.h"
+#include "logger.h"
+#include "metrics.h"
+#include "trace.h"
+
+enum Connection_State {
+    CONN_READING, // Waiting for (the rest of) the next request
+    CONN_WRITING, // Waiting for the socket to take the queued output, requests are not read meanwhile
+    CONN_COMMITTING, // Waiting for the upload writer before answering, requests are not read meanwhile
+    CONN_CLOSING  // Peer gone, error, or the last response asked for the connection to close
+};
+
+struct Connection {
+    int fd;
+    enum Connection_State state;
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    struct Request_State request;
+    struct Output_Queue output;  // What the socket did not take yet
+    bool close_after_output;     // Close once output has been sent instead of reading on
+    time_t last_active;
+    // Idle list (or committing list), ordered from least to most recently active
+    struct Connection *prev;
+    struct Connection *next;
+};
+
+struct Connection_List {
+    struct Connection *head;
+    struct Connection *tail;
+};
+
+struct Reactor {
+    int id;
+    int epoll_fd;
+    int server_fd;
+    int commit_fd;  // eventfd the upload writer signals, registered with the reactor as data pointer
+    pthread_t thread;
+    struct Connection_List idle;
+    struct Connection_List committing; // Not timed out while the writer has their upload
+};
+
+static void connection_list_remove(struct Connection_List *list, struct Connection *conn) {
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        list->head = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    } else {
+        list->tail = conn->prev;
+    }
+    conn->prev = NULL;
+    conn->next = NULL;
+}
+
+static void connection_list_append(struct Connection_List *list, struct Connection *conn) {
+    conn->prev = list->tail;
+    conn->next = NULL;
+    if (list->tail) {
+        list->tail->next = conn;
+    } else {
+        list->head = conn;
+    }
+    list->tail = conn;
+}
+
+// Moves conn to the tail of the idle list, keeping the list sorted by last activity
+static void connection_touch(struct Reactor *reactor, struct Connection *conn) {
+    conn->last_active = time(NULL);
+    connection_list_remove(&reactor->idle, conn);
+    connection_list_append(&reactor->idle, conn);
+}
+
+static struct Connection *connection_create(int fd) {
+    struct Connection *conn = malloc(sizeof(struct Connection));
+    if (conn == NULL) {
+        return NULL;
+    }
+    memset(conn, 0, sizeof(struct Connection));
+    conn->buffer = acquire_request_buffer(&conn->capacity);
+    if (conn->buffer == NULL) {
+        free(conn);
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->state = CONN_READING;
+    metrics_connection_opened();
+    request_state_init(&conn->request);
+    conn->last_active = time(NULL);
+    return conn;
+}
+
+// Closes the socket and frees everything connection_create set up
+static void connection_destroy(struct Connection *conn) {
+    close(conn->fd);
+    log_debug("Closed connection with client: %d", conn->fd);
+    request_state_release(&conn->request);
+    output_queue_clear(&conn->output);
+    release_request_buffer(conn->buffer, conn->capacity);
+    free(conn);
+    metrics_connection_closed();
+}
+
+static void connection_close(struct Reactor *reactor, struct Connection *conn) {
+    connection_list_remove(&reactor->idle, conn);
+    // Closing the fd removes it from the epoll set, but be explicit in case it was dup'ed
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    connection_destroy(conn);
+}
+
+/*
+    Reads everything currently available on the socket (required with edge-triggered epoll),
+    or until the buffer is full, in which case *drained is left false.
+    Returns false if the peer closed the connection or a read error occurred.
+*/
+static bool connection_read(struct Connection *conn, bool *drained) {
+    *drained = false;
+    while (1) {
+        if (conn->length == conn->capacity && !grow_request_buffer(&conn->buffer, conn->length, &conn->capacity)) {
+            return true; // Buffer is full, caller serves what it can or rejects the request
+        }
+
+        ssize_t bytes_received = recv(conn->fd, conn->buffer + conn->length, conn->capacity - conn->length, 0);
+        if (bytes_received > 0) {
+            metrics_add_bytes_received(bytes_received);
+            conn->length += bytes_received;
+            conn->buffer[conn->length] = '\0';
+            continue;
+        }
+        if (bytes_received == 0) {
+            return false; // Peer closed the connection
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            *drained = true;
+            return true;
+        }
+        log_errno("Receiving failed");
+        return false;
+    }
+}
+
+// Switches the events conn is waited on for between EPOLLIN and EPOLLOUT
+static bool connection_watch(struct Reactor *reactor, struct Connection *conn, uint32_t direction) {
+    struct epoll_event event = {
+        .events = direction | EPOLLRDHUP | EPOLLET,
+        .data.ptr = conn,
+    };
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) == -1) {
+        log_errno("Failed to update client in epoll");
+        return false;
+    }
+    return true;
+}
+
+/*
+    Called after conn was served: a request waiting for its upload commit parks it on the
+    committing list, output the socket did not take makes it wait for EPOLLOUT (and stop
+    reading requests until it drained), otherwise it is closed or waits for more.
+*/
+static void connection_settle(struct Reactor *reactor, struct Connection *conn) {
+    if (conn->request.commit != NULL) {
+        conn->state = CONN_COMMITTING;
+        connection_list_remove(&reactor->idle, conn);
+        connection_list_append(&reactor->committing, conn);
+        return;
+    }
+    if (conn->output.head != NULL && conn->state != CONN_WRITING) {
+        conn->close_after_output = conn->state == CONN_CLOSING;
+        conn->state = connection_watch(reactor, conn, EPOLLOUT) ? CONN_WRITING : CONN_CLOSING;
+    }
+
+    if (conn->state == CONN_CLOSING) {
+        connection_close(reactor, conn);
+    } else {
+        connection_touch(reactor, conn);
+    }
+}
+
+static void connection_on_readable(struct Reactor *reactor, struct Connection *conn) {
+    bool drained = false;
+    deferred_output = &conn->output;
+
+    // Bodies are streamed through the buffer, so keep serving until the socket is drained
+    while (!drained && conn->state == CONN_READING && conn->output.head == NULL) {
+        trace_current = conn->request.trace_id;
+        struct Trace_Span recv_span = trace_begin("recv");
+        bool is_open = connection_read(conn, &drained);
+        trace_end(&recv_span);
+        bool keep_open = true;
+
+        size_t consumed = serve_buffered_requests(conn->buffer, conn->length, conn->fd, &conn->request, &keep_open);
+        memmove(conn->buffer, conn->buffer + consumed, conn->length - consumed);
+        conn->length -= consumed;
+        conn->buffer[conn->length] = '\0';
+
+        if (conn->request.commit != NULL) {
+            break; // Closed, if it has to be, after the response was sent
+        } else if (!keep_open || !is_open) {
+            conn->state = CONN_CLOSING;
+        } else if (conn->length == conn->capacity && conn->output.head == NULL) {
+            // The buffer could not grow any further and still holds incomplete headers
+            request_context.keep_alive = false;
+            send_400(conn->fd, "Bad Request: Request too large", strlen("Bad Request: Request too large"));
+            arena_reset(request_arena());
+            conn->state = CONN_CLOSING;
+        }
+    }
+
+    deferred_output = NULL;
+    connection_settle(reactor, conn);
+}
+
+/*
+    Sends queued output. Once all of it went out the connection either closes or goes back to
+    reading: the requests left in its buffer are served and the socket is read again, since
+    the edge of anything that arrived meanwhile was ignored.
+*/
+static void connection_on_writable(struct Reactor *reactor, struct Connection *conn) {
+    if (output_queue_flush(conn->fd, &conn->output) == -1) {
+        log_errno("Sending response failed");
+        conn->state = CONN_CLOSING;
+    } else if (conn->output.head == NULL) {
+        conn->state = conn->close_after_output || !connection_watch(reactor, conn, EPOLLIN) ? CONN_CLOSING : CONN_READING;
+    }
+
+    if (conn->state == CONN_READING) {
+        connection_on_readable(reactor, conn);
+    } else {
+        connection_settle(reactor, conn);
+    }
+}
+
+/*
+    Answers the requests whose upload commit is done, after the writer signalled commit_fd.
+    A connection goes back to reading like after a flush: the requests left in its buffer
+    are served and the socket is read again, since its read edges were ignored meanwhile.
+*/
+static void reactor_on_commits(struct Reactor *reactor) {
+    uint64_t signalled;
+    if (read(reactor->commit_fd, &signalled, sizeof(signalled)) == -1 && errno != EAGAIN) {
+        log_errno("Failed to read upload commit eventfd");
+    }
+
+    struct Connection *next = NULL;
+    for (struct Connection *conn = reactor->committing.head; conn != NULL; conn = next) {
+        next = conn->next;
+        if (!upload_commit_done(conn->request.commit)) {
+            continue;
+        }
+        connection_list_remove(&reactor->committing, conn);
+        connection_list_append(&reactor->idle, conn);
+
+        deferred_output = &conn->output;
+        bool keep_open = finish_committed_request(conn->fd, &conn->request);
+        deferred_output = NULL;
+        conn->state = keep_open ? CONN_READING : CONN_CLOSING;
+        if (conn->state == CONN_READING && conn->output.head == NULL) {
+            connection_on_readable(reactor, conn);
+        } else {
+            connection_settle(reactor, conn);
+        }
+    }
+}
+
+// Closes connections that have been idle, or not read any of their output, for longer than --keepalive-timeout
+static void close_idle_connections(struct Reactor *reactor) {
+    time_t now = time(NULL);
+    while (reactor->idle.head != NULL && now - reactor->idle.head->last_active >= server_config.keepalive_timeout) {
+        connection_close(reactor, reactor->idle.head);
+    }
+}
+
+/*
+    Accepts up to ACCEPT_BATCH_SIZE pending connections. The listener is registered
+    level-triggered, so anything left in the queue wakes a reactor up again.
+*/
+static void accept_connections(struct Reactor *reactor) {
+    for (int i = 0; i < ACCEPT_BATCH_SIZE; i++) {
+        int client_fd = accept4(reactor->server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_errno("Failed to connect to client");
+            }
+            return;
+        }
+
+        struct Connection *conn = connection_create(client_fd);
+        if (conn == NULL) {
+            log_errno("Failed to allocate connection");
+            close(client_fd);
+            continue;
+        }
+
+        struct epoll_event event = {
+            .events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+            .data.ptr = conn,
+        };
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
+            log_errno("Failed to register client with epoll");
+            connection_destroy(conn); // Not in the idle list yet
+            continue;
+        }
+        connection_list_append(&reactor->idle, conn);
+        log_debug("Client connected: %d (reactor %d)", client_fd, reactor->id);
+    }
+}
+
+static void *reactor_run(void *arg) {
+    struct Reactor *reactor = arg;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    upload_commit_notify_fd = reactor->commit_fd;
+
+    while (1) {
+        int ready = epoll_wait(reactor->epoll_fd, events, MAX_EPOLL_EVENTS, IDLE_SWEEP_INTERVAL_MS);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_errno("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            // The listening socket is registered with a NULL data pointer
+            if (events[i].data.ptr == NULL) {
+                accept_connections(reactor);
+                continue;
+            }
+            if (events[i].data.ptr == reactor) {
+                reactor_on_commits(reactor);
+                continue;
+            }
+
+            struct Connection *conn = events[i].data.ptr;
+            if (conn->state == CONN_WRITING) {
+                // A hang-up or error shows up as a failed send
+                if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+                    connection_on_writable(reactor, conn);
+                }
+            } else if (conn->state == CONN_READING && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                connection_on_readable(reactor, conn);
+            }
+        }
+
+        close_idle_connections(reactor);
+    }
+
+    return NULL;
+}
+
+/*
+    Runs thread_count reactors, each with its own epoll instance. Reactor i watches
+    server_fds[i % listener_count]: with a single listener all reactors share it through
+    EPOLLEXCLUSIVE so a new connection wakes only one of them, with SO_REUSEPORT shards
+    each reactor runs an independent accept loop on its own socket. Either way the reactor
+    that accepts a connection owns it for its whole lifetime.
+    Only returns if the reactors could not be started or all of them stopped.
+*/
+int run_event_loop(int *server_fds, int listener_count, int thread_count, bool cpu_affinity) {
+    for (int i = 0; i < listener_count; i++) {
+        if (set_nonblocking(server_fds[i]) == -1) {
+            log_errno("Failed to make listening socket non-blocking");
+            return -1;
+        }
+    }
+
+    struct Reactor *reactors = calloc(thread_count, sizeof(struct Reactor));
+    if (reactors == NULL) {
+        log_errno("Failed to allocate reactors");
+        return -1;
+    }
+
+    int started = 0;
+    for (int i = 0; i < thread_count; i++) {
+        reactors[i].id = i;
+        reactors[i].server_fd = server_fds[i % listener_count];
+        reactors[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (reactors[i].epoll_fd == -1) {
+            log_errno("epoll_create1 failed");
+            break;
+        }
+
+        struct epoll_event event = {
+            .events = EPOLLIN | EPOLLEXCLUSIVE,
+            .data.ptr = NULL,
+        };
+        if (epoll_ctl(reactors[i].epoll_fd, EPOLL_CTL_ADD, reactors[i].server_fd, &event) == -1) {
+            log_errno("Failed to register listening socket with epoll");
+            close(reactors[i].epoll_fd);
+            break;
+        }
+
+        reactors[i].commit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event commit_event = {
+            .events = EPOLLIN,
+            .data.ptr = &reactors[i],
+        };
+        if (reactors[i].commit_fd == -1 || epoll_ctl(reactors[i].epoll_fd, EPOLL_CTL_ADD, reactors[i].commit_fd, &commit_event) == -1) {
+            log_errno("Failed to set up the upload commit eventfd");
+            if (reactors[i].commit_fd != -1) {
+                close(reactors[i].commit_fd);
+            }
+            close(reactors[i].epoll_fd);
+            break;
+        }
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (cpu_affinity) {
+            thread_attr_set_cpu(&attr, i);
+        }
+        int thread_result = pthread_create(&reactors[i].thread, &attr, reactor_run, &reactors[i]);
+        pthread_attr_destroy(&attr);
+        if (thread_result != 0) {
+            log_errno("Failed to create reactor thread");
+            close(reactors[i].commit_fd);
+            close(reactors[i].epoll_fd);
+            break;
+        }
+        started++;
+    }
+
+    if (started == 0) {
+        free(reactors);
+        return -1;
+    }
+    log_info("Event loop running with %d reactor thread(s) on %d listener(s)", started, listener_count);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(reactors[i].thread, NULL);
+        close(reactors[i].commit_fd);
+        close(reactors[i].epoll_fd);
+    }
+    free(reactors);
+    return 0;
+}
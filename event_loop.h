@@ -0,0 +1,15 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "includes.h"
+
+// Maximum number of events returned by a single epoll_wait call
+#define MAX_EPOLL_EVENTS 256
+// Maximum number of connections accepted per listener wake-up
+#define ACCEPT_BATCH_SIZE 64
+// How often reactors look for connections that exceeded the keep-alive timeout
+#define IDLE_SWEEP_INTERVAL_MS 1000
+
+int run_event_loop(int *server_fds, int listener_count, int thread_count, bool cpu_affinity);
+
+#endif
@@ -1,109 +1,201 @@
+#include <sys/file.h>
 #include "file_helpers.h"
+#include "logger.h"
+#include "metrics.h"
+#include "trace.h"
 
-char *get_file_mime_type(char *file_name)
-{
-    char *ext = strrchr(file_name, '.');
+/*
+    Served file types, by extension. cache_control is the Cache-Control value sent with the
+    file, it can be overridden with --cache-control. Pages revalidate on every use, with the
+    ETag that is cheap; assets may be reused for a while without asking.
+*/
+static struct File_Type file_types[] = {
+    { "html", MIME_TEXT_HTML, "no-cache" },
+    { "htm", MIME_TEXT_HTML, "no-cache" },
+    { "jpeg", MIME_JPEG, "public, max-age=86400" },
+    { "jpg", MIME_JPEG, "public, max-age=86400" },
+    { "css", MIME_TEXT_CSS, "public, max-age=3600" },
+    { "js", MIME_TEXT_JS, "public, max-age=3600" },
+    { "json", MIME_JSON, "no-cache" },
+    { "txt", MIME_TEXT_PLAIN, "no-cache" },
+    { "png", MIME_PNG, "public, max-age=86400" },
+};
+
+static const char *default_cache_control = DEFAULT_CACHE_CONTROL;
 
+static struct File_Type *find_file_type(const char *file_name) {
+    const char *ext = strrchr(file_name, '.');
     if (ext == NULL) {
-        return MIME_OCTET_STREAM;
+        return NULL;
     }
-    
     ext++;
+    for (size_t i = 0; i < sizeof(file_types) / sizeof(file_types[0]); i++) {
+        if (strcmp(ext, file_types[i].extension) == 0) {
+            return &file_types[i];
+        }
+    }
+    return NULL;
+}
+
+char *get_file_mime_type(char *file_name)
+{
+    struct File_Type *type = find_file_type(file_name);
+    return type != NULL ? (char *)type->mime_type : MIME_OCTET_STREAM;
+}
+
+/*
+    Paths are resolved lexically: a path is canonical when it is under HTML_DIR and has no
+    empty, "." or ".." segment, so it stays inside HTML_DIR and every file has exactly one.
+*/
+bool is_canonical_path(const char *path) {
+    size_t root_length = strlen(HTML_DIR);
+    if (strncmp(path, HTML_DIR, root_length) != 0) {
+        return false;
+    }
+    const char *segment = path + root_length;
+    while (1) {
+        const char *slash = strchr(segment, '/');
+        size_t length = slash ? (size_t)(slash - segment) : strlen(segment);
+        if (length == 0 || (length == 1 && segment[0] == '.') || (length == 2 && segment[0] == '.' && segment[1] == '.')) {
+            return false;
+        }
+        if (slash == NULL) {
+            return true;
+        }
+        segment = slash + 1;
+    }
+}
 
-    if (strcmp(ext, "html") == 0 || strcmp(ext, "htm") == 0) { return MIME_TEXT_HTML; }
-    if (strcmp(ext, "jpeg") == 0 || strcmp(ext, "jpg") == 0) { return MIME_JPEG; }
-    if (strcmp(ext, "css") == 0) { return MIME_TEXT_CSS; }
-    if (strcmp(ext, "js") == 0) { return MIME_TEXT_JS; }
-    if (strcmp(ext, "json") == 0) { return MIME_JSON; }
-    if (strcmp(ext, "txt") == 0) { return MIME_TEXT_PLAIN; }
-    if (strcmp(ext, "png") == 0) { return MIME_PNG; }
+const char *get_file_cache_control(const char *file_name) {
+    struct File_Type *type = find_file_type(file_name);
+    return type != NULL ? type->cache_control : default_cache_control;
+}
 
-    return MIME_OCTET_STREAM;
+/*
+    Applies a --cache-control setting, "ext=value" or "*=value" for files of any other type.
+    Must be called before the server starts. Returns false if the setting is invalid.
+*/
+bool set_file_cache_control(const char *setting) {
+    const char *equals = strchr(setting, '=');
+    if (equals == NULL || equals == setting || equals[1] == '\0' || strlen(equals + 1) > MAX_CACHE_CONTROL_LENGTH
+        || strpbrk(equals + 1, "\r\n") != NULL) {
+        return false;
+    }
+    size_t extension_length = equals - setting;
+    if (extension_length == 1 && setting[0] == '*') {
+        default_cache_control = equals + 1;
+        return true;
+    }
+    for (size_t i = 0; i < sizeof(file_types) / sizeof(file_types[0]); i++) {
+        if (strlen(file_types[i].extension) == extension_length && strncmp(setting, file_types[i].extension, extension_length) == 0) {
+            file_types[i].cache_control = equals + 1;
+            return true;
+        }
+    }
+    return false;
 }
 
 int write_file(char *filename, char *data, size_t data_size) {
-    printf("Writing %zu bytes to file '%s'\n", data_size, filename);
+    log_debug("Writing %zu bytes to file '%s'", data_size, filename);
     // Open the file for writing (create if it doesn't exist)
     int file_fd = open(filename, O_APPEND | O_CREAT | O_WRONLY, 0644);
 
     if (file_fd == -1) {
-        perror("Could not open file for writing");
+        log_errno("Could not open file for writing");
         return -1;
     }
 
     // Write the data to the file
     ssize_t bytes_written = write(file_fd, data, data_size);
-    printf("Bytes written: %zd\n", bytes_written);
+    log_debug("Bytes written: %zd", bytes_written);
     close(file_fd);
 
     if (bytes_written == -1 || (size_t)bytes_written != data_size) {
-        perror("Failed to write file");
+        log_errno("Failed to write file");
         return -1;
     }
 
     return 0; // Success
 }
 
-struct file_data *load_file(char *filename) {
-    // Try to open the file as read-only and get the file descriptor
+/*
+    Opens a regular file for reading and stores its size in *file_size.
+    Returns the file descriptor, or -1 if the file does not exist or is not a regular file.
+*/
+// Opens a regular file for reading and fills file_stat, returns -1 for anything else
+int open_file_stat(const char *filename, struct stat *file_stat) {
     int file_fd = open(filename, O_RDONLY);
     if (file_fd == -1) {
-        return NULL;
+        return -1;
     }
 
-    // Get the file size using fstat
-    struct stat file_stat;
-    fstat(file_fd, &file_stat);
-    off_t file_size = file_stat.st_size;
-
-    // Allocate buffer to hold the file content plus null terminator
-    size_t buffer_size = file_size + 1;
-    char *file_buffer = malloc(buffer_size);
-    if (file_buffer == NULL) {
+    if (fstat(file_fd, file_stat) == -1 || !S_ISREG(file_stat->st_mode)) {
         close(file_fd);
-        free(file_buffer);
-        return NULL;
+        return -1;
     }
-    memset(file_buffer, 0, buffer_size); // Clear buffer
+    return file_fd;
+}
 
-    // Read the contents of the file into the buffer
-    ssize_t bytes_read = read(file_fd, file_buffer, file_size);
-    close(file_fd);
-    if (bytes_read == -1) {
-        free(file_buffer);
-        return NULL;
+int open_file(char *filename, size_t *file_size) {
+    struct stat file_stat;
+    int file_fd = open_file_stat(filename, &file_stat);
+    if (file_fd != -1) {
+        *file_size = file_stat.st_size;
     }
+    return file_fd;
+}
 
-    // Add null terminator to the end of the buffer
-    file_buffer[buffer_size - 1] = '\0';
-
-    // Allocate struct
+/*
+    Reads the first file_size bytes of an open file into memory. data holds exactly size bytes
+    followed by a null terminator (not counted in size) so text files can also be used as strings.
+    Does not close file_fd.
+*/
+struct file_data *load_file_fd(int file_fd, size_t file_size) {
+    uint64_t started_ns = metrics_now_ns();
+    struct Trace_Span span = trace_begin("load_file");
     struct file_data *filedata = malloc(sizeof(struct file_data));
-    if (filedata == NULL) {
+    char *file_buffer = malloc(file_size + 1);
+    if (filedata == NULL || file_buffer == NULL) {
+        free(filedata);
         free(file_buffer);
         return NULL;
     }
 
-    // Copy file contents into struct
-    char *file_contents = malloc(buffer_size);
-    if (file_contents == NULL) {
+    // Read the contents of the file straight into the buffer handed to the caller
+    size_t total_read = 0;
+    while (total_read < file_size) {
+        ssize_t bytes_read = read(file_fd, file_buffer + total_read, file_size - total_read);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            break;
+        }
+        total_read += bytes_read;
+    }
+
+    if (total_read != file_size) {
         free(filedata);
         free(file_buffer);
         return NULL;
     }
-    memset(file_contents, 0, buffer_size); // Clear contents buffer
-    memcpy(file_contents, file_buffer, buffer_size);
-    free(file_buffer);
+    file_buffer[file_size] = '\0';
+    metrics_observe(PHASE_FILE_READ, metrics_now_ns() - started_ns);
+    trace_end(&span);
 
-    // Populate struct
-    filedata->size = buffer_size;
-    filedata->data = file_contents;
+    filedata->size = file_size;
+    filedata->data = file_buffer;
+    return filedata;
+}
 
-    if (filedata->data == NULL) {
-        free(filedata);
+struct file_data *load_file(char *filename) {
+    size_t file_size = 0;
+    int file_fd = open_file(filename, &file_size);
+    if (file_fd == -1) {
         return NULL;
     }
-
+    struct file_data *filedata = load_file_fd(file_fd, file_size);
+    close(file_fd);
     return filedata;
 }
 
@@ -111,4 +203,187 @@ void file_free(struct file_data *filedata)
 {
     free(filedata->data);
     free(filedata);
-}
\ No newline at end of file
+}
+
+// Writes all of data, retrying after short writes
+int write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Temporary file that disappears on its own once closed
+static int open_spool_file(void) {
+    int fd = open(POST_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd != -1) {
+        return fd;
+    }
+    // Filesystems without O_TMPFILE: create a named file and unlink it right away
+    char template[] = POST_DIR ".upload-XXXXXX";
+    fd = mkstemp(template);
+    if (fd != -1) {
+        unlink(template);
+    }
+    return fd;
+}
+
+/*
+    Creates a named temporary file under POST_DIR for an uploaded file and stores its path in
+    path (at least UPLOAD_TEMP_PATH_SIZE bytes). The name starts with a dot, so it can never
+    collide with a stored upload, see upload_file_name.
+*/
+int create_upload_file(char *path) {
+    memcpy(path, POST_DIR ".upload-XXXXXX", UPLOAD_TEMP_PATH_SIZE);
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd == -1) {
+        log_errno("Could not create upload file");
+    }
+    return fd;
+}
+
+/*
+    Turns the file name sent by a client into the name an upload is stored under in POST_DIR:
+    the last path component, which may not start with a dot. A name made only of digits gets
+    UPLOAD_NUMERIC_NAME_PREFIX, GET /post/<digits> returns the record with that id instead.
+    Returns false if nothing usable is left.
+*/
+bool upload_file_name(const char *file_name, char *name, size_t size) {
+    const char *base = file_name;
+    bool numeric = true;
+    for (const char *c = file_name; *c != '\0'; c++) {
+        if (*c == '/' || *c == '\\') {
+            base = c + 1; // Browsers on Windows may send the full path
+            numeric = true;
+        } else if (*c < '0' || *c > '9') {
+            numeric = false;
+        }
+    }
+    size_t length = strlen(base);
+    size_t prefix_length = numeric ? strlen(UPLOAD_NUMERIC_NAME_PREFIX) : 0;
+    if (length == 0 || prefix_length + length >= size || base[0] == '.') {
+        return false;
+    }
+    memcpy(name, UPLOAD_NUMERIC_NAME_PREFIX, prefix_length);
+    memcpy(name + prefix_length, base, length + 1);
+    return true;
+}
+
+void upload_spool_init(struct Upload_Spool *spool) {
+    spool->memory = NULL;
+    spool->capacity = 0;
+    spool->file_fd = -1;
+    spool->length = 0;
+    spool->checksum = 0;
+}
+
+int upload_spool_write(struct Upload_Spool *spool, const char *data, size_t length) {
+    spool->checksum = crc32_update(spool->checksum, data, length);
+
+    if (spool->file_fd == -1 && spool->length + length > UPLOAD_MEMORY_LIMIT) {
+        // Too big for memory: move what we have to a temporary file and continue there
+        spool->file_fd = open_spool_file();
+        if (spool->file_fd == -1) {
+            log_errno("Could not create upload spool file");
+            return -1;
+        }
+        if (write_all(spool->file_fd, spool->memory, spool->length) == -1) {
+            log_errno("Could not write upload spool file");
+            return -1;
+        }
+        free(spool->memory);
+        spool->memory = NULL;
+        spool->capacity = 0;
+    }
+
+    if (spool->file_fd != -1) {
+        if (write_all(spool->file_fd, data, length) == -1) {
+            log_errno("Could not write upload spool file");
+            return -1;
+        }
+        spool->length += length;
+        return 0;
+    }
+
+    if (spool->length + length > spool->capacity) {
+        size_t new_capacity = spool->capacity ? spool->capacity : 4096;
+        while (new_capacity < spool->length + length) {
+            new_capacity *= 2;
+        }
+        char *new_memory = realloc(spool->memory, new_capacity);
+        if (new_memory == NULL) {
+            return -1;
+        }
+        spool->memory = new_memory;
+        spool->capacity = new_capacity;
+    }
+    memcpy(spool->memory + spool->length, data, length);
+    spool->length += length;
+    return 0;
+}
+
+// Writes the whole upload to fd, at its current offset
+int upload_spool_copy_to(struct Upload_Spool *spool, int fd) {
+    if (spool->file_fd == -1) {
+        return write_all(fd, spool->memory, spool->length);
+    }
+    // sendfile() and copy_file_range() refuse O_APPEND destinations, copy through a buffer
+    char *buffer = malloc(UPLOAD_COPY_CHUNK_SIZE);
+    if (buffer == NULL) {
+        return -1;
+    }
+    int result = 0;
+    off_t offset = 0;
+    while ((size_t)offset < spool->length) {
+        ssize_t bytes_read = pread(spool->file_fd, buffer, UPLOAD_COPY_CHUNK_SIZE, offset);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0 || write_all(fd, buffer, bytes_read) == -1) {
+            result = -1;
+            break;
+        }
+        offset += bytes_read;
+    }
+    free(buffer);
+    return result;
+}
+
+/*
+    Appends the whole upload to filename. The file is locked while the upload is copied, so
+    concurrent uploads never interleave even when they are too big for a single write.
+*/
+int upload_spool_append_to_file(struct Upload_Spool *spool, char *filename) {
+    log_debug("Writing %zu bytes to file '%s'", spool->length, filename);
+    int file_fd = open(filename, O_APPEND | O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+    if (file_fd == -1) {
+        log_errno("Could not open file for writing");
+        return -1;
+    }
+    flock(file_fd, LOCK_EX);
+
+    int result = upload_spool_copy_to(spool, file_fd);
+
+    flock(file_fd, LOCK_UN);
+    close(file_fd);
+    if (result == -1) {
+        log_errno("Failed to write file");
+    }
+    return result;
+}
+
+void upload_spool_free(struct Upload_Spool *spool) {
+    free(spool->memory);
+    if (spool->file_fd != -1) {
+        close(spool->file_fd);
+    }
+    upload_spool_init(spool);
+}
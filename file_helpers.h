@@ -2,15 +2,62 @@
 #define FILE_HELPERS_H
 
 #include "includes.h"
+#include "other_helpers.h"
+
+// Uploads bigger than this are spooled to a temporary file instead of memory
+#define UPLOAD_MEMORY_LIMIT (64 * 1024)
+
+// Read size when copying an upload spooled to a file
+#define UPLOAD_COPY_CHUNK_SIZE (64 * 1024)
+// Size of the path filled in by create_upload_file
+#define UPLOAD_TEMP_PATH_SIZE (sizeof(POST_DIR ".upload-XXXXXX"))
+// Put before uploaded file names made only of digits, which would read as record ids
+#define UPLOAD_NUMERIC_NAME_PREFIX "file-"
+
+// Cache-Control of files whose type is not in the table
+#define DEFAULT_CACHE_CONTROL "no-cache"
+
+struct File_Type {
+    const char *extension;
+    const char *mime_type;
+    const char *cache_control;
+};
 
 struct file_data {
-    int size;
+    size_t size;
     void *data;
 };
 
+/*
+    Holds an upload while it is being received: in memory while it is small, moved to an
+    unlinked temporary file under POST_DIR once it outgrows UPLOAD_MEMORY_LIMIT, so the memory
+    used per upload stays bounded whatever its size.
+*/
+struct Upload_Spool {
+    char *memory;
+    size_t capacity;
+    int file_fd;   // -1 while the upload is in memory
+    size_t length;
+    uint32_t checksum; // CRC-32 of everything written so far
+};
+
+bool is_canonical_path(const char *path);
 char *get_file_mime_type(char *file_name);
+const char *get_file_cache_control(const char *file_name);
+bool set_file_cache_control(const char *setting);
+int open_file(char *filename, size_t *file_size);
+int open_file_stat(const char *filename, struct stat *file_stat);
 struct file_data *load_file(char *filename);
+struct file_data *load_file_fd(int file_fd, size_t file_size);
 void file_free(struct file_data *filedata);
 int write_file(char *filename, char *data, size_t data_size);
+int write_all(int fd, const char *data, size_t length);
+int create_upload_file(char *path);
+bool upload_file_name(const char *file_name, char *name, size_t size);
+void upload_spool_init(struct Upload_Spool *spool);
+int upload_spool_write(struct Upload_Spool *spool, const char *data, size_t length);
+int upload_spool_copy_to(struct Upload_Spool *spool, int fd);
+int upload_spool_append_to_file(struct Upload_Spool *spool, char *filename);
+void upload_spool_free(struct Upload_Spool *spool);
 
 #endif
\ No newline at end of file
@@ -1,17 +1,37 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #define HTTP_V_1_1 "HTTP/1.1"
 #define HTTP_V_1_0 "HTTP/1.0"
 
+#define STATUS_CONTINUE "100 Continue"
 #define STATUS_OK "200 OK"
 #define STATUS_CREATED "201 Created"
+#define STATUS_PARTIAL_CONTENT "206 Partial Content"
+#define STATUS_NOT_MODIFIED "304 Not Modified"
 #define STATUS_NOT_FOUND "404 Not Found"
 #define STATUS_BAD_REQUEST "400 Bad Request"
+#define STATUS_CONTENT_TOO_LARGE "413 Content Too Large"
+#define STATUS_RANGE_NOT_SATISFIABLE "416 Range Not Satisfiable"
 #define STATUS_INTERNAL_SERVER_ERROR "500 Internal Server Error"
 #define STATUS_NOT_IMPLEMENTED "501 Not Implemented"
+#define STATUS_SERVICE_UNAVAILABLE "503 Service Unavailable"
 #define STATUS_HTTP_VERSION_NOT_SUPPORTED "505 HTTP Version Not Supported"
 
+// Complete status line, built at compile time from one of the STATUS_ macros
+#define STATUS_LINE(status) "HTTP/1.1 " status "\r\n"
+
+// Value of the Server header sent with every response
+#define SERVER_NAME "c-http-server"
+// Length of an IMF-fixdate such as "Sun, 06 Nov 1994 08:49:37 GMT"
+#define HTTP_DATE_LENGTH 29
+// Longest Cache-Control value accepted from --cache-control
+#define MAX_CACHE_CONTROL_LENGTH 128
+
 #define MIME_TEXT_PLAIN "text/plain"
 #define MIME_TEXT_HTML "text/html"
 #define MIME_TEXT_CSS "text/css"
@@ -22,35 +42,88 @@
 #define MIME_JSON "application/json"
 #define MIME_JPEG "image/jpeg"
 #define MIME_PNG "image/png"
+#define MIME_MULTIPART_BYTERANGES "multipart/byteranges"
 
 #define POST_DIR "www/post/"
 #define HTML_DIR "www/"
+#define UPLOAD_STORE_DIR "uploads/"
 
-struct Req_Headers
-{
-    char *method;
-    char *uri;
-    char *protocol;
-    char *host;
-    char *user_agent;
-    char *accept;
-    char *content_type;
-    int content_length;
+// Maximum number of header fields accepted in a request
+#define MAX_REQUEST_HEADERS 64
+
+// Content codings a file can be sent with
+enum Content_Encoding {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_BROTLI,
+    CONTENT_ENCODING_COUNT
 };
 
-struct Req_Body {
-    char *content_type;
-    void *content;
-    int length;
+// Non-owning reference to length-delimited text, usually pointing into the receive buffer
+struct Str_View {
+    const char *data;
+    size_t length;
 };
 
-struct Response {
-    char *status;
-    char *content_type;
+// Header fields recognized by the parser, looked up with a perfect hash (see http_helpers.c)
+enum Known_Header {
+    HEADER_UNKNOWN = 0,
+    HEADER_HOST,
+    HEADER_USER_AGENT,
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_CONTENT_TYPE,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONNECTION,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_EXPECT,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_RANGE,
+    HEADER_IF_RANGE
+};
+
+struct Header_Field {
+    enum Known_Header id;
+    struct Str_View name;
+    struct Str_View value;
+};
+
+/*
+    Parsed request line and headers. Every view points into the request buffer,
+    so the struct is only valid for as long as that buffer is.
+*/
+struct Req_Headers
+{
+    struct Str_View method;
+    struct Str_View uri;
+    struct Str_View protocol;
+    struct Str_View host;
+    struct Str_View user_agent;
+    struct Str_View accept;
+    struct Str_View accept_encoding;
+    struct Str_View content_type;
+    struct Str_View connection;
+    struct Str_View transfer_encoding;
+    struct Str_View expect;
+    struct Str_View if_none_match;
+    struct Str_View if_modified_since;
+    struct Str_View range;
+    struct Str_View if_range;
     size_t content_length;
-    char *headers;
-    int headers_length;
-    void *body;
+    bool has_content_length;
+    size_t headers_length; // Request line + headers + the blank line
+    struct Header_Field fields[MAX_REQUEST_HEADERS];
+    size_t field_count;
+};
+
+// Per-thread state of the request currently being handled
+struct Request_Context {
+    bool keep_alive; // Whether the response announces a persistent connection
+    int status;        // Of the last response sent, for the access log
+    size_t bytes_sent; // By the responses sent since the access log last collected them
+    uint64_t send_ns;  // Spent sending those responses
+    int route_key;     // Key the request is counted under in the metrics
 };
 
 struct Part {
@@ -1,246 +1,266 @@
+#include <pthread.h>
+#include <inttypes.h>
 #include "http_helpers.h"
+#include "logger.h"
 
-char *get_header(const char *headers, const char *key) {
-    char *headers_copy = strdup(headers);
-    if (headers_copy == NULL) {
-        return NULL;
+__thread struct Request_Context request_context = { .keep_alive = false };
+
+/*
+    Shared clock for the Date header. The formatted date only changes once per second, so the
+    first thread to notice a new second formats it into the spare buffer and publishes it;
+    every other call is a coarse clock read and a 29 byte copy.
+*/
+static char http_date_buffers[2][HTTP_DATE_LENGTH + 1];
+static int http_date_current;
+static time_t http_date_second = -1;
+static pthread_mutex_t http_date_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Writes time as an IMF-fixdate into date, which must hold HTTP_DATE_LENGTH + 1 bytes
+void format_http_date(time_t time, char *date) {
+    struct tm gmt;
+    gmtime_r(&time, &gmt);
+    strftime(date, HTTP_DATE_LENGTH + 1, "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+}
+
+// Parses an IMF-fixdate, the obsolete formats are not accepted
+bool parse_http_date(struct Str_View value, time_t *time) {
+    char date[HTTP_DATE_LENGTH + 1];
+    if (value.length != HTTP_DATE_LENGTH) {
+        return false;
     }
-    char *line = strtok(headers_copy, "\r\n");
-    size_t key_len = strlen(key);
-    
-    if (strcmp(key, "Method") == 0) {
-        char *extracted = strtok(headers_copy, " ");
-        char *value = strdup(extracted);
-        free(headers_copy);
-        return value;
-    }
-
-    if (strcmp(key, "Path") == 0) {
-        strtok(headers_copy, " "); // Skip method
-        char *extracted = strtok(NULL, " ");
-        char *value = strdup(extracted);
-        free(headers_copy);
-        return value;
-    }
-
-    if (strcmp(key, "Protocol") == 0) {
-        strtok(headers_copy, " "); // Skip method
-        strtok(NULL, " ");         // Skip path
-        char *extracted = strtok(NULL, "\r\n");
-        char *value = strdup(extracted);
-        free(headers_copy);
-        return value;
-    }
-
-    while (line != NULL) {
-        if (strncmp(line, key, key_len) == 0 && line[key_len] == ':') {
-            char *value_start = line + key_len + 1; // Skip the colon
-            while (*value_start == ' ') value_start++; // Skip leading spaces
-            char *value = strdup(value_start);
-            if (value == NULL) {
-                free(headers_copy);
-                return NULL;
-            }
-            free(headers_copy);
-            return value;
-        }
-        line = strtok(NULL, "\r\n");
+    memcpy(date, value.data, HTTP_DATE_LENGTH);
+    date[HTTP_DATE_LENGTH] = '\0';
+
+    struct tm gmt;
+    memset(&gmt, 0, sizeof(gmt));
+    const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+    if (end == NULL || *end != '\0') {
+        return false;
     }
-    
-    free(headers_copy);
-    return NULL; // Key not found
+    *time = timegm(&gmt);
+    return true;
 }
 
+// Copies the current date, formatted for the Date header, into date (not null-terminated)
+void get_http_date(char *date) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+
+    if (now.tv_sec != __atomic_load_n(&http_date_second, __ATOMIC_ACQUIRE) && pthread_mutex_trylock(&http_date_lock) == 0) {
+        if (now.tv_sec != http_date_second) {
+            int next = 1 - http_date_current;
+            format_http_date(now.tv_sec, http_date_buffers[next]);
+            __atomic_store_n(&http_date_current, next, __ATOMIC_RELEASE);
+            __atomic_store_n(&http_date_second, now.tv_sec, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&http_date_lock);
+    }
+
+    memcpy(date, http_date_buffers[__atomic_load_n(&http_date_current, __ATOMIC_ACQUIRE)], HTTP_DATE_LENGTH);
+}
 
-/**
- * \r\n\r\n represents the CRLF:
- * 		CR = Carriage Return (\r, 0x0D in hexadecimal, 13 in decimal) — moves the cursor to the beginning
- * 		of the line without advancing to the next line.
- *
- * 		LF = Line Feed (\n, 0x0A in hexadecimal, 10 in decimal) — moves the cursor down to the next line
- * 		without returning to the beginning of the line.
- *
- * - https://developer.mozilla.org/en-US/docs/Glossary/CRLF
+/*
+    Perfect hash over the known header names, generated offline the same way gperf does:
+    hash = length + asso[first char] + asso[last char], case-insensitive.
+    Every known header lands in a distinct slot, so a lookup is one hash plus one compare.
 */
-char *get_body(const void *request) {
-    const char *body_start = strstr(request, "\r\n\r\n");
-    if (body_start) {
-        body_start += 4; // Move past the "\r\n\r\n"
-        return strdup(body_start);
+#define KNOWN_HEADER_MAX_HASH 31
+
+static const unsigned char known_header_asso[256] = {
+    ['a'] = 7, ['A'] = 7, ['c'] = 1, ['C'] = 1, ['e'] = 5, ['E'] = 5,
+    ['g'] = 5, ['G'] = 5, ['h'] = 2, ['H'] = 2, ['i'] = 0, ['I'] = 0,
+    ['n'] = 12, ['N'] = 12, ['r'] = 10, ['R'] = 10, ['t'] = 8, ['T'] = 8,
+    ['u'] = 13, ['U'] = 13,
+};
+
+static const struct {
+    const char *name;
+    size_t length;
+    enum Known_Header id;
+} known_header_table[KNOWN_HEADER_MAX_HASH + 1] = {
+    [13] = {"If-Range", 8, HEADER_IF_RANGE},
+    [14] = {"Host", 4, HEADER_HOST},
+    [15] = {"If-None-Match", 13, HEADER_IF_NONE_MATCH},
+    [17] = {"Content-Length", 14, HEADER_CONTENT_LENGTH},
+    [18] = {"Content-Type", 12, HEADER_CONTENT_TYPE},
+    [19] = {"Expect", 6, HEADER_EXPECT},
+    [20] = {"Range", 5, HEADER_RANGE},
+    [21] = {"Accept", 6, HEADER_ACCEPT},
+    [22] = {"If-Modified-Since", 17, HEADER_IF_MODIFIED_SINCE},
+    [23] = {"Connection", 10, HEADER_CONNECTION},
+    [27] = {"Accept-Encoding", 15, HEADER_ACCEPT_ENCODING},
+    [30] = {"Transfer-Encoding", 17, HEADER_TRANSFER_ENCODING},
+    [31] = {"User-Agent", 10, HEADER_USER_AGENT},
+};
+
+enum Known_Header lookup_known_header(const char *name, size_t length) {
+    if (length == 0) {
+        return HEADER_UNKNOWN;
+    }
+    size_t hash = length + known_header_asso[(unsigned char)name[0]] + known_header_asso[(unsigned char)name[length - 1]];
+    if (hash > KNOWN_HEADER_MAX_HASH || known_header_table[hash].length != length) {
+        return HEADER_UNKNOWN;
+    }
+    if (strncasecmp(name, known_header_table[hash].name, length) != 0) {
+        return HEADER_UNKNOWN;
     }
-    return NULL; // No body found
+    return known_header_table[hash].id;
 }
 
-struct Req_Body parse_request_body(const void *request) {
-    struct Req_Body body = {0};
+static struct Str_View *known_header_slot(struct Req_Headers *headers, enum Known_Header id) {
+    switch (id) {
+        case HEADER_HOST: return &headers->host;
+        case HEADER_USER_AGENT: return &headers->user_agent;
+        case HEADER_ACCEPT: return &headers->accept;
+        case HEADER_ACCEPT_ENCODING: return &headers->accept_encoding;
+        case HEADER_CONTENT_TYPE: return &headers->content_type;
+        case HEADER_CONNECTION: return &headers->connection;
+        case HEADER_TRANSFER_ENCODING: return &headers->transfer_encoding;
+        case HEADER_EXPECT: return &headers->expect;
+        case HEADER_IF_NONE_MATCH: return &headers->if_none_match;
+        case HEADER_IF_MODIFIED_SINCE: return &headers->if_modified_since;
+        case HEADER_RANGE: return &headers->range;
+        case HEADER_IF_RANGE: return &headers->if_range;
+        default: return NULL;
+    }
+}
 
-    void *body_raw = get_body(request);
-    if (body_raw) {
-        body.content = body_raw;
-        body.length = strlen(body_raw);
-        body.content_type = get_header(request, "Content-Type");
+// Parses a non-negative decimal Content-Length value, returns -1 if it is not a valid number
+static int parse_content_length(struct Str_View value, size_t *content_length) {
+    if (value.length == 0 || value.length > 18) {
+        return -1;
+    }
+    size_t parsed = 0;
+    for (size_t i = 0; i < value.length; i++) {
+        if (value.data[i] < '0' || value.data[i] > '9') {
+            return -1;
+        }
+        parsed = parsed * 10 + (value.data[i] - '0');
     }
-    return body;
+    *content_length = parsed;
+    return 0;
 }
 
-char *get_boundary(const char *content_type) {
-    char *boundary_var = "boundary=";
-    char *boundary_definition_start = strstr(content_type, boundary_var);
+// Splits the next space-delimited token of the request line off [*cursor, end)
+static struct Str_View next_token(const char **cursor, const char *end) {
+    struct Str_View token = { .data = *cursor, .length = 0 };
+    const char *space = memchr(*cursor, ' ', end - *cursor);
+    const char *token_end = space ? space : end;
+    token.length = token_end - *cursor;
+    *cursor = space ? space + 1 : end;
+    return token;
+}
 
-    if (boundary_definition_start == NULL) {
-        return NULL;
+/*
+    Parses the request line and every header of request in a single pass.
+    All values are views into request, nothing is allocated or copied, and request does not
+    need to be null-terminated. Returns -1 if the request is malformed, otherwise 0 with
+    headers->headers_length left at 0 while the blank line ending the headers has not arrived.
+*/
+int parse_request_headers(const char *request, size_t length, struct Req_Headers *headers) {
+    memset(headers, 0, offsetof(struct Req_Headers, fields));
+    headers->field_count = 0;
+
+    const char *end = request + length;
+    const char *line_end = scan_find_crlf(request, end);
+    if (line_end == NULL) {
+        return 0;
     }
 
-    char *value = strstr(boundary_definition_start, "=") + 1; // Get the value after '='
-    if (value == NULL) {
-        return NULL;
+    const char *cursor = request;
+    struct Str_View method = next_token(&cursor, line_end);
+    struct Str_View uri = next_token(&cursor, line_end);
+    struct Str_View protocol = { .data = cursor, .length = line_end - cursor };
+    if (method.length == 0 || uri.length == 0 || protocol.length == 0 || memchr(protocol.data, ' ', protocol.length)) {
+        return -1;
     }
 
-    char *value_copy = strdup(value);
+    const char *line = line_end + 2;
+    while (1) {
+        line_end = scan_find_crlf(line, end);
+        if (line_end == NULL) {
+            return 0; // Headers not terminated yet
+        }
+        if (line_end == line) {
+            break; // Blank line, end of headers
+        }
+
+        const char *colon = scan_find_byte(line, line_end, ':');
+        if (colon == NULL || colon == line) {
+            return -1;
+        }
+        if (headers->field_count == MAX_REQUEST_HEADERS) {
+            return -1;
+        }
 
-    char *boundary_value = malloc(strlen(value_copy) + 3); // +3 for the two dashes and null terminator
-    if (boundary_value == NULL) {
-        free(value_copy);
-        return NULL;
+        const char *value_start = colon + 1;
+        const char *value_end = line_end;
+        while (value_start < value_end && (*value_start == ' ' || *value_start == '\t')) value_start++;
+        while (value_end > value_start && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+
+        struct Header_Field *field = &headers->fields[headers->field_count++];
+        field->name = (struct Str_View){ line, colon - line };
+        field->value = (struct Str_View){ value_start, value_end - value_start };
+        field->id = lookup_known_header(line, colon - line);
+
+        if (field->id == HEADER_CONTENT_LENGTH) {
+            size_t content_length;
+            if (parse_content_length(field->value, &content_length) == -1) {
+                return -1;
+            }
+            // Repeated lengths that disagree leave the end of the body ambiguous
+            if (headers->has_content_length && content_length != headers->content_length) {
+                return -1;
+            }
+            headers->content_length = content_length;
+            headers->has_content_length = true;
+        }
+
+        // The first occurrence of a header wins
+        struct Str_View *slot = known_header_slot(headers, field->id);
+        if (slot != NULL && slot->data == NULL) {
+            *slot = field->value;
+        }
+        line = line_end + 2;
     }
-    strcpy(boundary_value, "--");
-    strcat(boundary_value, value_copy);
-    free(value_copy);
 
-    return boundary_value;
+    headers->method = method;
+    headers->uri = uri;
+    headers->protocol = protocol;
+    headers->headers_length = line_end + 2 - request;
+    return 0;
 }
 
+char *get_boundary(const char *content_type) {
+    char *boundary_var = "boundary=";
+    char *boundary_definition_start = strstr(content_type, boundary_var);
 
-void parse_multipart_form_data(struct Req_Body* body) {
-    char *boundary = get_boundary(body->content_type);
-    if (boundary == NULL) {
-        perror("No boundary found in Content-Type\n");
-        return;
-    }
-    char *form_end_boundary = (char *)malloc(strlen(boundary) + 3); // +3 for the two dashes and null terminator
-    if (form_end_boundary == NULL) {
-        perror("Failed to allocate memory for form_end_boundary\n");
-        free(boundary);
-        return;
+    if (boundary_definition_start == NULL) {
+        return NULL;
     }
-    strcpy(form_end_boundary, boundary);
-    strcat(form_end_boundary, "--");
 
-    char *body_copy = extract_substr(body->content, boundary, form_end_boundary, false, true);
-    if (body_copy == NULL) {
-        perror("Failed to copy body content\n");
-        free(boundary);
-        free(form_end_boundary);
-        return;
+    char *value = boundary_definition_start + strlen(boundary_var); // Get the value after '='
+    size_t value_length;
+    if (*value == '"') {
+        value++;
+        value_length = strcspn(value, "\"");
+    } else {
+        value_length = strcspn(value, "; \t\r\n"); // Stop at the next parameter
     }
-    char *start = body_copy;
-
-    int new_max_size = body->length;
-    body->length = 0;
-    free(body->content);
 
-    body->content = malloc(new_max_size);
-    if (body->content == NULL) {
-        perror("Error reallocating space");
-        free(boundary);
-        free(form_end_boundary);
-        free(start);
-        return;
+    char *boundary_value = arena_alloc(request_arena(), value_length + 3); // +3 for the two dashes and null terminator
+    if (boundary_value == NULL) {
+        return NULL;
     }
-    memset(body->content, 0, new_max_size); // Clear new content buffer
-
-    bool is_last_part = false;
-
-    do
-    {
-        /*
-            At this point body_copy contains something like this:
-            1 [ \r\n\ ]
-            2 [ part 1 headers, such as Content-Disposition and Content-Type]
-            3 [ \r\n\r\n ]
-            4 [ data]
-            5 [ \r\n ]
-            6 [ end boundary ]
-            7 [ part 2 headers ... ]
-            8 [ ... ]
-            This extracts the first part, from point 2 (we exclude the first \r\n),
-            up until and including the boundary, so this_part contains { 2, 3, 4, 5, 6 }
-        */
-        char *this_part = extract_substr(body_copy, "\r\n", boundary, false, true);
-        if (this_part == NULL) {
-            break;
-        }
+    memcpy(boundary_value, "--", 2);
+    memcpy(boundary_value + 2, value, value_length);
+    boundary_value[value_length + 2] = '\0';
 
-        /*
-            Extract the data portion of the part
-            3 [ \r\n\r\n ]
-            4 [ data]
-            5 [ \r\n ]
-            6 [ end boundary ]
-            Data is always after a double CRLF and before a single CRLF followed by the boundary
-        */
-        char *part_content_start = extract_substr(this_part, "\r\n\r\n", boundary, false, false);
-        size_t part_content_length = strlen(part_content_start);
-    
-        struct Part *new_part = malloc(sizeof(struct Part));
-        if (!new_part) {
-            perror("Failed to allocate memory for new_part\n");
-            free(this_part);
-            free(part_content_start);
-            break;
-        }
-        memset(new_part, 0, sizeof(struct Part));
-
-        set_part_content_disposition(new_part, this_part);
-        set_part_form_data_name(new_part);
-        set_part_file_name(new_part);
-        set_part_content_type(new_part, this_part);
-        set_part_content(new_part, part_content_start, part_content_length);
-       
-        // Append part info to body content
-        strncat(body->content, new_part->form_data_name, new_part->fdn_length);
-        strcat(body->content, ":\n");
-        strncat(body->content, new_part->part_content, new_part->pc_length);
-        strcat(body->content, "\n---\n");
-        body->length = strlen(body->content);
-
-        free_part(new_part);
-        free(this_part);
-        free(part_content_start);
-
-        /*
-        If the distance to the next form_end_boundary is equal to the distance to the boundary,
-        then this is the last part.
-        Example:
-          Case 1                     |    Case 2
-          ___________________________|_____________________
-        ----form boundary            |  ----form boundary
-            part 1                   |      part 1  
-        ----form boundary            |  ----form end boundary--
-            part 2                   |
-        ----form end boundary--      |
-        */
-        is_last_part = (strlen(strstr(body_copy, boundary)) == strlen(strstr(body_copy, form_end_boundary)));
-
-        if (is_last_part) {
-            break; // Exit loop if last part
-        }
-
-        body_copy = strstr(body_copy, boundary);
-        if (body_copy == NULL) {
-            break; // No more boundaries found
-        }
-        body_copy += strlen(boundary);
-    } while (!is_last_part);
-    
-
-    free(start);
-    free(form_end_boundary);
-    free(boundary);
+    return boundary_value;
 }
 
-bool is_valid_http_version(const char *version) {
-    return (strcmp(version, HTTP_V_1_1) == 0 || strcmp(version, HTTP_V_1_0) == 0);
+bool is_valid_http_version(struct Str_View version) {
+    return str_view_equals(version, HTTP_V_1_1) || str_view_equals(version, HTTP_V_1_0);
 }
 
 bool is_text_based_mime_type(char *content_type) {
@@ -254,50 +274,22 @@ bool is_text_based_mime_type(char *content_type) {
     return false;
 }
 
-struct Req_Headers parse_request_headers(const char *request) {
-    struct Req_Headers headers = {0};
-    char *request_copy = strdup(request);
-    
-    headers.method = get_header(request_copy, "Method");
-    headers.uri = get_header(request_copy, "Path");
-    headers.protocol = get_header(request_copy, "Protocol");
-    headers.host = get_header(request_copy, "Host");
-    headers.user_agent = get_header(request_copy, "User-Agent");
-    headers.accept = get_header(request_copy, "Accept");
-    headers.content_type = get_header(request_copy, "Content-Type");
-    char *content_length_str = get_header(request_copy, "Content-Length");
-    headers.content_length = content_length_str ? atoi(content_length_str) : 0;
-
-    free(content_length_str);
-    free(request_copy);
-    return headers;
-}
-
-void free_part(struct Part *part) {
-    if (part) {
-        free(part->content_disposition);
-        free(part->form_data_name);
-        free(part->content_type);
-        free(part->part_content);
-        free(part->file_name);
-        free(part);
-    }
-}
-
 void set_part_content_disposition(struct Part *part, const char* part_header) {
 
     char *part_content_disposition = strstr(part_header, "Content-Disposition: ");
+    if (part_content_disposition == NULL) {
+        part->content_disposition = NULL;
+        part->cd_length = 0;
+        return;
+    }
     part_content_disposition += strlen("Content-Disposition: ");
-    char *part_content_disposition_copy = strdup(part_content_disposition);
-    part_content_disposition = strtok(part_content_disposition_copy, "\r\n");
-    part->content_disposition = strdup(part_content_disposition);
-    part->cd_length = strlen(part->content_disposition);
-    free(part_content_disposition_copy);
+    part->cd_length = strcspn(part_content_disposition, "\r\n");
+    part->content_disposition = arena_strndup(request_arena(), part_content_disposition, part->cd_length);
 }
 
 void set_part_form_data_name(struct Part *part) {
     if (part->content_disposition == NULL) {
-        perror("Part Content-Disposition is NULL");
+        log_error("Part Content-Disposition is NULL");
         return;
     }
 
@@ -317,13 +309,13 @@ void set_part_form_data_name(struct Part *part) {
     }
     
     size_t form_data_name_length = form_data_name_end - form_data_name_start;
-    part->form_data_name = strndup(form_data_name_start, form_data_name_length);
+    part->form_data_name = arena_strndup(request_arena(), form_data_name_start, form_data_name_length);
     part->fdn_length = strlen(part->form_data_name);
 }
 
 void set_part_file_name(struct Part *part) {
     if (part->content_disposition == NULL) {
-        perror("Part Content-Disposition is NULL");
+        log_error("Part Content-Disposition is NULL");
         return;
     }
 
@@ -335,31 +327,38 @@ void set_part_file_name(struct Part *part) {
     }
     form_file_name_start += strlen("filename=\"");
     char *form_file_name_end = strstr(form_file_name_start, "\"");
+    if (form_file_name_end == NULL) {
+        part->file_name = NULL;
+        part->fn_length = 0;
+        return;
+    }
     size_t form_file_name_length = form_file_name_end - form_file_name_start;
-    part->file_name = strndup(form_file_name_start, form_file_name_length);
+    part->file_name = arena_strndup(request_arena(), form_file_name_start, form_file_name_length);
     part->fn_length = strlen(part->file_name);
 }
 
 void set_part_content_type(struct Part *part, const char* part_headers) {
     char *part_content_type = strstr(part_headers, "Content-Type: ");
     if (part_content_type == NULL) {
-        part->content_type = strdup("text/plain");
+        part->content_type = MIME_TEXT_PLAIN;
         part->ct_length = strlen(part->content_type);
     } else {
         part_content_type += strlen("Content-Type: ");
-        char *part_content_type_copy = strdup(part_content_type);
-        part_content_type = strtok(part_content_type_copy, "\r\n");
-        part->content_type = strdup(part_content_type);
-        part->ct_length = strlen(part->content_type);
-        free(part_content_type_copy);
+        part->ct_length = strcspn(part_content_type, "\r\n");
+        part->content_type = arena_strndup(request_arena(), part_content_type, part->ct_length);
     }
 }
 
 void set_part_content(struct Part *part, const void* data, size_t data_len) {
     if (is_text_based_mime_type(part->content_type)) {
-        part->part_content = strndup(data, data_len); // Copy string with null terminator
+        // Copy string with null terminator, memcpy so that an embedded NUL cannot shorten the copy
+        part->part_content = arena_alloc(request_arena(), data_len + 1);
+        if (part->part_content != NULL) {
+            memcpy(part->part_content, data, data_len);
+            ((char *)part->part_content)[data_len] = '\0';
+        }
     } else {
-        part->part_content = malloc(data_len);
+        part->part_content = arena_alloc(request_arena(), data_len);
         if (part->part_content != NULL) {
             memcpy(part->part_content, data, data_len); // Copy raw bytes
         }
@@ -368,77 +367,304 @@ void set_part_content(struct Part *part, const void* data, size_t data_len) {
     part->pc_length = data_len;
 }
 
-void free_body_content(struct Req_Body *body) {
-    if (body) {
-        free(body->content);
-        free(body->content_type);
+/*
+    Writes the status line and headers of a response into buffer, like snprintf: returns the
+    length the headers need, which may be larger than size. extra_headers, NULL or complete
+    lines ending with CRLF, are added before Connection.
+    The Date header is left out, it is inserted after the status line when the response is sent.
+*/
+int format_response_headers(char *buffer, size_t size, const char *status, const char *content_type, size_t content_length, bool keep_alive, const char *extra_headers) {
+    const char *headers_template = "HTTP/1.1 %s\r\nServer: " SERVER_NAME "\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%sConnection: %s\r\n\r\n";
+    const char *connection = keep_alive ? "keep-alive" : "close";
+    return snprintf(buffer, size, headers_template, status, content_type, content_length, extra_headers ? extra_headers : "", connection);
+}
+
+// Names of the content codings, as in Content-Encoding and Accept-Encoding
+static const char *content_encoding_names[CONTENT_ENCODING_COUNT] = {
+    [ENCODING_IDENTITY] = "identity",
+    [ENCODING_GZIP] = "gzip",
+    [ENCODING_BROTLI] = "br",
+};
+
+const char *content_encoding_name(enum Content_Encoding encoding) {
+    return content_encoding_names[encoding];
+}
+
+static void format_validator_headers(struct File_Validators *validators) {
+    char last_modified[HTTP_DATE_LENGTH + 1];
+    format_http_date(validators->last_modified, last_modified);
+    int length = snprintf(validators->headers, sizeof(validators->headers), "ETag: %s\r\nLast-Modified: %s\r\nCache-Control: %s\r\nAccept-Ranges: bytes\r\n",
+        validators->etag, last_modified, validators->cache_control);
+    if (validators->vary_encoding && length < (int)sizeof(validators->headers)) {
+        if (validators->encoding != ENCODING_IDENTITY) {
+            length += snprintf(validators->headers + length, sizeof(validators->headers) - length, "Content-Encoding: %s\r\n",
+                content_encoding_name(validators->encoding));
+        }
+        if (length < (int)sizeof(validators->headers)) {
+            length += snprintf(validators->headers + length, sizeof(validators->headers) - length, "Vary: Accept-Encoding\r\n");
+        }
     }
+    validators->headers_length = length < (int)sizeof(validators->headers) ? (size_t)length : sizeof(validators->headers) - 1;
 }
 
-void free_req_headers(struct Req_Headers *headers) {
-    if (headers) {
-        free(headers->method);
-        free(headers->uri);
-        free(headers->protocol);
-        free(headers->host);
-        free(headers->user_agent);
-        free(headers->accept);
-        free(headers->content_type);
+/*
+    Computes the validators of a file from its metadata. The ETag is strong: it changes with the
+    inode, the size and the nanosecond modification time, so a file that is replaced or
+    rewritten gets a new one without its contents being hashed.
+*/
+void file_validators_init(struct File_Validators *validators, const struct stat *file_stat, const char *cache_control) {
+    uint64_t mtime_ns = (uint64_t)file_stat->st_mtim.tv_sec * 1000000000ull + (uint64_t)file_stat->st_mtim.tv_nsec;
+    validators->etag_length = snprintf(validators->etag, sizeof(validators->etag), "\"%" PRIx64 "-%" PRIx64 "-%" PRIx64 "\"",
+        (uint64_t)file_stat->st_ino, (uint64_t)file_stat->st_size, mtime_ns);
+    validators->last_modified = file_stat->st_mtim.tv_sec;
+    validators->cache_control = cache_control;
+    validators->encoding = ENCODING_IDENTITY;
+    validators->vary_encoding = false;
+    format_validator_headers(validators);
+}
+
+/*
+    Marks the validators as those of one encoding of a file that is negotiated with
+    Accept-Encoding: responses get Vary, and encoded ones Content-Encoding and their own ETag,
+    since a strong ETag must differ between the bytes of two representations.
+*/
+void file_validators_set_encoding(struct File_Validators *validators, enum Content_Encoding encoding) {
+    if (encoding != ENCODING_IDENTITY && validators->encoding == ENCODING_IDENTITY) {
+        validators->etag_length = snprintf(validators->etag + validators->etag_length - 1, sizeof(validators->etag) - validators->etag_length + 1,
+            "-%s\"", content_encoding_name(encoding)) + validators->etag_length - 1;
     }
+    validators->encoding = encoding;
+    validators->vary_encoding = true;
+    format_validator_headers(validators);
 }
 
-struct Response *build_response(const char *status, const char *content_type, size_t content_length, const void *body) {
-    // Allocate memory for Response struct
-    struct Response *response = malloc(sizeof(struct Response));
-    if (!response) {
-        return NULL;
+/*
+    Fills order with the content codings the client accepts, best first: by q-value, then
+    brotli before gzip. identity is left out, it is always acceptable as a fallback.
+    Returns the number of codings stored.
+*/
+int accepted_encodings(struct Str_View accept_encoding, enum Content_Encoding *order) {
+    int quality[CONTENT_ENCODING_COUNT] = { 0 };
+    int wildcard_quality = -1;
+    bool listed[CONTENT_ENCODING_COUNT] = { false };
+    const char *cursor = accept_encoding.data;
+    const char *end = accept_encoding.data + accept_encoding.length;
+
+    while (cursor < end) {
+        while (cursor < end && (*cursor == ' ' || *cursor == '\t' || *cursor == ',')) {
+            cursor++;
+        }
+        const char *coding = cursor;
+        while (cursor < end && *cursor != ',' && *cursor != ';' && *cursor != ' ' && *cursor != '\t') {
+            cursor++;
+        }
+        struct Str_View name = { .data = coding, .length = cursor - coding };
+
+        // Optional ";q=0.xyz", in thousandths
+        int q = 1000;
+        const char *element_end = memchr(cursor, ',', end - cursor);
+        if (element_end == NULL) {
+            element_end = end;
+        }
+        const char *q_param = cursor;
+        while (q_param < element_end && (*q_param == ' ' || *q_param == '\t' || *q_param == ';')) {
+            q_param++;
+        }
+        if (element_end - q_param >= 2 && (q_param[0] == 'q' || q_param[0] == 'Q') && q_param[1] == '=') {
+            q_param += 2;
+            q = (q_param < element_end && *q_param == '1') ? 1000 : 0;
+            if (q == 0 && q_param + 1 < element_end && q_param[1] == '.') {
+                int scale = 100;
+                for (const char *digit = q_param + 2; digit < element_end && *digit >= '0' && *digit <= '9' && scale > 0; digit++) {
+                    q += (*digit - '0') * scale;
+                    scale /= 10;
+                }
+            }
+        }
+        cursor = element_end;
+
+        if (str_view_equals(name, "*")) {
+            wildcard_quality = q;
+            continue;
+        }
+        for (int encoding = ENCODING_GZIP; encoding < CONTENT_ENCODING_COUNT; encoding++) {
+            if (str_view_case_equals(name, content_encoding_name(encoding)) ||
+                (encoding == ENCODING_GZIP && str_view_case_equals(name, "x-gzip"))) {
+                quality[encoding] = q;
+                listed[encoding] = true;
+            }
+        }
     }
-    memset(response, 0, sizeof(struct Response));
 
-    // Build headers
-    const char *headers_template = "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n";
+    int count = 0;
+    for (int encoding = CONTENT_ENCODING_COUNT - 1; encoding > ENCODING_IDENTITY; encoding--) {
+        if (!listed[encoding] && wildcard_quality > 0) {
+            quality[encoding] = wildcard_quality;
+        }
+        if (quality[encoding] == 0) {
+            continue;
+        }
+        // Insertion by quality, stable so that brotli stays ahead of gzip on a tie
+        int position = count;
+        while (position > 0 && quality[order[position - 1]] < quality[encoding]) {
+            order[position] = order[position - 1];
+            position--;
+        }
+        order[position] = encoding;
+        count++;
+    }
+    return count;
+}
 
-    // Calculate size needed for headers
-    size_t headers_size = snprintf(NULL, 0, headers_template, status, content_type, content_length);
-    response->headers = malloc(headers_size + 1);
-    if (!response->headers) {
-        free(response);
-        return NULL;
+// If-None-Match: "*" or a list of entity tags, compared weakly as RFC 9110 requires for GET
+static bool etag_list_matches(struct Str_View list, const char *etag, size_t etag_length) {
+    const char *cursor = list.data;
+    const char *end = list.data + list.length;
+    while (cursor < end) {
+        while (cursor < end && (*cursor == ' ' || *cursor == '\t' || *cursor == ',')) {
+            cursor++;
+        }
+        const char *tag_end = memchr(cursor, ',', end - cursor);
+        if (tag_end == NULL) {
+            tag_end = end;
+        }
+        const char *tag = cursor;
+        size_t tag_length = tag_end - cursor;
+        while (tag_length > 0 && (tag[tag_length - 1] == ' ' || tag[tag_length - 1] == '\t')) {
+            tag_length--;
+        }
+        if (tag_length == 1 && tag[0] == '*') {
+            return true;
+        }
+        if (tag_length > 2 && tag[0] == 'W' && tag[1] == '/') {
+            tag += 2;
+            tag_length -= 2;
+        }
+        if (tag_length == etag_length && memcmp(tag, etag, etag_length) == 0) {
+            return true;
+        }
+        cursor = tag_end;
     }
-    memset(response->headers, 0, headers_size + 1);
+    return false;
+}
 
-    // Fill in headers template
-    sprintf(response->headers, headers_template, status, content_type, content_length);
+/*
+    Whether a GET for a file with these validators can be answered with 304 Not Modified.
+    If-None-Match takes precedence, If-Modified-Since is only used without it.
+*/
+bool is_not_modified(const struct Req_Headers *req_headers, const struct File_Validators *validators) {
+    if (!str_view_is_empty(req_headers->if_none_match)) {
+        return etag_list_matches(req_headers->if_none_match, validators->etag, validators->etag_length);
+    }
+    time_t since;
+    if (!str_view_is_empty(req_headers->if_modified_since) && parse_http_date(req_headers->if_modified_since, &since)) {
+        return validators->last_modified <= since;
+    }
+    return false;
+}
 
-    // Build response struct
-    response->headers_length = headers_size;
-    response->status = strdup(status);
-    response->content_type = strdup(content_type);
-    response->content_length = content_length;
+// Reads the decimal number at *cursor, false if there is none or it overflows
+static bool parse_range_position(const char **cursor, const char *end, size_t *value) {
+    const char *start = *cursor;
+    size_t parsed = 0;
+    while (*cursor < end && **cursor >= '0' && **cursor <= '9') {
+        size_t digit = **cursor - '0';
+        if (parsed > (SIZE_MAX - digit) / 10) {
+            return false;
+        }
+        parsed = parsed * 10 + digit;
+        (*cursor)++;
+    }
+    *value = parsed;
+    return *cursor > start;
+}
 
-    if (content_length == 0) {
-        response->body = NULL;
-        return response;
+/*
+    Parses "bytes=first-last, first-, -suffix, ..." against a representation of size bytes,
+    clamping the ranges to it. Returns the number of satisfiable ranges stored in ranges (at
+    most MAX_BYTE_RANGES), 0 if none is satisfiable (416), or BYTE_RANGES_IGNORED if the header
+    is malformed, uses another unit or asks for too many ranges.
+*/
+int parse_byte_ranges(struct Str_View range, size_t size, struct Byte_Range *ranges) {
+    static const char unit[] = "bytes=";
+    if (range.length < sizeof(unit) - 1 || strncasecmp(range.data, unit, sizeof(unit) - 1) != 0) {
+        return BYTE_RANGES_IGNORED;
     }
+    const char *cursor = range.data + sizeof(unit) - 1;
+    const char *end = range.data + range.length;
+    int count = 0;
+    int specs = 0;
+
+    while (cursor < end) {
+        while (cursor < end && (*cursor == ' ' || *cursor == '\t' || *cursor == ',')) {
+            cursor++;
+        }
+        if (cursor == end) {
+            break;
+        }
+        if (++specs > MAX_BYTE_RANGES) {
+            return BYTE_RANGES_IGNORED;
+        }
 
-    response->body = malloc(content_length);
-    if (body) {
-        memset(response->body, 0, content_length);
-        // Use memcpy to copy body content so that it works for binary data as well
-        memcpy(response->body, body, content_length);
-    } else {
-        response->body = NULL;
+        size_t first = 0;
+        size_t last = 0;
+        bool has_first = parse_range_position(&cursor, end, &first);
+        if (cursor == end || *cursor != '-') {
+            return BYTE_RANGES_IGNORED;
+        }
+        cursor++;
+        bool has_last = parse_range_position(&cursor, end, &last);
+        while (cursor < end && (*cursor == ' ' || *cursor == '\t')) {
+            cursor++;
+        }
+        if ((!has_first && !has_last) || (cursor < end && *cursor != ',') || (has_first && has_last && last < first)) {
+            return BYTE_RANGES_IGNORED;
+        }
+
+        if (!has_first) {
+            // Suffix: the last "last" bytes
+            if (last == 0 || size == 0) {
+                continue;
+            }
+            first = last >= size ? 0 : size - last;
+            last = size - 1;
+        } else {
+            if (first >= size) {
+                continue;
+            }
+            if (!has_last || last >= size) {
+                last = size - 1;
+            }
+        }
+        ranges[count].first = first;
+        ranges[count].last = last;
+        count++;
     }
+    return specs == 0 ? BYTE_RANGES_IGNORED : count;
+}
 
-    return response;
+/*
+    If-Range: the Range header only applies if the client's copy is still current, judged by
+    a strong ETag match or an exact Last-Modified date. Otherwise the whole file is sent.
+*/
+static bool if_range_matches(struct Str_View if_range, const struct File_Validators *validators) {
+    if (if_range.length > 0 && if_range.data[0] == '"') {
+        return if_range.length == validators->etag_length && memcmp(if_range.data, validators->etag, validators->etag_length) == 0;
+    }
+    time_t date;
+    return parse_http_date(if_range, &date) && date == validators->last_modified;
 }
 
-void free_response(struct Response *response) {
-    if (response) {
-        free(response->status);
-        free(response->content_type);
-        free(response->headers);
-        free(response->body);
-        free(response);
+/*
+    The ranges to send for a GET of a file, see parse_byte_ranges for the result. Call once
+    the request is known not to be answered with 304.
+*/
+int requested_byte_ranges(const struct Req_Headers *req_headers, const struct File_Validators *validators, size_t size, struct Byte_Range *ranges) {
+    if (str_view_is_empty(req_headers->range)) {
+        return BYTE_RANGES_IGNORED;
+    }
+    if (!str_view_is_empty(req_headers->if_range) && !if_range_matches(req_headers->if_range, validators)) {
+        return BYTE_RANGES_IGNORED;
     }
+    return parse_byte_ranges(req_headers->range, size, ranges);
 }
@@ -3,20 +3,59 @@
 
 #include "includes.h"
 #include "other_helpers.h"
+#include "simd_scan.h"
+#include "arena.h"
 
-char *get_header(const char *headers, const char *key);
-char *get_body(const void *request);
-struct Req_Headers parse_request_headers(const char *request);
-struct Req_Body parse_request_body(const void *request);
-void free_req_headers(struct Req_Headers *headers);
-void free_body_content(struct Req_Body *body);
+// Longest ETag generated: three 64-bit hex numbers, two dashes, an encoding suffix and the quotes
+#define ETAG_MAX_LENGTH 60
+// ETag, Last-Modified, Cache-Control, Accept-Ranges, Content-Encoding and Vary lines
+#define FILE_VALIDATOR_HEADERS_SIZE (ETAG_MAX_LENGTH + HTTP_DATE_LENGTH + MAX_CACHE_CONTROL_LENGTH + 160)
+
+/*
+    What a client needs to revalidate a file: its ETag and modification time, and the headers
+    announcing them, Accept-Ranges and for negotiated files Content-Encoding and Vary (each line
+    ends with CRLF), sent with every response for the file.
+*/
+struct File_Validators {
+    char etag[ETAG_MAX_LENGTH + 1];
+    size_t etag_length;
+    time_t last_modified;
+    const char *cache_control;
+    enum Content_Encoding encoding;
+    bool vary_encoding;      // The file is negotiated with Accept-Encoding
+    char headers[FILE_VALIDATOR_HEADERS_SIZE];
+    size_t headers_length;
+};
+
+// Most ranges served from one Range header, a request with more gets the whole file
+#define MAX_BYTE_RANGES 16
+// parse_byte_ranges result when the Range header has to be ignored and the whole file sent
+#define BYTE_RANGES_IGNORED -1
+
+// Inclusive byte positions, as in Content-Range
+struct Byte_Range {
+    size_t first;
+    size_t last;
+};
+
+extern __thread struct Request_Context request_context;
+
+enum Known_Header lookup_known_header(const char *name, size_t length);
+int parse_request_headers(const char *request, size_t length, struct Req_Headers *headers);
 char *get_boundary(const char *content_type);
-void parse_multipart_form_data(struct Req_Body* body);
-void free_part(struct Part *part);
 bool is_text_based_mime_type(char *content_type);
-bool is_valid_http_version(const char *version);
-struct Response *build_response(const char *status, const char *content_type, size_t content_length, const void *body);
-void free_response(struct Response *response);
+bool is_valid_http_version(struct Str_View version);
+void get_http_date(char *date);
+void format_http_date(time_t time, char *date);
+bool parse_http_date(struct Str_View value, time_t *time);
+int format_response_headers(char *buffer, size_t size, const char *status, const char *content_type, size_t content_length, bool keep_alive, const char *extra_headers);
+void file_validators_init(struct File_Validators *validators, const struct stat *file_stat, const char *cache_control);
+void file_validators_set_encoding(struct File_Validators *validators, enum Content_Encoding encoding);
+const char *content_encoding_name(enum Content_Encoding encoding);
+int accepted_encodings(struct Str_View accept_encoding, enum Content_Encoding *order);
+bool is_not_modified(const struct Req_Headers *req_headers, const struct File_Validators *validators);
+int parse_byte_ranges(struct Str_View range, size_t size, struct Byte_Range *ranges);
+int requested_byte_ranges(const struct Req_Headers *req_headers, const struct File_Validators *validators, size_t size, struct Byte_Range *ranges);
 
 void set_part_content_disposition(struct Part *part, const char* part_header);
 void set_part_form_data_name(struct Part *part);
@@ -0,0 +1,327 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include "logger.h"
+#include "http_helpers.h"
+
+enum Log_Level log_level = LOG_LEVEL_INFO;
+
+struct Log_Record {
+    struct timespec time;
+    uint8_t level;
+    uint16_t length;
+    char text[LOG_MESSAGE_SIZE];
+};
+
+/*
+    Single producer (the owning thread), single consumer (the drain thread). head and tail only
+    ever grow, the slot of a record is its index modulo LOG_RING_RECORDS. They sit on separate
+    cache lines so the two threads do not contend for one.
+*/
+struct Log_Ring {
+    size_t head __attribute__((aligned(64)));       // Next record the owner writes
+    unsigned long dropped;
+    size_t tail __attribute__((aligned(64)));       // Next record the drain thread reads
+    bool closed;                                    // The owner exited, freed once drained
+    struct Log_Ring *next;
+    struct Log_Record records[LOG_RING_RECORDS];
+};
+
+static const char *level_names[] = {
+    [LOG_LEVEL_DEBUG] = "DEBUG",
+    [LOG_LEVEL_INFO] = "INFO",
+    [LOG_LEVEL_WARN] = "WARN",
+    [LOG_LEVEL_ERROR] = "ERROR",
+    [LOG_LEVEL_OFF] = "OFF",
+};
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER; // Guards the list and the output
+static struct Log_Ring *rings;
+static int ring_count;
+static pthread_key_t ring_key;
+static __thread struct Log_Ring *thread_ring;
+static bool started = false;
+static unsigned long orphan_drops;   // Of threads that could not get a ring or have exited
+static unsigned long written;
+static unsigned long dropped_reported;  // Drops already announced in the log
+
+static char output[LOG_OUTPUT_BUFFER_SIZE];
+static size_t output_length;
+static time_t output_second = -1;
+static char output_timestamp[32];     // "2006-01-02T15:04:05", of output_second
+
+bool log_level_from(const char *name, enum Log_Level *level) {
+    for (int i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_OFF; i++) {
+        if (strcasecmp(name, level_names[i]) == 0) {
+            *level = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Runs when a thread with a ring exits, the drain thread frees the ring once it is empty
+static void release_thread_ring(void *ring) {
+    thread_ring = NULL;
+    __atomic_store_n(&((struct Log_Ring *)ring)->closed, true, __ATOMIC_RELEASE);
+}
+
+static struct Log_Ring *get_thread_ring(void) {
+    if (thread_ring != NULL) {
+        return thread_ring;
+    }
+    // The records are written before they are read, only the ring header needs clearing
+    struct Log_Ring *ring = malloc(sizeof(struct Log_Ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    memset(ring, 0, offsetof(struct Log_Ring, records));
+    pthread_mutex_lock(&rings_lock);
+    ring->next = rings;
+    rings = ring;
+    ring_count++;
+    pthread_mutex_unlock(&rings_lock);
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+static void output_flush(void) {
+    size_t written_bytes = 0;
+    while (written_bytes < output_length) {
+        ssize_t result = write(STDOUT_FILENO, output + written_bytes, output_length - written_bytes);
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            break; // Nowhere to write the log, drop it
+        }
+        written_bytes += result;
+    }
+    output_length = 0;
+}
+
+// Appends one formatted line to the output buffer: "<UTC time> <LEVEL> <message>\n"
+static void output_line(const struct timespec *time, enum Log_Level level, const char *text, size_t length) {
+    if (output_length + length + 64 > sizeof(output)) {
+        output_flush();
+    }
+    if (time->tv_sec != output_second) {
+        struct tm gmt;
+        gmtime_r(&time->tv_sec, &gmt);
+        strftime(output_timestamp, sizeof(output_timestamp), "%Y-%m-%dT%H:%M:%S", &gmt);
+        output_second = time->tv_sec;
+    }
+    output_length += snprintf(output + output_length, sizeof(output) - output_length, "%s.%03ldZ %-5s ",
+        output_timestamp, time->tv_nsec / 1000000, level_names[level]);
+    memcpy(output + output_length, text, length);
+    output_length += length;
+    output[output_length++] = '\n';
+}
+
+/*
+    Moves every queued record to the output, frees the rings of exited threads and reports
+    new drops. Called with rings_lock held. Returns the number of records drained.
+*/
+static size_t drain_rings(void) {
+    size_t drained = 0;
+    unsigned long dropped = __atomic_load_n(&orphan_drops, __ATOMIC_RELAXED);
+    struct Log_Ring **link = &rings;
+    while (*link != NULL) {
+        struct Log_Ring *ring = *link;
+        bool closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        size_t tail = ring->tail;
+        for (; tail != head; tail++) {
+            const struct Log_Record *record = &ring->records[tail % LOG_RING_RECORDS];
+            output_line(&record->time, record->level, record->text, record->length);
+            drained++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+        if (closed && tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+            // Its drops stay counted
+            __atomic_fetch_add(&orphan_drops, ring->dropped, __ATOMIC_RELAXED);
+            *link = ring->next;
+            ring_count--;
+            free(ring);
+            continue;
+        }
+        link = &ring->next;
+    }
+    written += drained;
+
+    if (dropped > dropped_reported) {
+        char text[96];
+        int length = snprintf(text, sizeof(text), "log: %lu messages dropped, the log buffers were full", dropped - dropped_reported);
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        output_line(&now, LOG_LEVEL_WARN, text, length);
+        dropped_reported = dropped;
+    }
+    return drained;
+}
+
+static void *drain_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&rings_lock);
+        size_t drained = drain_rings();
+        output_flush();
+        pthread_mutex_unlock(&rings_lock);
+        if (drained == 0) {
+            struct timespec interval = { .tv_sec = 0, .tv_nsec = LOG_DRAIN_INTERVAL_MS * 1000000L };
+            nanosleep(&interval, NULL);
+        }
+    }
+    return NULL;
+}
+
+// Writes everything queued so far, e.g. before the process exits
+void log_flush(void) {
+    if (!started) {
+        return;
+    }
+    pthread_mutex_lock(&rings_lock);
+    drain_rings();
+    output_flush();
+    pthread_mutex_unlock(&rings_lock);
+}
+
+/*
+    Switches to asynchronous logging at the given level. Must be called before the server
+    threads start. Whatever is still queued is written when the process exits.
+*/
+bool log_start(enum Log_Level level) {
+    log_level = level;
+    if (pthread_key_create(&ring_key, release_thread_ring) != 0) {
+        return false;
+    }
+    // The drain thread blocks every signal, so they keep going to the threads meant for them
+    sigset_t all_signals, previous;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &previous);
+    pthread_t thread;
+    int result = pthread_create(&thread, NULL, drain_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (result != 0) {
+        return false;
+    }
+    pthread_detach(thread);
+    fflush(stdout); // Direct messages written so far come first
+    atexit(log_flush);
+    __atomic_store_n(&started, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+static void log_vwrite(enum Log_Level level, const char *format, va_list args) {
+    if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE)) {
+        vprintf(format, args);
+        putchar('\n');
+        return;
+    }
+
+    struct Log_Ring *ring = get_thread_ring();
+    if (ring == NULL) {
+        __atomic_fetch_add(&orphan_drops, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    size_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_RECORDS) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct Log_Record *record = &ring->records[head % LOG_RING_RECORDS];
+    clock_gettime(CLOCK_REALTIME, &record->time);
+    record->level = level;
+    int length = vsnprintf(record->text, sizeof(record->text), format, args);
+    if (length < 0) {
+        length = 0;
+    }
+    record->length = (size_t)length < sizeof(record->text) ? (size_t)length : sizeof(record->text) - 1;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Use through log_debug, log_info, log_warn and log_error, which skip disabled levels
+void log_write(enum Log_Level level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_vwrite(level, format, args);
+    va_end(args);
+}
+
+// Replaces perror: logs message and the description of errno at the error level
+void log_errno(const char *message) {
+    int error = errno;
+    char description[128];
+    log_error("%s: %s", message, strerror_r(error, description, sizeof(description)));
+    errno = error;
+}
+
+/*
+    Starts the access record of a request whose headers have arrived. The method and path are
+    copied, the request buffer does not live as long as a request with a body.
+*/
+void access_log_begin(struct Access_Record *record, struct Str_View method, struct Str_View uri) {
+    request_context.status = 0;
+    request_context.bytes_sent = 0;
+    record->status = 0;
+    record->bytes = 0;
+    if (log_level > LOG_LEVEL_INFO) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &record->start);
+    size_t method_length = method.length < sizeof(record->method) ? method.length : sizeof(record->method) - 1;
+    memcpy(record->method, method.data, method_length);
+    record->method[method_length] = '\0';
+    size_t uri_length = uri.length < sizeof(record->uri) ? uri.length : sizeof(record->uri) - 1;
+    memcpy(record->uri, uri.data, uri_length);
+    record->uri[uri_length] = '\0';
+}
+
+/*
+    Moves the status and size of the responses sent by this thread since the last call into
+    the record. Called after every step of a request, since in epoll mode the thread serves
+    other connections between the steps of one request.
+*/
+void access_log_collect(struct Access_Record *record) {
+    if (request_context.status != 0) {
+        record->status = request_context.status;
+    }
+    record->bytes += request_context.bytes_sent;
+    request_context.status = 0;
+    request_context.bytes_sent = 0;
+}
+
+// Logs the access line of a finished request: method, path, status, bytes sent and latency
+void access_log_end(struct Access_Record *record) {
+    access_log_collect(record);
+    if (log_level > LOG_LEVEL_INFO) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long latency_us = (now.tv_sec - record->start.tv_sec) * 1000000L + (now.tv_nsec - record->start.tv_nsec) / 1000;
+    log_write(LOG_LEVEL_INFO, "access method=%s uri=%s status=%d bytes=%zu latency_us=%ld",
+        record->method, record->uri, record->status, record->bytes, latency_us);
+}
+
+void log_get_stats(struct Log_Stats *stats) {
+    pthread_mutex_lock(&rings_lock);
+    stats->written = written;
+    stats->dropped = __atomic_load_n(&orphan_drops, __ATOMIC_RELAXED);
+    for (struct Log_Ring *ring = rings; ring != NULL; ring = ring->next) {
+        stats->dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    stats->rings = ring_count;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+void log_report(void) {
+    struct Log_Stats stats;
+    log_get_stats(&stats);
+    log_info("Log: level %s, %lu messages written, %lu dropped, %d thread buffers",
+        level_names[log_level], stats.written, stats.dropped, stats.rings);
+}
@@ -0,0 +1,70 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdarg.h>
+#include <stdint.h>
+#include "includes.h"
+
+/*
+    Asynchronous logging. Every thread writes its messages into its own ring buffer, without
+    locks or system calls; a background thread drains the rings and writes whole batches to
+    stdout. A thread whose ring is full drops the message and counts it instead of waiting,
+    the drain thread then reports how many were lost.
+    Until log_start is called messages are written directly, so startup errors are not lost.
+*/
+
+// Records per thread ring, a power of two
+#define LOG_RING_RECORDS 256
+// Longest message kept, longer ones are truncated
+#define LOG_MESSAGE_SIZE 232
+// How long the drain thread sleeps once every ring is empty
+#define LOG_DRAIN_INTERVAL_MS 10
+// Output buffer of the drain thread, written with one write() when full or idle
+#define LOG_OUTPUT_BUFFER_SIZE (64 * 1024)
+
+enum Log_Level {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_OFF
+};
+
+// Method, path and timing of the request being served on a connection, for its access log line
+#define ACCESS_METHOD_SIZE 16
+#define ACCESS_URI_SIZE 160
+
+struct Access_Record {
+    char method[ACCESS_METHOD_SIZE];
+    char uri[ACCESS_URI_SIZE];        // Truncated if longer
+    struct timespec start;
+    int status;                       // 0 until a response has been sent
+    size_t bytes;
+};
+
+struct Log_Stats {
+    unsigned long written;
+    unsigned long dropped;
+    int rings;
+};
+
+extern enum Log_Level log_level;
+
+void log_write(enum Log_Level level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#define log_debug(...) do { if (log_level <= LOG_LEVEL_DEBUG) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__); } while (0)
+#define log_info(...) do { if (log_level <= LOG_LEVEL_INFO) log_write(LOG_LEVEL_INFO, __VA_ARGS__); } while (0)
+#define log_warn(...) do { if (log_level <= LOG_LEVEL_WARN) log_write(LOG_LEVEL_WARN, __VA_ARGS__); } while (0)
+#define log_error(...) do { if (log_level <= LOG_LEVEL_ERROR) log_write(LOG_LEVEL_ERROR, __VA_ARGS__); } while (0)
+
+bool log_level_from(const char *name, enum Log_Level *level);
+bool log_start(enum Log_Level level);
+void log_flush(void);
+void log_errno(const char *message);
+void access_log_begin(struct Access_Record *record, struct Str_View method, struct Str_View uri);
+void access_log_collect(struct Access_Record *record);
+void access_log_end(struct Access_Record *record);
+void log_get_stats(struct Log_Stats *stats);
+void log_report(void);
+
+#endif
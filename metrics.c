@@ -0,0 +1,421 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include "metrics.h"
+#include "buffer_pool.h"
+#include "static_cache.h"
+#include "compress_cache.h"
+#include "upload_writer.h"
+#include "upload_store.h"
+#include "logger.h"
+
+static const int status_codes[] = METRICS_STATUS_CODES;
+#define STATUS_CODE_COUNT ((int)(sizeof(status_codes) / sizeof(status_codes[0])))
+_Static_assert(STATUS_CODE_COUNT + 1 == METRICS_STATUS_SLOTS, "METRICS_STATUS_SLOTS must fit every code and \"other\"");
+
+static const char *phase_names[METRICS_PHASE_COUNT] = {
+    [PHASE_PARSE] = "parse",
+    [PHASE_HANDLER] = "handler",
+    [PHASE_SEND] = "send",
+    [PHASE_FILE_READ] = "file_read",
+    [PHASE_REQUEST] = "request",
+};
+
+// Live thread copies, and the sum of the copies of threads that already exited
+static struct Thread_Metrics *live_metrics;
+static struct Thread_Metrics *exited_metrics;
+static pthread_mutex_t live_metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Routes counted and request keys of every copy, set by metrics_init
+static int metrics_routes = 0;
+static int request_key_count = 0;
+
+static pthread_key_t thread_metrics_key;
+static pthread_once_t thread_metrics_key_once = PTHREAD_ONCE_INIT;
+static __thread struct Thread_Metrics *thread_metrics;
+
+// Only the owning thread writes its counters, a relaxed store keeps scrapes from reading torn values
+static inline void counter_add(uint64_t *counter, uint64_t value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t counter_read(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Adds every counter of from to to, reading from with relaxed loads
+static void metrics_merge(struct Thread_Metrics *to, const struct Thread_Metrics *from) {
+    // Copies made before metrics_init have no request counters
+    int request_keys = from->request_keys < to->request_keys ? from->request_keys : to->request_keys;
+    for (int key = 0; key < request_keys; key++) {
+        for (int slot = 0; slot < METRICS_STATUS_SLOTS; slot++) {
+            to->requests[key][slot] += counter_read(&from->requests[key][slot]);
+        }
+    }
+    to->bytes_received += counter_read(&from->bytes_received);
+    to->bytes_sent += counter_read(&from->bytes_sent);
+    to->connections_opened += counter_read(&from->connections_opened);
+    to->connections_closed += counter_read(&from->connections_closed);
+    for (int phase = 0; phase < METRICS_PHASE_COUNT; phase++) {
+        for (int bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; bucket++) {
+            to->phases[phase].buckets[bucket] += counter_read(&from->phases[phase].buckets[bucket]);
+        }
+        to->phases[phase].count += counter_read(&from->phases[phase].count);
+        to->phases[phase].sum_ns += counter_read(&from->phases[phase].sum_ns);
+    }
+}
+
+// Runs when a thread exits: its counts move to exited_metrics
+static void thread_metrics_release(void *arg) {
+    struct Thread_Metrics *metrics = arg;
+    pthread_mutex_lock(&live_metrics_lock);
+    if (exited_metrics != NULL) {
+        metrics_merge(exited_metrics, metrics);
+    }
+    if (metrics->prev) {
+        metrics->prev->next = metrics->next;
+    } else {
+        live_metrics = metrics->next;
+    }
+    if (metrics->next) {
+        metrics->next->prev = metrics->prev;
+    }
+    pthread_mutex_unlock(&live_metrics_lock);
+    thread_metrics = NULL;
+    free(metrics);
+}
+
+static void create_thread_metrics_key(void) {
+    pthread_key_create(&thread_metrics_key, thread_metrics_release);
+}
+
+// A zeroed copy with request_keys rows of request counters, NULL if it could not be allocated
+static struct Thread_Metrics *thread_metrics_create(int request_keys) {
+    size_t size = sizeof(struct Thread_Metrics) + request_keys * sizeof(uint64_t[METRICS_STATUS_SLOTS]);
+    size = (size + 63) & ~(size_t)63; // aligned_alloc wants a multiple of the alignment
+    struct Thread_Metrics *metrics = aligned_alloc(64, size);
+    if (metrics == NULL) {
+        return NULL;
+    }
+    memset(metrics, 0, size);
+    metrics->request_keys = request_keys;
+    return metrics;
+}
+
+/*
+    Sizes the request counters for the routes registered so far, one row per route and per
+    method. Called once the route table is compiled, before any request is served.
+*/
+bool metrics_init(void) {
+    metrics_routes = route_count();
+    request_key_count = metrics_routes + HTTP_METHOD_COUNT + 1;
+    exited_metrics = thread_metrics_create(request_key_count);
+    return exited_metrics != NULL;
+}
+
+static struct Thread_Metrics *get_thread_metrics(void) {
+    if (thread_metrics != NULL) {
+        return thread_metrics;
+    }
+    pthread_once(&thread_metrics_key_once, create_thread_metrics_key);
+    struct Thread_Metrics *metrics = thread_metrics_create(request_key_count);
+    if (metrics == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&live_metrics_lock);
+    metrics->next = live_metrics;
+    if (live_metrics) {
+        live_metrics->prev = metrics;
+    }
+    live_metrics = metrics;
+    pthread_mutex_unlock(&live_metrics_lock);
+    pthread_setspecific(thread_metrics_key, metrics);
+    thread_metrics = metrics;
+    return metrics;
+}
+
+static int histogram_bucket(uint64_t nanoseconds) {
+    if (nanoseconds < (1ull << METRICS_MIN_SHIFT)) {
+        return nanoseconds >> (METRICS_MIN_SHIFT - METRICS_SUB_BUCKET_BITS);
+    }
+    int shift = 63 - __builtin_clzll(nanoseconds);
+    if (shift >= METRICS_MAX_SHIFT) {
+        return METRICS_HISTOGRAM_BUCKETS - 1;
+    }
+    int exponent = shift - METRICS_MIN_SHIFT + 1;
+    int sub_bucket = (nanoseconds >> (shift - METRICS_SUB_BUCKET_BITS)) & (METRICS_SUB_BUCKETS - 1);
+    return exponent * METRICS_SUB_BUCKETS + sub_bucket;
+}
+
+// Largest value counted in bucket, in nanoseconds (exclusive)
+static uint64_t histogram_bucket_limit(int bucket) {
+    if (bucket < METRICS_SUB_BUCKETS) {
+        return (uint64_t)(bucket + 1) << (METRICS_MIN_SHIFT - METRICS_SUB_BUCKET_BITS);
+    }
+    int shift = bucket / METRICS_SUB_BUCKETS + METRICS_MIN_SHIFT - 1;
+    int sub_bucket = bucket % METRICS_SUB_BUCKETS;
+    return (uint64_t)(METRICS_SUB_BUCKETS + sub_bucket + 1) << (shift - METRICS_SUB_BUCKET_BITS);
+}
+
+static int status_slot(int status) {
+    for (int i = 0; i < STATUS_CODE_COUNT; i++) {
+        if (status_codes[i] == status) {
+            return i;
+        }
+    }
+    return STATUS_CODE_COUNT;
+}
+
+// Key a request is counted under: its route, or its method if it matched no route
+int metrics_request_key(int route, enum Http_Method method) {
+    if (route != ROUTE_NONE) {
+        return route;
+    }
+    return metrics_routes + (method == HTTP_METHOD_UNKNOWN ? HTTP_METHOD_COUNT : method);
+}
+
+// Counts a finished request. status is 0 if no response was sent.
+void metrics_request_end(int request_key, int status, size_t bytes_sent) {
+    struct Thread_Metrics *metrics = get_thread_metrics();
+    if (metrics == NULL || request_key >= metrics->request_keys) {
+        return;
+    }
+    counter_add(&metrics->requests[request_key][status_slot(status)], 1);
+    counter_add(&metrics->bytes_sent, bytes_sent);
+}
+
+void metrics_observe(enum Metrics_Phase phase, uint64_t nanoseconds) {
+    struct Thread_Metrics *metrics = get_thread_metrics();
+    if (metrics == NULL) {
+        return;
+    }
+    struct Histogram *histogram = &metrics->phases[phase];
+    counter_add(&histogram->buckets[histogram_bucket(nanoseconds)], 1);
+    counter_add(&histogram->count, 1);
+    counter_add(&histogram->sum_ns, nanoseconds);
+}
+
+void metrics_add_bytes_received(size_t bytes) {
+    struct Thread_Metrics *metrics = get_thread_metrics();
+    if (metrics != NULL) {
+        counter_add(&metrics->bytes_received, bytes);
+    }
+}
+
+void metrics_connection_opened(void) {
+    struct Thread_Metrics *metrics = get_thread_metrics();
+    if (metrics != NULL) {
+        counter_add(&metrics->connections_opened, 1);
+    }
+}
+
+void metrics_connection_closed(void) {
+    struct Thread_Metrics *metrics = get_thread_metrics();
+    if (metrics != NULL) {
+        counter_add(&metrics->connections_closed, 1);
+    }
+}
+
+struct Text_Buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+    bool failed;
+};
+
+static void text_printf(struct Text_Buffer *text, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void text_printf(struct Text_Buffer *text, const char *format, ...) {
+    while (!text->failed) {
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(text->data + text->length, text->capacity - text->length, format, args);
+        va_end(args);
+        if (written < 0) {
+            text->failed = true;
+            return;
+        }
+        if ((size_t)written < text->capacity - text->length) {
+            text->length += written;
+            return;
+        }
+        size_t capacity = text->capacity * 2 + written;
+        char *data = realloc(text->data, capacity);
+        if (data == NULL) {
+            text->failed = true;
+            return;
+        }
+        text->data = data;
+        text->capacity = capacity;
+    }
+}
+
+static void render_histogram(struct Text_Buffer *text, const char *phase, const struct Histogram *histogram) {
+    // Exported at every power of two, the finer buckets only serve the quantiles below
+    uint64_t cumulative = 0;
+    for (int bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; bucket++) {
+        cumulative += histogram->buckets[bucket];
+        if (bucket % METRICS_SUB_BUCKETS == METRICS_SUB_BUCKETS - 1) {
+            text_printf(text, "chttp_phase_duration_seconds_bucket{phase=\"%s\",le=\"%.9g\"} %" PRIu64 "\n",
+                phase, histogram_bucket_limit(bucket) / 1e9, cumulative);
+        }
+    }
+    text_printf(text, "chttp_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", phase, histogram->count);
+    text_printf(text, "chttp_phase_duration_seconds_sum{phase=\"%s\"} %.9f\n", phase, histogram->sum_ns / 1e9);
+    text_printf(text, "chttp_phase_duration_seconds_count{phase=\"%s\"} %" PRIu64 "\n", phase, histogram->count);
+}
+
+// Upper limit of the bucket holding the given quantile, 0 if the histogram is empty
+static double histogram_quantile(const struct Histogram *histogram, double quantile) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(quantile * histogram->count);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t cumulative = 0;
+    for (int bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; bucket++) {
+        cumulative += histogram->buckets[bucket];
+        if (cumulative >= rank) {
+            return histogram_bucket_limit(bucket) / 1e9;
+        }
+    }
+    return histogram_bucket_limit(METRICS_HISTOGRAM_BUCKETS - 1) / 1e9;
+}
+
+static void render_request_counts(struct Text_Buffer *text, const struct Thread_Metrics *totals) {
+    text_printf(text, "# HELP chttp_requests_total Requests served, by method, route and status (0: no response sent).\n");
+    text_printf(text, "# TYPE chttp_requests_total counter\n");
+    for (int key = 0; key < totals->request_keys; key++) {
+        const char *method;
+        const char *route;
+        if (key < metrics_routes) {
+            method = http_method_name(route_method(key));
+            route = route_pattern(key);
+        } else {
+            method = http_method_name(key - metrics_routes < HTTP_METHOD_COUNT ? key - metrics_routes : HTTP_METHOD_UNKNOWN);
+            route = "none";
+        }
+        for (int slot = 0; slot < METRICS_STATUS_SLOTS; slot++) {
+            if (totals->requests[key][slot] == 0) {
+                continue;
+            }
+            char status[8];
+            if (slot < STATUS_CODE_COUNT) {
+                snprintf(status, sizeof(status), "%d", status_codes[slot]);
+            } else {
+                snprintf(status, sizeof(status), "other");
+            }
+            text_printf(text, "chttp_requests_total{method=\"%s\",route=\"%s\",status=\"%s\"} %" PRIu64 "\n",
+                method, route, status, totals->requests[key][slot]);
+        }
+    }
+}
+
+static long resident_memory_bytes(void) {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL) {
+        return -1;
+    }
+    long pages = 0;
+    long resident = 0;
+    int fields = fscanf(statm, "%ld %ld", &pages, &resident);
+    fclose(statm);
+    return fields == 2 ? resident * sysconf(_SC_PAGESIZE) : -1;
+}
+
+static void render_resource_usage(struct Text_Buffer *text) {
+    struct Buffer_Pool_Stats pool;
+    buffer_pool_get_stats(&pool);
+    struct Static_Cache_Stats cache;
+    static_cache_get_stats(&cache);
+    struct Compress_Cache_Stats compressed;
+    compress_cache_get_stats(&compressed);
+    struct Upload_Writer_Stats writer;
+    upload_writer_get_stats(&writer);
+    struct Upload_Store_Stats store;
+    upload_store_get_stats(&store);
+    struct Log_Stats log;
+    log_get_stats(&log);
+
+    text_printf(text, "# TYPE chttp_buffer_pool_bytes gauge\nchttp_buffer_pool_bytes %zu\n", pool.bytes_allocated);
+    text_printf(text, "# TYPE chttp_buffer_pool_peak_bytes gauge\nchttp_buffer_pool_peak_bytes %zu\n", pool.peak_bytes_allocated);
+    text_printf(text, "# TYPE chttp_buffer_pool_acquires_total counter\nchttp_buffer_pool_acquires_total %lu\n", pool.acquires);
+    text_printf(text, "# TYPE chttp_buffer_pool_hits_total counter\nchttp_buffer_pool_hits_total %lu\n", pool.hits);
+    text_printf(text, "# TYPE chttp_static_cache_bytes gauge\nchttp_static_cache_bytes %zu\n", cache.bytes);
+    text_printf(text, "# TYPE chttp_static_cache_entries gauge\nchttp_static_cache_entries %zu\n", cache.entries);
+    text_printf(text, "# TYPE chttp_static_cache_hits_total counter\nchttp_static_cache_hits_total %lu\n", cache.hits);
+    text_printf(text, "# TYPE chttp_static_cache_misses_total counter\nchttp_static_cache_misses_total %lu\n", cache.misses);
+    text_printf(text, "# TYPE chttp_static_cache_evictions_total counter\nchttp_static_cache_evictions_total %lu\n", cache.evictions);
+    text_printf(text, "# TYPE chttp_compress_cache_bytes gauge\nchttp_compress_cache_bytes %zu\n", compressed.bytes);
+    text_printf(text, "# TYPE chttp_compress_cache_entries gauge\nchttp_compress_cache_entries %zu\n", compressed.entries);
+    text_printf(text, "# TYPE chttp_compress_cache_hits_total counter\nchttp_compress_cache_hits_total %lu\n", compressed.hits);
+    text_printf(text, "# TYPE chttp_compress_cache_misses_total counter\nchttp_compress_cache_misses_total %lu\n", compressed.misses);
+    text_printf(text, "# TYPE chttp_uploads_total counter\nchttp_uploads_total %lu\n", writer.uploads);
+    text_printf(text, "# TYPE chttp_upload_store_bytes gauge\nchttp_upload_store_bytes %zu\n", store.bytes);
+    text_printf(text, "# TYPE chttp_log_messages_total counter\nchttp_log_messages_total %lu\n", log.written);
+    text_printf(text, "# TYPE chttp_log_dropped_total counter\nchttp_log_dropped_total %lu\n", log.dropped);
+    long resident = resident_memory_bytes();
+    if (resident >= 0) {
+        text_printf(text, "# TYPE process_resident_memory_bytes gauge\nprocess_resident_memory_bytes %ld\n", resident);
+    }
+}
+
+/*
+    Sums up the copies of every thread and formats them in the Prometheus text format, along
+    with the memory held by the pools and caches. Returns a malloc'd buffer the caller frees,
+    or NULL if it could not be allocated.
+*/
+char *metrics_render(size_t *length) {
+    struct Thread_Metrics *totals = thread_metrics_create(request_key_count);
+    if (totals == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&live_metrics_lock);
+    if (exited_metrics != NULL) {
+        metrics_merge(totals, exited_metrics);
+    }
+    for (struct Thread_Metrics *metrics = live_metrics; metrics != NULL; metrics = metrics->next) {
+        metrics_merge(totals, metrics);
+    }
+    pthread_mutex_unlock(&live_metrics_lock);
+
+    struct Text_Buffer text = { .data = malloc(16 * 1024), .length = 0, .capacity = 16 * 1024, .failed = false };
+    if (text.data == NULL) {
+        free(totals);
+        return NULL;
+    }
+    render_request_counts(&text, totals);
+    text_printf(&text, "# TYPE chttp_received_bytes_total counter\nchttp_received_bytes_total %" PRIu64 "\n", totals->bytes_received);
+    text_printf(&text, "# TYPE chttp_sent_bytes_total counter\nchttp_sent_bytes_total %" PRIu64 "\n", totals->bytes_sent);
+    text_printf(&text, "# TYPE chttp_connections_total counter\nchttp_connections_total %" PRIu64 "\n", totals->connections_opened);
+    // A connection closing between the reads of the two counters can make it look negative
+    uint64_t active = totals->connections_opened > totals->connections_closed ? totals->connections_opened - totals->connections_closed : 0;
+    text_printf(&text, "# TYPE chttp_connections_active gauge\nchttp_connections_active %" PRIu64 "\n", active);
+
+    text_printf(&text, "# HELP chttp_phase_duration_seconds Time spent in each phase of a request.\n");
+    text_printf(&text, "# TYPE chttp_phase_duration_seconds histogram\n");
+    for (int phase = 0; phase < METRICS_PHASE_COUNT; phase++) {
+        render_histogram(&text, phase_names[phase], &totals->phases[phase]);
+    }
+    text_printf(&text, "# HELP chttp_phase_duration_quantile_seconds Upper bound of a quantile of chttp_phase_duration_seconds, within 12.5%%.\n");
+    text_printf(&text, "# TYPE chttp_phase_duration_quantile_seconds gauge\n");
+    static const char *quantile_names[] = { "0.5", "0.99", "0.999" };
+    static const double quantiles[] = { 0.5, 0.99, 0.999 };
+    for (int phase = 0; phase < METRICS_PHASE_COUNT; phase++) {
+        for (int i = 0; i < 3; i++) {
+            text_printf(&text, "chttp_phase_duration_quantile_seconds{phase=\"%s\",quantile=\"%s\"} %.9g\n",
+                phase_names[phase], quantile_names[i], histogram_quantile(&totals->phases[phase], quantiles[i]));
+        }
+    }
+    render_resource_usage(&text);
+    free(totals);
+
+    if (text.failed) {
+        free(text.data);
+        return NULL;
+    }
+    *length = text.length;
+    return text.data;
+}
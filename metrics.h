@@ -0,0 +1,80 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include "includes.h"
+#include "route_table.h"
+
+/*
+    Counters and latency histograms for GET /metrics. Every thread updates its own copy,
+    padded to whole cache lines, with plain stores: nothing is shared or locked on the
+    request path. The copies are only summed up when /metrics is scraped; the counts of
+    threads that exited are folded into a total kept for them.
+*/
+
+/*
+    Histograms are log-linear like HdrHistogram: every power of two of nanoseconds is split
+    into 2^METRICS_SUB_BUCKET_BITS buckets, so a value is known within 12.5% from 1us up to
+    2^METRICS_MAX_SHIFT ns (about 68 seconds). Anything below 1us shares the first 8 buckets
+    and anything above the range is counted in the last one.
+*/
+#define METRICS_SUB_BUCKET_BITS 3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_MIN_SHIFT 10
+#define METRICS_MAX_SHIFT 36
+#define METRICS_HISTOGRAM_BUCKETS ((METRICS_MAX_SHIFT - METRICS_MIN_SHIFT + 1) * METRICS_SUB_BUCKETS)
+
+/*
+    Requests are counted by key: the index of the route they matched or, for requests that
+    matched none, the slot of their method after the routes. metrics_init sizes the counters
+    for the routes registered.
+*/
+// Status codes this server sends, every other one is counted as "other"
+#define METRICS_STATUS_CODES { 0, 200, 201, 206, 304, 400, 404, 413, 416, 500, 501, 503, 505 }
+#define METRICS_STATUS_SLOTS 14
+
+#define MIME_PROMETHEUS_TEXT "text/plain; version=0.0.4; charset=utf-8"
+
+enum Metrics_Phase {
+    PHASE_PARSE,      // parse_request_headers
+    PHASE_HANDLER,    // Routing and handlers, without sending
+    PHASE_SEND,       // Building and sending responses
+    PHASE_FILE_READ,  // Reading whole files into memory, see load_file
+    PHASE_REQUEST,    // Headers parsed to response sent
+    METRICS_PHASE_COUNT
+};
+
+struct Histogram {
+    uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+};
+
+struct Thread_Metrics {
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    uint64_t connections_opened;
+    uint64_t connections_closed;
+    struct Histogram phases[METRICS_PHASE_COUNT];
+    struct Thread_Metrics *prev;
+    struct Thread_Metrics *next;
+    int request_keys;                                // Rows of requests
+    uint64_t requests[][METRICS_STATUS_SLOTS];       // By request key
+} __attribute__((aligned(64)));
+
+static inline uint64_t metrics_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+bool metrics_init(void);
+int metrics_request_key(int route, enum Http_Method method);
+void metrics_request_end(int request_key, int status, size_t bytes_sent);
+void metrics_observe(enum Metrics_Phase phase, uint64_t nanoseconds);
+void metrics_add_bytes_received(size_t bytes);
+void metrics_connection_opened(void);
+void metrics_connection_closed(void);
+char *metrics_render(size_t *length);
+
+#endif
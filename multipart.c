@@ -0,0 +1,230 @@
+#include "multipart.h"
+#include "http_helpers.h"
+
+/*
+    The delimiter searched for is CRLF "--" boundary: the CRLF before a boundary belongs to
+    the boundary, not to the data of the part it ends. The body starts as if it were
+    preceded by a CRLF so that the first boundary, which has none, matches as well.
+*/
+int multipart_parser_init(struct Multipart_Parser *parser, const char *content_type, const struct Multipart_Callbacks *callbacks, void *context) {
+    memset(parser, 0, sizeof(struct Multipart_Parser));
+    parser->state = MULTIPART_ERROR;
+    parser->callbacks = *callbacks;
+    parser->context = context;
+
+    char *boundary = get_boundary(content_type); // "--" boundary
+    if (boundary == NULL) {
+        return -1;
+    }
+    size_t boundary_length = strlen(boundary);
+    if (boundary_length <= 2 || boundary_length > MULTIPART_MAX_BOUNDARY_LENGTH + 2) {
+        return -1;
+    }
+    memcpy(parser->delimiter, "\r\n", 2);
+    memcpy(parser->delimiter + 2, boundary, boundary_length);
+    parser->delimiter_length = boundary_length + 2;
+
+    // Distance from the last occurrence of every byte to the end of the delimiter
+    size_t last = parser->delimiter_length - 1;
+    memset(parser->skip, parser->delimiter_length, sizeof(parser->skip));
+    for (size_t i = 0; i < last; i++) {
+        parser->skip[(unsigned char)parser->delimiter[i]] = last - i;
+    }
+
+    parser->state = MULTIPART_PREAMBLE;
+    parser->matched = 2;
+    return 0;
+}
+
+bool multipart_parser_done(const struct Multipart_Parser *parser) {
+    return parser->state == MULTIPART_EPILOGUE;
+}
+
+static const char *find_delimiter(const struct Multipart_Parser *parser, const char *start, const char *end) {
+    size_t last = parser->delimiter_length - 1;
+    unsigned char last_byte = parser->delimiter[last];
+
+    while ((size_t)(end - start) >= parser->delimiter_length) {
+        unsigned char c = start[last];
+        if (c == last_byte && memcmp(start, parser->delimiter, last) == 0) {
+            return start;
+        }
+        start += parser->skip[c];
+    }
+    return NULL;
+}
+
+// Length of the longest tail of [start, end) that is the beginning of the delimiter
+static size_t partial_delimiter_length(const struct Multipart_Parser *parser, const char *start, const char *end) {
+    if ((size_t)(end - start) >= parser->delimiter_length) {
+        start = end - (parser->delimiter_length - 1);
+    }
+    // The delimiter starts with the only CR it contains, so only a CR can start a match
+    while ((start = memchr(start, '\r', end - start)) != NULL) {
+        if (memcmp(start, parser->delimiter, end - start) == 0) {
+            return end - start;
+        }
+        start++;
+    }
+    return 0;
+}
+
+static int emit_data(struct Multipart_Parser *parser, const char *data, size_t length) {
+    if (parser->state != MULTIPART_DATA || length == 0) {
+        return 0; // Preamble bytes are dropped
+    }
+    return parser->callbacks.on_part_data(parser->context, data, length);
+}
+
+static int on_delimiter(struct Multipart_Parser *parser) {
+    if (parser->state == MULTIPART_DATA && parser->callbacks.on_part_end(parser->context) == -1) {
+        return -1;
+    }
+    parser->state = MULTIPART_BOUNDARY_END;
+    return 0;
+}
+
+/*
+    Consumes part data (or preamble) up to the next delimiter. Returns the number of bytes
+    consumed or -1 if a callback failed.
+*/
+static ssize_t feed_data(struct Multipart_Parser *parser, const char *data, size_t length) {
+    if (parser->matched > 0) {
+        // Finish the match held back at the end of the previous piece
+        size_t wanted = parser->delimiter_length - parser->matched;
+        size_t available = length < wanted ? length : wanted;
+        if (memcmp(data, parser->delimiter + parser->matched, available) == 0) {
+            parser->matched += available;
+            if (parser->matched < parser->delimiter_length) {
+                return available;
+            }
+            parser->matched = 0;
+            return on_delimiter(parser) == -1 ? -1 : (ssize_t)available;
+        }
+        // Not a delimiter after all, the bytes held back were data. No delimiter can start
+        // inside them since they hold no other CR.
+        if (emit_data(parser, parser->delimiter, parser->matched) == -1) {
+            return -1;
+        }
+        parser->matched = 0;
+    }
+
+    const char *end = data + length;
+    const char *delimiter = find_delimiter(parser, data, end);
+    if (delimiter != NULL) {
+        if (emit_data(parser, data, delimiter - data) == -1) {
+            return -1;
+        }
+        if (on_delimiter(parser) == -1) {
+            return -1;
+        }
+        return delimiter + parser->delimiter_length - data;
+    }
+
+    size_t held_back = partial_delimiter_length(parser, data, end);
+    if (emit_data(parser, data, length - held_back) == -1) {
+        return -1;
+    }
+    parser->matched = held_back;
+    return length;
+}
+
+/*
+    Collects part headers until the blank line that ends them. The buffer starts with a
+    CRLF, so a part without headers is found by the same CRLFCRLF search.
+    Returns the number of bytes consumed or -1 if the headers are too big or rejected.
+*/
+static ssize_t feed_headers(struct Multipart_Parser *parser, const char *data, size_t length) {
+    size_t previous_length = parser->headers_length;
+    size_t space = MULTIPART_MAX_PART_HEADERS_SIZE - previous_length;
+    size_t copied = length < space ? length : space;
+    memcpy(parser->headers + previous_length, data, copied);
+    parser->headers_length += copied;
+
+    size_t search_from = previous_length > 3 ? previous_length - 3 : 0;
+    const char *terminator = scan_find(parser->headers + search_from, parser->headers + parser->headers_length, "\r\n\r\n", 4);
+    if (terminator == NULL) {
+        if (parser->headers_length == MULTIPART_MAX_PART_HEADERS_SIZE) {
+            return -1;
+        }
+        return copied;
+    }
+
+    size_t headers_end = terminator + 4 - parser->headers;
+    // Keep the CRLF of the last header line, the set_part_* lookups stop at it
+    parser->headers[terminator + 2 - parser->headers] = '\0';
+
+    struct Part part;
+    memset(&part, 0, sizeof(struct Part));
+    const char *part_headers = parser->headers + 2;
+    set_part_content_disposition(&part, part_headers);
+    set_part_form_data_name(&part);
+    set_part_file_name(&part);
+    set_part_content_type(&part, part_headers);
+
+    if (parser->callbacks.on_part_begin(parser->context, &part) == -1) {
+        return -1;
+    }
+    parser->state = MULTIPART_DATA;
+    return headers_end - previous_length;
+}
+
+/*
+    Feeds the next piece of the body. Returns 0, or -1 if the body is malformed or a
+    callback failed, after which the parser rejects everything.
+*/
+int multipart_parser_feed(struct Multipart_Parser *parser, const char *data, size_t length) {
+    size_t i = 0;
+
+    while (i < length) {
+        ssize_t consumed = 1;
+        char c = data[i];
+
+        switch (parser->state) {
+            case MULTIPART_PREAMBLE:
+            case MULTIPART_DATA:
+                consumed = feed_data(parser, data + i, length - i);
+                break;
+            case MULTIPART_BOUNDARY_END:
+                if (c == '-') {
+                    parser->state = MULTIPART_BOUNDARY_DASH;
+                } else if (c == '\r') {
+                    parser->state = MULTIPART_BOUNDARY_LF;
+                } else if (c != ' ' && c != '\t') { // Transport padding
+                    consumed = -1;
+                }
+                break;
+            case MULTIPART_BOUNDARY_DASH:
+                if (c == '-') {
+                    parser->state = MULTIPART_EPILOGUE;
+                } else {
+                    consumed = -1;
+                }
+                break;
+            case MULTIPART_BOUNDARY_LF:
+                if (c == '\n') {
+                    memcpy(parser->headers, "\r\n", 2);
+                    parser->headers_length = 2;
+                    parser->state = MULTIPART_HEADERS;
+                } else {
+                    consumed = -1;
+                }
+                break;
+            case MULTIPART_HEADERS:
+                consumed = feed_headers(parser, data + i, length - i);
+                break;
+            case MULTIPART_EPILOGUE:
+                return 0;
+            case MULTIPART_ERROR:
+                consumed = -1;
+                break;
+        }
+
+        if (consumed == -1) {
+            parser->state = MULTIPART_ERROR;
+            return -1;
+        }
+        i += consumed;
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef MULTIPART_H
+#define MULTIPART_H
+
+#include "includes.h"
+
+/*
+    Incremental multipart/form-data parser. The body is fed in pieces of any size as it
+    arrives and every part is handed to callbacks: its headers once they are complete, then
+    its data in pieces, then its end. Part data is never buffered, only a partial boundary
+    at the end of a piece is held back, so parts of any size and content (binary included)
+    are parsed with constant memory.
+    Boundaries are searched for with Boyer-Moore-Horspool, so most bytes of a part are never
+    looked at.
+*/
+
+#define MULTIPART_MAX_BOUNDARY_LENGTH 70 // RFC 2046
+#define MULTIPART_MAX_PART_HEADERS_SIZE (8 * 1024)
+
+enum Multipart_State {
+    MULTIPART_PREAMBLE,      // Before the first boundary, ignored
+    MULTIPART_BOUNDARY_END,  // After a boundary: "--" closes the body, CRLF starts a part
+    MULTIPART_BOUNDARY_DASH,
+    MULTIPART_BOUNDARY_LF,
+    MULTIPART_HEADERS,
+    MULTIPART_DATA,
+    MULTIPART_EPILOGUE,      // After the closing boundary, ignored
+    MULTIPART_ERROR
+};
+
+/*
+    Callbacks return -1 to stop parsing. The part passed to on_part_begin and its strings
+    are only valid during the call.
+*/
+struct Multipart_Callbacks {
+    int (*on_part_begin)(void *context, struct Part *part);
+    int (*on_part_data)(void *context, const char *data, size_t length);
+    int (*on_part_end)(void *context);
+};
+
+struct Multipart_Parser {
+    enum Multipart_State state;
+    char delimiter[4 + MULTIPART_MAX_BOUNDARY_LENGTH]; // "\r\n--" boundary
+    size_t delimiter_length;
+    unsigned char skip[256];  // Boyer-Moore-Horspool shift for every byte value
+    size_t matched;           // Bytes of a possible delimiter held back at the end of the last piece
+    char headers[MULTIPART_MAX_PART_HEADERS_SIZE + 1];
+    size_t headers_length;
+    struct Multipart_Callbacks callbacks;
+    void *context;
+};
+
+int multipart_parser_init(struct Multipart_Parser *parser, const char *content_type, const struct Multipart_Callbacks *callbacks, void *context);
+int multipart_parser_feed(struct Multipart_Parser *parser, const char *data, size_t length);
+bool multipart_parser_done(const struct Multipart_Parser *parser);
+
+#endif
@@ -0,0 +1,174 @@
+#include <pthread.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include "net_helpers.h"
+#include "logger.h"
+
+/*
+	Creates a TCP socket bound to every interface on the given port and marks it as listening.
+	connection_backlog is the maximum length of the queue of pending connections.
+	Returns the listening socket or -1 on error.
+*/
+int create_listener(int port, int connection_backlog, bool reuseport)
+{
+	/*
+		sockaddr_in : https://man7.org/linux/man-pages/man3/sockaddr.3type.html
+		sin_family  : Address family (AF_INET for IPv4) (AF_INET6 for IPv6)
+		sin_port    : Port number
+		sin_addr    : IP address
+
+		htons       : https://man7.org/linux/man-pages/man3/htons.3p.html
+		Converts unsigned short integer (16-bit) from host byte order to network byte order.
+
+		htonl       : https://man7.org/linux/man-pages/man3/htonl.3p.html
+		Converts unsigned long integer (32-bit) from host byte order to network byte order.
+
+		The htons function converts a 16-bit unsigned integer (short) from host byte order to network byte order. 
+		Network byte order is always big-endian. This ensures a consistent interpretation across different systems.
+		Similarly, the htonl function converts a 32-bit unsigned integer (long) from host byte order to network byte order.
+
+		INADDR_ANY is a special address constant used to indicate that a socket should bind to all network interfaces on a machine. 
+		When a server application binds to INADDR_ANY, it can accept connections and receive data from any IP address that the computer has, including its loopback address 127.0.0.1
+	*/
+	struct sockaddr_in serv_addr = {
+		.sin_family = AF_INET,			
+		.sin_port = htons(port),		 
+		.sin_addr = {htonl(INADDR_ANY)}, 
+	};
+
+	/*
+		socket     : https://man7.org/linux/man-pages/man2/socket.2.html
+		argument 1 : domain   --> AF_INET for IPv4
+		argument 2 : type     --> SOCK_STREAM for bidirectional stream
+		argument 3 : protocol --> 0 to select default protocol for given domain and type (TCP for AF_INET and SOCK_STREAM)
+		returns    : file descriptor for the server socket or -1 on error
+	*/
+	int server_fd = socket(AF_INET, SOCK_STREAM, 0); 
+	if (server_fd == -1)
+	{
+		log_errno("Socket creation failed");
+		return -1;
+	}
+
+	/*
+		setsockopt : https://man7.org/linux/man-pages/man3/setsockopt.3p.html
+		argument 1 : file descriptor for locating the socket
+		argument 2 : level  --> SOL_SOCKET to manipulate options at the sockets API level
+		argument 3 : option --> SO_REUSEADDR to allow reuse of local addresses
+		argument 4 : pointer to option value
+		argument 5 : size of the option value
+		returns    : 0 on success, -1 on error
+	*/
+	int reuse = 1;
+	if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0)
+	{
+		log_errno("SO_REUSEADDR failed");
+		close(server_fd);
+		return -1;
+	}
+
+	/*
+		SO_REUSEPORT allows several sockets to bind the exact same address and port.
+		The kernel then load balances incoming connections across all of them, so each
+		shard gets its own accept queue instead of every accept going through one socket.
+	*/
+	if (reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+	{
+		log_errno("SO_REUSEPORT failed");
+		close(server_fd);
+		return -1;
+	}
+
+	/*
+		bind : https://man7.org/linux/man-pages/man2/bind.2.html
+		argument 1 : server_fd  --->  file descriptor of the socket to be bound
+		argument 2 : serv_addr  --->  pointer to the sockaddr structure (casted from sockaddr_in to sockaddr)
+		argument 3 : size of the sockaddr structure
+		returns    : 0 on success, -1 on error
+
+		assigns a name to a socket identified by socket file descriptor
+	*/
+	if (bind(server_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) != 0)
+	{
+		log_errno("Bind failed");
+		close(server_fd);
+		return -1;
+	}
+
+	/*
+		listen : https://man7.org/linux/man-pages/man2/listen.2.html
+		argument 1 : server_fd           --->  file descriptor of the socket to be marked as a passive socket
+		argument 2 : connection_backlog  --->  maximum length of the queue of pending connections
+		returns    : 0 on success, -1 on error
+
+		a passive socket is will be used to accept incoming connections
+		connection_backlog defines the maximum length to which the queue of pending connections for sockfd may grow
+	*/
+	if (listen(server_fd, connection_backlog) != 0)
+	{
+		log_errno("Listen failed");
+		close(server_fd);
+		return -1;
+	}
+	return server_fd;
+}
+
+/*
+	Attaches a classic BPF program to a SO_REUSEPORT group that picks the socket by the CPU
+	that is processing the incoming packet: index = cpu % group_size.
+	Together with pinning shard i to CPU i this keeps a connection on the core that received it.
+	Sockets are indexed in the order they were bound, so it only needs to be attached once.
+*/
+int attach_reuseport_cbpf(int server_fd, int group_size)
+{
+	struct sock_filter code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU }, // A = current CPU
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, (unsigned int)group_size }, // A = A % group_size
+		{ BPF_RET | BPF_A, 0, 0, 0 },                                 // return A
+	};
+	struct sock_fprog program = {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code,
+	};
+
+	if (setsockopt(server_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0)
+	{
+		log_errno("SO_ATTACH_REUSEPORT_CBPF failed");
+		return -1;
+	}
+	return 0;
+}
+
+int set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+	Restricts threads created with attr to a single CPU, wrapping around when there are more
+	threads than CPUs. Setting it on the attributes (rather than after pthread_create) means
+	the thread never runs anywhere else, and threads it spawns inherit the same CPU.
+*/
+int thread_attr_set_cpu(pthread_attr_t *attr, int index)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus <= 0) {
+		return -1;
+	}
+
+	cpu_set_t cpu_set;
+	CPU_ZERO(&cpu_set);
+	CPU_SET(index % cpus, &cpu_set);
+	if (pthread_attr_setaffinity_np(attr, sizeof(cpu_set), &cpu_set) != 0) {
+		log_errno("Failed to set thread CPU affinity");
+		return -1;
+	}
+	return 0;
+}
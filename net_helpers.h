@@ -0,0 +1,12 @@
+#ifndef NET_HELPERS_H
+#define NET_HELPERS_H
+
+#include <pthread.h>
+#include "includes.h"
+
+int create_listener(int port, int connection_backlog, bool reuseport);
+int attach_reuseport_cbpf(int server_fd, int group_size);
+int set_nonblocking(int fd);
+int thread_attr_set_cpu(pthread_attr_t *attr, int index);
+
+#endif
@@ -1,41 +1,55 @@
 #include "other_helpers.h"
 
-void *extract_substr(char *source, char *start_delim, char *end_delim, bool include_start, bool include_end) {
-
-    if (start_delim == NULL || end_delim == NULL || source == NULL) {
-        return NULL;
+bool str_view_is_empty(struct Str_View view) {
+    return view.data == NULL || view.length == 0;
+}
+
+bool str_view_equals(struct Str_View view, const char *literal) {
+    size_t literal_length = strlen(literal);
+    return view.length == literal_length && memcmp(view.data, literal, literal_length) == 0;
+}
+
+bool str_view_case_equals(struct Str_View view, const char *literal) {
+    size_t literal_length = strlen(literal);
+    return view.length == literal_length && strncasecmp(view.data, literal, literal_length) == 0;
+}
+
+// Case-insensitive search for needle inside view (header values are not null-terminated)
+bool str_view_case_contains(struct Str_View view, const char *needle) {
+    size_t needle_length = strlen(needle);
+    if (needle_length == 0) {
+        return true;
     }
-
-    char *start_ptr = NULL;
-    if (strcmp(start_delim, "") == 0) {
-        start_ptr = source;
-    } else {
-        start_ptr = strstr(source, start_delim);
-        if (!start_ptr) {
-            return NULL;
-        }
-        if (!include_start) {
-            start_ptr += strlen(start_delim);
+    for (size_t i = 0; i + needle_length <= view.length; i++) {
+        if (strncasecmp(view.data + i, needle, needle_length) == 0) {
+            return true;
         }
     }
+    return false;
+}
 
-    char *end_ptr = strstr(start_ptr, end_delim);
-    if (!end_ptr) {
-        return NULL;
-    }
+static uint32_t crc32_table[256];
 
-    if (include_end) {
-        end_ptr += strlen(end_delim);        
+__attribute__((constructor))
+static void build_crc32_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+        }
+        crc32_table[i] = crc;
     }
-
-    size_t substr_length = end_ptr - start_ptr;
-    char *substr = (char *)malloc(substr_length + 1);
-    if (!substr) {
-        return NULL;
+}
+
+/*
+    CRC-32 (IEEE 802.3) of data, continuing from crc. Start with 0, and pass the result back
+    in to checksum data that arrives in pieces.
+*/
+uint32_t crc32_update(uint32_t crc, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = crc32_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
     }
-
-    memcpy(substr, start_ptr, substr_length);
-    substr[substr_length] = '\0';
-
-    return substr;
-}
\ No newline at end of file
+    return ~crc;
+}
@@ -1,8 +1,15 @@
 #ifndef OTHER_HELPERS_H
 #define OTHER_HELPERS_H
 
+#include <stdint.h>
 #include "includes.h"
+#include "simd_scan.h"
+#include "arena.h"
 
-void *extract_substr(char *source, char *start_delim, char *end_delim, bool include_start, bool include_end);
+bool str_view_equals(struct Str_View view, const char *literal);
+bool str_view_case_equals(struct Str_View view, const char *literal);
+bool str_view_case_contains(struct Str_View view, const char *needle);
+bool str_view_is_empty(struct Str_View view);
+uint32_t crc32_update(uint32_t crc, const void *data, size_t length);
 
 #endif
\ No newline at end of file
@@ -1,64 +1,491 @@
 #include "request_handlers.h"
 #include "file_helpers.h"
+#include "static_cache.h"
+#include "compress_cache.h"
+#include "multipart.h"
+#include "upload_writer.h"
+#include "upload_store.h"
+#include "logger.h"
+#include "metrics.h"
+#include "trace.h"
+#include <inttypes.h>
 
-void handle_GET(struct Req_Headers *req_headers, int client_fd) {
+static struct Body_Sink *handle_health(struct Req_Headers *req_headers, const struct Route_Params *params, int client_fd) {
+    (void)req_headers;
+    (void)params;
+    send_canned_response(client_fd, CANNED_HEALTH);
+    return NULL;
+}
 
-    if (strcmp(req_headers->uri, "/health") == 0) {
-        send_200(client_fd, "Server is OK", MIME_TEXT_PLAIN, 0);
-        return;
+// Prometheus text exposition of the counters and histograms of every thread
+static struct Body_Sink *handle_metrics(struct Req_Headers *req_headers, const struct Route_Params *params, int client_fd) {
+    (void)req_headers;
+    (void)params;
+    size_t length = 0;
+    char *text = metrics_render(&length);
+    if (text == NULL) {
+        send_500(client_fd);
+        return NULL;
     }
+    send_response_parts(client_fd, STATUS_LINE(STATUS_OK), MIME_PROMETHEUS_TEXT, text, length);
+    free(text);
+    return NULL;
+}
 
-    char *file_full_name = NULL;
-    if (strcmp(req_headers->uri, "/") == 0) {
-        file_full_name = "index.html";
+// Chrome trace-event JSON of the latest spans of every thread, only routed with --trace-sample
+static struct Body_Sink *handle_trace(struct Req_Headers *req_headers, const struct Route_Params *params, int client_fd) {
+    (void)req_headers;
+    (void)params;
+    size_t length = 0;
+    char *json = trace_render(&length);
+    if (json == NULL) {
+        send_500(client_fd);
+        return NULL;
+    }
+    send_response_parts(client_fd, STATUS_LINE(STATUS_OK), MIME_JSON, json, length);
+    free(json);
+    return NULL;
+}
+
+// Answers a Range request with 206 or 416, returns false if the whole file has to be sent
+static bool send_requested_ranges(struct Req_Headers *req_headers, const struct File_Validators *validators, const struct File_Body *file, int client_fd) {
+    struct Byte_Range ranges[MAX_BYTE_RANGES];
+    int range_count = requested_byte_ranges(req_headers, validators, file->size, ranges);
+    if (range_count == BYTE_RANGES_IGNORED) {
+        return false;
+    }
+    if (range_count == 0) {
+        send_416(client_fd, file->size);
     } else {
-        file_full_name = req_headers->uri + 1; // Skip leading '/'
+        send_206(client_fd, file, ranges, range_count);
     }
+    return true;
+}
+
+// 304 if the client's copy is current, else the requested ranges or the whole file
+static void send_file_body(struct Req_Headers *req_headers, const struct File_Validators *validators, const struct File_Body *file, int client_fd) {
+    if (is_not_modified(req_headers, validators)) {
+        send_304(client_fd, validators);
+        return;
+    }
+    if (send_requested_ranges(req_headers, validators, file, client_fd)) {
+        return;
+    }
+    send_200_body(client_fd, file);
+}
 
-    if (strlen(file_full_name) + strlen(HTML_DIR) >= MAX_FILE_PATH_LENGTH) {
+/*
+    Sends the file compressed with the best coding the client accepts, if possible. A
+    precompressed sibling (file_path + ".br" or ".gz") is sent as it is, otherwise the file is
+    compressed once and kept in the compression cache. The static cache entry of the file, if
+    there is one, tells which siblings exist, so only files it does not hold are looked up on
+    disk. Returns false if the file has to be sent uncompressed.
+*/
+static bool serve_compressed_file(struct Req_Headers *req_headers, const char *file_path, const char *file_name,
+    const struct Static_Cache_Entry *cached, int client_fd) {
+    enum Content_Encoding order[CONTENT_ENCODING_COUNT];
+    int count = accepted_encodings(req_headers->accept_encoding, order);
+    const char *cache_control = get_file_cache_control(file_name);
+    const char *mime_type = get_file_mime_type((char *)file_name);
+
+    for (int i = 0; i < count; i++) {
+        if (cached != NULL) {
+            const struct Static_Cache_Sibling *sibling = &cached->siblings[order[i]];
+            if (!sibling->present) {
+                continue;
+            }
+            if (sibling->data != NULL) {
+                struct File_Body body = { .fd = -1, .data = sibling->data, .size = sibling->size,
+                    .content_type = mime_type, .headers = sibling->validators.headers };
+                send_file_body(req_headers, &sibling->validators, &body, client_fd);
+                return true;
+            }
+        }
+        char sibling_path[MAX_FILE_PATH_LENGTH + 4];
+        snprintf(sibling_path, sizeof(sibling_path), "%s%s", file_path, precompressed_extension(order[i]));
+        struct stat sibling_stat;
+        int sibling_fd = open_file_stat(sibling_path, &sibling_stat);
+        if (sibling_fd == -1) {
+            continue;
+        }
+        struct File_Validators validators;
+        file_validators_init(&validators, &sibling_stat, cache_control);
+        file_validators_set_encoding(&validators, order[i]);
+        struct File_Body body = { .fd = sibling_fd, .data = NULL, .size = sibling_stat.st_size,
+            .content_type = mime_type, .headers = validators.headers };
+        send_file_body(req_headers, &validators, &body, client_fd);
+        close(sibling_fd);
+        return true;
+    }
+
+    struct stat file_stat;
+    if (cached != NULL) {
+        file_stat = cached->file_stat;
+    } else if (count == 0 || stat(file_path, &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        struct Compressed_Entry *compressed = compress_cache_acquire(file_path, &file_stat, order[i], cache_control);
+        if (compressed == NULL) {
+            continue;
+        }
+        struct File_Body body = { .fd = -1, .data = compressed->data, .size = compressed->length,
+            .content_type = mime_type, .headers = compressed->validators.headers };
+        send_file_body(req_headers, &compressed->validators, &body, client_fd);
+        compress_cache_release(compressed);
+        return true;
+    }
+    return false;
+}
+
+/*
+    Sends a file under HTML_DIR, file_name is relative to it. Every response carries the
+    file's validators, a conditional request for an unchanged file gets a 304 without a body
+    and a Range request only the bytes it asks for. Text files are compressed when the client
+    accepts it.
+*/
+static void serve_static_file(struct Req_Headers *req_headers, struct Str_View file_name, int client_fd) {
+    if (file_name.length + strlen(HTML_DIR) >= MAX_FILE_PATH_LENGTH) {
         send_400(client_fd, "Bad Request: File name too long", 0);
         return;
     }
 
     char file_path[MAX_FILE_PATH_LENGTH] = HTML_DIR;
-    strncat(file_path, file_full_name, strlen(file_full_name));
+    strncat(file_path, file_name.data, file_name.length);
+    // ".." segments would reach files outside HTML_DIR
+    if (strlen(file_path) != strlen(HTML_DIR) + file_name.length || !is_canonical_path(file_path)) {
+        send_404(client_fd);
+        return;
+    }
+    char *file_full_name = file_path + strlen(HTML_DIR);
+    const char *mime_type = get_file_mime_type(file_full_name);
+    bool compressible = compression_applies(file_full_name);
 
-    struct file_data *filedata = load_file(file_path);
-    if (filedata == NULL) {
+    struct Static_Cache_Entry *cached = static_cache_acquire(file_path);
+    if (cached != NULL && cached->state == CACHE_ENTRY_MISSING) {
+        static_cache_release(cached);
         send_404(client_fd);
         return;
     }
 
-    const char *mime_type = get_file_mime_type(file_full_name);
+    if (compressible && !str_view_is_empty(req_headers->accept_encoding)
+        && serve_compressed_file(req_headers, file_path, file_full_name, cached, client_fd)) {
+        if (cached != NULL) {
+            static_cache_release(cached);
+        }
+        return;
+    }
+
+    if (cached != NULL && cached->state == CACHE_ENTRY_TOO_LARGE) {
+        static_cache_release(cached);
+        cached = NULL;
+    }
+    if (cached != NULL) {
+        bool conditional = !str_view_is_empty(req_headers->if_none_match) || !str_view_is_empty(req_headers->if_modified_since)
+            || !str_view_is_empty(req_headers->range);
+        if (conditional) {
+            struct File_Body body = { .fd = -1, .data = cached->data, .size = cached->size,
+                .content_type = mime_type, .headers = cached->validators.headers };
+            send_file_body(req_headers, &cached->validators, &body, client_fd);
+        } else {
+            int keep_alive = request_context.keep_alive ? 1 : 0;
+            send_prebuilt_response(client_fd, cached->headers[keep_alive], cached->headers_length[keep_alive], cached->data, cached->size);
+        }
+        static_cache_release(cached);
+        return;
+    }
+
+    // Too big for the cache, cache disabled, or a path the cache could not read
+    struct stat file_stat;
+    int file_fd = open_file_stat(file_path, &file_stat);
+    if (file_fd == -1) {
+        send_404(client_fd);
+        return;
+    }
 
-    send_200(client_fd, filedata->data, mime_type, filedata->size);
-    file_free(filedata);
+    struct File_Validators validators;
+    file_validators_init(&validators, &file_stat, get_file_cache_control(file_full_name));
+    if (compressible) {
+        file_validators_set_encoding(&validators, ENCODING_IDENTITY);
+    }
+    // The body goes from the page cache to the socket, it is never read into memory
+    struct File_Body body = { .fd = file_fd, .data = NULL, .size = file_stat.st_size,
+        .content_type = mime_type, .headers = validators.headers };
+    send_file_body(req_headers, &validators, &body, client_fd);
+    close(file_fd);
 }
 
-void handle_POST(struct Req_Headers *req_headers, struct Req_Body *req_body, int client_fd) {
-    if (strcmp(req_headers->uri, "/post") == 0) {
+// GET /{path...}: static files, "/" is index.html
+struct Body_Sink *handle_GET(struct Req_Headers *req_headers, const struct Route_Params *params, int client_fd) {
+    struct Str_View file_name = route_param(params, "path");
+    if (file_name.length == 0) {
+        file_name.data = "index.html";
+        file_name.length = strlen("index.html");
+    }
+    serve_static_file(req_headers, file_name, client_fd);
+    return NULL;
+}
 
-        char *is_multipart_form = strstr(req_headers->content_type, MIME_MULTIPART_FORM);
-        if (is_multipart_form != NULL) {
-            parse_multipart_form_data(req_body);
-        } else if (strcmp(req_headers->content_type, MIME_TEXT_PLAIN) != 0) {
-            send_501(client_fd);
-            return;
-        }
-        
-        char *file_full_name = "file.txt";
+/*
+    GET /post/{id}: the upload stored under id, sent straight from its segment file. Files
+    stored from multipart bodies live under the same path, anything that is not an id is
+    served as a static file.
+*/
+static struct Body_Sink *handle_GET_record(struct Req_Headers *req_headers, const struct Route_Params *params, int client_fd) {
+    struct Str_View id_view = route_param(params, "id");
+    uint64_t id = 0;
+    bool numeric = id_view.length <= 19;
+    for (size_t i = 0; i < id_view.length && numeric; i++) {
+        numeric = id_view.data[i] >= '0' && id_view.data[i] <= '9';
+        id = id * 10 + (id_view.data[i] - '0');
+    }
+    if (!numeric) {
+        // The file name is the path of the request, without its leading "/" and its query
+        struct Str_View uri = req_headers->uri;
+        const char *query = memchr(uri.data, '?', uri.length);
+        size_t path_length = query ? (size_t)(query - uri.data) : uri.length;
+        struct Str_View file_name = { .data = uri.data + 1, .length = path_length - 1 };
+        serve_static_file(req_headers, file_name, client_fd);
+        return NULL;
+    }
+
+    off_t offset = 0;
+    size_t length = 0;
+    int segment_fd = upload_store_open_record(id, &offset, &length);
+    if (segment_fd == -1) {
+        send_404(client_fd);
+        return NULL;
+    }
+    send_200_file(client_fd, segment_fd, offset, length, MIME_TEXT_PLAIN, NULL);
+    close(segment_fd);
+    return NULL;
+}
+
+// Stored file part, kept under a temporary name until the whole body has been received
+struct Stored_File {
+    char temp_path[UPLOAD_TEMP_PATH_SIZE];
+    char name[256];
+    struct Stored_File *next;
+};
+
+/*
+    Body of a POST /post request. Text bodies are spooled and appended to the upload file as
+    they are. Multipart bodies are parsed as they arrive: every part is summarized as
+    "name:\ncontent\n---\n" in the spool, except file parts whose content goes straight to
+    a file under POST_DIR (the summary then holds the stored name).
+*/
+struct Post_Upload {
+    struct Body_Sink sink;
+    struct Upload_Spool spool;
+    struct Multipart_Parser *multipart; // NULL for text bodies
+    bool malformed;                     // The rest of the multipart body is read and dropped
+    int part_fd;                        // File part being received, -1 otherwise
+    struct Stored_File *files;
+    struct Upload_Commit commit;        // When committed in the background
+    struct Trace_Span commit_span;
+};
 
+static int multipart_part_begin(void *context, struct Part *part) {
+    struct Post_Upload *upload = context;
+
+    if (part->form_data_name != NULL && upload_spool_write(&upload->spool, part->form_data_name, part->fdn_length) == -1) {
+        return -1;
+    }
+    if (upload_spool_write(&upload->spool, ":\n", 2) == -1) {
+        return -1;
+    }
+
+    struct Stored_File *file = malloc(sizeof(struct Stored_File));
+    if (file == NULL) {
+        return -1;
+    }
+    if (part->file_name == NULL || !upload_file_name(part->file_name, file->name, sizeof(file->name))) {
+        free(file); // Form field, or a file input left empty
+        return 0;
+    }
+    upload->part_fd = create_upload_file(file->temp_path);
+    if (upload->part_fd == -1) {
+        free(file);
+        return -1;
+    }
+    file->next = upload->files;
+    upload->files = file;
+    return upload_spool_write(&upload->spool, file->name, strlen(file->name));
+}
+
+static int multipart_part_data(void *context, const char *data, size_t length) {
+    struct Post_Upload *upload = context;
+    if (upload->part_fd != -1) {
+        return write_all(upload->part_fd, data, length);
+    }
+    return upload_spool_write(&upload->spool, data, length);
+}
+
+static int multipart_part_end(void *context) {
+    struct Post_Upload *upload = context;
+    if (upload->part_fd != -1) {
+        close(upload->part_fd);
+        upload->part_fd = -1;
+    }
+    return upload_spool_write(&upload->spool, "\n---\n", 5);
+}
+
+static const struct Multipart_Callbacks post_multipart_callbacks = {
+    .on_part_begin = multipart_part_begin,
+    .on_part_data = multipart_part_data,
+    .on_part_end = multipart_part_end,
+};
+
+static int post_upload_write(struct Body_Sink *sink, const char *data, size_t length) {
+    struct Post_Upload *upload = (struct Post_Upload *)sink;
+    if (upload->multipart == NULL) {
+        return upload_spool_write(&upload->spool, data, length);
+    }
+    if (upload->malformed) {
+        return 0;
+    }
+    struct Trace_Span span = trace_begin("multipart");
+    if (multipart_parser_feed(upload->multipart, data, length) == -1) {
+        // Answered with 400 once the body is complete, so the connection can be reused
+        upload->malformed = true;
+    }
+    trace_end(&span);
+    return 0;
+}
+
+static void post_upload_abort(struct Body_Sink *sink) {
+    struct Post_Upload *upload = (struct Post_Upload *)sink;
+    if (upload->part_fd != -1) {
+        close(upload->part_fd);
+    }
+    while (upload->files != NULL) {
+        struct Stored_File *next = upload->files->next;
+        unlink(upload->files->temp_path); // No-op once it has been renamed
+        free(upload->files);
+        upload->files = next;
+    }
+    upload_spool_free(&upload->spool);
+    free(upload->multipart);
+    free(upload);
+}
+
+// Moves the file parts to their final names once the whole body is known to be valid
+static int store_uploaded_files(struct Post_Upload *upload) {
+    for (struct Stored_File *file = upload->files; file != NULL; file = file->next) {
         char file_path[MAX_FILE_PATH_LENGTH] = POST_DIR;
-        strncat(file_path, file_full_name, strlen(file_full_name));
+        strncat(file_path, file->name, sizeof(file_path) - strlen(file_path) - 1);
+        if (rename(file->temp_path, file_path) == -1) {
+            log_errno("Could not store uploaded file");
+            return -1;
+        }
+        log_debug("Stored uploaded file '%s'", file_path);
+    }
+    return 0;
+}
 
-        int write_result = write_file(file_path, req_body->content, req_body->length);
+// Answers once the upload has been committed (or failed to) and releases it
+static void post_upload_respond(struct Post_Upload *upload, int client_fd, int write_result, uint64_t id) {
+    post_upload_abort(&upload->sink);
 
-        if (write_result == -1) {
-            send_500(client_fd);
-            return;
+    if (write_result == -1) {
+        send_500(client_fd);
+        return;
+    }
+    char body[64];
+    int body_length = snprintf(body, sizeof(body), "File uploaded successfully: " UPLOAD_RECORD_PREFIX "%" PRIu64, id);
+    send_201(client_fd, body, MIME_TEXT_PLAIN, body_length);
+}
+
+static struct Upload_Commit *post_upload_finish(struct Body_Sink *sink, int client_fd) {
+    struct Post_Upload *upload = (struct Post_Upload *)sink;
+
+    if (upload->multipart != NULL && (upload->malformed || !multipart_parser_done(upload->multipart))) {
+        post_upload_abort(sink);
+        send_400(client_fd, "Bad Request: Malformed multipart body", strlen("Bad Request: Malformed multipart body"));
+        return NULL;
+    }
+
+    // Acknowledged only once the writer has committed the upload
+    uint64_t id = 0;
+    int write_result = store_uploaded_files(upload);
+    if (write_result == 0 && upload_commit_notify_fd != -1) {
+        upload->commit_span = trace_begin("upload_commit");
+        if (upload_writer_submit(&upload->commit, &upload->spool, upload_commit_notify_fd)) {
+            return &upload->commit; // Answered by post_upload_committed
         }
-        send_201(client_fd, "File uploaded successfully", MIME_TEXT_PLAIN, strlen("File uploaded successfully"));
-    } else {
-        send_404(client_fd);
+        write_result = -1;
+    } else if (write_result == 0) {
+        struct Trace_Span span = trace_begin("upload_commit");
+        write_result = upload_writer_commit(&upload->spool, &id);
+        trace_end(&span);
+    }
+    post_upload_respond(upload, client_fd, write_result, id);
+    return NULL;
+}
+
+static void post_upload_committed(struct Body_Sink *sink, int client_fd) {
+    struct Post_Upload *upload = (struct Post_Upload *)sink;
+    trace_end(&upload->commit_span);
+    post_upload_respond(upload, client_fd, upload->commit.result, upload->commit.id);
+}
+
+/*
+    Called as soon as the headers of a POST request have arrived. Returns the sink that will
+    receive the body, or NULL if the request was rejected (the response has then been sent).
+*/
+struct Body_Sink *handle_POST(struct Req_Headers *req_headers, const struct Route_Params *params, int client_fd) {
+    (void)params;
+
+    bool multipart = str_view_case_contains(req_headers->content_type, MIME_MULTIPART_FORM);
+    if (!multipart && !str_view_equals(req_headers->content_type, MIME_TEXT_PLAIN)) {
+        send_501(client_fd);
+        return NULL;
     }
-}
\ No newline at end of file
+
+    // The request buffer is reused while the body streams in, keep what is needed later
+    struct Post_Upload *upload = calloc(1, sizeof(struct Post_Upload));
+    if (upload == NULL) {
+        send_500(client_fd);
+        return NULL;
+    }
+    upload->sink.write = post_upload_write;
+    upload->sink.finish = post_upload_finish;
+    upload->sink.committed = post_upload_committed;
+    upload->sink.abort = post_upload_abort;
+    upload_spool_init(&upload->spool);
+    upload->part_fd = -1;
+    if (!multipart) {
+        return &upload->sink;
+    }
+
+    upload->multipart = malloc(sizeof(struct Multipart_Parser));
+    char *content_type = arena_strndup(request_arena(), req_headers->content_type.data, req_headers->content_type.length);
+    if (upload->multipart == NULL || content_type == NULL) {
+        post_upload_abort(&upload->sink);
+        send_500(client_fd);
+        return NULL;
+    }
+    if (multipart_parser_init(upload->multipart, content_type, &post_multipart_callbacks, upload) == -1) {
+        post_upload_abort(&upload->sink);
+        send_400(client_fd, "Bad Request: Missing multipart boundary", strlen("Bad Request: Missing multipart boundary"));
+        return NULL;
+    }
+    return &upload->sink;
+}
+
+/*
+    Every endpoint of the server. Called once at startup, before any connection is accepted,
+    the route table is read-only afterwards.
+*/
+bool register_routes(void) {
+    bool registered =
+        route_register("GET", "/health", handle_health) &&
+        route_register("GET", "/metrics", handle_metrics) &&
+        route_register("GET", UPLOAD_RECORD_PREFIX "{id}", handle_GET_record) &&
+        route_register("GET", "/{path...}", handle_GET) &&
+        route_register("POST", "/post", handle_POST);
+    if (registered && trace_enabled()) {
+        registered = route_register("GET", "/debug/trace", handle_trace);
+    }
+    return registered && route_table_compile();
+}
@@ -2,10 +2,31 @@
 #define REQUEST_HANDLERS_H
 
 #include "response_handlers.h"
+#include "route_table.h"
+#include "upload_writer.h"
 
 #define MAX_FILE_PATH_LENGTH 1024
+// GET UPLOAD_RECORD_PREFIX{id} returns the upload stored under that id
+#define UPLOAD_RECORD_PREFIX "/post/"
 
-void handle_GET(struct Req_Headers *req_headers, int client_fd);
-void handle_POST(struct Req_Headers *req_headers, struct Req_Body *req_body, int client_fd);
+/*
+    Receives the body of a request while it is read from the socket. Route handlers return one
+    for requests whose body they want; the connection code passes it every piece of the body, then calls
+    finish, which sends the response, or abort if the request fails before the body is
+    complete. Both release the sink.
+    finish may instead return the upload commit the response waits for (only when
+    upload_commit_notify_fd is set): the sink is then kept, and once the commit is done
+    committed sends the response and releases it.
+*/
+struct Body_Sink {
+    int (*write)(struct Body_Sink *sink, const char *data, size_t length);
+    struct Upload_Commit *(*finish)(struct Body_Sink *sink, int client_fd);
+    void (*committed)(struct Body_Sink *sink, int client_fd);
+    void (*abort)(struct Body_Sink *sink);
+};
+
+struct Body_Sink *handle_GET(struct Req_Headers *req_headers, const struct Route_Params *params, int client_fd);
+struct Body_Sink *handle_POST(struct Req_Headers *req_headers, const struct Route_Params *params, int client_fd);
+bool register_routes(void);
 
 #endif
\ No newline at end of file
@@ -1,27 +1,572 @@
+#include <sys/sendfile.h>
 #include "response_handlers.h"
+#include "logger.h"
+#include "metrics.h"
+#include "trace.h"
+
+/*
+    Notes a response on the request context for the access log and the metrics, or logs why
+    it failed. status_line is the start of the response, "HTTP/1.1 <code> ...", and
+    started_ns when building it began.
+*/
+static void response_sent(const char *status_line, ssize_t sent, const char *failure, uint64_t started_ns) {
+    request_context.status = atoi(status_line + strlen("HTTP/1.1 "));
+    request_context.send_ns += metrics_now_ns() - started_ns;
+    struct Trace_Span span = { "send", trace_current != 0 ? started_ns : 0 };
+    trace_end(&span);
+    if (sent == -1) {
+        log_errno(failure);
+        return;
+    }
+    request_context.bytes_sent += sent;
+    log_debug("Response sent successfully, bytes sent: %zd", sent);
+}
+
+// Waits up to SEND_TIMEOUT_MS for a non-blocking socket to accept more data
+static bool wait_writable(int client_fd) {
+    struct pollfd pfd = { .fd = client_fd, .events = POLLOUT };
+    return poll(&pfd, 1, SEND_TIMEOUT_MS) > 0;
+}
+
+__thread struct Output_Queue *deferred_output = NULL;
+
+// True once something was queued on deferred_output, later output has to wait behind it
+bool output_pending(void) {
+    return deferred_output != NULL && deferred_output->head != NULL;
+}
+
+static void output_queue_push(struct Output_Queue *queue, struct Output_Segment *segment) {
+    segment->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = segment;
+    } else {
+        queue->head = segment;
+    }
+    queue->tail = segment;
+}
+
+static void output_segment_free(struct Output_Segment *segment) {
+    if (segment->file_fd != -1) {
+        close(segment->file_fd);
+    }
+    free(segment);
+}
+
+// Queues a copy of what is left of iov on deferred_output, returns its size or -1
+static ssize_t defer_iov(const struct iovec *iov, int iov_count) {
+    size_t length = 0;
+    for (int i = 0; i < iov_count; i++) {
+        length += iov[i].iov_len;
+    }
+    struct Output_Segment *segment = malloc(sizeof(struct Output_Segment) + length);
+    if (segment == NULL) {
+        return -1;
+    }
+    segment->file_fd = -1;
+    segment->offset = 0;
+    segment->length = length;
+    size_t copied = 0;
+    for (int i = 0; i < iov_count; i++) {
+        memcpy(segment->data + copied, iov[i].iov_base, iov[i].iov_len);
+        copied += iov[i].iov_len;
+    }
+    output_queue_push(deferred_output, segment);
+    return length;
+}
+
+// Queues length bytes of file_fd from offset on deferred_output, the caller may close file_fd
+static ssize_t defer_file(int file_fd, off_t offset, size_t length) {
+    struct Output_Segment *segment = malloc(sizeof(struct Output_Segment));
+    if (segment == NULL) {
+        return -1;
+    }
+    segment->file_fd = fcntl(file_fd, F_DUPFD_CLOEXEC, 0);
+    if (segment->file_fd == -1) {
+        free(segment);
+        return -1;
+    }
+    segment->offset = offset;
+    segment->length = length;
+    output_queue_push(deferred_output, segment);
+    return length;
+}
+
+// Sends the next chunk of a file segment through userspace, for when sendfile() is not available
+static ssize_t send_file_chunk(int client_fd, const struct Output_Segment *segment) {
+    char chunk[FILE_CHUNK_SIZE];
+    size_t wanted = segment->length < sizeof(chunk) ? segment->length : sizeof(chunk);
+    ssize_t bytes_read = pread(segment->file_fd, chunk, wanted, segment->offset);
+    if (bytes_read <= 0) {
+        return bytes_read;
+    }
+    return send(client_fd, chunk, bytes_read, MSG_NOSIGNAL);
+}
+
+/**
+ * Sends as much of queue as client_fd takes without blocking. Everything went out once
+ * queue->head is NULL, otherwise the socket is full and the caller waits for it to drain.
+ * Returns the number of bytes sent or -1 on error.
+*/
+ssize_t output_queue_flush(int client_fd, struct Output_Queue *queue) {
+    size_t total_sent = 0;
+    while (queue->head != NULL) {
+        struct Output_Segment *segment = queue->head;
+        ssize_t sent;
+        if (segment->file_fd == -1) {
+            int flags = segment->next ? MSG_MORE : 0;
+            sent = send(client_fd, segment->data + segment->offset, segment->length, flags | MSG_NOSIGNAL);
+        } else {
+            off_t offset = segment->offset;
+            sent = sendfile(client_fd, segment->file_fd, &offset, segment->length);
+            if (sent == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                sent = send_file_chunk(client_fd, segment);
+            }
+            if (sent == 0) {
+                errno = EIO;
+                return -1; // The file shrank after the headers were sent
+            }
+        }
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+
+        total_sent += sent;
+        segment->offset += sent;
+        segment->length -= sent;
+        if (segment->length == 0) {
+            queue->head = segment->next;
+            if (queue->head == NULL) {
+                queue->tail = NULL;
+            }
+            output_segment_free(segment);
+        }
+    }
+    return total_sent;
+}
+
+// Drops whatever is still queued, e.g. when the connection closes
+void output_queue_clear(struct Output_Queue *queue) {
+    while (queue->head != NULL) {
+        struct Output_Segment *segment = queue->head;
+        queue->head = segment->next;
+        output_segment_free(segment);
+    }
+    queue->tail = NULL;
+}
+
+/**
+ * Sends the whole buffer on client_fd, with the same EAGAIN handling as send_iov_all.
+ * Returns the number of bytes sent or -1 on error.
+*/
+ssize_t send_all(int client_fd, const void *data, size_t length) {
+    struct iovec iov = { (void *)data, length };
+    return send_iov_all(client_fd, &iov, 1, 0);
+}
+
+/**
+ * Gathers every buffer of iov into as few `sendmsg()` calls as the socket allows: after a
+ * partial write the vector is advanced past what was sent and the rest is retried.
+ * On EAGAIN the rest is queued on deferred_output when it is set, otherwise we wait with
+ * `poll()` until the socket is writable again (up to SEND_TIMEOUT_MS).
+ * iov is modified. flags is passed on (e.g. MSG_MORE).
+ * Returns the number of bytes sent or -1 on error.
+*/
+ssize_t send_iov_all(int client_fd, struct iovec *iov, int iov_count, int flags) {
+    if (output_pending()) {
+        return defer_iov(iov, iov_count);
+    }
+    size_t total_sent = 0;
+    while (iov_count > 0) {
+        struct msghdr message = { .msg_iov = iov, .msg_iovlen = iov_count };
+        ssize_t sent = sendmsg(client_fd, &message, flags | MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && deferred_output != NULL) {
+                ssize_t deferred = defer_iov(iov, iov_count);
+                return deferred == -1 ? -1 : (ssize_t)total_sent + deferred;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(client_fd)) {
+                continue;
+            }
+            return -1;
+        }
+        total_sent += sent;
+
+        // Skip the buffers that went out completely, then trim the one that went out partially
+        size_t remaining = sent;
+        while (iov_count > 0 && remaining >= iov->iov_len) {
+            remaining -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0) {
+            iov->iov_base = (char *)iov->iov_base + remaining;
+            iov->iov_len -= remaining;
+        }
+    }
+    return total_sent;
+}
+
+// Writes value in decimal into buffer (at least 20 bytes), returns the number of digits
+static size_t format_decimal(char *buffer, size_t value) {
+    char digits[20];
+    size_t count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    for (size_t i = 0; i < count; i++) {
+        buffer[i] = digits[count - 1 - i];
+    }
+    return count;
+}
+
+/*
+    Points iov at the status line and headers of a response, assembled from constant
+    fragments: only the Date and the Content-Length digits are written, into scratch.
+    extra_headers (NULL or lines ending with CRLF) is referenced, not copied.
+    Returns the number of entries used (RESPONSE_HEADER_IOVS).
+*/
+static int fill_header_iov(struct iovec *iov, struct Header_Scratch *scratch, const char *status_line, const char *content_type, size_t content_length, const char *extra_headers) {
+    static const char date_prefix[] = "Date: ";
+    static const char type_prefix[] = "\r\nServer: " SERVER_NAME "\r\nContent-Type: ";
+    static const char length_prefix[] = "\r\nContent-Length: ";
+    static const char keep_alive_suffix[] = "Connection: keep-alive\r\n\r\n";
+    static const char close_suffix[] = "Connection: close\r\n\r\n";
+
+    get_http_date(scratch->date);
+    iov[0] = (struct iovec){ (void *)status_line, strlen(status_line) };
+    iov[1] = (struct iovec){ (void *)date_prefix, sizeof(date_prefix) - 1 };
+    iov[2] = (struct iovec){ scratch->date, HTTP_DATE_LENGTH };
+    iov[3] = (struct iovec){ (void *)type_prefix, sizeof(type_prefix) - 1 };
+    iov[4] = (struct iovec){ (void *)content_type, strlen(content_type) };
+    iov[5] = (struct iovec){ (void *)length_prefix, sizeof(length_prefix) - 1 };
+    iov[6] = (struct iovec){ scratch->length, format_decimal(scratch->length, content_length) };
+    iov[7] = (struct iovec){ "\r\n", 2 };
+    iov[8] = (struct iovec){ (void *)extra_headers, extra_headers ? strlen(extra_headers) : 0 };
+    if (request_context.keep_alive) {
+        iov[9] = (struct iovec){ (void *)keep_alive_suffix, sizeof(keep_alive_suffix) - 1 };
+    } else {
+        iov[9] = (struct iovec){ (void *)close_suffix, sizeof(close_suffix) - 1 };
+    }
+    return RESPONSE_HEADER_IOVS;
+}
+
+/*
+    Responses that never change apart from their Date, built once before main runs.
+    Each one is split around the date: head ends with "Date: " and tail holds the rest of the
+    headers and the body, so sending one is a single sendmsg of three buffers.
+*/
+struct Canned_Response {
+    char head[64];
+    size_t head_length;
+    char tail[256];
+    size_t tail_length;
+};
+
+static struct Canned_Response canned_responses[CANNED_RESPONSE_COUNT][2]; // Indexed by keep_alive
+
+static void build_canned_response(enum Canned_Response_Id id, const char *status_line, const char *body) {
+    for (int keep_alive = 0; keep_alive < 2; keep_alive++) {
+        struct Canned_Response *canned = &canned_responses[id][keep_alive];
+        canned->head_length = snprintf(canned->head, sizeof(canned->head), "%sDate: ", status_line);
+        canned->tail_length = snprintf(canned->tail, sizeof(canned->tail),
+            "\r\nServer: " SERVER_NAME "\r\nContent-Type: " MIME_TEXT_PLAIN "\r\nContent-Length: %zu\r\nConnection: %s\r\n\r\n%s",
+            strlen(body), keep_alive ? "keep-alive" : "close", body);
+    }
+}
+
+__attribute__((constructor))
+static void build_canned_responses(void) {
+    build_canned_response(CANNED_HEALTH, STATUS_LINE(STATUS_OK), "Server is OK");
+    build_canned_response(CANNED_NOT_FOUND, STATUS_LINE(STATUS_NOT_FOUND), "Resource Not Found");
+    build_canned_response(CANNED_CONTENT_TOO_LARGE, STATUS_LINE(STATUS_CONTENT_TOO_LARGE), "Request body too large");
+    build_canned_response(CANNED_INTERNAL_SERVER_ERROR, STATUS_LINE(STATUS_INTERNAL_SERVER_ERROR), "Internal Server Error");
+    build_canned_response(CANNED_NOT_IMPLEMENTED, STATUS_LINE(STATUS_NOT_IMPLEMENTED), "Not Implemented");
+    build_canned_response(CANNED_SERVICE_UNAVAILABLE, STATUS_LINE(STATUS_SERVICE_UNAVAILABLE), "Service Unavailable");
+    build_canned_response(CANNED_HTTP_VERSION_NOT_SUPPORTED, STATUS_LINE(STATUS_HTTP_VERSION_NOT_SUPPORTED), "HTTP Version Not Supported");
+}
+
+void send_canned_response(int client_fd, enum Canned_Response_Id id) {
+    uint64_t started_ns = metrics_now_ns();
+    const struct Canned_Response *canned = &canned_responses[id][request_context.keep_alive ? 1 : 0];
+    char date[HTTP_DATE_LENGTH];
+    get_http_date(date);
+
+    struct iovec iov[3] = {
+        { (void *)canned->head, canned->head_length },
+        { date, HTTP_DATE_LENGTH },
+        { (void *)canned->tail, canned->tail_length },
+    };
+    ssize_t sent = send_iov_all(client_fd, iov, 3, 0);
+    response_sent(canned->head, sent, "Sending response failed", started_ns);
+}
 
 /**
- * `send()` sends data on the client_fd socket.
- * If successful, returns 0 or greater indicating the number of bytes sent, otherwise
- * returns -1.
+ * Sends a complete response in one `sendmsg()`: the headers come from constant fragments
+ * and body is referenced where the caller keeps it, nothing is formatted into or copied to
+ * the heap. status_line is built with STATUS_LINE.
 */
-void send_response(struct Response *response, int client_fd) {
-    int headersSent = send(client_fd, response->headers, response->headers_length, 0);
+void send_response_parts(int client_fd, const char *status_line, const char *content_type, const void *body, size_t body_length) {
+    uint64_t started_ns = metrics_now_ns();
+    struct iovec iov[RESPONSE_HEADER_IOVS + 1];
+    struct Header_Scratch scratch;
+    int iov_count = fill_header_iov(iov, &scratch, status_line, content_type, body_length, NULL);
+    if (body_length > 0) {
+        iov[iov_count++] = (struct iovec){ (void *)body, body_length };
+    }
+
+    ssize_t sent = send_iov_all(client_fd, iov, iov_count, 0);
+    response_sent(status_line, sent, "Sending response failed", started_ns);
+}
+
+// Fallback for when sendfile() cannot be used on this pair of descriptors
+static ssize_t send_file_read_loop(int client_fd, int file_fd, off_t offset, size_t length) {
+    char chunk[FILE_CHUNK_SIZE];
+    size_t total_sent = 0;
+    while (total_sent < length) {
+        size_t wanted = length - total_sent < sizeof(chunk) ? length - total_sent : sizeof(chunk);
+        ssize_t bytes_read = pread(file_fd, chunk, wanted, offset + total_sent);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return -1; // The file shrank or could not be read
+        }
+        if (send_all(client_fd, chunk, bytes_read) == -1) {
+            return -1;
+        }
+        total_sent += bytes_read;
+    }
+    return total_sent;
+}
 
+/**
+ * Sends length bytes of file_fd starting at offset with `sendfile()`, so the data goes from
+ * the page cache to the socket without passing through userspace.
+ * Falls back to a pread/send loop if the kernel cannot sendfile between the two descriptors.
+ * With deferred_output set, the part the socket does not take is queued as a file range.
+ * Returns the number of bytes sent or -1 on error.
+*/
+ssize_t send_file_range(int client_fd, int file_fd, off_t offset, size_t length) {
+    if (output_pending()) {
+        return defer_file(file_fd, offset, length);
+    }
+    size_t total_sent = 0;
+    while (total_sent < length) {
+        ssize_t sent = sendfile(client_fd, file_fd, &offset, length - total_sent);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            bool would_block = errno == EAGAIN || errno == EWOULDBLOCK;
+            bool unsupported = (errno == EINVAL || errno == ENOSYS) && total_sent == 0;
+            if ((would_block || unsupported) && deferred_output != NULL) {
+                // The queue falls back to reading the file itself if sendfile() is not available
+                ssize_t deferred = defer_file(file_fd, offset, length - total_sent);
+                return deferred == -1 ? -1 : (ssize_t)total_sent + deferred;
+            }
+            if (would_block && wait_writable(client_fd)) {
+                continue;
+            }
+            if (unsupported) {
+                return send_file_read_loop(client_fd, file_fd, offset, length);
+            }
+            return -1;
+        }
+        if (sent == 0) {
+            return -1; // The file shrank after the headers were sent
+        }
+        total_sent += sent;
+    }
+    return total_sent;
+}
+
+/**
+ * Sends a response whose headers were formatted ahead of time, e.g. by the static file cache.
+ * Neither buffer is copied: the Date header is spliced in right after the status line.
+*/
+void send_prebuilt_response(int client_fd, const char *headers, size_t headers_length, const void *body, size_t body_length) {
+    uint64_t started_ns = metrics_now_ns();
+    char date[HTTP_DATE_LENGTH];
+    get_http_date(date);
+
+    const char *status_line_end = memchr(headers, '\n', headers_length);
+    size_t status_line_length = status_line_end ? (size_t)(status_line_end + 1 - headers) : 0;
+    struct iovec iov[6] = {
+        { (void *)headers, status_line_length },
+        { "Date: ", strlen("Date: ") },
+        { date, HTTP_DATE_LENGTH },
+        { "\r\n", 2 },
+        { (void *)(headers + status_line_length), headers_length - status_line_length },
+        { (void *)body, body_length },
+    };
+    ssize_t sent = send_iov_all(client_fd, iov, body_length > 0 ? 6 : 5, 0);
+    response_sent(headers, sent, "Sending response failed", started_ns);
+}
+
+/**
+ * Sends file_size bytes of file_fd, starting at offset, as the body of a 200 response.
+ * The headers are sent with MSG_MORE and the body with `sendfile()`, so the kernel merges
+ * them into full segments and the file contents are never copied into userspace.
+ * extra_headers, e.g. the validators of the file, may be NULL.
+*/
+void send_200_file(int client_fd, int file_fd, off_t offset, size_t file_size, const char *content_type, const char *extra_headers) {
+    uint64_t started_ns = metrics_now_ns();
+    struct iovec iov[RESPONSE_HEADER_IOVS];
+    struct Header_Scratch scratch;
+    int iov_count = fill_header_iov(iov, &scratch, STATUS_LINE(STATUS_OK), content_type, file_size, extra_headers);
+
+    int flags = file_size > 0 ? MSG_MORE : 0;
+    ssize_t headersSent = send_iov_all(client_fd, iov, iov_count, flags);
     if (headersSent == -1) {
-        perror("Sending response headers failed");
+        response_sent(STATUS_LINE(STATUS_OK), -1, "Sending response headers failed", started_ns);
         return;
     }
 
-    int bodySent = send(client_fd, response->body, response->content_length, 0);
+    ssize_t bodySent = send_file_range(client_fd, file_fd, offset, file_size);
+    response_sent(STATUS_LINE(STATUS_OK), bodySent == -1 ? -1 : headersSent + bodySent, "Sending file failed", started_ns);
+}
 
-    if (bodySent == -1) {
-        perror("Sending response body failed");
-    } else {
-        printf("Response sent successfully, bytes sent: %d\n", headersSent + bodySent);
+// Interim response telling a client that sent "Expect: 100-continue" to go ahead with the body
+void send_100_continue(int client_fd) {
+    static const char response[] = STATUS_LINE(STATUS_CONTINUE) "\r\n";
+    if (send_all(client_fd, response, sizeof(response) - 1) == -1) {
+        log_errno("Sending 100 Continue failed");
     }
 }
 
+// 304 for a file the client already has: no body, only the headers describing the file
+void send_304(int client_fd, const struct File_Validators *validators) {
+    uint64_t started_ns = metrics_now_ns();
+    static const char head[] = STATUS_LINE(STATUS_NOT_MODIFIED) "Date: ";
+    static const char server[] = "\r\nServer: " SERVER_NAME "\r\n";
+    static const char keep_alive_suffix[] = "Connection: keep-alive\r\n\r\n";
+    static const char close_suffix[] = "Connection: close\r\n\r\n";
+    char date[HTTP_DATE_LENGTH];
+    get_http_date(date);
+
+    struct iovec iov[5] = {
+        { (void *)head, sizeof(head) - 1 },
+        { date, HTTP_DATE_LENGTH },
+        { (void *)server, sizeof(server) - 1 },
+        { (void *)validators->headers, validators->headers_length },
+        { (void *)close_suffix, sizeof(close_suffix) - 1 },
+    };
+    if (request_context.keep_alive) {
+        iov[4] = (struct iovec){ (void *)keep_alive_suffix, sizeof(keep_alive_suffix) - 1 };
+    }
+    ssize_t sent = send_iov_all(client_fd, iov, 5, 0);
+    response_sent(head, sent, "Sending response failed", started_ns);
+}
+
+// Sends length bytes of a file body starting at offset, flags apply when it is in memory
+static ssize_t send_body_range(int client_fd, const struct File_Body *file, size_t offset, size_t length, int flags) {
+    if (file->data != NULL) {
+        struct iovec iov = { (void *)(file->data + offset), length };
+        return send_iov_all(client_fd, &iov, 1, flags);
+    }
+    return send_file_range(client_fd, file->fd, offset, length);
+}
+
+// 200 with a whole file body, from memory or with sendfile()
+void send_200_body(int client_fd, const struct File_Body *file) {
+    uint64_t started_ns = metrics_now_ns();
+    struct iovec iov[RESPONSE_HEADER_IOVS];
+    struct Header_Scratch scratch;
+    int iov_count = fill_header_iov(iov, &scratch, STATUS_LINE(STATUS_OK), file->content_type, file->size, file->headers);
+    ssize_t headers_sent = send_iov_all(client_fd, iov, iov_count, file->size > 0 ? MSG_MORE : 0);
+    ssize_t body_sent = headers_sent == -1 ? -1 : send_body_range(client_fd, file, 0, file->size, 0);
+    response_sent(STATUS_LINE(STATUS_OK), body_sent == -1 ? -1 : headers_sent + body_sent, "Sending file failed", started_ns);
+}
+
+// Boundary of multipart/byteranges bodies, random per process so no file is likely to contain it
+static char byteranges_boundary[24];
+
+__attribute__((constructor))
+static void init_byteranges_boundary(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    unsigned long long seed = ((unsigned long long)now.tv_sec << 32) ^ (unsigned long long)now.tv_nsec ^ ((unsigned long long)getpid() << 16);
+    snprintf(byteranges_boundary, sizeof(byteranges_boundary), "%016llx", seed * 6364136223846793005ull + 1442695040888963407ull);
+}
+
+/*
+    206 Partial Content for the given ranges of a file. One range is sent as is with a
+    Content-Range header; several become a multipart/byteranges body whose parts each carry
+    their own Content-Range. The data is sent with sendfile() or straight from memory, the
+    file is never read as a whole.
+*/
+void send_206(int client_fd, const struct File_Body *file, const struct Byte_Range *ranges, int range_count) {
+    uint64_t started_ns = metrics_now_ns();
+    struct iovec iov[RESPONSE_HEADER_IOVS];
+    struct Header_Scratch scratch;
+    char extra_headers[RANGE_PART_HEADERS_SIZE + FILE_VALIDATOR_HEADERS_SIZE];
+    const char *file_headers = file->headers ? file->headers : "";
+
+    if (range_count == 1) {
+        size_t length = ranges[0].last - ranges[0].first + 1;
+        snprintf(extra_headers, sizeof(extra_headers), "Content-Range: bytes %zu-%zu/%zu\r\n%s",
+            ranges[0].first, ranges[0].last, file->size, file_headers);
+        int iov_count = fill_header_iov(iov, &scratch, STATUS_LINE(STATUS_PARTIAL_CONTENT), file->content_type, length, extra_headers);
+        ssize_t headers_sent = send_iov_all(client_fd, iov, iov_count, MSG_MORE);
+        ssize_t body_sent = headers_sent == -1 ? -1 : send_body_range(client_fd, file, ranges[0].first, length, 0);
+        response_sent(STATUS_LINE(STATUS_PARTIAL_CONTENT), body_sent == -1 ? -1 : headers_sent + body_sent, "Sending partial content failed", started_ns);
+        return;
+    }
+
+    char part_headers[MAX_BYTE_RANGES][RANGE_PART_HEADERS_SIZE];
+    size_t part_headers_length[MAX_BYTE_RANGES];
+    char closing[sizeof(byteranges_boundary) + 8];
+    size_t closing_length = snprintf(closing, sizeof(closing), "\r\n--%s--\r\n", byteranges_boundary);
+    size_t content_length = closing_length;
+    for (int i = 0; i < range_count; i++) {
+        int length = snprintf(part_headers[i], RANGE_PART_HEADERS_SIZE, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %zu-%zu/%zu\r\n\r\n",
+            byteranges_boundary, file->content_type, ranges[i].first, ranges[i].last, file->size);
+        part_headers_length[i] = length < RANGE_PART_HEADERS_SIZE ? (size_t)length : RANGE_PART_HEADERS_SIZE - 1;
+        content_length += part_headers_length[i] + ranges[i].last - ranges[i].first + 1;
+    }
+
+    char content_type[sizeof(MIME_MULTIPART_BYTERANGES) + sizeof(byteranges_boundary) + 16];
+    snprintf(content_type, sizeof(content_type), MIME_MULTIPART_BYTERANGES "; boundary=%s", byteranges_boundary);
+    int iov_count = fill_header_iov(iov, &scratch, STATUS_LINE(STATUS_PARTIAL_CONTENT), content_type, content_length, file_headers);
+    ssize_t sent = send_iov_all(client_fd, iov, iov_count, MSG_MORE);
+    for (int i = 0; i < range_count && sent != -1; i++) {
+        struct iovec part = { part_headers[i], part_headers_length[i] };
+        ssize_t part_sent = send_iov_all(client_fd, &part, 1, MSG_MORE);
+        ssize_t body_sent = part_sent == -1 ? -1 : send_body_range(client_fd, file, ranges[i].first, ranges[i].last - ranges[i].first + 1, MSG_MORE);
+        sent = body_sent == -1 ? -1 : sent + part_sent + body_sent;
+    }
+    if (sent != -1) {
+        ssize_t closing_sent = send_all(client_fd, closing, closing_length);
+        sent = closing_sent == -1 ? -1 : sent + closing_sent;
+    }
+    response_sent(STATUS_LINE(STATUS_PARTIAL_CONTENT), sent, "Sending partial content failed", started_ns);
+}
+
+// None of the requested ranges overlaps the file, Content-Range tells the client its size
+void send_416(int client_fd, size_t size) {
+    uint64_t started_ns = metrics_now_ns();
+    static const char body[] = "Range Not Satisfiable";
+    char content_range[64];
+    snprintf(content_range, sizeof(content_range), "Content-Range: bytes */%zu\r\n", size);
+
+    struct iovec iov[RESPONSE_HEADER_IOVS + 1];
+    struct Header_Scratch scratch;
+    int iov_count = fill_header_iov(iov, &scratch, STATUS_LINE(STATUS_RANGE_NOT_SATISFIABLE), MIME_TEXT_PLAIN, sizeof(body) - 1, content_range);
+    iov[iov_count++] = (struct iovec){ (void *)body, sizeof(body) - 1 };
+    ssize_t sent = send_iov_all(client_fd, iov, iov_count, 0);
+    response_sent(STATUS_LINE(STATUS_RANGE_NOT_SATISFIABLE), sent, "Sending response failed", started_ns);
+}
+
 void send_200(int client_fd, const char *body, const char *content_type, size_t content_length) {
     size_t body_length = 0;
     // Determine body length based on MIME type
@@ -33,47 +578,37 @@ void send_200(int client_fd, const char *body, const char *content_type, size_t
         body_length = content_length;
     }
 
-    struct Response *response = build_response(STATUS_OK, content_type, body_length, body);
-    send_response(response, client_fd);
-    free_response(response);
+    send_response_parts(client_fd, STATUS_LINE(STATUS_OK), content_type, body, body_length);
 }
 
 void send_201(int client_fd, const char *body, const char *content_type, size_t content_length) {
-    struct Response *response = build_response(STATUS_CREATED, content_type, content_length, body);
-    send_response(response, client_fd);
-    free_response(response);
+    send_response_parts(client_fd, STATUS_LINE(STATUS_CREATED), content_type, body, content_length);
 }
 
 void send_400(int client_fd, const char *body, size_t content_length) {
-    struct Response *response = build_response(STATUS_BAD_REQUEST, MIME_TEXT_PLAIN, content_length, body);
-    send_response(response, client_fd);
-    free_response(response);
+    send_response_parts(client_fd, STATUS_LINE(STATUS_BAD_REQUEST), MIME_TEXT_PLAIN, body, content_length);
 }
 
 void send_404(int client_fd) {
-    char message[] = "Resource Not Found";
-    struct Response *response = build_response(STATUS_NOT_FOUND, MIME_TEXT_PLAIN, strlen(message), message);
-    send_response(response, client_fd);
-    free_response(response);
+    send_canned_response(client_fd, CANNED_NOT_FOUND);
+}
+
+void send_413(int client_fd) {
+    send_canned_response(client_fd, CANNED_CONTENT_TOO_LARGE);
 }
 
 void send_500(int client_fd) {
-    char message[] = "Internal Server Error";
-    struct Response *response = build_response(STATUS_INTERNAL_SERVER_ERROR, MIME_TEXT_PLAIN, strlen(message), message);
-    send_response(response, client_fd);
-    free_response(response);
+    send_canned_response(client_fd, CANNED_INTERNAL_SERVER_ERROR);
 }
 
 void send_501(int client_fd) {
-    char message[] = "Not Implemented";
-    struct Response *response = build_response(STATUS_NOT_IMPLEMENTED, MIME_TEXT_PLAIN, strlen(message), message);
-    send_response(response, client_fd);
-    free_response(response);
+    send_canned_response(client_fd, CANNED_NOT_IMPLEMENTED);
+}
+
+void send_503(int client_fd) {
+    send_canned_response(client_fd, CANNED_SERVICE_UNAVAILABLE);
 }
 
 void send_505(int client_fd) {
-    char message[] = "HTTP Version Not Supported";
-    struct Response *response = build_response(STATUS_HTTP_VERSION_NOT_SUPPORTED, MIME_TEXT_PLAIN, strlen(message), message);
-    send_response(response, client_fd);
-    free_response(response);
-}
\ No newline at end of file
+    send_canned_response(client_fd, CANNED_HTTP_VERSION_NOT_SUPPORTED);
+}
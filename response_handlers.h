@@ -3,14 +3,93 @@
 
 #include "includes.h"
 #include "http_helpers.h"
+#include <poll.h>
+#include <sys/uio.h>
 
-void send_response(struct Response *response, int client_fd);
+// How long send_all waits for a non-blocking socket to become writable, without an output queue
+#define SEND_TIMEOUT_MS 10000
+// Buffer size of the read loop used when sendfile() is not available
+#define FILE_CHUNK_SIZE (16 * 1024)
+// iovec entries used by the status line and headers of a response
+#define RESPONSE_HEADER_IOVS 10
+
+// Per-response buffers for the header fragments that are not constant
+struct Header_Scratch {
+    char date[HTTP_DATE_LENGTH];
+    char length[24];
+};
+
+// Room for the Content-Type and Content-Range lines of one multipart/byteranges part
+#define RANGE_PART_HEADERS_SIZE 192
+
+// A file being sent: from data when it is in memory (static cache), from fd otherwise
+struct File_Body {
+    int fd;
+    const char *data;
+    size_t size;
+    const char *content_type;
+    const char *headers; // Extra header lines for the file, e.g. its validators, may be NULL
+};
+
+// Responses that are byte-identical every time, apart from the Date header
+enum Canned_Response_Id {
+    CANNED_HEALTH,
+    CANNED_NOT_FOUND,
+    CANNED_CONTENT_TOO_LARGE,
+    CANNED_INTERNAL_SERVER_ERROR,
+    CANNED_NOT_IMPLEMENTED,
+    CANNED_SERVICE_UNAVAILABLE,
+    CANNED_HTTP_VERSION_NOT_SUPPORTED,
+    CANNED_RESPONSE_COUNT
+};
+
+/*
+    Output a socket did not accept yet, in the order it has to go out. A segment holds either
+    a copy of the data or a range of a file (with its own descriptor), sent with sendfile().
+*/
+struct Output_Segment {
+    struct Output_Segment *next;
+    int file_fd;   // -1 for data
+    off_t offset;  // Into the file, or into data
+    size_t length; // Left to send
+    char data[];
+};
+
+struct Output_Queue {
+    struct Output_Segment *head;
+    struct Output_Segment *tail;
+};
+
+/*
+    Set by the epoll reactors to the queue of the connection they are serving: with it the
+    send functions never wait for the socket, whatever it does not take is queued instead and
+    counted as sent. NULL (the default) makes them wait up to SEND_TIMEOUT_MS.
+*/
+extern __thread struct Output_Queue *deferred_output;
+
+bool output_pending(void);
+ssize_t output_queue_flush(int client_fd, struct Output_Queue *queue);
+void output_queue_clear(struct Output_Queue *queue);
+ssize_t send_all(int client_fd, const void *data, size_t length);
+ssize_t send_iov_all(int client_fd, struct iovec *iov, int iov_count, int flags);
+ssize_t send_file_range(int client_fd, int file_fd, off_t offset, size_t length);
+void send_canned_response(int client_fd, enum Canned_Response_Id id);
+void send_response_parts(int client_fd, const char *status_line, const char *content_type, const void *body, size_t body_length);
+void send_100_continue(int client_fd);
 void send_200(int client_fd, const char *body, const char *content_type, size_t content_length);
+void send_prebuilt_response(int client_fd, const char *headers, size_t headers_length, const void *body, size_t body_length);
+void send_200_file(int client_fd, int file_fd, off_t offset, size_t file_size, const char *content_type, const char *extra_headers);
+void send_304(int client_fd, const struct File_Validators *validators);
+void send_200_body(int client_fd, const struct File_Body *file);
+void send_206(int client_fd, const struct File_Body *file, const struct Byte_Range *ranges, int range_count);
+void send_416(int client_fd, size_t size);
 void send_201(int client_fd, const char *body, const char *content_type, size_t content_length);
 void send_400(int client_fd, const char *body, size_t content_length);
 void send_404(int client_fd);
+void send_413(int client_fd);
 void send_500(int client_fd);
 void send_501(int client_fd);
+void send_503(int client_fd);
 void send_505(int client_fd);
 
 #endif
\ No newline at end of file
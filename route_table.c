@@ -0,0 +1,379 @@
+#include "route_table.h"
+#include "other_helpers.h"
+#include "logger.h"
+
+// Trie as routes are registered, turned into Route_Node by route_table_compile
+struct Build_Node {
+    char *label;                 // Static bytes on the edge into this node
+    size_t label_length;
+    struct Build_Node **children;
+    size_t child_count;
+    struct Build_Node *param;    // {name}
+    struct Build_Node *catch_all; // {name...}
+    char *param_name;
+    Route_Handler handlers[HTTP_METHOD_COUNT];
+    int routes[HTTP_METHOD_COUNT];   // Index of the route of each handler
+};
+
+// Compiled trie node, children of a node are stored next to each other
+struct Route_Node {
+    const char *label;
+    size_t label_length;
+    const char *child_bytes;     // First label byte of every static child
+    const struct Route_Node *children;
+    size_t child_count;
+    const struct Route_Node *param;
+    const struct Route_Node *catch_all;
+    const char *param_name;
+    Route_Handler handlers[HTTP_METHOD_COUNT];
+    int routes[HTTP_METHOD_COUNT];
+};
+
+// Method and pattern of every registered route, by index
+struct Route_Info {
+    enum Http_Method method;
+    const char *pattern;
+};
+
+static const char *method_names[HTTP_METHOD_COUNT] = {
+    [HTTP_GET] = "GET",
+    [HTTP_HEAD] = "HEAD",
+    [HTTP_POST] = "POST",
+    [HTTP_PUT] = "PUT",
+    [HTTP_DELETE] = "DELETE",
+    [HTTP_PATCH] = "PATCH",
+    [HTTP_OPTIONS] = "OPTIONS",
+};
+
+static struct Build_Node *build_root;
+static struct Route_Info *routes;     // Grown as routes are registered
+static int routes_capacity = 0;
+static int routes_registered = 0;
+static bool method_routed[HTTP_METHOD_COUNT];
+static struct Route_Node *route_nodes; // route_nodes[0] is the root
+static bool routes_compiled = false;
+
+enum Http_Method http_method_from(struct Str_View method) {
+    for (int i = 0; i < HTTP_METHOD_COUNT; i++) {
+        if (str_view_equals(method, method_names[i])) {
+            return i;
+        }
+    }
+    return HTTP_METHOD_UNKNOWN;
+}
+
+const char *http_method_name(enum Http_Method method) {
+    return method >= 0 && method < HTTP_METHOD_COUNT ? method_names[method] : "OTHER";
+}
+
+static struct Build_Node *build_node_create(const char *label, size_t label_length) {
+    struct Build_Node *node = calloc(1, sizeof(struct Build_Node));
+    if (node == NULL) {
+        return NULL;
+    }
+    node->label = strndup(label, label_length);
+    if (node->label == NULL) {
+        free(node);
+        return NULL;
+    }
+    node->label_length = label_length;
+    return node;
+}
+
+static bool add_child(struct Build_Node *node, struct Build_Node *child) {
+    struct Build_Node **children = realloc(node->children, (node->child_count + 1) * sizeof(struct Build_Node *));
+    if (children == NULL) {
+        return false;
+    }
+    node->children = children;
+    node->children[node->child_count++] = child;
+    return true;
+}
+
+/*
+    Walks down from node along the static bytes of a pattern, splitting edges where the
+    pattern diverges from them, and returns the node the bytes end at.
+*/
+static struct Build_Node *insert_static(struct Build_Node *node, const char *bytes, size_t length) {
+    while (length > 0) {
+        struct Build_Node *child = NULL;
+        size_t child_index = 0;
+        for (; child_index < node->child_count; child_index++) {
+            if (node->children[child_index]->label[0] == bytes[0]) {
+                child = node->children[child_index];
+                break;
+            }
+        }
+        if (child == NULL) {
+            child = build_node_create(bytes, length);
+            if (child == NULL || !add_child(node, child)) {
+                return NULL;
+            }
+            return child;
+        }
+
+        size_t common = 0;
+        while (common < child->label_length && common < length && child->label[common] == bytes[common]) {
+            common++;
+        }
+        if (common < child->label_length) {
+            // Split the edge: node -> middle (common part) -> child (rest of its label)
+            struct Build_Node *middle = build_node_create(child->label, common);
+            if (middle == NULL || !add_child(middle, child)) {
+                return NULL;
+            }
+            memmove(child->label, child->label + common, child->label_length - common + 1);
+            child->label_length -= common;
+            node->children[child_index] = middle;
+            child = middle;
+        }
+        node = child;
+        bytes += common;
+        length -= common;
+    }
+    return node;
+}
+
+static struct Build_Node *insert_param(struct Build_Node **slot, const char *name, size_t name_length) {
+    if (*slot == NULL) {
+        *slot = build_node_create("", 0);
+        if (*slot == NULL) {
+            return NULL;
+        }
+        (*slot)->param_name = strndup(name, name_length);
+    } else if (strlen((*slot)->param_name) != name_length || strncmp((*slot)->param_name, name, name_length) != 0) {
+        log_warn("Route parameter {%.*s} conflicts with {%s} at the same position", (int)name_length, name, (*slot)->param_name);
+        return NULL;
+    }
+    return *slot;
+}
+
+/*
+    Registers handler for method and pattern. Must be called before route_table_compile.
+    Returns false if the pattern is invalid or the route already exists.
+*/
+bool route_register(const char *method, const char *pattern, Route_Handler handler) {
+    struct Str_View method_view = { .data = method, .length = strlen(method) };
+    enum Http_Method method_id = http_method_from(method_view);
+    if (routes_compiled || method_id == HTTP_METHOD_UNKNOWN || pattern[0] != '/') {
+        log_error("Invalid route: %s %s", method, pattern);
+        return false;
+    }
+    if (build_root == NULL && (build_root = build_node_create("", 0)) == NULL) {
+        return false;
+    }
+
+    struct Build_Node *node = build_root;
+    const char *cursor = pattern;
+    while (node != NULL && *cursor != '\0') {
+        const char *open = strchr(cursor, '{');
+        size_t static_length = open ? (size_t)(open - cursor) : strlen(cursor);
+        if (static_length > 0) {
+            node = insert_static(node, cursor, static_length);
+            cursor += static_length;
+            continue;
+        }
+
+        const char *close = strchr(open, '}');
+        if (close == NULL || close == open + 1) {
+            node = NULL;
+            break;
+        }
+        const char *name = open + 1;
+        size_t name_length = close - name;
+        if (name_length > 3 && strncmp(close - 3, "...", 3) == 0) {
+            // The rest of the path, so it has to end the pattern
+            node = close[1] == '\0' ? insert_param(&node->catch_all, name, name_length - 3) : NULL;
+        } else if (close[1] == '\0' || close[1] == '/') {
+            node = insert_param(&node->param, name, name_length);
+        } else {
+            node = NULL; // A parameter has to span a whole segment
+        }
+        cursor = close + 1;
+    }
+
+    if (node == NULL || node->handlers[method_id] != NULL) {
+        log_error("Invalid or duplicate route: %s %s", method, pattern);
+        return false;
+    }
+    if (routes_registered == routes_capacity) {
+        int capacity = routes_capacity ? routes_capacity * 2 : 8;
+        struct Route_Info *grown = realloc(routes, capacity * sizeof(struct Route_Info));
+        if (grown == NULL) {
+            return false;
+        }
+        routes = grown;
+        routes_capacity = capacity;
+    }
+    char *pattern_copy = strdup(pattern);
+    if (pattern_copy == NULL) {
+        return false;
+    }
+    node->handlers[method_id] = handler;
+    node->routes[method_id] = routes_registered;
+    routes[routes_registered].method = method_id;
+    routes[routes_registered].pattern = pattern_copy;
+    routes_registered++;
+    method_routed[method_id] = true;
+    return true;
+}
+
+static size_t count_nodes(const struct Build_Node *node) {
+    if (node == NULL) {
+        return 0;
+    }
+    size_t count = 1 + count_nodes(node->param) + count_nodes(node->catch_all);
+    for (size_t i = 0; i < node->child_count; i++) {
+        count += count_nodes(node->children[i]);
+    }
+    return count;
+}
+
+/*
+    Lays the trie out in one array, breadth first, so the static children of every node are
+    contiguous. The build tree is released, its strings now belong to the compiled nodes.
+*/
+bool route_table_compile(void) {
+    if (build_root == NULL && (build_root = build_node_create("", 0)) == NULL) {
+        return false;
+    }
+    size_t node_count = count_nodes(build_root);
+    struct Build_Node **order = malloc(node_count * sizeof(struct Build_Node *));
+    route_nodes = calloc(node_count, sizeof(struct Route_Node));
+    char *child_bytes = malloc(node_count);
+    if (order == NULL || route_nodes == NULL || child_bytes == NULL) {
+        free(order);
+        free(child_bytes);
+        return false;
+    }
+
+    size_t placed = 0;
+    order[placed++] = build_root;
+    for (size_t i = 0; i < node_count; i++) {
+        struct Build_Node *node = order[i];
+        struct Route_Node *compiled = &route_nodes[i];
+        compiled->label = node->label;
+        compiled->label_length = node->label_length;
+        compiled->param_name = node->param_name;
+        memcpy(compiled->handlers, node->handlers, sizeof(compiled->handlers));
+        memcpy(compiled->routes, node->routes, sizeof(compiled->routes));
+
+        compiled->children = &route_nodes[placed];
+        compiled->child_bytes = &child_bytes[placed];
+        compiled->child_count = node->child_count;
+        for (size_t c = 0; c < node->child_count; c++) {
+            child_bytes[placed] = node->children[c]->label[0];
+            order[placed++] = node->children[c];
+        }
+        if (node->param != NULL) {
+            compiled->param = &route_nodes[placed];
+            order[placed++] = node->param;
+        }
+        if (node->catch_all != NULL) {
+            compiled->catch_all = &route_nodes[placed];
+            order[placed++] = node->catch_all;
+        }
+        free(node->children);
+    }
+    for (size_t i = 0; i < node_count; i++) {
+        free(order[i]);
+    }
+    free(order);
+    build_root = NULL;
+    routes_compiled = true;
+    return true;
+}
+
+static bool push_param(struct Route_Params *params, const char *name, const char *value, size_t length) {
+    if (params->count == ROUTE_MAX_PARAMS) {
+        return false;
+    }
+    params->items[params->count].name = name;
+    params->items[params->count].value.data = value;
+    params->items[params->count].value.length = length;
+    params->count++;
+    return true;
+}
+
+// Matches the rest of the path below node, static children first, then {name}, then {name...}
+static const struct Route_Node *match_node(const struct Route_Node *node, const char *path, size_t length, enum Http_Method method, struct Route_Params *params) {
+    if (length == 0 && node->handlers[method] != NULL) {
+        return node;
+    }
+
+    if (length > 0 && node->child_count > 0) {
+        const char *byte = memchr(node->child_bytes, path[0], node->child_count);
+        if (byte != NULL) {
+            const struct Route_Node *child = &node->children[byte - node->child_bytes];
+            if (length >= child->label_length && memcmp(path, child->label, child->label_length) == 0) {
+                const struct Route_Node *found = match_node(child, path + child->label_length, length - child->label_length, method, params);
+                if (found != NULL) {
+                    return found;
+                }
+            }
+        }
+    }
+
+    if (node->param != NULL && length > 0) {
+        const char *slash = memchr(path, '/', length);
+        size_t segment_length = slash ? (size_t)(slash - path) : length;
+        if (segment_length > 0 && push_param(params, node->param->param_name, path, segment_length)) {
+            const struct Route_Node *found = match_node(node->param, path + segment_length, length - segment_length, method, params);
+            if (found != NULL) {
+                return found;
+            }
+            params->count--;
+        }
+    }
+
+    if (node->catch_all != NULL && node->catch_all->handlers[method] != NULL &&
+        push_param(params, node->catch_all->param_name, path, length)) {
+        return node->catch_all;
+    }
+    return NULL;
+}
+
+/*
+    Finds the handler for a request. The query string is not part of the match. On
+    ROUTE_FOUND *handler is set and params holds the captured path parameters.
+*/
+enum Route_Match route_table_match(struct Str_View method, struct Str_View uri, Route_Handler *handler, struct Route_Params *params) {
+    params->route = ROUTE_NONE;
+    params->count = 0;
+    enum Http_Method method_id = http_method_from(method);
+    if (method_id == HTTP_METHOD_UNKNOWN || !method_routed[method_id] || !routes_compiled) {
+        return ROUTE_METHOD_UNSUPPORTED;
+    }
+
+    const char *query = memchr(uri.data, '?', uri.length);
+    size_t path_length = query ? (size_t)(query - uri.data) : uri.length;
+    const struct Route_Node *node = match_node(&route_nodes[0], uri.data, path_length, method_id, params);
+    if (node == NULL) {
+        return ROUTE_NOT_FOUND;
+    }
+    *handler = node->handlers[method_id];
+    params->route = node->routes[method_id];
+    return ROUTE_FOUND;
+}
+
+// Value of a captured path parameter, empty if there is none with that name
+struct Str_View route_param(const struct Route_Params *params, const char *name) {
+    for (int i = 0; i < params->count; i++) {
+        if (strcmp(params->items[i].name, name) == 0) {
+            return params->items[i].value;
+        }
+    }
+    return (struct Str_View){ .data = NULL, .length = 0 };
+}
+
+int route_count(void) {
+    return routes_registered;
+}
+
+enum Http_Method route_method(int route) {
+    return routes[route].method;
+}
+
+const char *route_pattern(int route) {
+    return routes[route].pattern;
+}
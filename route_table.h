@@ -0,0 +1,69 @@
+#ifndef ROUTE_TABLE_H
+#define ROUTE_TABLE_H
+
+#include "includes.h"
+
+/*
+    Request routing. Handlers are registered at startup for a method and a path pattern:
+        "/health"          static path
+        "/post/{id}"       {name} captures one path segment
+        "/{path...}"       {name...} captures the rest of the path, possibly empty, and must come last
+    route_table_compile() turns the patterns into a radix trie stored in one flat array. It is
+    never changed afterwards, so dispatch needs no locks, and its cost depends on the length of
+    the path, not on the number of routes. Static segments win over {name}, which wins over
+    {name...}.
+*/
+
+#define ROUTE_MAX_PARAMS 4
+// Index of a request that matched no route
+#define ROUTE_NONE -1
+
+enum Http_Method {
+    HTTP_GET,
+    HTTP_HEAD,
+    HTTP_POST,
+    HTTP_PUT,
+    HTTP_DELETE,
+    HTTP_PATCH,
+    HTTP_OPTIONS,
+    HTTP_METHOD_COUNT,
+    HTTP_METHOD_UNKNOWN = -1
+};
+
+struct Route_Param {
+    const char *name;
+    struct Str_View value; // Points into the request URI
+};
+
+struct Route_Params {
+    int route;             // Index of the matched route, ROUTE_NONE if there is none
+    int count;
+    struct Route_Param items[ROUTE_MAX_PARAMS];
+};
+
+struct Body_Sink;
+
+/*
+    Handles a request once its headers have arrived. Returns the sink that will receive the
+    body, or NULL if the request has been answered.
+*/
+typedef struct Body_Sink *(*Route_Handler)(struct Req_Headers *req_headers, const struct Route_Params *params, int client_fd);
+
+// Result of route_table_match
+enum Route_Match {
+    ROUTE_FOUND,
+    ROUTE_NOT_FOUND,          // No route for this method and path
+    ROUTE_METHOD_UNSUPPORTED  // No route at all for this method
+};
+
+enum Http_Method http_method_from(struct Str_View method);
+const char *http_method_name(enum Http_Method method);
+bool route_register(const char *method, const char *pattern, Route_Handler handler);
+bool route_table_compile(void);
+enum Route_Match route_table_match(struct Str_View method, struct Str_View uri, Route_Handler *handler, struct Route_Params *params);
+struct Str_View route_param(const struct Route_Params *params, const char *name);
+int route_count(void);
+enum Http_Method route_method(int route);
+const char *route_pattern(int route);
+
+#endif
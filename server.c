@@ -1,119 +1,28 @@
 #include <netinet/in.h>
-#include <netinet/ip.h>
-#include <arpa/inet.h>
 #include <pthread.h>
+#include <signal.h>
 #include "server_handlers.h"
+#include "server_config.h"
+#include "event_loop.h"
+#include "thread_pool.h"
+#include "net_helpers.h"
+#include "buffer_pool.h"
+#include "static_cache.h"
+#include "compress_cache.h"
+#include "upload_writer.h"
+#include "upload_store.h"
+#include "logger.h"
+#include "metrics.h"
+#include "trace.h"
 
-int main(int argc, char **argv)
+// Accepts connections on server_fd forever, handling each one on its own detached thread
+static void *run_thread_per_connection(void *arg)
 {
-	printf("args count: %d\n", argc);
-	if (argc < 2) {
-		printf("Missing argument, please provide the port number");
-		exit(EXIT_FAILURE);
-	}
-	
-	const char *portAsChar = argv[1];
-	const int PORT = atoi(portAsChar);
-	if (PORT <= 0 || PORT > 65535) {
-		printf("Invalid port number: %s\n", portAsChar);
-		exit(EXIT_FAILURE);
-	}
-
-	setbuf(stdout, NULL);
-	printf("Starting server...\n");
-
-	/*
-		sockaddr_in : https://man7.org/linux/man-pages/man3/sockaddr.3type.html
-		sin_family  : Address family (AF_INET for IPv4) (AF_INET6 for IPv6)
-		sin_port    : Port number
-		sin_addr    : IP address
-
-		htons       : https://man7.org/linux/man-pages/man3/htons.3p.html
-		Converts unsigned short integer (16-bit) from host byte order to network byte order.
-
-		htonl       : https://man7.org/linux/man-pages/man3/htonl.3p.html
-		Converts unsigned long integer (32-bit) from host byte order to network byte order.
-
-		The htons function converts a 16-bit unsigned integer (short) from host byte order to network byte order. 
-		Network byte order is always big-endian. This ensures a consistent interpretation across different systems.
-		Similarly, the htonl function converts a 32-bit unsigned integer (long) from host byte order to network byte order.
-
-		INADDR_ANY is a special address constant used to indicate that a socket should bind to all network interfaces on a machine. 
-		When a server application binds to INADDR_ANY, it can accept connections and receive data from any IP address that the computer has, including its loopback address 127.0.0.1
-	*/
-	struct sockaddr_in serv_addr = {
-		.sin_family = AF_INET,			
-		.sin_port = htons(PORT),		 
-		.sin_addr = {htonl(INADDR_ANY)}, 
-	};
-
-	/*
-		socket     : https://man7.org/linux/man-pages/man2/socket.2.html
-		argument 1 : domain   --> AF_INET for IPv4
-		argument 2 : type     --> SOCK_STREAM for bidirectional stream
-		argument 3 : protocol --> 0 to select default protocol for given domain and type (TCP for AF_INET and SOCK_STREAM)
-		returns    : file descriptor for the server socket or -1 on error
-	*/
-	int server_fd = socket(AF_INET, SOCK_STREAM, 0); 
-	if (server_fd == -1)
-	{
-		perror("Socket creation failed");
-		exit(EXIT_FAILURE);
-	}
-
-	/*
-		setsockopt : https://man7.org/linux/man-pages/man3/setsockopt.3p.html
-		argument 1 : file descriptor for locating the socket
-		argument 2 : level  --> SOL_SOCKET to manipulate options at the sockets API level
-		argument 3 : option --> SO_REUSEADDR to allow reuse of local addresses
-		argument 4 : pointer to option value
-		argument 5 : size of the option value
-		returns    : 0 on success, -1 on error
-	*/
-	int reuse = 1;
-	if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0)
-	{
-		perror("SO_REUSEADDR failed");
-		exit(EXIT_FAILURE);
-	}
-
-	/*
-		bind : https://man7.org/linux/man-pages/man2/bind.2.html
-		argument 1 : server_fd  --->  file descriptor of the socket to be bound
-		argument 2 : serv_addr  --->  pointer to the sockaddr structure (casted from sockaddr_in to sockaddr)
-		argument 3 : size of the sockaddr structure
-		returns    : 0 on success, -1 on error
-
-		assigns a name to a socket identified by socket file descriptor
-	*/
-	if (bind(server_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) != 0)
-	{
-		perror("Bind failed");
-		exit(EXIT_FAILURE);
-	}
-
-	// Maximum length of the queue of pending connections
-	int connection_backlog = 5; 
-
-	/*
-		listen : https://man7.org/linux/man-pages/man2/listen.2.html
-		argument 1 : server_fd           --->  file descriptor of the socket to be marked as a passive socket
-		argument 2 : connection_backlog  --->  maximum length of the queue of pending connections
-		returns    : 0 on success, -1 on error
-
-		a passive socket is will be used to accept incoming connections
-		connection_backlog defines the maximum length to which the queue of pending connections for sockfd may grow
-	*/
-	if (listen(server_fd, connection_backlog) != 0)
-	{
-		perror("Listen failed");
-		exit(EXIT_FAILURE);
-	}
-	printf("Server is listening on PORT %d...\n", PORT);
+	int server_fd = *((int *)arg);
 
 	while (1)
 	{
-		printf("Waiting for a new connection...\n");
+		log_debug("Waiting for a new connection...");
 		struct sockaddr_in client_addr; // Stores the client address
 		socklen_t cl_addr_len = sizeof(client_addr);
 
@@ -136,10 +45,10 @@ int main(int argc, char **argv)
 
 		if (*client_fd == -1)
 		{
-			perror("Failed to connect to client");
+			log_errno("Failed to connect to client");
 			free(client_fd); // Free the malloc'd pointer on error
 		} else {
-			printf("Client connected: %d\n", *client_fd);
+			log_debug("Client connected: %d", *client_fd);
 			
 			pthread_t thread_pid;
 			/*
@@ -149,7 +58,7 @@ int main(int argc, char **argv)
 			*/
 			int thread_result = pthread_create(&thread_pid, NULL, handle_connection, (void *)client_fd);
 			if (thread_result != 0) {
-				perror("Failed to create thread");
+				log_errno("Failed to create thread");
 				close(*client_fd);
 				free(client_fd); // Free the malloc'd pointer on pthread_create error
 			} else {
@@ -158,8 +67,195 @@ int main(int argc, char **argv)
 			}	
 		}
 	}
+	return NULL;
+}
+
+/*
+	Runs one thread-per-connection accept loop for each listener. Connection threads inherit
+	the CPU affinity of the accept loop that spawned them, so with cpu_affinity every shard
+	serves its connections on its own core.
+*/
+static void run_sharded_accept_loops(int *server_fds, int listener_count, bool cpu_affinity)
+{
+	if (listener_count == 1 && !cpu_affinity) {
+		run_thread_per_connection(&server_fds[0]);
+		return;
+	}
+
+	pthread_t *acceptors = malloc(listener_count * sizeof(pthread_t));
+	if (acceptors == NULL) {
+		log_errno("Failed to allocate accept loops");
+		return;
+	}
+
+	int started = 0;
+	for (int i = 0; i < listener_count; i++) {
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if (cpu_affinity) {
+			thread_attr_set_cpu(&attr, i);
+		}
+		int thread_result = pthread_create(&acceptors[i], &attr, run_thread_per_connection, &server_fds[i]);
+		pthread_attr_destroy(&attr);
+		if (thread_result != 0) {
+			log_errno("Failed to create accept loop thread");
+			break;
+		}
+		started++;
+	}
+
+	for (int i = 0; i < started; i++) {
+		pthread_join(acceptors[i], NULL);
+	}
+	free(acceptors);
+}
+
+static sigset_t report_signals;
+
+/*
+	Prints runtime statistics whenever the process receives SIGUSR1 and writes the request
+	trace to a file on SIGUSR2. SIGTERM and SIGINT exit through here too, so the log lines
+	still queued are written before the process ends.
+*/
+static void *report_signal_thread(void *arg)
+{
+	(void)arg;
+	while (1) {
+		int signal_number;
+		if (sigwait(&report_signals, &signal_number) != 0) {
+			continue;
+		}
+		if (signal_number == SIGTERM || signal_number == SIGINT) {
+			log_info("Shutting down server...");
+			exit(EXIT_SUCCESS);
+		}
+		if (signal_number == SIGUSR1) {
+			buffer_pool_report();
+			static_cache_report();
+			compress_cache_report();
+			upload_writer_report();
+			upload_store_report();
+			log_report();
+		}
+		if (signal_number == SIGUSR2) {
+			char path[64];
+			if (!trace_enabled()) {
+				log_info("Tracing is off, start the server with --trace-sample N");
+			} else if (trace_dump_file(path, sizeof(path))) {
+				log_info("Trace written to %s", path);
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+	Report signals are blocked before any other thread is created, so every thread inherits
+	the mask and only the dedicated thread receives them through sigwait. That way the
+	report runs as normal code and can take locks, which a signal handler could not.
+*/
+static void start_report_thread(void)
+{
+	sigemptyset(&report_signals);
+	sigaddset(&report_signals, SIGUSR1);
+	sigaddset(&report_signals, SIGUSR2);
+	sigaddset(&report_signals, SIGTERM);
+	sigaddset(&report_signals, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &report_signals, NULL);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, report_signal_thread, NULL) != 0) {
+		log_errno("Failed to create report thread");
+		return;
+	}
+	pthread_detach(thread);
+}
 
-	printf("Shutting down server...\n");
-	close(server_fd);
+int main(int argc, char **argv)
+{
+	log_debug("args count: %d", argc);
+	if (parse_server_config(argc, argv, &server_config) != 0) {
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	const int PORT = server_config.port;
+
+	if (!log_start(server_config.log_level)) {
+		log_error("Failed to start the log thread");
+		exit(EXIT_FAILURE);
+	}
+	trace_init(server_config.trace_sample);
+	log_info("Starting server...");
+
+	int listener_count = server_config.shards;
+	int *server_fds = malloc(listener_count * sizeof(int));
+	if (server_fds == NULL) {
+		log_errno("Failed to allocate listeners");
+		exit(EXIT_FAILURE);
+	}
+
+	// With more than one shard every listener joins the same SO_REUSEPORT group
+	bool reuseport = listener_count > 1;
+	for (int i = 0; i < listener_count; i++) {
+		server_fds[i] = create_listener(PORT, server_config.backlog, reuseport);
+		if (server_fds[i] == -1) {
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (reuseport && server_config.cpu_affinity) {
+		attach_reuseport_cbpf(server_fds[0], listener_count);
+	}
+	log_info("Server is listening on PORT %d with %d listener(s), backlog %d...", PORT, listener_count, server_config.backlog);
+
+	/*
+		Writing to a socket whose peer already closed the connection raises SIGPIPE,
+		which would terminate the whole server. Ignore it and handle EPIPE instead.
+	*/
+	signal(SIGPIPE, SIG_IGN);
+	start_report_thread();
+
+	if (static_cache_init((size_t)server_config.cache_size_mb * 1024 * 1024)) {
+		static_cache_watch(HTML_DIR);
+		log_info("Static file cache enabled with %d MB", server_config.cache_size_mb);
+	}
+	if (compress_cache_init((size_t)server_config.compress_cache_size_mb * 1024 * 1024)) {
+		log_info("Compression cache enabled with %d MB", server_config.compress_cache_size_mb);
+	}
+	size_t segment_size = (size_t)server_config.segment_size_mb * 1024 * 1024;
+	if (!upload_store_open(UPLOAD_STORE_DIR, segment_size, (size_t)server_config.retention_mb * 1024 * 1024)) {
+		log_error("Failed to open the upload store");
+		exit(EXIT_FAILURE);
+	}
+	if (!upload_writer_start(server_config.durability, server_config.sync_interval_ms)) {
+		log_error("Failed to start the upload writer");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!register_routes()) {
+		log_error("Failed to register routes");
+		exit(EXIT_FAILURE);
+	}
+	if (!metrics_init()) {
+		log_error("Failed to allocate the request metrics");
+		exit(EXIT_FAILURE);
+	}
+
+	if (server_config.mode == MODE_EPOLL) {
+		if (run_event_loop(server_fds, listener_count, server_config.event_threads, server_config.cpu_affinity) != 0) {
+			log_error("Failed to start the event loop");
+		}
+	} else if (server_config.mode == MODE_POOL) {
+		if (run_thread_pool(server_fds, listener_count, server_config.workers, server_config.queue_depth) != 0) {
+			log_error("Failed to start the thread pool");
+		}
+	} else {
+		run_sharded_accept_loops(server_fds, listener_count, server_config.cpu_affinity);
+	}
+
+	log_info("Shutting down server...");
+	for (int i = 0; i < listener_count; i++) {
+		close(server_fds[i]);
+	}
+	free(server_fds);
 	return 0;
 }
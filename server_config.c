@@ -0,0 +1,272 @@
+#include <getopt.h>
+#include "server_config.h"
+#include "thread_pool.h"
+
+struct Server_Config server_config = {
+    .port = 0,
+    .mode = MODE_THREAD,
+    .event_threads = 0,
+    .workers = 0,
+    .queue_depth = DEFAULT_QUEUE_DEPTH,
+    .shards = 1,
+    .backlog = SOMAXCONN,
+    .cpu_affinity = false,
+    .keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT,
+    .max_requests = DEFAULT_MAX_REQUESTS,
+    .cache_size_mb = DEFAULT_CACHE_SIZE_MB,
+    .compress_cache_size_mb = DEFAULT_COMPRESS_CACHE_SIZE_MB,
+    .max_body_size_mb = DEFAULT_MAX_BODY_SIZE_MB,
+    .durability = DURABILITY_NONE,
+    .sync_interval_ms = DEFAULT_SYNC_INTERVAL_MS,
+    .segment_size_mb = DEFAULT_SEGMENT_SIZE_MB,
+    .retention_mb = 0,
+    .log_level = LOG_LEVEL_INFO,
+    .trace_sample = 0,
+};
+
+void print_usage(const char *program_name) {
+    printf("Usage: %s {port number} [options]\n", program_name);
+    printf("  --mode thread|epoll|pool  connection handling model (default: thread)\n");
+    printf("  --threads N               number of epoll reactor threads (default: online CPUs)\n");
+    printf("  --workers N               number of worker threads in pool mode (default: online CPUs)\n");
+    printf("  --queue-depth N           per-worker queue capacity in pool mode (default: %d)\n", DEFAULT_QUEUE_DEPTH);
+    printf("  --shards N                number of SO_REUSEPORT listening sockets, one accept loop each (default: 1)\n");
+    printf("  --backlog N               listen backlog of each listening socket (default: %d)\n", SOMAXCONN);
+    printf("  --cpu-affinity            pin each accept loop to a CPU and steer connections by CPU\n");
+    printf("  --keepalive-timeout S     seconds an idle persistent connection stays open (default: %d)\n", DEFAULT_KEEPALIVE_TIMEOUT);
+    printf("  --max-requests N          requests served per connection before closing it (default: %d)\n", DEFAULT_MAX_REQUESTS);
+    printf("  --max-body-size MB        largest request body accepted, bigger ones get 413 (default: %d)\n", DEFAULT_MAX_BODY_SIZE_MB);
+    printf("  --durability none|batch|interval  when uploads are acknowledged: once written, once fdatasync()ed,\n");
+    printf("                            or once written with fdatasync() every sync interval (default: none)\n");
+    printf("  --sync-interval MS        milliseconds between syncs with --durability interval (default: %d)\n", DEFAULT_SYNC_INTERVAL_MS);
+    printf("  --segment-size MB         size at which upload store segments are rotated (default: %d)\n", DEFAULT_SEGMENT_SIZE_MB);
+    printf("  --retention MB            delete the oldest upload segments above this total size, 0 keeps all (default: 0)\n");
+    printf("  --cache-size MB           memory budget of the static file cache, 0 disables it (default: %d)\n", DEFAULT_CACHE_SIZE_MB);
+    printf("  --compress-cache-size MB  memory budget of the compressed variants of text files, 0 only serves .gz/.br files (default: %d)\n", DEFAULT_COMPRESS_CACHE_SIZE_MB);
+    printf("  --cache-control EXT=VALUE Cache-Control sent with files ending in .EXT, * for any other type;\n");
+    printf("                            may be repeated (default: no-cache for pages, max-age for assets)\n");
+    printf("  --log-level LEVEL         debug|info|warn|error|off, info and below log every request (default: info)\n");
+    printf("  --trace-sample N          trace one request in N, served on GET /debug/trace and dumped on SIGUSR2;\n");
+    printf("                            0 turns tracing off (default: 0)\n");
+}
+
+static int parse_positive_int(const char *value, const char *option_name) {
+    char *end = NULL;
+    long parsed = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || parsed <= 0 || parsed > 1024 * 1024) {
+        printf("Invalid value for %s: %s\n", option_name, value);
+        return -1;
+    }
+    return (int)parsed;
+}
+
+/*
+    Parses the command line: the first positional argument is the port number,
+    everything else is an optional --flag. Returns 0 on success, -1 on error.
+*/
+int parse_server_config(int argc, char **argv, struct Server_Config *config) {
+    static const struct option long_options[] = {
+        {"mode", required_argument, NULL, 'm'},
+        {"threads", required_argument, NULL, 't'},
+        {"workers", required_argument, NULL, 'w'},
+        {"queue-depth", required_argument, NULL, 'q'},
+        {"shards", required_argument, NULL, 's'},
+        {"backlog", required_argument, NULL, 'b'},
+        {"cpu-affinity", no_argument, NULL, 'a'},
+        {"keepalive-timeout", required_argument, NULL, 'k'},
+        {"max-requests", required_argument, NULL, 'r'},
+        {"cache-size", required_argument, NULL, 'c'},
+        {"cache-control", required_argument, NULL, 'C'},
+        {"compress-cache-size", required_argument, NULL, 'Z'},
+        {"max-body-size", required_argument, NULL, 'B'},
+        {"durability", required_argument, NULL, 'D'},
+        {"sync-interval", required_argument, NULL, 'I'},
+        {"segment-size", required_argument, NULL, 'S'},
+        {"retention", required_argument, NULL, 'R'},
+        {"log-level", required_argument, NULL, 'L'},
+        {"trace-sample", required_argument, NULL, 'T'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "m:t:w:q:s:b:ak:r:c:C:Z:B:D:I:S:R:L:T:h", long_options, NULL)) != -1) {
+        switch (option) {
+            case 'm':
+                if (strcmp(optarg, "thread") == 0) {
+                    config->mode = MODE_THREAD;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    config->mode = MODE_EPOLL;
+                } else if (strcmp(optarg, "pool") == 0) {
+                    config->mode = MODE_POOL;
+                } else {
+                    printf("Invalid mode: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 't':
+                config->event_threads = parse_positive_int(optarg, "--threads");
+                if (config->event_threads == -1) {
+                    return -1;
+                }
+                break;
+            case 'w':
+                config->workers = parse_positive_int(optarg, "--workers");
+                if (config->workers == -1) {
+                    return -1;
+                }
+                break;
+            case 'q':
+                config->queue_depth = parse_positive_int(optarg, "--queue-depth");
+                if (config->queue_depth == -1) {
+                    return -1;
+                }
+                break;
+            case 's':
+                config->shards = parse_positive_int(optarg, "--shards");
+                if (config->shards == -1) {
+                    return -1;
+                }
+                break;
+            case 'b':
+                config->backlog = parse_positive_int(optarg, "--backlog");
+                if (config->backlog == -1) {
+                    return -1;
+                }
+                break;
+            case 'a':
+                config->cpu_affinity = true;
+                break;
+            case 'k':
+                config->keepalive_timeout = parse_positive_int(optarg, "--keepalive-timeout");
+                if (config->keepalive_timeout == -1) {
+                    return -1;
+                }
+                break;
+            case 'r':
+                config->max_requests = parse_positive_int(optarg, "--max-requests");
+                if (config->max_requests == -1) {
+                    return -1;
+                }
+                break;
+            case 'c':
+                // 0 is allowed here, it turns the cache off
+                if (strcmp(optarg, "0") == 0) {
+                    config->cache_size_mb = 0;
+                    break;
+                }
+                config->cache_size_mb = parse_positive_int(optarg, "--cache-size");
+                if (config->cache_size_mb == -1) {
+                    return -1;
+                }
+                break;
+            case 'C':
+                if (!set_file_cache_control(optarg)) {
+                    printf("Invalid value for --cache-control: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'Z':
+                // 0 is allowed here, it turns compression on the fly off
+                if (strcmp(optarg, "0") == 0) {
+                    config->compress_cache_size_mb = 0;
+                    break;
+                }
+                config->compress_cache_size_mb = parse_positive_int(optarg, "--compress-cache-size");
+                if (config->compress_cache_size_mb == -1) {
+                    return -1;
+                }
+                break;
+            case 'B':
+                config->max_body_size_mb = parse_positive_int(optarg, "--max-body-size");
+                if (config->max_body_size_mb == -1) {
+                    return -1;
+                }
+                break;
+            case 'D':
+                if (strcmp(optarg, "none") == 0) {
+                    config->durability = DURABILITY_NONE;
+                } else if (strcmp(optarg, "batch") == 0) {
+                    config->durability = DURABILITY_BATCH;
+                } else if (strcmp(optarg, "interval") == 0) {
+                    config->durability = DURABILITY_INTERVAL;
+                } else {
+                    printf("Invalid durability: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'I':
+                config->sync_interval_ms = parse_positive_int(optarg, "--sync-interval");
+                if (config->sync_interval_ms == -1) {
+                    return -1;
+                }
+                break;
+            case 'S':
+                config->segment_size_mb = parse_positive_int(optarg, "--segment-size");
+                if (config->segment_size_mb == -1) {
+                    return -1;
+                }
+                break;
+            case 'R':
+                // 0 is allowed here, it keeps every upload
+                if (strcmp(optarg, "0") == 0) {
+                    config->retention_mb = 0;
+                    break;
+                }
+                config->retention_mb = parse_positive_int(optarg, "--retention");
+                if (config->retention_mb == -1) {
+                    return -1;
+                }
+                break;
+            case 'L':
+                if (!log_level_from(optarg, &config->log_level)) {
+                    printf("Invalid log level: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'T':
+                // 0 is allowed here, it turns tracing off
+                if (strcmp(optarg, "0") == 0) {
+                    config->trace_sample = 0;
+                    break;
+                }
+                config->trace_sample = parse_positive_int(optarg, "--trace-sample");
+                if (config->trace_sample == -1) {
+                    return -1;
+                }
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    if (optind >= argc) {
+        printf("Missing argument, please provide the port number\n");
+        return -1;
+    }
+
+    const char *portAsChar = argv[optind];
+    config->port = atoi(portAsChar);
+    if (config->port <= 0 || config->port > 65535) {
+        printf("Invalid port number: %s\n", portAsChar);
+        return -1;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus <= 0) {
+        cpus = 1;
+    }
+    if (config->event_threads == 0) {
+        config->event_threads = (int)cpus;
+    }
+    if (config->workers == 0) {
+        config->workers = (int)cpus;
+    }
+    // Every listening socket needs a reactor: the kernel spreads connections over all of them
+    if (config->mode == MODE_EPOLL && config->shards > config->event_threads) {
+        printf("--shards %d is more than --threads %d, using %d shards\n", config->shards, config->event_threads, config->event_threads);
+        config->shards = config->event_threads;
+    }
+
+    return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef SERVER_CONFIG_H
+#define SERVER_CONFIG_H
+
+#include "includes.h"
+#include "upload_writer.h"
+#include "logger.h"
+
+// Seconds an idle persistent connection is kept open
+#define DEFAULT_KEEPALIVE_TIMEOUT 5
+// Requests served on one connection before it is closed
+#define DEFAULT_MAX_REQUESTS 100
+// Largest request body accepted, in MB
+#define DEFAULT_MAX_BODY_SIZE_MB 20
+// Milliseconds between syncs of the upload file with --durability interval
+#define DEFAULT_SYNC_INTERVAL_MS 1000
+// Size at which upload store segments are rotated, in MB
+#define DEFAULT_SEGMENT_SIZE_MB 64
+// Memory budget of the static file cache, in MB
+#define DEFAULT_CACHE_SIZE_MB 64
+// Memory budget of the cache of compressed files, in MB
+#define DEFAULT_COMPRESS_CACHE_SIZE_MB 32
+
+// Connection handling model selected at startup
+enum Server_Mode {
+    MODE_THREAD, // One detached pthread per accepted connection
+    MODE_EPOLL,  // Edge-triggered epoll reactor on a small number of threads
+    MODE_POOL    // Pre-spawned worker threads fed through work-stealing deques
+};
+
+struct Server_Config {
+    int port;
+    enum Server_Mode mode;
+    int event_threads;
+    int workers;
+    int queue_depth;
+    int shards;
+    int backlog;
+    bool cpu_affinity;
+    int keepalive_timeout;
+    int max_requests;
+    int cache_size_mb;
+    int compress_cache_size_mb;
+    int max_body_size_mb;
+    enum Durability durability;
+    int sync_interval_ms;
+    int segment_size_mb;
+    int retention_mb;
+    enum Log_Level log_level;
+    int trace_sample;    // One request traced in this many, 0 if tracing is off
+};
+
+extern struct Server_Config server_config;
+
+int parse_server_config(int argc, char **argv, struct Server_Config *config);
+void print_usage(const char *program_name);
+
+#endif
@@ -1,36 +1,394 @@
 #include "server_handlers.h"
 #include "http_helpers.h"
+#include "server_config.h"
+#include "buffer_pool.h"
+#include "logger.h"
 
-void router(
+/*
+    Dispatches a request whose headers have arrived. Returns the sink that will receive its
+    body, or NULL if the request has already been answered.
+*/
+struct Body_Sink *router(
     struct Req_Headers *req_headers, 
-    struct Req_Body *req_body, 
     int client_fd) {
 
-    if (req_headers == NULL || req_body == NULL) {
-        printf("Error: Request headers or body is NULL.\n");
-        send_400(client_fd, "Bad Request: Missing headers or body", 0);
-        return;
+    if (req_headers == NULL) {
+        log_error("Request headers are NULL");
+        send_400(client_fd, "Bad Request: Missing headers", strlen("Bad Request: Missing headers"));
+        return NULL;
     }
 
     if (!is_valid_http_version(req_headers->protocol)) {
-        printf("Error: Unsupported HTTP version: %s\n", req_headers->protocol);
+        log_warn("Unsupported HTTP version: %.*s", (int)req_headers->protocol.length, req_headers->protocol.data);
         send_505(client_fd);
-        return;
+        return NULL;
+    }
+
+    Route_Handler handler;
+    struct Route_Params params;
+    struct Trace_Span route_span = trace_begin("route");
+    enum Route_Match match = route_table_match(req_headers->method, req_headers->uri, &handler, &params);
+    trace_end(&route_span);
+    switch (match) {
+        case ROUTE_FOUND: {
+            request_context.route_key = metrics_request_key(params.route, HTTP_METHOD_UNKNOWN);
+            log_debug("Handling %.*s request for path: %.*s", (int)req_headers->method.length, req_headers->method.data,
+                (int)req_headers->uri.length, req_headers->uri.data);
+            struct Trace_Span handler_span = trace_begin(route_pattern(params.route));
+            struct Body_Sink *sink = handler(req_headers, &params, client_fd);
+            trace_end(&handler_span);
+            return sink;
+        }
+        case ROUTE_NOT_FOUND:
+            send_404(client_fd);
+            return NULL;
+        case ROUTE_METHOD_UNSUPPORTED:
+        default:
+            log_warn("Unsupported HTTP method: %.*s", (int)req_headers->method.length, req_headers->method.data);
+            send_501(client_fd);
+            return NULL;
+    }
+}
+
+/*
+    HTTP/1.1 connections are persistent unless the client sends "Connection: close",
+    HTTP/1.0 connections are closed unless the client sends "Connection: keep-alive".
+*/
+bool wants_keep_alive(const struct Req_Headers *req_headers) {
+    if (str_view_equals(req_headers->protocol, HTTP_V_1_1)) {
+        return !str_view_case_contains(req_headers->connection, "close");
+    }
+    return str_view_case_contains(req_headers->connection, "keep-alive");
+}
+
+void request_state_init(struct Request_State *state) {
+    memset(state, 0, sizeof(struct Request_State));
+}
+
+// Starts the access record and the metrics of a request whose headers have arrived
+static void request_started(struct Request_State *state, struct Str_View method, struct Str_View uri) {
+    access_log_begin(&state->access, method, uri);
+    request_context.send_ns = 0;
+    request_context.route_key = metrics_request_key(ROUTE_NONE, http_method_from(method));
+    state->route_key = request_context.route_key;
+    state->started_ns = metrics_now_ns();
+    state->handler_ns = 0;
+    state->send_ns = 0;
+}
+
+/*
+    Collects what the step of the request that began at step_started_ns sent. Called after
+    every step, since in epoll mode the thread serves other connections between them.
+*/
+static void request_step_done(struct Request_State *state, uint64_t step_started_ns) {
+    access_log_collect(&state->access);
+    state->handler_ns += metrics_now_ns() - step_started_ns;
+    state->send_ns += request_context.send_ns;
+    request_context.send_ns = 0;
+}
+
+// Logs and counts a request that was answered, or dropped without an answer
+static void request_finished(struct Request_State *state) {
+    access_log_end(&state->access);
+    metrics_request_end(state->route_key, state->access.status, state->access.bytes);
+    metrics_observe(PHASE_HANDLER, state->handler_ns > state->send_ns ? state->handler_ns - state->send_ns : 0);
+    metrics_observe(PHASE_SEND, state->send_ns);
+    metrics_observe(PHASE_REQUEST, metrics_now_ns() - state->started_ns);
+    state->trace_id = 0;
+    trace_current = 0;
+}
+
+// Drops a request whose body was still being received, e.g. because the connection closed
+void request_state_release(struct Request_State *state) {
+    bool unfinished = state->reading_body;
+    if (state->commit != NULL) {
+        // The writer still uses the upload of the sink, which can only be freed once it is done
+        upload_writer_wait(state->commit);
+        state->commit = NULL;
+        unfinished = true;
+    }
+    if (state->sink != NULL) {
+        state->sink->abort(state->sink);
+        state->sink = NULL;
+    }
+    if (unfinished) {
+        request_finished(state); // With the status of its response, or 0 if none was sent
+    }
+    state->reading_body = false;
+}
+
+/*
+    Calls finish on the sink of a request whose body is complete. If the response waits for a
+    background commit, the sink stays in state until finish_committed_request.
+*/
+static void finish_body(struct Body_Sink *sink, int client_fd, struct Request_State *state) {
+    state->commit = sink->finish(sink, client_fd);
+    if (state->commit != NULL) {
+        state->sink = sink;
+        state->keep_alive = request_context.keep_alive;
+    }
+}
+
+/*
+    Handles a request whose headers have arrived: routes it and, if it has a body, gets
+    state ready to receive it. keep_alive_allowed is false when the connection will be closed
+    regardless of what the client asks for (e.g. it reached --max-requests).
+    Returns false if the connection has to be closed.
+*/
+static bool begin_request(struct Req_Headers *req_headers, int client_fd, struct Request_State *state, bool keep_alive_allowed) {
+    request_context.keep_alive = keep_alive_allowed && wants_keep_alive(req_headers);
+
+    enum Body_Encoding encoding = req_headers->content_length > 0 ? BODY_CONTENT_LENGTH : BODY_NONE;
+    if (!str_view_is_empty(req_headers->transfer_encoding)) {
+        // With both headers the body could be framed two ways, which is how requests get smuggled
+        // past a proxy (RFC 9112 section 6.1), so the request is refused and the connection closed
+        if (req_headers->has_content_length) {
+            request_context.keep_alive = false;
+            send_400(client_fd, "Bad Request: Content-Length with Transfer-Encoding", strlen("Bad Request: Content-Length with Transfer-Encoding"));
+            return false;
+        }
+        // Chunked is the only coding we decode
+        if (!str_view_case_equals(req_headers->transfer_encoding, "chunked")) {
+            request_context.keep_alive = false;
+            send_501(client_fd);
+            return false;
+        }
+        encoding = BODY_CHUNKED;
+    }
+
+    size_t max_body_size = (size_t)server_config.max_body_size_mb * 1024 * 1024;
+    if (encoding == BODY_CONTENT_LENGTH && req_headers->content_length > max_body_size) {
+        request_context.keep_alive = false;
+        send_413(client_fd);
+        return false;
+    }
+
+    struct Body_Sink *sink = router(req_headers, client_fd);
+    bool expects_continue = str_view_case_equals(req_headers->expect, "100-continue");
+
+    if (encoding == BODY_NONE) {
+        if (sink != NULL) {
+            finish_body(sink, client_fd, state);
+        }
+        return request_context.keep_alive;
+    }
+
+    if (sink == NULL && expects_continue) {
+        // Already answered, the client is waiting for 100 Continue and may never send the body
+        return false;
+    }
+    if (sink != NULL && expects_continue) {
+        send_100_continue(client_fd);
+    }
+
+    // Without a sink the body is read and discarded, so the connection can be reused
+    body_reader_init(&state->body, encoding, req_headers->content_length, max_body_size);
+    state->sink = sink;
+    state->keep_alive = request_context.keep_alive;
+    state->reading_body = true;
+    return true;
+}
+
+static int write_to_sink(void *context, const char *data, size_t length) {
+    struct Body_Sink *sink = context;
+    return sink->write(sink, data, length);
+}
+
+/*
+    Passes the body bytes at the start of data to the request being received.
+    Sets *done once the body is complete (the response has then been sent) and returns the
+    number of bytes used, or -1 if the request failed and the connection has to be closed.
+*/
+static ssize_t continue_request(const char *data, size_t length, int client_fd, struct Request_State *state, bool *done) {
+    size_t consumed = 0;
+    enum Body_Status status = body_reader_feed(&state->body, data, length, &consumed,
+        state->sink ? write_to_sink : NULL, state->sink);
+    *done = false;
+
+    if (status == BODY_NEED_MORE) {
+        return consumed;
     }
 
-    if (strcmp(req_headers->method, "GET") == 0) {
-        printf("Handling GET request for path: %s\n", req_headers->uri);
-        handle_GET(req_headers, client_fd);
-        return;
-    } else if (strcmp(req_headers->method, "POST") == 0) {
-        printf("Handling POST request for path: %s\n", req_headers->uri);
-        handle_POST(req_headers, req_body, client_fd);
-        return;
-    } else {
-        printf("Error: Unsupported HTTP method: %s\n", req_headers->method);
-        send_501(client_fd);
-        return;
+    request_context.keep_alive = state->keep_alive;
+    if (status == BODY_DONE) {
+        struct Body_Sink *sink = state->sink;
+        state->sink = NULL;
+        state->reading_body = false;
+        if (sink != NULL) {
+            finish_body(sink, client_fd, state);
+        }
+        *done = true;
+        return consumed;
     }
+
+    // A discarded body belongs to a request that was already answered
+    if (state->sink != NULL) {
+        request_context.keep_alive = false;
+        if (status == BODY_TOO_LARGE) {
+            send_413(client_fd);
+        } else if (status == BODY_MALFORMED) {
+            send_400(client_fd, "Bad Request: Malformed chunked body", strlen("Bad Request: Malformed chunked body"));
+        } else {
+            send_500(client_fd);
+        }
+    }
+    request_state_release(state);
+    return -1;
+}
+
+/*
+    Serves every request at the start of buffer, so pipelined requests that arrived in the
+    same read are answered in order. Bodies are streamed: whatever part of a body is in
+    buffer is handed to the request's sink and consumed, so the buffer only ever has to hold
+    the headers of a request. Returns the number of bytes consumed and sets *keep_open to
+    false once the connection has to be closed.
+    Everything allocated while handling a request lives in the request arena, which is reset
+    after every step, so nothing allocated there may outlive the call.
+    Stops early once output is queued on deferred_output: the rest of buffer is served after
+    the socket drained, so a client that does not read cannot make the queue grow. It also
+    stops at a request waiting for its upload commit (state->commit), the caller then calls
+    finish_committed_request once the commit is done and serves the rest afterwards.
+*/
+size_t serve_buffered_requests(char *buffer, size_t length, int client_fd, struct Request_State *state, bool *keep_open) {
+    size_t consumed = 0;
+    struct Req_Headers req_headers;
+
+    while (*keep_open && !output_pending() && state->commit == NULL) {
+        if (state->reading_body) {
+            bool done = false;
+            uint64_t step_started_ns = metrics_now_ns();
+            trace_current = state->trace_id;
+            struct Trace_Span body_span = trace_begin("body");
+            ssize_t used = continue_request(buffer + consumed, length - consumed, client_fd, state, &done);
+            trace_end(&body_span);
+            arena_reset(request_arena());
+            if (used == -1) {
+                *keep_open = false;
+                break;
+            }
+            consumed += used;
+            request_step_done(state, step_started_ns);
+            if (!done) {
+                break; // Wait for the rest of the body
+            }
+            if (state->commit != NULL) {
+                break; // Finished by finish_committed_request
+            }
+            request_finished(state);
+            *keep_open = state->keep_alive;
+            continue;
+        }
+
+        if (consumed == length) {
+            break; // Wait for the next request
+        }
+        char *request = buffer + consumed;
+        if (state->trace_id == 0) {
+            state->trace_id = trace_sample(); // Kept until the request is answered
+        }
+        trace_current = state->trace_id;
+        uint64_t parse_started_ns = metrics_now_ns();
+        struct Trace_Span parse_span = trace_begin("parse");
+        int parsed = parse_request_headers(request, length - consumed, &req_headers);
+        trace_end(&parse_span);
+        if (parsed == -1) {
+            struct Str_View unknown = { "-", 1 };
+            request_started(state, unknown, unknown);
+            request_context.keep_alive = false;
+            send_400(client_fd, "Bad Request: Malformed headers", strlen("Bad Request: Malformed headers"));
+            request_step_done(state, state->started_ns);
+            request_finished(state);
+            arena_reset(request_arena());
+            *keep_open = false;
+            break;
+        }
+        if (req_headers.headers_length == 0) {
+            break; // Wait for the rest of the headers
+        }
+        metrics_observe(PHASE_PARSE, metrics_now_ns() - parse_started_ns);
+
+        // Terminate the headers so that nothing reading them as a string runs into the body
+        char saved = request[req_headers.headers_length];
+        request[req_headers.headers_length] = '\0';
+
+        state->requests_served++;
+        bool keep_alive_allowed = state->requests_served < server_config.max_requests;
+        request_started(state, req_headers.method, req_headers.uri);
+        *keep_open = begin_request(&req_headers, client_fd, state, keep_alive_allowed);
+        state->route_key = request_context.route_key;
+        request_step_done(state, state->started_ns);
+        if (!state->reading_body && state->commit == NULL) {
+            request_finished(state);
+        }
+
+        request[req_headers.headers_length] = saved;
+        consumed += req_headers.headers_length;
+        arena_reset(request_arena());
+    }
+
+    trace_current = 0; // Until the next read of this connection
+    return consumed;
+}
+
+/*
+    Sends the response of a request whose upload commit is done and finishes the request.
+    Returns false if the connection has to be closed.
+*/
+bool finish_committed_request(int client_fd, struct Request_State *state) {
+    uint64_t step_started_ns = metrics_now_ns();
+    trace_current = state->trace_id;
+    request_context.keep_alive = state->keep_alive;
+    struct Body_Sink *sink = state->sink;
+    state->sink = NULL;
+    state->commit = NULL;
+    sink->committed(sink, client_fd);
+    arena_reset(request_arena());
+    request_step_done(state, step_started_ns);
+    request_finished(state);
+    return state->keep_alive;
+}
+
+/*
+    Connection buffers come from the buffer pool. capacity is the usable size: buffers always
+    keep one extra byte for the null terminator.
+*/
+char *acquire_request_buffer(size_t *capacity) {
+    size_t size = 0;
+    char *buffer = buffer_pool_acquire(CONNECTION_BUFFER_SIZE, &size);
+    if (buffer == NULL) {
+        return NULL;
+    }
+    *capacity = size - 1;
+    buffer[0] = '\0';
+    return buffer;
+}
+
+void release_request_buffer(char *buffer, size_t capacity) {
+    buffer_pool_release(buffer, capacity + 1);
+}
+
+/*
+    Makes room for more data in a connection buffer holding length bytes, moving it to the
+    next size class up to MAX_HEADERS_SIZE. Only requests that need it ever get a bigger buffer.
+    Returns false if the buffer is already at the maximum size or cannot grow.
+*/
+bool grow_request_buffer(char **buffer, size_t length, size_t *capacity) {
+    if (*capacity >= MAX_HEADERS_SIZE) {
+        return false;
+    }
+    size_t min_size = (*capacity + 1) * 2;
+    if (min_size > MAX_HEADERS_SIZE + 1) {
+        min_size = MAX_HEADERS_SIZE + 1;
+    }
+    size_t size = *capacity + 1;
+    char *new_buffer = buffer_pool_grow(*buffer, length + 1, &size, min_size);
+    if (new_buffer == NULL) {
+        log_errno("Failed to grow connection buffer");
+        return false;
+    }
+    *buffer = new_buffer;
+    *capacity = size - 1;
+    return true;
 }
 
  // Handles a new connection, receives a pointer to an integer containing the client_fd
@@ -38,50 +396,103 @@ void *handle_connection(void *arg)
 {
 	int client_fd = *((int *)arg);
 	free(arg); // Free the malloc'd client_fd_ptr from server.c
-	printf("Started new connection with client: %d\n", client_fd);
-	printf("\n");
+	serve_connection(client_fd);
+	return NULL;
+}
 
-	/**
-	 * `recv()` receives data on the client_fd socket and stores it in the readBuffer buffer.
-	 * If successful, returns the length of the message or datagram in bytes, otherwise
-	 * returns -1.
-	 */
-	const int bufferSize = 1024 * 1024 * 20; // 20MB
-	char* readBuffer = malloc(bufferSize);
+/*
+    Serves requests on client_fd until the client closes the connection, asks for it to be
+    closed, stays idle for longer than --keepalive-timeout or reaches --max-requests, then
+    returns false. The caller closes client_fd.
+    With park_when_idle it returns true as soon as the connection is idle between two
+    requests instead of waiting for the next one, so the caller can wait for it without
+    holding a thread. *requests_served carries over between the calls for one connection.
+*/
+static bool serve_requests(int client_fd, int *requests_served, bool park_when_idle)
+{
+	size_t capacity = 0;
+	size_t length = 0;
+	char *readBuffer = acquire_request_buffer(&capacity);
 
     if (readBuffer == NULL) {
-        perror("Failed to allocate memory for readBuffer");
-        close(client_fd);
-        return NULL;
+        log_errno("Failed to allocate memory for readBuffer");
+        return false;
     }
 
-    memset(readBuffer, 0, bufferSize); // Clear buffer
-	int bytesReceived = recv(client_fd, readBuffer, bufferSize, 0);
-    
+    struct Request_State state;
+    request_state_init(&state);
+    state.requests_served = *requests_served;
+    bool keep_open = true;
+    bool idle = false;
+    while (keep_open) {
+        if (length == capacity && !grow_request_buffer(&readBuffer, length, &capacity)) {
+            request_context.keep_alive = false;
+            send_400(client_fd, "Bad Request: Request too large", strlen("Bad Request: Request too large"));
+            arena_reset(request_arena());
+            break;
+        }
 
-    // For debugging only
-    // printf("-------------------\n");
-    // printf("Client_fd: %d, bytesReceived: %d at timestamp: %ld\n", client_fd, bytesReceived, time(NULL));
-    // printf("Received request:\n%s\n", readBuffer);
-    // printf("-------------------\n");
+        // Wait for the next request, giving up once the connection has been idle for too long
+        struct pollfd pfd = { .fd = client_fd, .events = POLLIN };
+        bool between_requests = length == 0 && !state.reading_body;
+        if (park_when_idle && between_requests && poll(&pfd, 1, 0) == 0) {
+            idle = true;
+            break;
+        }
+        int ready = poll(&pfd, 1, server_config.keepalive_timeout * 1000);
+        if (ready <= 0) {
+            break;
+        }
 
-	if (bytesReceived == -1)
-	{
-		perror("Receiving failed");
-		close(client_fd);
-		return NULL;
-	}
+        /**
+         * `recv()` receives data on the client_fd socket and stores it in the readBuffer buffer.
+         * If successful, returns the length of the message or datagram in bytes, otherwise
+         * returns -1.
+         */
+        trace_current = state.trace_id;
+        struct Trace_Span recv_span = trace_begin("recv");
+        ssize_t bytesReceived = recv(client_fd, readBuffer + length, capacity - length, 0);
+        trace_end(&recv_span);
+        if (bytesReceived == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytesReceived == -1) {
+            log_errno("Receiving failed");
+            break;
+        }
+        if (bytesReceived == 0) {
+            break; // Client closed the connection
+        }
+        metrics_add_bytes_received(bytesReceived);
+        length += bytesReceived;
+        readBuffer[length] = '\0';
 
-	struct Req_Headers req_headers = parse_request_headers(readBuffer);
-	struct Req_Body body_contents = parse_request_body(readBuffer);
+        size_t consumed = serve_buffered_requests(readBuffer, length, client_fd, &state, &keep_open);
+        memmove(readBuffer, readBuffer + consumed, length - consumed);
+        length -= consumed;
+        readBuffer[length] = '\0';
+    }
 
-	router(&req_headers, &body_contents, client_fd);
+    *requests_served = state.requests_served;
+    request_state_release(&state);
+    release_request_buffer(readBuffer, capacity);
+    return idle;
+}
 
-    free(readBuffer);
-    free_body_content(&body_contents);
-    free_req_headers(&req_headers);
+// Thread mode: serves client_fd until it is done with it and closes it
+void serve_connection(int client_fd)
+{
+	log_debug("Started new connection with client: %d", client_fd);
+	metrics_connection_opened();
+	int requests_served = 0;
+	serve_requests(client_fd, &requests_served, false);
+	close(client_fd);
+	log_debug("Closed connection with client: %d", client_fd);
+	metrics_connection_closed();
+}
 
-    close(client_fd);
-    printf("Closed connection with client: %d\n", client_fd);
-    return NULL;
+// Pool mode: returns true when the connection is idle and waits for its next request parked
+bool serve_pooled_connection(int client_fd, int *requests_served)
+{
+	return serve_requests(client_fd, requests_served, true);
 }
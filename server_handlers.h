@@ -3,8 +3,43 @@
 
 #include "response_handlers.h"
 #include "request_handlers.h"
+#include "body_reader.h"
+#include "logger.h"
+#include "metrics.h"
+#include "trace.h"
 
-void router(struct Req_Headers *req_headers, struct Req_Body *request_body, int client_fd);
+// Largest request line + headers a connection will buffer, bodies are streamed
+#define MAX_HEADERS_SIZE (64 * 1024)
+// Initial size of a connection read buffer, grown on demand up to MAX_HEADERS_SIZE
+#define CONNECTION_BUFFER_SIZE (4 * 1024)
+
+// Per-connection state carried between reads
+struct Request_State {
+    int requests_served;
+    bool reading_body;       // The headers of the current request were handled, its body is arriving
+    bool keep_alive;         // Decided when the headers arrived
+    struct Body_Reader body;
+    struct Body_Sink *sink;  // NULL while a body is being discarded
+    struct Upload_Commit *commit; // The response waits for this upload to be committed, see finish_committed_request
+    struct Access_Record access; // Of the request being served
+    int route_key;           // Metrics key of the request being served
+    uint64_t started_ns;     // When its headers were parsed
+    uint64_t handler_ns;     // Spent handling it so far, including sending
+    uint64_t send_ns;        // Spent sending its responses so far
+    uint64_t trace_id;       // 0 if it is not traced
+};
+
+struct Body_Sink *router(struct Req_Headers *req_headers, int client_fd);
+bool wants_keep_alive(const struct Req_Headers *req_headers);
+void request_state_init(struct Request_State *state);
+void request_state_release(struct Request_State *state);
+size_t serve_buffered_requests(char *buffer, size_t length, int client_fd, struct Request_State *state, bool *keep_open);
+bool finish_committed_request(int client_fd, struct Request_State *state);
+char *acquire_request_buffer(size_t *capacity);
+void release_request_buffer(char *buffer, size_t capacity);
+bool grow_request_buffer(char **buffer, size_t length, size_t *capacity);
 void *handle_connection(void *arg);
+void serve_connection(int client_fd);
+bool serve_pooled_connection(int client_fd, int *requests_served);
 
 #endif
\ No newline at end of file
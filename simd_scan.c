@@ -0,0 +1,196 @@
+#include "simd_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_HAVE_X86 1
+#endif
+
+/* ---- Scalar fallback ---- */
+
+static const char *find_byte_scalar(const char *start, const char *end, char byte) {
+    for (const char *p = start; p < end; p++) {
+        if (*p == byte) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static const char *find_scalar(const char *start, const char *end, const char *needle, size_t needle_length) {
+    if ((size_t)(end - start) < needle_length) {
+        return NULL;
+    }
+    const char *last = end - needle_length;
+    for (const char *p = start; p <= last; p++) {
+        if (*p == needle[0] && memcmp(p, needle, needle_length) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+#ifdef SCAN_HAVE_X86
+
+/*
+    The substring kernels compare the first and the last byte of the needle against a whole
+    block of candidate positions at once, and only run memcmp on the positions where both
+    match. For short delimiters like "\r\n" that filter alone is already an exact match.
+*/
+
+/* ---- SSE2 (baseline on x86_64) ---- */
+
+static const char *find_byte_sse2(const char *start, const char *end, char byte) {
+    const __m128i target = _mm_set1_epi8(byte);
+    const char *p = start;
+    for (; p + 16 <= end; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)p);
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, target));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return find_byte_scalar(p, end, byte);
+}
+
+static const char *find_sse2(const char *start, const char *end, const char *needle, size_t needle_length) {
+    if ((size_t)(end - start) < needle_length) {
+        return NULL;
+    }
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_length - 1]);
+    const char *p = start;
+    for (; p + needle_length - 1 + 16 <= end; p += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)p);
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(p + needle_length - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+        while (mask != 0) {
+            int offset = __builtin_ctz(mask);
+            if (memcmp(p + offset, needle, needle_length) == 0) {
+                return p + offset;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return find_scalar(p, end, needle, needle_length);
+}
+
+/* ---- AVX2 ---- */
+
+__attribute__((target("avx2")))
+static const char *find_byte_avx2(const char *start, const char *end, char byte) {
+    const __m256i target = _mm256_set1_epi8(byte);
+    const char *p = start;
+    for (; p + 32 <= end; p += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)p);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, target));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return find_byte_sse2(p, end, byte);
+}
+
+__attribute__((target("avx2")))
+static const char *find_avx2(const char *start, const char *end, const char *needle, size_t needle_length) {
+    if ((size_t)(end - start) < needle_length) {
+        return NULL;
+    }
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_length - 1]);
+    const char *p = start;
+    for (; p + needle_length - 1 + 32 <= end; p += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)p);
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(p + needle_length - 1));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+        while (mask != 0) {
+            int offset = __builtin_ctz(mask);
+            if (memcmp(p + offset, needle, needle_length) == 0) {
+                return p + offset;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return find_sse2(p, end, needle, needle_length);
+}
+
+#endif
+
+/* ---- Runtime dispatch ---- */
+
+static enum Scan_Implementation active_implementation = SCAN_SCALAR;
+static const char *(*find_byte_impl)(const char *, const char *, char) = find_byte_scalar;
+static const char *(*find_impl)(const char *, const char *, const char *, size_t) = find_scalar;
+
+bool scan_set_implementation(enum Scan_Implementation implementation) {
+    switch (implementation) {
+        case SCAN_SCALAR:
+            find_byte_impl = find_byte_scalar;
+            find_impl = find_scalar;
+            break;
+#ifdef SCAN_HAVE_X86
+        case SCAN_SSE2:
+            if (!__builtin_cpu_supports("sse2")) {
+                return false;
+            }
+            find_byte_impl = find_byte_sse2;
+            find_impl = find_sse2;
+            break;
+        case SCAN_AVX2:
+            if (!__builtin_cpu_supports("avx2")) {
+                return false;
+            }
+            find_byte_impl = find_byte_avx2;
+            find_impl = find_avx2;
+            break;
+#endif
+        default:
+            return false;
+    }
+    active_implementation = implementation;
+    return true;
+}
+
+// Runs before main, so the function pointers never change while requests are being served
+__attribute__((constructor))
+static void scan_select_implementation(void) {
+#ifdef SCAN_HAVE_X86
+    __builtin_cpu_init();
+    if (scan_set_implementation(SCAN_AVX2) || scan_set_implementation(SCAN_SSE2)) {
+        return;
+    }
+#endif
+    scan_set_implementation(SCAN_SCALAR);
+}
+
+enum Scan_Implementation scan_get_implementation(void) {
+    return active_implementation;
+}
+
+const char *scan_implementation_name(enum Scan_Implementation implementation) {
+    switch (implementation) {
+        case SCAN_AVX2: return "avx2";
+        case SCAN_SSE2: return "sse2";
+        default: return "scalar";
+    }
+}
+
+const char *scan_find_byte(const char *start, const char *end, char byte) {
+    if (start >= end) {
+        return NULL;
+    }
+    return find_byte_impl(start, end, byte);
+}
+
+const char *scan_find(const char *start, const char *end, const char *needle, size_t needle_length) {
+    if (needle_length == 0) {
+        return start;
+    }
+    if (start >= end) {
+        return NULL;
+    }
+    return find_impl(start, end, needle, needle_length);
+}
+
+const char *scan_find_crlf(const char *start, const char *end) {
+    return scan_find(start, end, "\r\n", 2);
+}
@@ -0,0 +1,26 @@
+#ifndef SIMD_SCAN_H
+#define SIMD_SCAN_H
+
+#include "includes.h"
+
+/*
+    Delimiter scanning over length-delimited buffers ([start, end), no null terminator needed).
+    The kernel is picked once at startup from what the CPU supports: AVX2, SSE2 or a portable
+    scalar loop. All functions return a pointer to the first match or NULL.
+*/
+
+enum Scan_Implementation {
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2
+};
+
+const char *scan_find_byte(const char *start, const char *end, char byte);
+const char *scan_find_crlf(const char *start, const char *end);
+const char *scan_find(const char *start, const char *end, const char *needle, size_t needle_length);
+
+enum Scan_Implementation scan_get_implementation(void);
+bool scan_set_implementation(enum Scan_Implementation implementation);
+const char *scan_implementation_name(enum Scan_Implementation implementation);
+
+#endif
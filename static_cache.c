@@ -0,0 +1,548 @@
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include "static_cache.h"
+#include "file_helpers.h"
+#include "http_helpers.h"
+#include "compress_cache.h"
+#include "logger.h"
+
+struct Cache_Shard {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded; // Signalled when a LOADING entry becomes READY or FAILED
+    struct Static_Cache_Entry *buckets[STATIC_CACHE_BUCKETS];
+    struct Static_Cache_Entry *lru_head; // Most recently used
+    struct Static_Cache_Entry *lru_tail;
+    size_t bytes;
+    size_t entries;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long invalidations;
+};
+
+static struct Cache_Shard shards[STATIC_CACHE_SHARDS];
+static size_t shard_budget;
+static size_t max_file_size;
+static bool cache_enabled = false;
+static bool watching = false; // Missing and too large entries are only kept while inotify runs
+
+// FNV-1a
+static uint32_t hash_path(const char *path) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static struct Cache_Shard *shard_for(uint32_t hash) {
+    return &shards[hash % STATIC_CACHE_SHARDS];
+}
+
+static struct Static_Cache_Entry **bucket_for(struct Cache_Shard *shard, uint32_t hash) {
+    return &shard->buckets[(hash / STATIC_CACHE_SHARDS) % STATIC_CACHE_BUCKETS];
+}
+
+static void entry_free(struct Static_Cache_Entry *entry) {
+    free(entry->path);
+    free(entry->data);
+    free(entry->headers[0]);
+    free(entry->headers[1]);
+    for (int encoding = 0; encoding < CONTENT_ENCODING_COUNT; encoding++) {
+        free(entry->siblings[encoding].data);
+    }
+    free(entry);
+}
+
+// Whether the entry is in the LRU list and counted against the budget once linked
+static bool entry_resident(const struct Static_Cache_Entry *entry) {
+    return entry->state != CACHE_ENTRY_LOADING && entry->state != CACHE_ENTRY_FAILED;
+}
+
+static void entry_unref(struct Static_Cache_Entry *entry) {
+    if (--entry->refcount == 0) {
+        entry_free(entry);
+    }
+}
+
+static struct Static_Cache_Entry *find_entry(struct Cache_Shard *shard, const char *path, uint32_t hash) {
+    for (struct Static_Cache_Entry *entry = *bucket_for(shard, hash); entry != NULL; entry = entry->bucket_next) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void lru_remove(struct Cache_Shard *shard, struct Static_Cache_Entry *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(struct Cache_Shard *shard, struct Static_Cache_Entry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head) {
+        shard->lru_head->lru_prev = entry;
+    } else {
+        shard->lru_tail = entry;
+    }
+    shard->lru_head = entry;
+}
+
+// Removes an entry from its shard. Readers still holding it keep it alive until they release it.
+static void entry_unlink(struct Cache_Shard *shard, struct Static_Cache_Entry *entry) {
+    struct Static_Cache_Entry **link = bucket_for(shard, entry->hash);
+    while (*link != entry) {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+    entry->bucket_next = NULL;
+
+    if (entry_resident(entry)) {
+        lru_remove(shard, entry);
+        shard->bytes -= entry->cost;
+        shard->entries--;
+    }
+    entry->linked = false;
+    entry_unref(entry);
+}
+
+static void evict_over_budget(struct Cache_Shard *shard, struct Static_Cache_Entry *keep) {
+    while (shard->bytes > shard_budget && shard->lru_tail != NULL && shard->lru_tail != keep) {
+        entry_unlink(shard, shard->lru_tail);
+        shard->evictions++;
+    }
+}
+
+// Out of descriptors or memory passes, anything else stays as it is until the path changes
+static bool open_failed_transiently(void) {
+    return errno == EMFILE || errno == ENFILE || errno == ENOMEM || errno == EINTR;
+}
+
+/*
+    Records the precompressed sibling of the entry's file in encoding, reading it into the
+    entry if it is small enough. Returns false if it could not be looked up.
+*/
+static bool load_sibling(struct Static_Cache_Entry *entry, enum Content_Encoding encoding) {
+    char sibling_path[PATH_MAX];
+    snprintf(sibling_path, sizeof(sibling_path), "%s%s", entry->path, precompressed_extension(encoding));
+    struct stat sibling_stat;
+    int sibling_fd = open_file_stat(sibling_path, &sibling_stat);
+    if (sibling_fd == -1) {
+        return !open_failed_transiently();
+    }
+    struct Static_Cache_Sibling *sibling = &entry->siblings[encoding];
+    sibling->present = true;
+    sibling->size = sibling_stat.st_size;
+    file_validators_init(&sibling->validators, &sibling_stat, get_file_cache_control(entry->path));
+    file_validators_set_encoding(&sibling->validators, encoding);
+    if (sibling->size <= max_file_size) {
+        struct file_data *filedata = load_file_fd(sibling_fd, sibling->size);
+        if (filedata != NULL) {
+            sibling->data = filedata->data;
+            sibling->size = filedata->size;
+            free(filedata);
+            entry->cost += sibling->size;
+        }
+    }
+    close(sibling_fd);
+    return true;
+}
+
+/*
+    Reads the file and prebuilds its headers. Runs without the shard lock held.
+    Returns the state the entry ends up in.
+*/
+static enum Static_Cache_Entry_State load_entry(struct Static_Cache_Entry *entry) {
+    entry->cost = sizeof(struct Static_Cache_Entry) + strlen(entry->path) + 1;
+    struct stat file_stat;
+    int file_fd = open_file_stat(entry->path, &file_stat);
+    if (file_fd == -1) {
+        return open_failed_transiently() ? CACHE_ENTRY_FAILED : CACHE_ENTRY_MISSING;
+    }
+    size_t file_size = file_stat.st_size;
+    entry->file_stat = file_stat;
+    file_validators_init(&entry->validators, &file_stat, get_file_cache_control(entry->path));
+    if (compression_applies(entry->path)) {
+        file_validators_set_encoding(&entry->validators, ENCODING_IDENTITY);
+        for (int encoding = ENCODING_IDENTITY + 1; encoding < CONTENT_ENCODING_COUNT; encoding++) {
+            if (!load_sibling(entry, encoding)) {
+                close(file_fd);
+                return CACHE_ENTRY_FAILED;
+            }
+        }
+    }
+    if (file_size > max_file_size) {
+        close(file_fd);
+        entry->size = file_size;
+        return CACHE_ENTRY_TOO_LARGE;
+    }
+    struct file_data *filedata = load_file_fd(file_fd, file_size);
+    close(file_fd);
+    if (filedata == NULL) {
+        return CACHE_ENTRY_FAILED;
+    }
+    entry->data = filedata->data;
+    entry->size = filedata->size;
+    free(filedata);
+
+    const char *content_type = get_file_mime_type(entry->path);
+    for (int keep_alive = 0; keep_alive < 2; keep_alive++) {
+        size_t length = format_response_headers(NULL, 0, STATUS_OK, content_type, entry->size, keep_alive, entry->validators.headers);
+        entry->headers[keep_alive] = malloc(length + 1);
+        if (entry->headers[keep_alive] == NULL) {
+            return CACHE_ENTRY_FAILED;
+        }
+        format_response_headers(entry->headers[keep_alive], length + 1, STATUS_OK, content_type, entry->size, keep_alive, entry->validators.headers);
+        entry->headers_length[keep_alive] = length;
+    }
+
+    entry->cost += entry->size + entry->headers_length[0] + entry->headers_length[1];
+    return CACHE_ENTRY_READY;
+}
+
+/*
+    Sets the memory budget shared by all shards and enables the cache.
+    Files bigger than a shard's share of the budget are never cached.
+*/
+bool static_cache_init(size_t budget) {
+    if (budget == 0) {
+        return false;
+    }
+    shard_budget = budget / STATIC_CACHE_SHARDS;
+    max_file_size = STATIC_CACHE_MAX_FILE_SIZE < shard_budget / 2 ? STATIC_CACHE_MAX_FILE_SIZE : shard_budget / 2;
+    for (int i = 0; i < STATIC_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        pthread_cond_init(&shards[i].loaded, NULL);
+    }
+    cache_enabled = true;
+    return true;
+}
+
+/*
+    Returns the cached entry for path, loading the file on a miss. Concurrent misses for the
+    same path are coalesced: the first thread reads the file while the others wait for it.
+    The entry is READY, or MISSING or TOO_LARGE when the file does not exist or has to be
+    streamed from disk. Returns NULL if the cache is disabled or the file could not be read,
+    the caller then serves it from disk.
+    Every entry returned must be given back with static_cache_release once it has been sent.
+*/
+struct Static_Cache_Entry *static_cache_acquire(const char *path) {
+    // Only canonical paths are cached, so every file has one key and inotify events map back to it
+    if (!cache_enabled || !is_canonical_path(path)) {
+        return NULL;
+    }
+
+    uint32_t hash = hash_path(path);
+    struct Cache_Shard *shard = shard_for(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    struct Static_Cache_Entry *entry = find_entry(shard, path, hash);
+    if (entry != NULL) {
+        entry->refcount++;
+        while (entry->state == CACHE_ENTRY_LOADING) {
+            pthread_cond_wait(&shard->loaded, &shard->lock);
+        }
+        if (entry->state != CACHE_ENTRY_FAILED) {
+            shard->hits++;
+            if (entry->linked) {
+                lru_remove(shard, entry);
+                lru_push_front(shard, entry);
+            }
+            pthread_mutex_unlock(&shard->lock);
+            return entry;
+        }
+        entry_unref(entry);
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+
+    shard->misses++;
+    entry = calloc(1, sizeof(struct Static_Cache_Entry));
+    char *path_copy = strdup(path);
+    if (entry == NULL || path_copy == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        free(entry);
+        free(path_copy);
+        return NULL;
+    }
+    entry->path = path_copy;
+    entry->hash = hash;
+    entry->state = CACHE_ENTRY_LOADING;
+    entry->refcount = 2; // The table and this thread
+    entry->linked = true;
+    struct Static_Cache_Entry **bucket = bucket_for(shard, hash);
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+    pthread_mutex_unlock(&shard->lock);
+
+    enum Static_Cache_Entry_State state = load_entry(entry);
+    if (state != CACHE_ENTRY_READY && !watching) {
+        state = CACHE_ENTRY_FAILED; // Nothing would tell when the file appears or shrinks
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    entry->state = state;
+    if (state != CACHE_ENTRY_FAILED) {
+        // If the file changed while it was being read the entry was already unlinked
+        if (entry->linked) {
+            shard->bytes += entry->cost;
+            shard->entries++;
+            lru_push_front(shard, entry);
+            evict_over_budget(shard, entry);
+        }
+    } else {
+        if (entry->linked) {
+            entry_unlink(shard, entry);
+        }
+        entry_unref(entry);
+        entry = NULL;
+    }
+    pthread_cond_broadcast(&shard->loaded);
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+void static_cache_release(struct Static_Cache_Entry *entry) {
+    struct Cache_Shard *shard = shard_for(entry->hash);
+    pthread_mutex_lock(&shard->lock);
+    entry_unref(entry);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void static_cache_invalidate(const char *path) {
+    if (!cache_enabled) {
+        return;
+    }
+    uint32_t hash = hash_path(path);
+    struct Cache_Shard *shard = shard_for(hash);
+    pthread_mutex_lock(&shard->lock);
+    struct Static_Cache_Entry *entry = find_entry(shard, path, hash);
+    if (entry != NULL) {
+        entry_unlink(shard, entry);
+        shard->invalidations++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void static_cache_invalidate_all(void) {
+    if (!cache_enabled) {
+        return;
+    }
+    for (int i = 0; i < STATIC_CACHE_SHARDS; i++) {
+        struct Cache_Shard *shard = &shards[i];
+        pthread_mutex_lock(&shard->lock);
+        for (int b = 0; b < STATIC_CACHE_BUCKETS; b++) {
+            while (shard->buckets[b] != NULL) {
+                entry_unlink(shard, shard->buckets[b]);
+                shard->invalidations++;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/* ---- inotify invalidation ---- */
+
+struct Watch {
+    int wd;
+    char *directory; // With a trailing '/', so directory + name is a cache key
+};
+
+static int inotify_fd = -1;
+static struct Watch *watches;
+static int watch_count;
+static int watch_capacity;
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// inotify is not recursive, so every directory under the root gets its own watch
+static void add_watch_recursive(const char *directory) {
+    int wd = inotify_add_watch(inotify_fd, directory, WATCH_EVENTS);
+    if (wd == -1) {
+        log_errno("Failed to watch directory");
+        return;
+    }
+
+    if (watch_count == watch_capacity) {
+        int new_capacity = watch_capacity ? watch_capacity * 2 : 16;
+        struct Watch *new_watches = realloc(watches, new_capacity * sizeof(struct Watch));
+        if (new_watches == NULL) {
+            return;
+        }
+        watches = new_watches;
+        watch_capacity = new_capacity;
+    }
+    size_t length = strlen(directory);
+    bool has_slash = length > 0 && directory[length - 1] == '/';
+    char *copy = malloc(length + 2);
+    if (copy == NULL) {
+        return;
+    }
+    memcpy(copy, directory, length);
+    if (!has_slash) {
+        copy[length++] = '/';
+    }
+    copy[length] = '\0';
+    watches[watch_count++] = (struct Watch){ .wd = wd, .directory = copy };
+
+    DIR *dir = opendir(copy);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *child;
+    while ((child = readdir(dir)) != NULL) {
+        if (child->d_type != DT_DIR || strcmp(child->d_name, ".") == 0 || strcmp(child->d_name, "..") == 0) {
+            continue;
+        }
+        char child_path[PATH_MAX];
+        snprintf(child_path, sizeof(child_path), "%s%s", copy, child->d_name);
+        add_watch_recursive(child_path);
+    }
+    closedir(dir);
+}
+
+static struct Watch *find_watch(int wd) {
+    for (int i = 0; i < watch_count; i++) {
+        if (watches[i].wd == wd) {
+            return &watches[i];
+        }
+    }
+    return NULL;
+}
+
+static void handle_watch_event(const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        static_cache_invalidate_all(); // Events were lost
+        return;
+    }
+    struct Watch *watch = find_watch(event->wd);
+    if (watch == NULL) {
+        return;
+    }
+    if (event->mask & IN_IGNORED) {
+        watch->wd = -1; // Directory is gone
+        return;
+    }
+    if (event->len == 0) {
+        return;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s", watch->directory, event->name);
+    if (event->mask & IN_ISDIR) {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            add_watch_recursive(path);
+        }
+        // Every file below it changed path, and missing entries below a new one may exist now
+        if (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+            static_cache_invalidate_all();
+        }
+        return;
+    }
+    static_cache_invalidate(path);
+
+    // Precompressed siblings are recorded in the entry of the file they belong to
+    size_t length = strlen(path);
+    for (int encoding = ENCODING_IDENTITY + 1; encoding < CONTENT_ENCODING_COUNT; encoding++) {
+        const char *extension = precompressed_extension(encoding);
+        size_t extension_length = strlen(extension);
+        if (length > extension_length && strcmp(path + length - extension_length, extension) == 0) {
+            path[length - extension_length] = '\0';
+            static_cache_invalidate(path);
+            return;
+        }
+    }
+}
+
+static void *watch_thread(void *arg) {
+    (void)arg;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+        if (length == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_errno("Failed to read inotify events");
+            return NULL;
+        }
+        for (char *p = buffer; p < buffer + length;) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            handle_watch_event(event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Watches directory and everything below it, dropping cache entries as soon as their file
+    is written, replaced, renamed or deleted.
+*/
+bool static_cache_watch(const char *directory) {
+    if (!cache_enabled) {
+        return false;
+    }
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd == -1) {
+        log_errno("Failed to initialize inotify");
+        return false;
+    }
+    add_watch_recursive(directory);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, watch_thread, NULL) != 0) {
+        log_errno("Failed to create cache watch thread");
+        return false;
+    }
+    pthread_detach(thread);
+    watching = true;
+    return true;
+}
+
+void static_cache_get_stats(struct Static_Cache_Stats *stats) {
+    memset(stats, 0, sizeof(struct Static_Cache_Stats));
+    stats->budget = shard_budget * STATIC_CACHE_SHARDS;
+    if (!cache_enabled) {
+        return;
+    }
+    for (int i = 0; i < STATIC_CACHE_SHARDS; i++) {
+        struct Cache_Shard *shard = &shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->invalidations += shard->invalidations;
+        stats->entries += shard->entries;
+        stats->bytes += shard->bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void static_cache_report(void) {
+    if (!cache_enabled) {
+        log_info("Static cache: disabled");
+        return;
+    }
+    struct Static_Cache_Stats stats;
+    static_cache_get_stats(&stats);
+    unsigned long lookups = stats.hits + stats.misses;
+    double hit_rate = lookups ? 100.0 * stats.hits / lookups : 0.0;
+    log_info("Static cache: %zu entries, %zu KB of %zu KB, %lu hits, %lu misses (%.1f%% hit rate), %lu evictions, %lu invalidations",
+        stats.entries, stats.bytes / 1024, stats.budget / 1024, stats.hits, stats.misses, hit_rate, stats.evictions, stats.invalidations);
+}
@@ -0,0 +1,79 @@
+#ifndef STATIC_CACHE_H
+#define STATIC_CACHE_H
+
+#include <stdint.h>
+#include "includes.h"
+#include "http_helpers.h"
+
+/*
+    In-memory cache of the files under HTML_DIR, keyed by file path. Every entry holds the
+    file bytes plus the response headers prebuilt for keep-alive and for close, so a hit is
+    served without touching the filesystem or formatting anything.
+    The cache is split into shards, each with its own lock, hash table and LRU list, and
+    bounded by a memory budget. An inotify thread drops entries whose file changes. While it
+    runs, paths that do not exist and files too big to cache get entries too, which only
+    remember that, so repeated requests for them skip the lookup.
+    Entries of text files also record their precompressed .gz/.br siblings, so the
+    negotiation of Accept-Encoding does not look for them on disk either.
+*/
+
+#define STATIC_CACHE_SHARDS 16
+#define STATIC_CACHE_BUCKETS 256 // Per shard
+// Bigger files are not cached, they are streamed with sendfile() instead
+#define STATIC_CACHE_MAX_FILE_SIZE (1024 * 1024)
+
+enum Static_Cache_Entry_State {
+    CACHE_ENTRY_LOADING, // Placeholder while one thread reads the file, others wait for it
+    CACHE_ENTRY_READY,
+    CACHE_ENTRY_MISSING, // No regular file at the path
+    CACHE_ENTRY_TOO_LARGE, // Bigger than the cache takes, data and headers are not set
+    CACHE_ENTRY_FAILED   // Could not be read, the next request tries again
+};
+
+// A precompressed copy next to the file, its path plus ".gz" or ".br"
+struct Static_Cache_Sibling {
+    bool present;
+    char *data;                // NULL if too big to cache, it is then sent from disk
+    size_t size;
+    struct File_Validators validators;
+};
+
+struct Static_Cache_Entry {
+    char *path;
+    uint32_t hash;
+    enum Static_Cache_Entry_State state;
+    char *data;
+    size_t size;
+    struct File_Validators validators;
+    struct stat file_stat;     // Identifies the file to the compression cache
+    struct Static_Cache_Sibling siblings[CONTENT_ENCODING_COUNT]; // Indexed by encoding, for text files
+    char *headers[2];          // Indexed by keep_alive, include the validators
+    size_t headers_length[2];
+    size_t cost;               // Bytes charged against the memory budget
+    int refcount;              // Held by the table while linked, and by every reader
+    bool linked;
+    struct Static_Cache_Entry *bucket_next;
+    struct Static_Cache_Entry *lru_prev;
+    struct Static_Cache_Entry *lru_next;
+};
+
+struct Static_Cache_Stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long invalidations;
+    size_t entries;
+    size_t bytes;
+    size_t budget;
+};
+
+bool static_cache_init(size_t budget);
+bool static_cache_watch(const char *directory);
+struct Static_Cache_Entry *static_cache_acquire(const char *path);
+void static_cache_release(struct Static_Cache_Entry *entry);
+void static_cache_invalidate(const char *path);
+void static_cache_invalidate_all(void);
+void static_cache_get_stats(struct Static_Cache_Stats *stats);
+void static_cache_report(void);
+
+#endif
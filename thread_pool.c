@@ -0,0 +1,386 @@
+#include <sys/epoll.h>
+#include "thread_pool.h"
+#include "server_handlers.h"
+#include "server_config.h"
+#include "logger.h"
+
+static int deque_init(struct Work_Deque *deque, size_t capacity) {
+    deque->items = malloc(capacity * sizeof(struct Pool_Connection *));
+    if (deque->items == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->capacity = capacity;
+    deque->head = 0;
+    deque->count = 0;
+    return 0;
+}
+
+static bool deque_push_back(struct Work_Deque *deque, struct Pool_Connection *conn) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        pthread_mutex_unlock(&deque->lock);
+        return false;
+    }
+    deque->items[(deque->head + deque->count) % deque->capacity] = conn;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+// Used by the owning worker: takes the connection that has been waiting the longest
+static struct Pool_Connection *deque_pop_front(struct Work_Deque *deque) {
+    struct Pool_Connection *conn = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        conn = deque->items[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return conn;
+}
+
+// Used by thieves: takes from the opposite end so it rarely races with the owner
+static struct Pool_Connection *deque_steal_back(struct Work_Deque *deque) {
+    struct Pool_Connection *conn = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        deque->count--;
+        conn = deque->items[(deque->head + deque->count) % deque->capacity];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return conn;
+}
+
+/*
+    Every queued connection posts one token to pool->pending. A worker that wins a token
+    is guaranteed that at least one unclaimed connection exists in some deque, so it looks in its
+    own deque first and then steals from the others until it finds it.
+    This way a worker stuck on a slow request never holds up connections queued behind it.
+*/
+static struct Pool_Connection *worker_next_connection(struct Worker *worker) {
+    struct Thread_Pool *pool = worker->pool;
+    while (1) {
+        struct Pool_Connection *conn = deque_pop_front(&worker->deque);
+        if (conn != NULL) {
+            return conn;
+        }
+        for (int i = 1; i < pool->worker_count; i++) {
+            struct Worker *victim = &pool->workers[(worker->id + i) % pool->worker_count];
+            conn = deque_steal_back(&victim->deque);
+            if (conn != NULL) {
+                return conn;
+            }
+        }
+        sched_yield();
+    }
+}
+
+struct Acceptor {
+    int server_fd;
+    int epoll_fd; // The listener, registered with a NULL data pointer, and the parked connections
+    struct Thread_Pool *pool;
+    pthread_mutex_t park_lock; // Taken by workers parking connections and by the acceptor
+    struct Pool_Connection *parked_head;
+    struct Pool_Connection *parked_tail;
+};
+
+static void pool_connection_close(struct Pool_Connection *conn) {
+    close(conn->fd);
+    log_debug("Closed connection with client: %d", conn->fd);
+    free(conn);
+    metrics_connection_closed();
+}
+
+static void park_list_remove(struct Acceptor *acceptor, struct Pool_Connection *conn) {
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        acceptor->parked_head = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    } else {
+        acceptor->parked_tail = conn->prev;
+    }
+    conn->prev = NULL;
+    conn->next = NULL;
+}
+
+/*
+    Called by a worker once conn is idle: the acceptor wakes up when its next request arrives.
+    The connection is registered one-shot, so only one acceptor event hands it on, and it is
+    listed and registered under park_lock so that the sweep never sees it half parked.
+*/
+static void acceptor_park(struct Acceptor *acceptor, struct Pool_Connection *conn) {
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+        .data.ptr = conn,
+    };
+    int operation = conn->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    conn->registered = true;
+    conn->parked_at = time(NULL);
+
+    pthread_mutex_lock(&acceptor->park_lock);
+    conn->prev = acceptor->parked_tail;
+    conn->next = NULL;
+    if (acceptor->parked_tail) {
+        acceptor->parked_tail->next = conn;
+    } else {
+        acceptor->parked_head = conn;
+    }
+    acceptor->parked_tail = conn;
+    if (epoll_ctl(acceptor->epoll_fd, operation, conn->fd, &event) == -1) {
+        log_errno("Failed to park connection");
+        park_list_remove(acceptor, conn);
+        pthread_mutex_unlock(&acceptor->park_lock);
+        pool_connection_close(conn);
+        return;
+    }
+    pthread_mutex_unlock(&acceptor->park_lock);
+}
+
+static void *worker_run(void *arg) {
+    struct Worker *worker = arg;
+    struct Thread_Pool *pool = worker->pool;
+
+    while (1) {
+        if (sem_wait(&pool->pending) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_errno("sem_wait failed");
+            break;
+        }
+        if (__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        struct Pool_Connection *conn = worker_next_connection(worker);
+        if (pool->handler(conn->fd, &conn->requests_served)) {
+            acceptor_park(conn->acceptor, conn);
+        } else {
+            pool_connection_close(conn);
+        }
+    }
+    return NULL;
+}
+
+/*
+    Undoes a thread_pool_create that failed after started_count workers were running:
+    wakes each of them up to see pool->stopping, joins them and frees the pool.
+    Deques are initialized before their worker starts, so initialized_count >= started_count.
+*/
+static void thread_pool_abort(struct Thread_Pool *pool, int initialized_count, int started_count) {
+    __atomic_store_n(&pool->stopping, true, __ATOMIC_RELEASE);
+    for (int i = 0; i < started_count; i++) {
+        sem_post(&pool->pending);
+    }
+    for (int i = 0; i < started_count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (int i = 0; i < initialized_count; i++) {
+        pthread_mutex_destroy(&pool->workers[i].deque.lock);
+        free(pool->workers[i].deque.items);
+    }
+    sem_destroy(&pool->pending);
+    free(pool->workers);
+    free(pool);
+}
+
+struct Thread_Pool *thread_pool_create(int worker_count, size_t queue_depth, bool (*handler)(int client_fd, int *requests_served)) {
+    struct Thread_Pool *pool = malloc(sizeof(struct Thread_Pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    memset(pool, 0, sizeof(struct Thread_Pool));
+
+    pool->workers = calloc(worker_count, sizeof(struct Worker));
+    if (pool->workers == NULL || sem_init(&pool->pending, 0, 0) == -1) {
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    pool->worker_count = worker_count;
+    pool->handler = handler;
+
+    for (int i = 0; i < worker_count; i++) {
+        struct Worker *worker = &pool->workers[i];
+        worker->id = i;
+        worker->pool = pool;
+        if (deque_init(&worker->deque, queue_depth) == -1) {
+            log_errno("Failed to allocate worker deque");
+            thread_pool_abort(pool, i, i);
+            return NULL;
+        }
+        if (pthread_create(&worker->thread, NULL, worker_run, worker) != 0) {
+            log_errno("Failed to create worker thread");
+            thread_pool_abort(pool, i + 1, i);
+            return NULL;
+        }
+    }
+
+    // Workers stay joinable until every one of them is up, so a failure above can wait for them
+    for (int i = 0; i < worker_count; i++) {
+        pthread_detach(pool->workers[i].thread);
+    }
+    return pool;
+}
+
+/*
+    Hands conn to the next worker in round-robin order, skipping workers whose
+    deque is full. Returns false if every deque is full.
+    Safe to call from several acceptor threads.
+*/
+bool thread_pool_submit(struct Thread_Pool *pool, struct Pool_Connection *conn) {
+    for (int attempt = 0; attempt < pool->worker_count; attempt++) {
+        size_t ticket = __atomic_fetch_add(&pool->next_worker, 1, __ATOMIC_RELAXED);
+        struct Worker *worker = &pool->workers[ticket % pool->worker_count];
+        if (deque_push_back(&worker->deque, conn)) {
+            sem_post(&pool->pending);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Accepts one connection and hands it to the worker pool
+static void acceptor_accept(struct Acceptor *acceptor) {
+    // Pause after errors that persist until some fd is closed, instead of spinning on accept
+    static const struct timespec backoff = { .tv_sec = 0, .tv_nsec = ACCEPT_BACKOFF_MS * 1000000L };
+
+    int client_fd = accept4(acceptor->server_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client_fd == -1) {
+        int accept_errno = errno;
+        if (accept_errno == EINTR) {
+            return;
+        }
+        log_errno("Failed to connect to client");
+        if (accept_errno == EMFILE || accept_errno == ENFILE || accept_errno == ENOBUFS || accept_errno == ENOMEM) {
+            nanosleep(&backoff, NULL);
+        }
+        return;
+    }
+
+    struct Pool_Connection *conn = calloc(1, sizeof(struct Pool_Connection));
+    if (conn == NULL) {
+        log_errno("Failed to allocate connection");
+        close(client_fd);
+        return;
+    }
+    conn->fd = client_fd;
+    conn->acceptor = acceptor;
+    log_debug("Started new connection with client: %d", client_fd);
+    metrics_connection_opened();
+
+    if (!thread_pool_submit(acceptor->pool, conn)) {
+        log_warn("All worker queues are full, rejecting client: %d", client_fd);
+        send_503(client_fd);
+        arena_reset(request_arena());
+        pool_connection_close(conn);
+    }
+}
+
+// A parked connection became readable (or was closed by the client): queue it again
+static void acceptor_resume(struct Acceptor *acceptor, struct Pool_Connection *conn) {
+    pthread_mutex_lock(&acceptor->park_lock);
+    park_list_remove(acceptor, conn);
+    pthread_mutex_unlock(&acceptor->park_lock);
+
+    if (!thread_pool_submit(acceptor->pool, conn)) {
+        log_warn("All worker queues are full, closing client: %d", conn->fd);
+        pool_connection_close(conn);
+    }
+}
+
+// Closes parked connections that have been idle for longer than --keepalive-timeout
+static void acceptor_close_idle(struct Acceptor *acceptor) {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&acceptor->park_lock);
+    while (acceptor->parked_head != NULL && now - acceptor->parked_head->parked_at >= server_config.keepalive_timeout) {
+        struct Pool_Connection *conn = acceptor->parked_head;
+        park_list_remove(acceptor, conn);
+        pool_connection_close(conn); // Closing the fd takes it out of the epoll set
+    }
+    pthread_mutex_unlock(&acceptor->park_lock);
+}
+
+/*
+    Waits for new connections on server_fd and for parked connections to become readable,
+    and hands both to the worker pool, until epoll fails.
+*/
+static void *acceptor_run(void *arg) {
+    struct Acceptor *acceptor = arg;
+    struct epoll_event events[ACCEPTOR_EPOLL_EVENTS];
+
+    while (1) {
+        int ready = epoll_wait(acceptor->epoll_fd, events, ACCEPTOR_EPOLL_EVENTS, PARK_SWEEP_INTERVAL_MS);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_errno("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == NULL) {
+                acceptor_accept(acceptor);
+            } else {
+                acceptor_resume(acceptor, events[i].data.ptr);
+            }
+        }
+
+        acceptor_close_idle(acceptor);
+    }
+
+    return NULL;
+}
+
+/*
+    Starts the worker pool and one acceptor per listener (the calling thread runs the last one).
+    Only returns if the pool could not be started.
+*/
+int run_thread_pool(int *server_fds, int listener_count, int worker_count, size_t queue_depth) {
+    struct Thread_Pool *pool = thread_pool_create(worker_count, queue_depth, serve_pooled_connection);
+    if (pool == NULL) {
+        return -1;
+    }
+
+    struct Acceptor *acceptors = calloc(listener_count, sizeof(struct Acceptor));
+    if (acceptors == NULL) {
+        return -1;
+    }
+    log_info("Thread pool running with %d worker(s), queue depth %zu, %d acceptor(s)", worker_count, queue_depth, listener_count);
+
+    for (int i = 0; i < listener_count; i++) {
+        acceptors[i].server_fd = server_fds[i];
+        acceptors[i].pool = pool;
+        pthread_mutex_init(&acceptors[i].park_lock, NULL);
+        acceptors[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (acceptors[i].epoll_fd == -1) {
+            log_errno("epoll_create1 failed");
+            return -1;
+        }
+        struct epoll_event event = {
+            .events = EPOLLIN,
+            .data.ptr = NULL,
+        };
+        if (epoll_ctl(acceptors[i].epoll_fd, EPOLL_CTL_ADD, server_fds[i], &event) == -1) {
+            log_errno("Failed to register listening socket with epoll");
+            return -1;
+        }
+        if (i == listener_count - 1) {
+            break;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, acceptor_run, &acceptors[i]) != 0) {
+            log_errno("Failed to create acceptor thread");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+
+    acceptor_run(&acceptors[listener_count - 1]);
+    return 0;
+}
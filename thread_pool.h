@@ -0,0 +1,68 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include "includes.h"
+
+// Default capacity of each worker's deque when --queue-depth is not given
+#define DEFAULT_QUEUE_DEPTH 1024
+// How long an acceptor waits before retrying after running out of fds or memory
+#define ACCEPT_BACKOFF_MS 10
+// Maximum number of events an acceptor handles per epoll_wait call
+#define ACCEPTOR_EPOLL_EVENTS 256
+// How often acceptors close parked connections that exceeded the keep-alive timeout
+#define PARK_SWEEP_INTERVAL_MS 1000
+
+struct Acceptor;
+
+/*
+    A connection of the pool. Between two requests it is parked with the acceptor that
+    accepted it, in its epoll set, instead of keeping a worker waiting for it; once it is
+    readable the acceptor queues it for the workers again.
+*/
+struct Pool_Connection {
+    int fd;
+    int requests_served;
+    bool registered;           // Added to the acceptor's epoll set by an earlier park
+    time_t parked_at;
+    struct Acceptor *acceptor;
+    // Park list of the acceptor, ordered from least to most recently parked
+    struct Pool_Connection *prev;
+    struct Pool_Connection *next;
+};
+
+/*
+    Bounded ring buffer of connections owned by one worker.
+    The acceptor pushes at the tail, the owner pops the oldest entry from the head
+    and idle workers steal the newest entry from the tail.
+*/
+struct Work_Deque {
+    pthread_mutex_t lock;
+    struct Pool_Connection **items;
+    size_t capacity;
+    size_t head;
+    size_t count;
+};
+
+struct Worker {
+    int id;
+    pthread_t thread;
+    struct Work_Deque deque;
+    struct Thread_Pool *pool;
+};
+
+struct Thread_Pool {
+    struct Worker *workers;
+    int worker_count;
+    sem_t pending;       // One token per queued connection
+    size_t next_worker;  // Round-robin cursor shared by the acceptors, updated atomically
+    bool (*handler)(int client_fd, int *requests_served); // Returns true to park the connection
+    bool stopping;       // Set when thread_pool_create fails part way, wakes workers up to exit
+};
+
+struct Thread_Pool *thread_pool_create(int worker_count, size_t queue_depth, bool (*handler)(int client_fd, int *requests_served));
+bool thread_pool_submit(struct Thread_Pool *pool, struct Pool_Connection *conn);
+int run_thread_pool(int *server_fds, int listener_count, int worker_count, size_t queue_depth);
+
+#endif
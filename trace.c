@@ -0,0 +1,185 @@
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/syscall.h>
+#include "trace.h"
+#include "logger.h"
+
+struct Trace_Event {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint64_t request;
+    pid_t tid;
+};
+
+/*
+    Written only by the thread holding it. head counts every event ever recorded, the slot
+    of an event is its index modulo TRACE_RING_EVENTS. The ring of a thread that exits is
+    kept, with its events, and handed to the next thread that needs one, so rings are never
+    freed and there are never more than threads alive at once.
+*/
+struct Trace_Ring {
+    size_t head;
+    bool in_use;
+    struct Trace_Ring *next;
+    struct Trace_Event events[TRACE_RING_EVENTS];
+};
+
+__thread uint64_t trace_current = 0;
+
+static int sample_every = 0;
+static uint64_t requests_seen;           // By every thread, threads of thread mode serve one connection
+static uint64_t trace_epoch_ns;          // Timestamps in the dump count from here
+static struct Trace_Ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread struct Trace_Ring *thread_ring;
+static __thread pid_t thread_id;
+
+static void release_thread_ring(void *ring) {
+    thread_ring = NULL;
+    __atomic_store_n(&((struct Trace_Ring *)ring)->in_use, false, __ATOMIC_RELEASE);
+}
+
+// Enables tracing of one request in sample_every, 0 leaves it off
+void trace_init(int every) {
+    if (every <= 0) {
+        return;
+    }
+    pthread_key_create(&ring_key, release_thread_ring);
+    trace_epoch_ns = metrics_now_ns();
+    sample_every = every;
+}
+
+bool trace_enabled(void) {
+    return sample_every > 0;
+}
+
+// Trace id for the request about to be read, 0 if it is not sampled
+uint64_t trace_sample(void) {
+    if (sample_every == 0) {
+        return 0;
+    }
+    uint64_t seen = __atomic_add_fetch(&requests_seen, 1, __ATOMIC_RELAXED);
+    return seen % sample_every == 0 ? seen / sample_every : 0;
+}
+
+static struct Trace_Ring *get_thread_ring(void) {
+    if (thread_ring != NULL) {
+        return thread_ring;
+    }
+    pthread_mutex_lock(&rings_lock);
+    struct Trace_Ring *ring = rings;
+    while (ring != NULL && __atomic_load_n(&ring->in_use, __ATOMIC_ACQUIRE)) {
+        ring = ring->next;
+    }
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(struct Trace_Ring));
+        if (ring == NULL) {
+            pthread_mutex_unlock(&rings_lock);
+            return NULL;
+        }
+        ring->next = rings;
+        rings = ring;
+    }
+    ring->in_use = true;
+    pthread_mutex_unlock(&rings_lock);
+
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    thread_id = syscall(SYS_gettid);
+    return ring;
+}
+
+// Use through trace_end
+void trace_record(const char *name, uint64_t start_ns, uint64_t end_ns) {
+    struct Trace_Ring *ring = get_thread_ring();
+    if (ring == NULL) {
+        return;
+    }
+    struct Trace_Event *event = &ring->events[ring->head % TRACE_RING_EVENTS];
+    event->name = name;
+    event->start_ns = start_ns;
+    event->duration_ns = end_ns - start_ns;
+    event->request = trace_current;
+    event->tid = thread_id;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+    Copies the events of a ring that is still being written to. Events the owner overwrote
+    while they were being copied are left out: after the copy, only the events that are
+    still within TRACE_RING_EVENTS of the head are known to be intact.
+*/
+static size_t copy_ring(const struct Trace_Ring *ring, struct Trace_Event *copy) {
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+    for (size_t i = first; i < head; i++) {
+        copy[i - first] = ring->events[i % TRACE_RING_EVENTS];
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    size_t head_after = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    size_t intact = head_after > TRACE_RING_EVENTS ? head_after - TRACE_RING_EVENTS : 0;
+    if (intact <= first) {
+        return head - first;
+    }
+    if (intact >= head) {
+        return 0;
+    }
+    memmove(copy, copy + (intact - first), (head - intact) * sizeof(struct Trace_Event));
+    return head - intact;
+}
+
+// Writes every recorded span as a Chrome trace-event "complete" event, times in microseconds
+void trace_write_json(FILE *out) {
+    struct Trace_Event *copy = malloc(TRACE_RING_EVENTS * sizeof(struct Trace_Event));
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    bool first_event = true;
+    if (copy != NULL) {
+        pthread_mutex_lock(&rings_lock);
+        for (const struct Trace_Ring *ring = rings; ring != NULL; ring = ring->next) {
+            size_t count = copy_ring(ring, copy);
+            for (size_t i = 0; i < count; i++) {
+                const struct Trace_Event *event = &copy[i];
+                fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"request\":%" PRIu64 "}}",
+                    first_event ? "" : ",", event->name, (event->start_ns - trace_epoch_ns) / 1e3, event->duration_ns / 1e3,
+                    (int)getpid(), (int)event->tid, event->request);
+                first_event = false;
+            }
+        }
+        pthread_mutex_unlock(&rings_lock);
+        free(copy);
+    }
+    fprintf(out, "\n]}\n");
+}
+
+// The trace as a malloc'd JSON document the caller frees, NULL if it could not be allocated
+char *trace_render(size_t *length) {
+    char *data = NULL;
+    FILE *out = open_memstream(&data, length);
+    if (out == NULL) {
+        return NULL;
+    }
+    trace_write_json(out);
+    if (fclose(out) != 0) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+// Writes the trace to trace-<pid>-<time>.json in the working directory, its name goes to path
+bool trace_dump_file(char *path, size_t path_size) {
+    snprintf(path, path_size, "trace-%d-%ld.json", (int)getpid(), (long)time(NULL));
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        log_errno("Could not create trace file");
+        return false;
+    }
+    trace_write_json(out);
+    if (fclose(out) != 0) {
+        log_errno("Could not write trace file");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,56 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "includes.h"
+#include "metrics.h"
+
+/*
+    Request tracing. One request in --trace-sample N gets a trace id when the server starts
+    parsing it, and every span timed while that request is being served is recorded into a
+    ring buffer of the thread serving it, keeping the latest TRACE_RING_EVENTS spans. The
+    rings are written out as Chrome trace-event JSON (chrome://tracing, Perfetto) by
+    GET /debug/trace or, as a file, on SIGUSR2.
+    Spans of requests that are not sampled, and all spans with tracing off, cost one branch
+    on a thread-local id.
+
+        struct Trace_Span span = trace_begin("parse");
+        ...
+        trace_end(&span);
+*/
+
+// Spans kept per ring, older ones are overwritten
+#define TRACE_RING_EVENTS 4096
+
+struct Trace_Span {
+    const char *name;    // Must outlive the dump, e.g. a literal
+    uint64_t start_ns;   // 0 if the span is not recorded
+};
+
+// Trace id of the request the thread is serving, 0 if it is not sampled
+extern __thread uint64_t trace_current;
+
+static inline struct Trace_Span trace_begin(const char *name) {
+    struct Trace_Span span = { name, 0 };
+    if (__builtin_expect(trace_current != 0, 0)) {
+        span.start_ns = metrics_now_ns();
+    }
+    return span;
+}
+
+void trace_record(const char *name, uint64_t start_ns, uint64_t end_ns);
+
+static inline void trace_end(const struct Trace_Span *span) {
+    if (__builtin_expect(span->start_ns != 0, 0)) {
+        trace_record(span->name, span->start_ns, metrics_now_ns());
+    }
+}
+
+void trace_init(int sample_every);
+bool trace_enabled(void);
+uint64_t trace_sample(void);
+void trace_write_json(FILE *out);
+char *trace_render(size_t *length);
+bool trace_dump_file(char *path, size_t path_size);
+
+#endif
@@ -0,0 +1,587 @@
+#include <pthread.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include "upload_store.h"
+#include "logger.h"
+
+// Iovecs gathered before a writev(), uploads spooled to a file are copied on their own
+#define STORE_IOVS 256
+// Location of an id whose record was lost, see upload_store_open
+#define STORE_MISSING UINT64_MAX
+
+struct Store_Segment {
+    uint64_t base_id;  // Id of its first record
+    uint64_t records;
+    size_t size;
+    int fd;
+    int index_fd;      // Only kept open for the segment being appended to
+};
+
+// Where a record lives, indexed by id - first_id
+struct Store_Location {
+    uint64_t segment;  // Sequence number of its segment, segments[segment - first_segment]
+    uint64_t offset;
+    uint64_t length;
+};
+
+// Guards the segment and location arrays, only the writer thread changes them
+static pthread_rwlock_t store_lock = PTHREAD_RWLOCK_INITIALIZER;
+static char *store_directory;
+static size_t segment_limit;
+static size_t retention_limit;
+
+static struct Store_Segment *segments; // Oldest first, the last one is appended to
+static size_t segment_count;
+static size_t segment_capacity;
+static uint64_t first_segment;         // Sequence number of segments[0]
+
+static struct Store_Location *locations;
+static size_t location_count;
+static size_t location_capacity;
+static uint64_t first_id;              // Id of locations[0]
+static unsigned long deleted_segments;
+
+static bool reserve(void **array, size_t *capacity, size_t needed, size_t item_size) {
+    if (needed <= *capacity) {
+        return true;
+    }
+    size_t new_capacity = *capacity ? *capacity : 64;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    void *new_array = realloc(*array, new_capacity * item_size);
+    if (new_array == NULL) {
+        return false;
+    }
+    *array = new_array;
+    *capacity = new_capacity;
+    return true;
+}
+
+static bool add_location(uint64_t segment, uint64_t offset, uint64_t length) {
+    if (!reserve((void **)&locations, &location_capacity, location_count + 1, sizeof(struct Store_Location))) {
+        return false;
+    }
+    locations[location_count++] = (struct Store_Location){ .segment = segment, .offset = offset, .length = length };
+    return true;
+}
+
+static void segment_path(char *path, uint64_t base_id, const char *extension) {
+    snprintf(path, PATH_MAX, "%s%0*" PRIu64 ".%s", store_directory, UPLOAD_STORE_SEGMENT_NAME_LENGTH, base_id, extension);
+}
+
+static int pread_all(int fd, void *buffer, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t bytes_read = pread(fd, buffer, length, offset);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return -1;
+        }
+        buffer = (char *)buffer + bytes_read;
+        length -= bytes_read;
+        offset += bytes_read;
+    }
+    return 0;
+}
+
+static int writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        // Skip what was written, the rest goes in the next call
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+static bool payload_matches(int fd, off_t offset, uint64_t length, uint32_t checksum) {
+    char *buffer = malloc(UPLOAD_COPY_CHUNK_SIZE);
+    if (buffer == NULL) {
+        return false;
+    }
+    uint32_t crc = 0;
+    bool complete = true;
+    while (length > 0) {
+        size_t chunk = length < UPLOAD_COPY_CHUNK_SIZE ? length : UPLOAD_COPY_CHUNK_SIZE;
+        if (pread_all(fd, buffer, chunk, offset) == -1) {
+            complete = false;
+            break;
+        }
+        crc = crc32_update(crc, buffer, chunk);
+        offset += chunk;
+        length -= chunk;
+    }
+    free(buffer);
+    return complete && crc == checksum;
+}
+
+static bool add_segment(struct Store_Segment *segment) {
+    if (!reserve((void **)&segments, &segment_capacity, segment_count + 1, sizeof(struct Store_Segment))) {
+        return false;
+    }
+    segments[segment_count++] = *segment;
+    return true;
+}
+
+static int open_segment_files(struct Store_Segment *segment, int flags) {
+    char path[PATH_MAX];
+    segment_path(path, segment->base_id, "log");
+    segment->fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC | flags, 0644);
+    if (segment->fd == -1) {
+        log_errno("Could not open upload store segment");
+        return -1;
+    }
+    segment_path(path, segment->base_id, "idx");
+    segment->index_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC | flags, 0644);
+    if (segment->index_fd == -1) {
+        log_errno("Could not open upload store index");
+        close(segment->fd);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Loads a segment found on startup. Its index is trusted as far as it agrees with the
+    segment, records past the last valid entry are verified one by one and indexed, and
+    the segment is cut at the first one that is incomplete or does not match its checksum.
+*/
+static int load_segment(uint64_t base_id) {
+    struct Store_Segment segment = { .base_id = base_id, .records = 0, .size = 0 };
+    if (open_segment_files(&segment, 0) == -1) {
+        return -1;
+    }
+    uint64_t sequence = first_segment + segment_count;
+
+    struct stat segment_stat, index_stat;
+    if (fstat(segment.fd, &segment_stat) == -1 || fstat(segment.index_fd, &index_stat) == -1) {
+        log_errno("Could not stat upload store segment");
+        close(segment.fd);
+        close(segment.index_fd);
+        return -1;
+    }
+    size_t size = segment_stat.st_size;
+    size_t entry_count = index_stat.st_size / sizeof(struct Store_Index_Entry);
+    struct Store_Index_Entry *entries = malloc(entry_count * sizeof(struct Store_Index_Entry) + 1);
+    if (entries == NULL || pread_all(segment.index_fd, entries, entry_count * sizeof(struct Store_Index_Entry), 0) == -1) {
+        entry_count = 0;
+    }
+
+    size_t end = 0;
+    bool loaded = true;
+    while (segment.records < entry_count) {
+        struct Store_Index_Entry *entry = &entries[segment.records];
+        if (entry->offset != end + sizeof(struct Store_Record_Header) || entry->offset > size || entry->length > size - entry->offset) {
+            break;
+        }
+        if (!add_location(sequence, entry->offset, entry->length)) {
+            loaded = false;
+            break;
+        }
+        end = entry->offset + entry->length;
+        segment.records++;
+    }
+    free(entries);
+    if (!loaded) {
+        log_error("Upload store: out of memory loading the index of segment %0*" PRIu64, UPLOAD_STORE_SEGMENT_NAME_LENGTH, base_id);
+        close(segment.fd);
+        close(segment.index_fd);
+        return -1;
+    }
+    if ((size_t)index_stat.st_size != segment.records * sizeof(struct Store_Index_Entry)) {
+        ftruncate(segment.index_fd, segment.records * sizeof(struct Store_Index_Entry));
+    }
+
+    // Records written after the last index entry, e.g. by a batch interrupted by a crash
+    while (end < size) {
+        struct Store_Record_Header header;
+        bool valid = size - end >= sizeof(header) &&
+            pread_all(segment.fd, &header, sizeof(header), end) == 0 &&
+            header.magic == UPLOAD_STORE_RECORD_MAGIC &&
+            header.id == base_id + segment.records &&
+            header.length <= size - end - sizeof(header) &&
+            payload_matches(segment.fd, end + sizeof(header), header.length, header.checksum);
+        if (!valid) {
+            log_warn("Upload store: cutting %zu bytes of a torn record off segment %0*" PRIu64,
+                size - end, UPLOAD_STORE_SEGMENT_NAME_LENGTH, base_id);
+            if (ftruncate(segment.fd, end) == -1) {
+                log_errno("Could not truncate upload store segment");
+            }
+            break;
+        }
+        struct Store_Index_Entry entry = { .offset = end + sizeof(header), .length = header.length };
+        if (write_all(segment.index_fd, (const char *)&entry, sizeof(entry)) == -1) {
+            log_errno("Could not write upload store index");
+            loaded = false;
+            break;
+        }
+        if (!add_location(sequence, entry.offset, entry.length)) {
+            log_error("Upload store: out of memory recovering segment %0*" PRIu64, UPLOAD_STORE_SEGMENT_NAME_LENGTH, base_id);
+            loaded = false;
+            break;
+        }
+        end = entry.offset + entry.length;
+        segment.records++;
+    }
+    segment.size = end;
+
+    if (!loaded || !add_segment(&segment)) {
+        close(segment.fd);
+        close(segment.index_fd);
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    uint64_t first = *(const uint64_t *)a;
+    uint64_t second = *(const uint64_t *)b;
+    return (first > second) - (first < second);
+}
+
+// Base ids of the segments in the store directory, oldest first
+static uint64_t *list_segments(size_t *count) {
+    DIR *directory = opendir(store_directory);
+    if (directory == NULL) {
+        log_errno("Could not open upload store directory");
+        return NULL;
+    }
+    uint64_t *ids = NULL;
+    size_t capacity = 0;
+    *count = 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        const char *name = entry->d_name;
+        if (strlen(name) != UPLOAD_STORE_SEGMENT_NAME_LENGTH + strlen(".log") ||
+            strspn(name, "0123456789") != UPLOAD_STORE_SEGMENT_NAME_LENGTH ||
+            strcmp(name + UPLOAD_STORE_SEGMENT_NAME_LENGTH, ".log") != 0) {
+            continue;
+        }
+        if (!reserve((void **)&ids, &capacity, *count + 1, sizeof(uint64_t))) {
+            break;
+        }
+        ids[(*count)++] = strtoull(name, NULL, 10);
+    }
+    closedir(directory);
+    qsort(ids, *count, sizeof(uint64_t), compare_ids);
+    return ids;
+}
+
+static int create_segment(uint64_t base_id) {
+    struct Store_Segment segment = { .base_id = base_id, .records = 0, .size = 0 };
+    if (open_segment_files(&segment, O_CREAT | O_TRUNC) == -1) {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&store_lock);
+    bool added = add_segment(&segment);
+    pthread_rwlock_unlock(&store_lock);
+    if (!added) {
+        close(segment.fd);
+        close(segment.index_fd);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Opens the store in directory (created if needed) and rebuilds the index from the segments
+    found there. segment_size is the size at which segments are rotated, retention the total
+    size above which the oldest segments are deleted (0 keeps everything).
+*/
+bool upload_store_open(const char *directory, size_t segment_size, size_t retention) {
+    store_directory = strdup(directory);
+    if (store_directory == NULL) {
+        return false;
+    }
+    segment_limit = segment_size;
+    retention_limit = retention;
+
+    if (mkdir(directory, 0755) == -1 && errno != EEXIST) {
+        log_errno("Could not create upload store directory");
+        return false;
+    }
+    size_t found = 0;
+    uint64_t *base_ids = list_segments(&found);
+
+    for (size_t i = 0; i < found; i++) {
+        if (segment_count == 0) {
+            first_id = base_ids[i];
+        } else {
+            struct Store_Segment *previous = &segments[segment_count - 1];
+            uint64_t expected = previous->base_id + previous->records;
+            if (base_ids[i] < expected) {
+                log_warn("Upload store: ignoring segment %0*" PRIu64 ", it overlaps the one before", UPLOAD_STORE_SEGMENT_NAME_LENGTH, base_ids[i]);
+                continue;
+            }
+            // The records between the two segments were lost, their ids stay unused
+            for (uint64_t id = expected; id < base_ids[i]; id++) {
+                if (!add_location(STORE_MISSING, 0, 0)) {
+                    log_error("Upload store: out of memory skipping the ids lost before segment %0*" PRIu64,
+                        UPLOAD_STORE_SEGMENT_NAME_LENGTH, base_ids[i]);
+                    free(base_ids);
+                    return false;
+                }
+            }
+            // Only the last segment is appended to
+            close(previous->index_fd);
+            previous->index_fd = -1;
+        }
+        if (load_segment(base_ids[i]) == -1) {
+            free(base_ids);
+            return false;
+        }
+    }
+    free(base_ids);
+
+    if (segment_count == 0) {
+        first_id = 1;
+        if (create_segment(first_id) == -1) {
+            return false;
+        }
+    }
+
+    struct Upload_Store_Stats stats;
+    upload_store_get_stats(&stats);
+    log_info("Upload store: %" PRIu64 " records in %zu segments, next id %" PRIu64,
+        stats.next_id - stats.first_id, stats.segments, stats.next_id);
+    return true;
+}
+
+// Makes records written to the current segment visible and persists their index entries
+static int publish(struct Store_Segment *segment, struct Store_Index_Entry *entries, int count, size_t end) {
+    if (count == 0) {
+        return 0;
+    }
+    if (write_all(segment->index_fd, (const char *)entries, count * sizeof(struct Store_Index_Entry)) == -1) {
+        log_errno("Could not write upload store index");
+        ftruncate(segment->index_fd, segment->records * sizeof(struct Store_Index_Entry));
+        return -1;
+    }
+    uint64_t sequence = first_segment + (segment - segments);
+
+    pthread_rwlock_wrlock(&store_lock);
+    bool added = reserve((void **)&locations, &location_capacity, location_count + count, sizeof(struct Store_Location));
+    if (added) {
+        // The room is reserved, so this cannot fail halfway through
+        for (int i = 0; i < count; i++) {
+            locations[location_count++] = (struct Store_Location){ .segment = sequence, .offset = entries[i].offset, .length = entries[i].length };
+        }
+        segment->records += count;
+        segment->size = end;
+    }
+    pthread_rwlock_unlock(&store_lock);
+    return added ? 0 : -1;
+}
+
+// Seals the current segment and starts the next one, the current one stays open for appends if that fails
+static int rotate(void) {
+    struct Store_Segment *current = &segments[segment_count - 1];
+    if (fdatasync(current->fd) == -1 || fdatasync(current->index_fd) == -1) {
+        log_errno("Could not sync upload store segment");
+    }
+    if (create_segment(current->base_id + current->records) == -1) {
+        return -1;
+    }
+    // create_segment may have moved the array
+    struct Store_Segment *sealed = &segments[segment_count - 2];
+    close(sealed->index_fd);
+    sealed->index_fd = -1;
+    return 0;
+}
+
+static size_t store_size(void) {
+    size_t total = 0;
+    for (size_t i = 0; i < segment_count; i++) {
+        total += segments[i].size;
+    }
+    return total;
+}
+
+// Deletes the oldest segments while the store is bigger than the retention limit
+static void apply_retention(void) {
+    while (retention_limit > 0 && segment_count > 1 && store_size() > retention_limit) {
+        struct Store_Segment oldest = segments[0];
+
+        pthread_rwlock_wrlock(&store_lock);
+        memmove(segments, segments + 1, (segment_count - 1) * sizeof(struct Store_Segment));
+        segment_count--;
+        first_segment++;
+        size_t dropped = segments[0].base_id - first_id;
+        memmove(locations, locations + dropped, (location_count - dropped) * sizeof(struct Store_Location));
+        location_count -= dropped;
+        first_id = segments[0].base_id;
+        deleted_segments++;
+        pthread_rwlock_unlock(&store_lock);
+
+        // Responses still sending from it hold their own descriptor
+        close(oldest.fd);
+        char path[PATH_MAX];
+        segment_path(path, oldest.base_id, "log");
+        unlink(path);
+        segment_path(path, oldest.base_id, "idx");
+        unlink(path);
+        log_info("Upload store: deleted segment %0*" PRIu64 " (%zu bytes)", UPLOAD_STORE_SEGMENT_NAME_LENGTH, oldest.base_id, oldest.size);
+    }
+}
+
+/*
+    Appends one record per spool and stores their ids in ids. Only called by the upload
+    writer thread. Records become visible to readers once written; on failure whatever part
+    of the batch is not visible yet is cut off the segment again.
+    Returns the number of records stored, from the start of spools: fewer than count if a
+    write failed, the ones stored before the failure stay visible under their ids.
+*/
+int upload_store_append(struct Upload_Spool **spools, int count, uint64_t *ids) {
+    struct Store_Record_Header *headers = malloc(count * sizeof(struct Store_Record_Header));
+    struct Store_Index_Entry *entries = malloc(count * sizeof(struct Store_Index_Entry));
+    if (headers == NULL || entries == NULL) {
+        free(headers);
+        free(entries);
+        return 0;
+    }
+
+    struct Store_Segment *segment = &segments[segment_count - 1];
+    size_t end = segment->size;
+    int pending = 0; // First record not published yet, every one before it is stored
+    struct iovec iov[STORE_IOVS];
+    int iov_count = 0;
+    int result = 0;
+
+    for (int i = 0; i < count && result == 0; i++) {
+        struct Upload_Spool *spool = spools[i];
+        size_t record_size = sizeof(struct Store_Record_Header) + spool->length;
+
+        if (end > 0 && end + record_size > segment_limit) {
+            if (writev_all(segment->fd, iov, iov_count) == -1 || publish(segment, entries + pending, i - pending, end) == -1) {
+                result = -1;
+                break;
+            }
+            iov_count = 0;
+            pending = i;
+            if (rotate() == -1) {
+                result = -1;
+                break;
+            }
+            segment = &segments[segment_count - 1];
+            end = 0;
+        }
+
+        ids[i] = segment->base_id + segment->records + (i - pending);
+        headers[i] = (struct Store_Record_Header){
+            .magic = UPLOAD_STORE_RECORD_MAGIC,
+            .checksum = spool->checksum,
+            .id = ids[i],
+            .length = spool->length,
+        };
+        entries[i].offset = end + sizeof(struct Store_Record_Header);
+        entries[i].length = spool->length;
+        end += record_size;
+
+        if (iov_count + 2 > STORE_IOVS) {
+            result = writev_all(segment->fd, iov, iov_count);
+            iov_count = 0;
+        }
+        iov[iov_count].iov_base = &headers[i];
+        iov[iov_count].iov_len = sizeof(struct Store_Record_Header);
+        iov_count++;
+        if (spool->file_fd == -1) {
+            iov[iov_count].iov_base = spool->memory;
+            iov[iov_count].iov_len = spool->length;
+            iov_count++;
+        } else if (result == 0) {
+            result = writev_all(segment->fd, iov, iov_count);
+            iov_count = 0;
+            if (result == 0) {
+                result = upload_spool_copy_to(spool, segment->fd);
+            }
+        }
+    }
+
+    if (result == 0) {
+        result = writev_all(segment->fd, iov, iov_count);
+    }
+    if (result == 0) {
+        result = publish(segment, entries + pending, count - pending, end);
+    }
+    if (result == 0) {
+        pending = count;
+    }
+    if (result == -1) {
+        log_errno("Could not append to upload store");
+        // Later records must follow the last visible one directly
+        if (ftruncate(segment->fd, segment->size) == -1) {
+            log_errno("Could not truncate upload store segment");
+        }
+    } else {
+        apply_retention();
+    }
+
+    free(headers);
+    free(entries);
+    return pending;
+}
+
+// Flushes the segment being appended to and its index to disk
+int upload_store_sync(void) {
+    struct Store_Segment *current = &segments[segment_count - 1];
+    if (fdatasync(current->fd) == -1 || fdatasync(current->index_fd) == -1) {
+        log_errno("Could not sync upload store");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Looks a record up. Returns a descriptor of its segment, which the caller closes, and sets
+    *offset and *length to where the payload is, or returns -1 if there is no such record.
+*/
+int upload_store_open_record(uint64_t id, off_t *offset, size_t *length) {
+    int fd = -1;
+    pthread_rwlock_rdlock(&store_lock);
+    if (id >= first_id && id - first_id < location_count) {
+        struct Store_Location *location = &locations[id - first_id];
+        if (location->segment != STORE_MISSING) {
+            fd = fcntl(segments[location->segment - first_segment].fd, F_DUPFD_CLOEXEC, 0);
+            *offset = location->offset;
+            *length = location->length;
+        }
+    }
+    pthread_rwlock_unlock(&store_lock);
+    return fd;
+}
+
+void upload_store_get_stats(struct Upload_Store_Stats *stats) {
+    pthread_rwlock_rdlock(&store_lock);
+    struct Store_Segment *current = &segments[segment_count - 1];
+    stats->first_id = first_id;
+    stats->next_id = current->base_id + current->records;
+    stats->segments = segment_count;
+    stats->bytes = store_size();
+    stats->deleted_segments = deleted_segments;
+    pthread_rwlock_unlock(&store_lock);
+}
+
+void upload_store_report(void) {
+    struct Upload_Store_Stats stats;
+    upload_store_get_stats(&stats);
+    log_info("Upload store: ids %" PRIu64 "-%" PRIu64 " in %zu segments, %zu KB, %lu segments deleted by retention",
+        stats.first_id, stats.next_id - 1, stats.segments, stats.bytes / 1024, stats.deleted_segments);
+}
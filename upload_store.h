@@ -0,0 +1,53 @@
+#ifndef UPLOAD_STORE_H
+#define UPLOAD_STORE_H
+
+#include <stdint.h>
+#include "includes.h"
+#include "file_helpers.h"
+
+/*
+    Append-only, log-structured store for uploads. Every upload becomes a record with an id
+    (1, 2, 3...) in a segment file, segments are rotated once they reach the segment size and
+    named after the id of their first record:
+        00000000000000000001.log   records: header + payload, back to back
+        00000000000000000001.idx   one index entry per record, in id order
+    The index of every segment is loaded on startup and kept in memory as one array indexed by
+    id, so finding a record is O(1). Records past the end of the index are recovered by
+    scanning the segment, a torn record at its end is cut off.
+    Only the upload writer thread appends, readers can look records up concurrently.
+    With a retention limit the oldest segments are deleted as a whole once the store outgrows it.
+*/
+
+#define UPLOAD_STORE_RECORD_MAGIC 0x444c5055u // "UPLD" in little-endian byte order
+#define UPLOAD_STORE_SEGMENT_NAME_LENGTH 20   // Zero-padded first id
+
+// Written before every payload, in host byte order
+struct Store_Record_Header {
+    uint32_t magic;
+    uint32_t checksum; // CRC-32 of the payload
+    uint64_t id;
+    uint64_t length;
+};
+
+// One per record in the .idx file of its segment
+struct Store_Index_Entry {
+    uint64_t offset;   // Of the payload in the segment
+    uint64_t length;
+};
+
+struct Upload_Store_Stats {
+    uint64_t first_id;
+    uint64_t next_id;
+    size_t segments;
+    size_t bytes;
+    unsigned long deleted_segments;
+};
+
+bool upload_store_open(const char *directory, size_t segment_size, size_t retention);
+int upload_store_append(struct Upload_Spool **spools, int count, uint64_t *ids);
+int upload_store_sync(void);
+int upload_store_open_record(uint64_t id, off_t *offset, size_t *length);
+void upload_store_get_stats(struct Upload_Store_Stats *stats);
+void upload_store_report(void);
+
+#endif
@@ -0,0 +1,222 @@
+#include <pthread.h>
+#include "upload_writer.h"
+#include "upload_store.h"
+#include "logger.h"
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_pending = PTHREAD_COND_INITIALIZER;   // Uploads were queued
+static pthread_cond_t writer_committed = PTHREAD_COND_INITIALIZER; // A batch was committed
+static struct Upload_Commit *queue_head;
+static struct Upload_Commit *queue_tail;
+static struct Upload_Writer_Stats writer_stats;
+static bool writer_running = false;
+
+__thread int upload_commit_notify_fd = -1;
+
+// Only used by the writer thread
+static enum Durability writer_durability;
+static int writer_sync_interval_ms;
+static struct Upload_Spool *batch_spools[UPLOAD_WRITER_MAX_BATCH];
+static uint64_t batch_ids[UPLOAD_WRITER_MAX_BATCH];
+
+/*
+    Appends every upload of the batch to the store, in queue order. Returns how many were
+    stored, from the start of the batch, and gives each of them its id.
+*/
+static int write_batch(struct Upload_Commit *batch, unsigned long *bytes) {
+    int count = 0;
+    for (struct Upload_Commit *commit = batch; commit != NULL; commit = commit->next) {
+        batch_spools[count++] = commit->spool;
+    }
+    int stored = upload_store_append(batch_spools, count, batch_ids);
+    count = 0;
+    for (struct Upload_Commit *commit = batch; commit != NULL && count < stored; commit = commit->next) {
+        commit->id = batch_ids[count++];
+        *bytes += commit->spool->length;
+    }
+    return stored;
+}
+
+static void add_milliseconds(struct timespec *time, int milliseconds) {
+    time->tv_sec += milliseconds / 1000;
+    time->tv_nsec += (long)(milliseconds % 1000) * 1000000;
+    if (time->tv_nsec >= 1000000000) {
+        time->tv_sec++;
+        time->tv_nsec -= 1000000000;
+    }
+}
+
+static bool is_past(const struct timespec *deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+// Takes up to UPLOAD_WRITER_MAX_BATCH queued uploads, called with writer_lock held
+static struct Upload_Commit *take_batch(void) {
+    struct Upload_Commit *batch = queue_head;
+    struct Upload_Commit *last = NULL;
+    struct Upload_Commit *commit = queue_head;
+    for (int taken = 0; commit != NULL && taken < UPLOAD_WRITER_MAX_BATCH; taken++) {
+        last = commit;
+        commit = commit->next;
+    }
+    if (last != NULL) {
+        last->next = NULL;
+    }
+    queue_head = commit;
+    if (queue_head == NULL) {
+        queue_tail = NULL;
+    }
+    return batch;
+}
+
+static void *upload_writer_thread(void *arg) {
+    (void)arg;
+    bool dirty = false; // Written since the last sync, DURABILITY_INTERVAL only
+    struct timespec next_sync = {0};
+
+    pthread_mutex_lock(&writer_lock);
+    while (1) {
+        while (queue_head == NULL) {
+            if (!dirty) {
+                pthread_cond_wait(&writer_pending, &writer_lock);
+            } else if (pthread_cond_timedwait(&writer_pending, &writer_lock, &next_sync) == ETIMEDOUT) {
+                break;
+            }
+        }
+        struct Upload_Commit *batch = take_batch();
+        pthread_mutex_unlock(&writer_lock);
+
+        int stored = 0;      // Uploads of the batch in the store, from its start
+        int sync_result = 0;
+        unsigned long bytes = 0;
+        unsigned long syncs = 0;
+        if (batch != NULL) {
+            stored = write_batch(batch, &bytes);
+            if (stored > 0 && writer_durability == DURABILITY_BATCH) {
+                sync_result = upload_store_sync();
+                syncs++;
+            } else if (writer_durability == DURABILITY_INTERVAL && !dirty) {
+                dirty = true;
+                clock_gettime(CLOCK_REALTIME, &next_sync);
+                add_milliseconds(&next_sync, writer_sync_interval_ms);
+            }
+        }
+        if (dirty && is_past(&next_sync)) {
+            upload_store_sync();
+            syncs++;
+            dirty = false;
+        }
+
+        pthread_mutex_lock(&writer_lock);
+        int position = 0;
+        for (struct Upload_Commit *commit = batch; commit != NULL; commit = commit->next) {
+            // Only the uploads after the first one that failed are lost
+            commit->result = position++ < stored ? sync_result : -1;
+            commit->done = true;
+            writer_stats.uploads++;
+            // The owner frees the commit once it sees it done, which needs writer_lock
+            if (commit->notify_fd != -1) {
+                uint64_t one = 1;
+                if (write(commit->notify_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+                    log_errno("Failed to signal a committed upload");
+                }
+            }
+        }
+        writer_stats.batches += batch != NULL;
+        writer_stats.bytes += bytes;
+        writer_stats.syncs += syncs;
+        if (batch != NULL) {
+            pthread_cond_broadcast(&writer_committed);
+        }
+    }
+    return NULL;
+}
+
+/*
+    Starts the writer thread that appends uploads to the upload store, which must be open.
+    sync_interval_ms is only used with DURABILITY_INTERVAL.
+*/
+bool upload_writer_start(enum Durability durability, int sync_interval_ms) {
+    writer_durability = durability;
+    writer_sync_interval_ms = sync_interval_ms;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, upload_writer_thread, NULL) != 0) {
+        log_errno("Failed to create upload writer thread");
+        return false;
+    }
+    pthread_detach(thread);
+    writer_running = true;
+    return true;
+}
+
+/*
+    Queues an upload without waiting for it: once the batch it went into has been committed
+    according to the durability policy, commit->done is set and notify_fd (an eventfd, or -1)
+    is signalled. commit and spool must not change until then.
+    Returns false, with commit->result -1, if there is no writer to queue it to.
+*/
+bool upload_writer_submit(struct Upload_Commit *commit, struct Upload_Spool *spool, int notify_fd) {
+    *commit = (struct Upload_Commit){ .spool = spool, .result = -1, .done = false, .notify_fd = notify_fd, .next = NULL };
+    if (!writer_running) {
+        return false;
+    }
+
+    pthread_mutex_lock(&writer_lock);
+    if (queue_tail == NULL) {
+        queue_head = commit;
+    } else {
+        queue_tail->next = commit;
+    }
+    queue_tail = commit;
+    pthread_cond_signal(&writer_pending);
+    pthread_mutex_unlock(&writer_lock);
+    return true;
+}
+
+bool upload_commit_done(struct Upload_Commit *commit) {
+    pthread_mutex_lock(&writer_lock);
+    bool done = commit->done;
+    pthread_mutex_unlock(&writer_lock);
+    return done;
+}
+
+// Blocks until a submitted upload has been committed
+void upload_writer_wait(struct Upload_Commit *commit) {
+    pthread_mutex_lock(&writer_lock);
+    while (!commit->done) {
+        pthread_cond_wait(&writer_committed, &writer_lock);
+    }
+    pthread_mutex_unlock(&writer_lock);
+}
+
+/*
+    Queues an upload and waits until the batch it went into has been committed according to
+    the durability policy. The spool must not change until then.
+    Returns 0 and sets *id to the id of its record, or returns -1 if it could not be written.
+*/
+int upload_writer_commit(struct Upload_Spool *spool, uint64_t *id) {
+    struct Upload_Commit commit;
+    if (!upload_writer_submit(&commit, spool, -1)) {
+        return -1;
+    }
+    upload_writer_wait(&commit);
+    *id = commit.id;
+    return commit.result;
+}
+
+void upload_writer_get_stats(struct Upload_Writer_Stats *stats) {
+    pthread_mutex_lock(&writer_lock);
+    *stats = writer_stats;
+    pthread_mutex_unlock(&writer_lock);
+}
+
+void upload_writer_report(void) {
+    struct Upload_Writer_Stats stats;
+    upload_writer_get_stats(&stats);
+    double per_batch = stats.batches ? (double)stats.uploads / stats.batches : 0.0;
+    log_info("Upload writer: %lu uploads in %lu batches (%.1f per batch), %lu KB written, %lu syncs",
+        stats.uploads, stats.batches, per_batch, stats.bytes / 1024, stats.syncs);
+}
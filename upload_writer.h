@@ -0,0 +1,58 @@
+#ifndef UPLOAD_WRITER_H
+#define UPLOAD_WRITER_H
+
+#include <stdint.h>
+#include "includes.h"
+#include "file_helpers.h"
+
+/*
+    Group commit for the upload store. Requests hand their finished upload to a single writer
+    thread and wait; the writer takes everything queued since its last batch and appends it
+    to the store with as few writev() calls as possible, then syncs the store according to the
+    durability policy and wakes the requests of that batch.
+    Threads that cannot block, the epoll reactors, submit the upload instead and are told
+    through an eventfd once it has been committed.
+*/
+
+// Largest number of queued uploads written in one batch
+#define UPLOAD_WRITER_MAX_BATCH 1024
+
+enum Durability {
+    DURABILITY_NONE,    // Acknowledged once written to the page cache
+    DURABILITY_BATCH,   // Acknowledged once the batch has been fdatasync()ed
+    DURABILITY_INTERVAL // Acknowledged once written, fdatasync() runs every sync interval
+};
+
+// One queued upload, owned by the request until it is done
+struct Upload_Commit {
+    struct Upload_Spool *spool;
+    uint64_t id;
+    int result;
+    bool done;                  // Read with upload_commit_done() while notify_fd is used
+    int notify_fd;              // eventfd written once done, -1 for upload_writer_commit
+    struct Upload_Commit *next;
+};
+
+/*
+    Set by the epoll reactors to an eventfd in their epoll set: their uploads are then
+    committed in the background and the response is sent once the eventfd fires.
+    -1 (the default) makes requests wait in upload_writer_commit.
+*/
+extern __thread int upload_commit_notify_fd;
+
+struct Upload_Writer_Stats {
+    unsigned long batches;
+    unsigned long uploads;
+    unsigned long syncs;
+    unsigned long bytes;
+};
+
+bool upload_writer_start(enum Durability durability, int sync_interval_ms);
+int upload_writer_commit(struct Upload_Spool *spool, uint64_t *id);
+bool upload_writer_submit(struct Upload_Commit *commit, struct Upload_Spool *spool, int notify_fd);
+bool upload_commit_done(struct Upload_Commit *commit);
+void upload_writer_wait(struct Upload_Commit *commit);
+void upload_writer_get_stats(struct Upload_Writer_Stats *stats);
+void upload_writer_report(void);
+
+#endif